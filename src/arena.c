@@ -0,0 +1,219 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Arenas.  An arena hands out memory by bumping a pointer through a
+ * chain of chunks, and frees it all at once.  This suits anything whose
+ * allocations share a single lifetime: there is one free for the lot,
+ * and nothing to leak.  We have arenas for:
+ *
+ *   - the process: the program name and command line strings (see
+ *     #process_arena);
+ *   - each generation of the config: the config file, which is
+ *     tokenized in place, and its path (see options_t);
+ *   - each client connection: output that cannot be written at once,
+ *     the arena being reset each time the output is drained (see
+ *     conn_t).
+ *
+ * Chunks come from MALLOC(), so running out of memory is handled in
+ * the usual way.  The exception is a fixed arena, whose only chunk is
+ * memory provided by its owner: connection arenas live in the
+ * connection slab, so that serving clients never touches the heap.  A
+ * fixed arena that is full simply fails the allocation.  At verbosity 2
+ * and above, each arena's usage is reported when it is freed, so that
+ * memory use can be budgeted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "volumed.h"
+
+#define ARENA_ALIGN 8
+
+
+/**
+ * @brief Add a chunk, able to hold at least \p size bytes, to \p arena.
+ */
+static arena_chunk_t *
+arena_add_chunk(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk;
+
+    size = MAX(size, arena->chunk_size);
+    chunk = (arena_chunk_t *) MALLOC(offsetof(arena_chunk_t, data) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->nchunks++;
+    arena->allocated += size;
+    return chunk;
+}
+
+/**
+ * @brief Create a new, empty, arena.
+ *
+ * @param name (char *) A name for the arena, for use in reports.
+ * @param chunk_size (size_t) The size of each chunk of memory that the
+ *        arena obtains.  Larger allocations get a chunk of their own.
+ *
+ * @return (arena_t *) The new arena.
+ */
+arena_t *
+arena_new(const char *name, size_t chunk_size)
+{
+    arena_t *arena = (arena_t *) MALLOC(sizeof(arena_t));
+
+    arena->name = name;
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    arena->nchunks = 0;
+    arena->allocated = 0;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->resets = 0;
+    return arena;
+}
+
+/**
+ * @brief Initialise \p arena as a fixed arena over the \p size bytes
+ * at \p mem, which must be suitably aligned for any of our types.  The
+ * arena never allocates memory of its own, and must not be passed to
+ * arena_free().
+ *
+ * @param arena (arena_t *) The arena to be initialised.
+ * @param name (char *) A name for the arena, for use in reports.
+ * @param mem (void *) The memory from which the arena allocates.
+ * @param size (size_t) The size of \p mem.
+ */
+void
+arena_init(arena_t *arena, const char *name, void *mem, size_t size)
+{
+    arena_chunk_t *chunk = (arena_chunk_t *) mem;
+
+    chunk->next = NULL;
+    chunk->size = size - offsetof(arena_chunk_t, data);
+    chunk->used = 0;
+    arena->name = name;
+    arena->chunks = chunk;
+    arena->chunk_size = 0;
+    arena->nchunks = 1;
+    arena->allocated = chunk->size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->resets = 0;
+}
+
+/**
+ * @brief Allocate \p size bytes from \p arena.  The memory is suitably
+ * aligned for any of our types, and remains valid until the arena is
+ * freed.
+ *
+ * @param arena (arena_t *) The arena.
+ * @param size (size_t) The number of bytes required.
+ *
+ * @return (void *) The allocated memory, or NULL if \p arena is a
+ *         fixed arena without room for it.
+ */
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    void *result;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (!chunk || (chunk->size - chunk->used < size)) {
+	if (arena->chunk_size == 0) {
+	    return NULL;
+	}
+	chunk = arena_add_chunk(arena, size);
+    }
+    result = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    arena->peak = MAX(arena->peak, arena->used);
+    return result;
+}
+
+/**
+ * @brief Copy the string \p str into \p arena.
+ *
+ * @param arena (arena_t *) The arena.
+ * @param str (char *) The string to be copied.
+ *
+ * @return (char *) The copy.
+ */
+char *
+arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return (char *) memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * @brief Free everything allocated from \p arena, so that it can be
+ * reused.  Its first chunk is kept, so that an arena that never
+ * outgrows its first chunk never goes back to the heap.
+ *
+ * @param arena (arena_t *) The arena.
+ */
+void
+arena_reset(arena_t *arena)
+{
+    arena_chunk_t *chunk;
+
+    while ((chunk = arena->chunks) && chunk->next) {
+	arena->chunks = chunk->next;
+	arena->allocated -= chunk->size;
+	arena->nchunks--;
+	free(chunk);
+    }
+    if (chunk) {
+	chunk->used = 0;
+    }
+    arena->used = 0;
+    arena->resets++;
+}
+
+/**
+ * @brief Report the memory usage of \p arena, if our verbosity is 2
+ * or more.
+ *
+ * @param arena (arena_t *) The arena, which may be NULL.
+ */
+void
+arena_report(const arena_t *arena)
+{
+    if (arena && (options.verbosity > 1)) {
+	printf("Arena %s: %d chunks, %zu bytes allocated, %zu used "
+	       "(peak %zu), %lu resets\n", arena->name, arena->nchunks,
+	       arena->allocated, arena->used, arena->peak, arena->resets);
+    }
+}
+
+/**
+ * @brief Free \p arena, and everything allocated from it.
+ *
+ * @param arena (arena_t *) The arena, which may be NULL.
+ */
+void
+arena_free(arena_t *arena)
+{
+    arena_chunk_t *chunk;
+
+    if (!arena) {
+	return;
+    }
+    arena_report(arena);
+    while ((chunk = arena->chunks)) {
+	arena->chunks = chunk->next;
+	free(chunk);
+    }
+    free(arena);
+}
@@ -0,0 +1,592 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The client side of volumed's protocols, for volumec and any other
+ * client program.  A client_t is a connection to volumed over either
+ * the websocket or the local socket.  Commands are queued to it and
+ * flushed without waiting for replies, so that a client with many
+ * commands to send can pipeline them over the one connection.
+ *
+ * A cmd_batch_t collapses a stream of commands into the fewest that
+ * have the same effect, so that a client reading commands faster than
+ * they can usefully be sent need never fall behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "volumed.h"
+
+#define CLIENT_KEY_BYTES 16
+
+
+/**
+ * @brief Fill \p buf with \p len random bytes, for websocket keys and
+ * masks.  These need to be unpredictable to intermediaries, not
+ * cryptographically strong.
+ */
+static void
+random_bytes(uint8_t *buf, size_t len)
+{
+    static bool seeded = false;
+    size_t i;
+
+    if (!seeded) {
+	srandom(time(NULL) ^ getpid());
+	seeded = true;
+    }
+    for (i = 0; i < len; i++) {
+	buf[i] = random() & 0xff;
+    }
+}
+
+/**
+ * @brief Connect to \p port on \p host.
+ *
+ * @return (int) The connected socket, or -1 if we could not connect,
+ *         in which case the problem has been reported.
+ */
+static int
+connect_tcp(const char *host, int port)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    char service[8];
+    int one = 1;
+    int fd = -1;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if ((err = getaddrinfo(host, service, &hints, &res)) != 0) {
+	dofail(0, "unable to resolve %s: %s", host, gai_strerror(err));
+	return -1;
+    }
+    err = 0;
+    for (ai = res; ai && (fd < 0); ai = ai->ai_next) {
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+		    ai->ai_protocol);
+	if ((fd >= 0) && (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)) {
+	    err = errno;
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+	dofail(0, "unable to connect to %s:%d: %s", host, port,
+	       strerror(err ? err: errno));
+	return -1;
+    }
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Connect to volumed's local socket at \p path.
+ *
+ * @return (int) The connected socket, or -1 if we could not connect,
+ *         in which case the problem has been reported.
+ */
+static int
+connect_local(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	dofail(0, "socket path %s is too long", path);
+	return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+	dofail(0, "unable to create local socket: %s", strerror(errno));
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	dofail(0, "unable to connect to %s: %s", path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Perform the websocket handshake for \p cl, which is still in
+ * blocking mode.  Anything sent by the server after its response is
+ * left in the input buffer.
+ *
+ * @return (bool) true if the server accepted the upgrade.
+ */
+static bool
+client_handshake(client_t *cl, const char *host, int port)
+{
+    uint8_t nonce[CLIENT_KEY_BYTES];
+    char key[32];
+    char req[256];
+    size_t req_len;
+    char *end = NULL;
+    ssize_t n;
+
+    random_bytes(nonce, sizeof(nonce));
+    base64_encode(nonce, sizeof(nonce), key);
+    req_len = snprintf(req, sizeof(req),
+		       "GET / HTTP/1.1\r\n"
+		       "Host: %s:%d\r\n"
+		       "Upgrade: websocket\r\n"
+		       "Connection: Upgrade\r\n"
+		       "Sec-WebSocket-Key: %s\r\n"
+		       "Sec-WebSocket-Version: 13\r\n\r\n", host, port, key);
+    if (send(cl->fd, req, req_len, MSG_NOSIGNAL) != req_len) {
+	dofail(0, "unable to send websocket handshake: %s", strerror(errno));
+	return false;
+    }
+    while (!end) {
+	n = recv(cl->fd, cl->in + cl->in_len,
+		 sizeof(cl->in) - cl->in_len - 1, 0);
+	if (n <= 0) {
+	    if ((n < 0) && (errno == EINTR)) {
+		continue;
+	    }
+	    dofail(0, "connection closed during websocket handshake");
+	    return false;
+	}
+	cl->in_len += n;
+	cl->in[cl->in_len] = '\0';
+	end = strstr((char *) cl->in, "\r\n\r\n");
+	if (!end && (cl->in_len == sizeof(cl->in) - 1)) {
+	    break;
+	}
+    }
+    if (!end || (strncmp((char *) cl->in, "HTTP/1.1 101 ", 13) != 0)) {
+	dofail(0, "websocket handshake refused by %s:%d", host, port);
+	return false;
+    }
+    end += 4;
+    cl->in_len -= end - (char *) cl->in;
+    memmove(cl->in, end, cl->in_len);
+    return true;
+}
+
+/**
+ * @brief Connect \p cl to volumed, on the local socket at \p path if
+ * that is not NULL, otherwise with a websocket to \p port on \p host.
+ * Once connected the socket is non-blocking.
+ *
+ * @param cl (client_t *) The client to be connected.
+ * @param host (char *) The host on which volumed is running.
+ * @param port (int) The port on which volumed is listening.
+ * @param path (char *) The path of volumed's local socket, or NULL.
+ *
+ * @return (bool) true if the connection was made.  If not, the problem
+ *         has been reported.
+ */
+bool
+client_open(client_t *cl, const char *host, int port, const char *path)
+{
+    cl->local = path != NULL;
+    cl->out_off = 0;
+    cl->out_len = 0;
+    cl->in_len = 0;
+    cl->sent = 0;
+    cl->received = 0;
+    cl->fd = path ? connect_local(path): connect_tcp(host, port);
+    if (cl->fd < 0) {
+	return false;
+    }
+    if ((!cl->local && !client_handshake(cl, host, port)) ||
+	(fcntl(cl->fd, F_SETFL, fcntl(cl->fd, F_GETFL) | O_NONBLOCK) < 0))
+    {
+	client_close(cl);
+	return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Queue the text message \p msg to be sent to volumed.
+ *
+ * @param cl (client_t *) The client.
+ * @param msg (char *) The message.
+ * @param len (size_t) The length of \p msg.
+ *
+ * @return (bool) true if the message was queued, false if there was no
+ *         room for it, in which case client_flush() must be given the
+ *         chance to make room.
+ */
+bool
+client_queue(client_t *cl, const char *msg, size_t len)
+{
+    size_t need = len + (cl->local ? 2: WS_MAX_HEADER);
+    uint8_t mask[4];
+
+    if (len > WS_MAX_PAYLOAD) {
+	return false;
+    }
+    if (cl->out_len + need > sizeof(cl->out)) {
+	memmove(cl->out, cl->out + cl->out_off, cl->out_len - cl->out_off);
+	cl->out_len -= cl->out_off;
+	cl->out_off = 0;
+	if (cl->out_len + need > sizeof(cl->out)) {
+	    return false;
+	}
+    }
+    if (cl->local) {
+	cl->out[cl->out_len] = (uint8_t) (len >> 8);
+	cl->out[cl->out_len + 1] = (uint8_t) len;
+	memcpy(cl->out + cl->out_len + 2, msg, len);
+	cl->out_len += len + 2;
+    }
+    else {
+	random_bytes(mask, sizeof(mask));
+	cl->out_len += ws_encode_frame(cl->out + cl->out_len, WS_OP_TEXT,
+				       msg, len, mask);
+    }
+    cl->sent++;
+    return true;
+}
+
+/**
+ * @brief Queue \p cmd, as a text command, to be sent to volumed.
+ *
+ * @param cl (client_t *) The client.
+ * @param cmd (command_t *) The command.
+ *
+ * @return (bool) true if the command was queued.
+ */
+bool
+client_queue_command(client_t *cl, const command_t *cmd)
+{
+    char text[32];
+    size_t len = format_command(cmd, text, sizeof(text));
+
+    return len && client_queue(cl, text, len);
+}
+
+/**
+ * @brief Write as much queued output for \p cl as the socket will
+ * take, without blocking.
+ *
+ * @param cl (client_t *) The client.
+ *
+ * @return (bool) false if the connection has failed.
+ */
+bool
+client_flush(client_t *cl)
+{
+    size_t len;
+    ssize_t n;
+
+    while (cl->out_off < cl->out_len) {
+	if (cl->local) {
+	    len = (cl->out[cl->out_off] << 8) | cl->out[cl->out_off + 1];
+	    n = send(cl->fd, cl->out + cl->out_off + 2, len, MSG_NOSIGNAL);
+	    if (n >= 0) {
+		n = len + 2;
+	    }
+	}
+	else {
+	    n = send(cl->fd, cl->out + cl->out_off,
+		     cl->out_len - cl->out_off, MSG_NOSIGNAL);
+	}
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+	}
+	cl->out_off += n;
+    }
+    cl->out_off = 0;
+    cl->out_len = 0;
+    return true;
+}
+
+/**
+ * @brief Return whether \p cl has output waiting to be written.
+ */
+bool
+client_pending(const client_t *cl)
+{
+    return cl->out_off < cl->out_len;
+}
+
+/**
+ * @brief Pass each complete websocket message buffered for \p cl to
+ * \p fn, and discard it.
+ *
+ * @return (int) The number of messages, or -1 if the server has closed
+ *         the connection or sent something we cannot handle.
+ */
+static int
+client_parse(client_t *cl, client_msg_fn_t *fn, void *arg)
+{
+    ws_frame_t frame;
+    ssize_t used;
+    size_t off = 0;
+    int count = 0;
+
+    while ((used = ws_parse_frame(cl->in + off, cl->in_len - off,
+				  &frame)) > 0)
+    {
+	off += used;
+	if (frame.opcode == WS_OP_CLOSE) {
+	    return -1;
+	}
+	if ((frame.opcode == WS_OP_TEXT) || (frame.opcode == WS_OP_BINARY)) {
+	    cl->received++;
+	    count++;
+	    if (fn) {
+		fn((const char *) frame.payload, frame.len, arg);
+	    }
+	}
+    }
+    if (used < 0) {
+	return -1;
+    }
+    cl->in_len -= off;
+    memmove(cl->in, cl->in + off, cl->in_len);
+    return count;
+}
+
+/**
+ * @brief Read everything available from volumed on \p cl, without
+ * blocking, passing each message received to \p fn.
+ *
+ * @param cl (client_t *) The client.
+ * @param fn (client_msg_fn_t *) Function to be called for each message,
+ *        or NULL if the messages are not wanted.
+ * @param arg (void *) Argument to be passed to \p fn.
+ *
+ * @return (int) The number of messages received, or -1 if the
+ *         connection has been closed or has failed.
+ */
+int
+client_read(client_t *cl, client_msg_fn_t *fn, void *arg)
+{
+    int count = 0;
+    int n;
+    ssize_t len;
+
+    if (!cl->local && ((count = client_parse(cl, fn, arg)) < 0)) {
+	return -1;
+    }
+    for (;;) {
+	len = recv(cl->fd, cl->in + cl->in_len,
+		   sizeof(cl->in) - cl->in_len, 0);
+	if (len == 0) {
+	    return -1;
+	}
+	if (len < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? count: -1;
+	}
+	if (cl->local) {
+	    cl->received++;
+	    count++;
+	    if (fn) {
+		fn((const char *) cl->in, len, arg);
+	    }
+	    continue;
+	}
+	cl->in_len += len;
+	if ((n = client_parse(cl, fn, arg)) < 0) {
+	    return -1;
+	}
+	count += n;
+    }
+}
+
+/**
+ * @brief Close the connection for \p cl, discarding any unsent output.
+ *
+ * @param cl (client_t *) The client.
+ */
+void
+client_close(client_t *cl)
+{
+    if (cl->fd >= 0) {
+	close(cl->fd);
+	cl->fd = -1;
+    }
+    cl->out_off = 0;
+    cl->out_len = 0;
+    cl->in_len = 0;
+}
+
+/**
+ * @brief Initialise \p batch to contain no commands.
+ *
+ * @param batch (cmd_batch_t *) The batch.
+ */
+void
+batch_init(cmd_batch_t *batch)
+{
+    batch->volume = -1;
+    batch->step = 0;
+    batch->mute = CMD_NONE;
+    batch->status = false;
+    batch->commands = 0;
+    batch->invalid = 0;
+}
+
+/**
+ * @brief Return whether \p batch has nothing to send.
+ */
+bool
+batch_empty(const cmd_batch_t *batch)
+{
+    return (batch->volume < 0) && (batch->step == 0) &&
+	(batch->mute == CMD_NONE) && !batch->status;
+}
+
+/**
+ * @brief Fold \p cmd into \p batch.
+ *
+ * @param batch (cmd_batch_t *) The batch.
+ * @param cmd (command_t *) The command to be added.
+ */
+void
+batch_add(cmd_batch_t *batch, const command_t *cmd)
+{
+    int step;
+
+    batch->commands++;
+    switch (cmd->type) {
+    case CMD_VOLUME:
+	batch->volume = MIN(cmd->value, 100);
+	batch->step = 0;
+	break;
+    case CMD_UP:
+    case CMD_DOWN:
+	step = (cmd->type == CMD_UP) ? cmd->value: -cmd->value;
+	if (batch->volume >= 0) {
+	    batch->volume = MAX(0, MIN(batch->volume + step, 100));
+	}
+	else {
+	    batch->step = MAX(-100, MIN(batch->step + step, 100));
+	}
+	break;
+    case CMD_MUTE:
+    case CMD_UNMUTE:
+	batch->mute = cmd->type;
+	break;
+    case CMD_TOGGLE_MUTE:
+	switch (batch->mute) {
+	case CMD_MUTE:
+	    batch->mute = CMD_UNMUTE;
+	    break;
+	case CMD_UNMUTE:
+	    batch->mute = CMD_MUTE;
+	    break;
+	case CMD_TOGGLE_MUTE:
+	    batch->mute = CMD_NONE;
+	    break;
+	default:
+	    batch->mute = CMD_TOGGLE_MUTE;
+	    break;
+	}
+	break;
+    case CMD_STATUS:
+	batch->status = true;
+	break;
+    default:
+	break;
+    }
+}
+
+/**
+ * @brief Parse each complete, newline-terminated, command in \p text
+ * and fold it into \p batch.  Blank lines are ignored; invalid commands
+ * are counted and otherwise ignored.
+ *
+ * @param batch (cmd_batch_t *) The batch.
+ * @param text (char *) The text to be parsed.  This need not be
+ *        NUL-terminated.
+ * @param len (size_t) The length of \p text.
+ *
+ * @return (size_t) The number of bytes of \p text consumed.  Anything
+ *         after the last newline is left for the caller to parse once
+ *         the rest of the line has arrived.
+ */
+size_t
+batch_parse(cmd_batch_t *batch, const char *text, size_t len)
+{
+    const char *end = text + len;
+    const char *line = text;
+    const char *eol;
+    const char *p;
+    command_t cmd;
+
+    while ((eol = memchr(line, '\n', end - line))) {
+	if (parse_command(line, eol - line, &cmd)) {
+	    batch_add(batch, &cmd);
+	}
+	else {
+	    for (p = line; (p < eol) && isspace(*p); p++) {
+	    }
+	    if (p < eol) {
+		batch->invalid++;
+	    }
+	}
+	line = eol + 1;
+    }
+    return line - text;
+}
+
+/**
+ * @brief Produce, in \p cmds, the commands to be sent for \p batch:
+ * a volume change, then a mute change, then a status request, each only
+ * if needed.
+ *
+ * @param batch (cmd_batch_t *) The batch.
+ * @param cmds (command_t *) Array of at least #BATCH_MAX_COMMANDS
+ *        commands, to be filled in.
+ *
+ * @return (int) The number of commands.
+ */
+int
+batch_commands(const cmd_batch_t *batch, command_t *cmds)
+{
+    int n = 0;
+
+    if (batch->volume >= 0) {
+	cmds[n].type = CMD_VOLUME;
+	cmds[n++].value = batch->volume;
+    }
+    else if (batch->step) {
+	cmds[n].type = (batch->step > 0) ? CMD_UP: CMD_DOWN;
+	cmds[n++].value = abs(batch->step);
+    }
+    if (batch->mute != CMD_NONE) {
+	cmds[n].type = batch->mute;
+	cmds[n++].value = 0;
+    }
+    if (batch->status) {
+	cmds[n].type = CMD_STATUS;
+	cmds[n++].value = 0;
+    }
+    return n;
+}
@@ -0,0 +1,382 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Client commands.  Commands are short text messages of the form:
+ *
+ *     volume <pct>   - set the volume to <pct> percent
+ *     up [<pct>]     - increase the volume by <pct> (default 1) percent
+ *     down [<pct>]   - decrease the volume by <pct> (default 1) percent
+ *     mute           - mute
+ *     unmute         - unmute
+ *     toggle         - toggle mute
+ *     status         - request the current status
+ *     stats          - request latency statistics (see stats.c)
+ *     zone <id>      - address further commands to zone <id>
+ *
+ * Status is reported to clients as a JSON object, eg:
+ *     {"volume":40,"mute":false}
+ *
+ * which, for zones other than zone 0, also gives the zone's id:
+ *     {"zone":1,"volume":40,"mute":false}
+ *
+ * Clients that negotiate the binary subprotocol (see BIN_PROTOCOL) send
+ * the same commands, other than stats and zone, and receive the same
+ * status, as fixed-size binary records instead.  Each record carries
+ * the id of its zone.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "volumed.h"
+
+/**
+ * @brief The current volume state of the default zone, as last written
+ * to the mixer and as reported to clients.
+ */
+volume_state_t volume_state = {0, false};
+
+/**
+ * @brief The number of zones (see zone.c).  This is kept here, rather
+ * than with the zones themselves, so that clients can validate zone
+ * ids without the zones.
+ */
+int nzones = 1;
+
+static struct {
+    const char *name;
+    cmd_type_t  type;
+    bool        has_value;
+    int         default_value;
+} command_defs[] = {
+    {"volume", CMD_VOLUME, true, -1},
+    {"up", CMD_UP, true, 1},
+    {"down", CMD_DOWN, true, 1},
+    {"mute", CMD_MUTE, false, 0},
+    {"unmute", CMD_UNMUTE, false, 0},
+    {"toggle", CMD_TOGGLE_MUTE, false, 0},
+    {"status", CMD_STATUS, false, 0},
+    {"stats", CMD_STATS, false, 0},
+    {"zone", CMD_ZONE, true, -1},
+    {NULL, CMD_NONE, false, 0}
+};
+
+/**
+ * @brief Parse a text command from a client.
+ *
+ * @param text (char *) The command text.  This need not be
+ *        NUL-terminated.
+ * @param len (size_t) The length of \p text.
+ * @param cmd (command_t *) The command structure to be filled in.
+ *
+ * @return (bool) true if the command was valid.
+ */
+bool
+parse_command(const char *text, size_t len, command_t *cmd)
+{
+    const char *end = text + len;
+    const char *word;
+    size_t word_len;
+    int i;
+    int value;
+    bool have_value = false;
+
+    cmd->type = CMD_NONE;
+    while ((text < end) && isspace(*text)) {
+	text++;
+    }
+    word = text;
+    while ((text < end) && isalpha(*text)) {
+	text++;
+    }
+    word_len = text - word;
+    while ((text < end) && isspace(*text)) {
+	text++;
+    }
+    value = 0;
+    while ((text < end) && isdigit(*text)) {
+	have_value = true;
+	value = value * 10 + (*text - '0');
+	if (value > 1000) {
+	    return false;
+	}
+	text++;
+    }
+    while ((text < end) && isspace(*text)) {
+	text++;
+    }
+    if (text != end) {
+	return false;
+    }
+
+    for (i = 0; command_defs[i].name; i++) {
+	if ((strlen(command_defs[i].name) == word_len) &&
+	    (strncasecmp(command_defs[i].name, word, word_len) == 0))
+	{
+	    if (have_value && !command_defs[i].has_value) {
+		return false;
+	    }
+	    if (!have_value) {
+		value = command_defs[i].default_value;
+		if (value < 0) {
+		    return false;
+		}
+	    }
+	    cmd->type = command_defs[i].type;
+	    cmd->value = value;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/**
+ * @brief Format \p cmd as a text command, as accepted by
+ * parse_command().
+ *
+ * @param cmd (command_t *) The command.
+ * @param buf (char *) The buffer into which to write the command.
+ * @param size (size_t) The size of \p buf.
+ *
+ * @return (size_t) The length of the command, or 0 if \p cmd is not
+ *         a valid command.
+ */
+size_t
+format_command(const command_t *cmd, char *buf, size_t size)
+{
+    int i;
+
+    for (i = 0; command_defs[i].name; i++) {
+	if (command_defs[i].type == cmd->type) {
+	    if (command_defs[i].has_value) {
+		return snprintf(buf, size, "%s %d",
+				command_defs[i].name, cmd->value);
+	    }
+	    return snprintf(buf, size, "%s", command_defs[i].name);
+	}
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply \p cmd to \p state.
+ *
+ * @param state (volume_state_t *) The state to be updated.
+ * @param cmd (command_t *) The command to be applied.
+ *
+ * @return (bool) true if \p state was changed.
+ */
+bool
+apply_command(volume_state_t *state, const command_t *cmd)
+{
+    volume_state_t prev = *state;
+
+    switch (cmd->type) {
+    case CMD_VOLUME:
+	state->volume = cmd->value;
+	break;
+    case CMD_UP:
+	state->volume += cmd->value;
+	break;
+    case CMD_DOWN:
+	state->volume -= cmd->value;
+	break;
+    case CMD_MUTE:
+	state->mute = true;
+	break;
+    case CMD_UNMUTE:
+	state->mute = false;
+	break;
+    case CMD_TOGGLE_MUTE:
+	state->mute = !state->mute;
+	break;
+    default:
+	break;
+    }
+    state->volume = MAX(0, MIN(state->volume, 100));
+    return (prev.volume != state->volume) || (prev.mute != state->mute);
+}
+
+/**
+ * @brief Format the current state of \p zone as a status message.
+ *
+ * @param zone (zone_t *) The zone.
+ * @param buf (char *) The buffer into which to write the message.
+ * @param size (size_t) The size of \p buf.
+ *
+ * @return (size_t) The length of the message.
+ */
+size_t
+format_status(const zone_t *zone, char *buf, size_t size)
+{
+    if (zone->id) {
+	return snprintf(buf, size, "{\"zone\":%d,\"volume\":%d,\"mute\":%s}",
+			zone->id, zone->state->volume,
+			zone->state->mute ? "true": "false");
+    }
+    return snprintf(buf, size, "{\"volume\":%d,\"mute\":%s}",
+		    zone->state->volume,
+		    zone->state->mute ? "true": "false");
+}
+
+/**
+ * @brief Parse a status message, as produced by format_status(), for
+ * any zone.
+ *
+ * @param text (char *) The message.  This need not be NUL-terminated.
+ * @param len (size_t) The length of \p text.
+ * @param state (volume_state_t *) The state to be filled in.
+ *
+ * @return (bool) true if \p text was a status message.
+ */
+bool
+parse_status(const char *text, size_t len, volume_state_t *state)
+{
+    char buf[STATUS_BUFFER_SIZE];
+    char *p = buf;
+    char mute[6];
+    int volume;
+    int zone;
+    int n = 0;
+
+    if (len >= sizeof(buf)) {
+	return false;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    if (sscanf(buf, "{\"zone\":%d,%n", &zone, &n) == 1) {
+	/* Skip the zone, leaving the brace for the format below. */
+	p += n - 1;
+	*p = '{';
+	len -= n - 1;
+	n = 0;
+    }
+    if ((sscanf(p, "{\"volume\":%d,\"mute\":%5[a-z]}%n",
+		&volume, mute, &n) != 2) || (n != len))
+    {
+	return false;
+    }
+    if (strcmp(mute, "true") == 0) {
+	state->mute = true;
+    }
+    else if (strcmp(mute, "false") == 0) {
+	state->mute = false;
+    }
+    else {
+	return false;
+    }
+    state->volume = volume;
+    return true;
+}
+
+/**
+ * @brief Decode the binary record at \p buf.
+ *
+ * @param buf (uint8_t *) The #BIN_RECORD_SIZE bytes of the record.
+ * @param rec (bin_record_t *) The record structure to be filled in.
+ */
+void
+bin_decode(const uint8_t *buf, bin_record_t *rec)
+{
+    rec->op = buf[0];
+    rec->zone = buf[1];
+    rec->seq = (uint16_t) ((buf[2] << 8) | buf[3]);
+    rec->value = (int32_t) (((uint32_t) buf[4] << 24) | (buf[5] << 16) |
+			    (buf[6] << 8) | buf[7]);
+}
+
+/**
+ * @brief Encode \p rec as a binary record.
+ *
+ * @param buf (uint8_t *) Buffer for the #BIN_RECORD_SIZE bytes of the
+ *        record.
+ * @param rec (bin_record_t *) The record.
+ */
+void
+bin_encode(uint8_t *buf, const bin_record_t *rec)
+{
+    uint32_t value = (uint32_t) rec->value;
+
+    buf[0] = rec->op;
+    buf[1] = rec->zone;
+    buf[2] = (uint8_t) (rec->seq >> 8);
+    buf[3] = (uint8_t) rec->seq;
+    buf[4] = (uint8_t) (value >> 24);
+    buf[5] = (uint8_t) (value >> 16);
+    buf[6] = (uint8_t) (value >> 8);
+    buf[7] = (uint8_t) value;
+}
+
+/**
+ * @brief Convert a binary command record into a command.  The limits
+ * are those of parse_command().
+ *
+ * @param rec (bin_record_t *) The record.
+ * @param cmd (command_t *) The command structure to be filled in.
+ *
+ * @return (bool) true if the record was a valid command.
+ */
+bool
+bin_command(const bin_record_t *rec, command_t *cmd)
+{
+    cmd->type = CMD_NONE;
+    cmd->value = 0;
+    if (rec->zone >= nzones) {
+	return false;
+    }
+    switch (rec->op) {
+    case BIN_OP_VOLUME:
+	cmd->type = CMD_VOLUME;
+	break;
+    case BIN_OP_UP:
+	cmd->type = CMD_UP;
+	break;
+    case BIN_OP_DOWN:
+	cmd->type = CMD_DOWN;
+	break;
+    case BIN_OP_MUTE:
+	cmd->type = CMD_MUTE;
+	return true;
+    case BIN_OP_UNMUTE:
+	cmd->type = CMD_UNMUTE;
+	return true;
+    case BIN_OP_TOGGLE_MUTE:
+	cmd->type = CMD_TOGGLE_MUTE;
+	return true;
+    case BIN_OP_STATUS:
+	cmd->type = CMD_STATUS;
+	return true;
+    default:
+	return false;
+    }
+    if ((rec->value < 0) || (rec->value > 1000)) {
+	cmd->type = CMD_NONE;
+	return false;
+    }
+    cmd->value = rec->value;
+    return true;
+}
+
+/**
+ * @brief Fill in \p rec as a status record for the current state of
+ * \p zone.
+ *
+ * @param rec (bin_record_t *) The record to be filled in.
+ * @param zone (zone_t *) The zone.
+ * @param seq (uint16_t) The seq of the command being answered, or 0.
+ */
+void
+bin_status(bin_record_t *rec, const zone_t *zone, uint16_t seq)
+{
+    rec->op = BIN_OP_STATE;
+    rec->zone = (uint8_t) zone->id;
+    rec->seq = seq;
+    rec->value = zone->state->volume |
+	(zone->state->mute ? BIN_STATE_MUTE: 0);
+}
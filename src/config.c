@@ -9,6 +9,94 @@
 /*
  * Put any mainpage documentation sections that we might need, in here.
  */
+
+/*! @page config Configuration
+The configuration file consists of lines of the form "name = value".
+Anything following a # is a comment.  The following names are
+recognised:
+
+- port: the websocket port (default 8888);
+- volcurve: whether to map volume percentages onto a volume curve
+  (yes/no, default yes);
+- max_pct: the maximum volume percentage (default 100);
+- alsa_mixer_name: the ALSA simple mixer control (default "Digital");
+- mpd_mixer: the mpd mixer type (default "hardware");
+- alsa_card_name: the ALSA card, either a card name or an ALSA device
+  name such as "hw:0" (default: the default card);
+- mixer: the mixer backend, "alsa" or, for testing and for running
+  without sound hardware, "fake" (default "alsa");
+- max_clients: the maximum number of simultaneous client connections
+  (default 64).  Space for this many connections is allocated at
+  startup; further connections are refused;
+- socket_path: the path of a unix domain socket on which to listen for
+  local clients, as well as listening on port (default: none).  Local
+  clients send each command as a single packet, without the websocket
+  handshake or framing;
+- ramp_step: the largest volume change, in percentage points, to be
+  made in one step.  Larger changes are made as a ramp of such steps,
+  so that a jump from quiet to loud is not abrupt (default 0, meaning
+  no ramping).  The steps are percentages, so with volcurve they
+  follow the volume curve;
+- ramp_interval: the time, in milliseconds, between the steps of a
+  ramp (default 20);
+- writer_thread: whether to make mixer writes from a dedicated thread,
+  so that network traffic can never delay them (yes/no, default no);
+- writer_priority: the SCHED_FIFO priority, from 1 to 99, to give the
+  writer thread (default 0, meaning the normal scheduling policy);
+- writer_cpu: the CPU to which to pin the writer thread (default: no
+  pinning);
+- workers: the number of event loops accepting connections on port
+  (default 1).  With more than one, a thread is started for each loop
+  after the first, and all listen on port using SO_REUSEPORT so that
+  the kernel spreads connections between them.  Each loop has its own
+  max_clients connections.  The mixers are still driven only by the
+  main loop, to which the others forward their commands;
+- status_page: the path of a file, such as /run/volumed.status, in
+  which to publish the volume and mute state of each zone for local
+  readers, which map it into memory and read it without any round trip
+  to volumed (default: none).  See status_page.c for its layout;
+- lazy_mixer: whether to leave each mixer unopened until the first
+  command for its zone, rather than opening it at startup, so that
+  volumed is ready for connections as soon as it is running (yes/no,
+  default yes).  A mixer that cannot be opened then fails only the
+  command that needed it, and is tried again for the next one.  With
+  lazy_mixer = no, each mixer is opened at startup, and one that cannot
+  be opened stops volumed there.  With workers or status_page,
+  which need the state of each zone from the start, the mixers are
+  instead opened as soon as volumed is listening, and volumed warns
+  that lazy_mixer has no effect;
+- zone: the start of a further zone, with the given name.  A zone is a
+  mixer with its own volume, mute and clients, addressed by clients
+  through its id: 1 for the first zone declared, 2 for the next and so
+  on, up to 7.  The mixer settings (volcurve, max_pct, alsa_mixer_name,
+  mpd_mixer, alsa_card_name and mixer) that follow a zone line apply
+  to that zone, which otherwise starts with those of the default zone,
+  zone 0, as set so far.  All other settings are for the daemon as a
+  whole, wherever they appear.  Eg:
+
+      alsa_card_name = hw:0       # Zone 0, "default"
+      zone = kitchen              # Zone 1
+      alsa_card_name = hw:1
+      max_pct = 80
+
+The configuration is reloaded on SIGHUP, and whenever the config file
+read at startup is rewritten.  Only what has changed is reinitialised:
+the volume curve is rebuilt, the mixer reopened or the port rebound,
+without dropping clients.  If the new configuration cannot be applied,
+the old one remains in force.  A change to max_clients, or to the
+writer thread settings, or to the zones other than the volume curves
+of existing zones, or to workers, status_page or lazy_mixer, takes
+effect only on restart, as does a change to port while there is more
+than one worker.
+
+volumed can be started by systemd socket activation: sockets passed to
+it under the LISTEN_FDS convention are used in place of port and
+socket_path, a unix domain socket (which must be of type
+SOCK_SEQPACKET) serving as the local socket, and an internet socket
+(of type SOCK_STREAM) as the port.  Any other socket, or one that is
+not listening, is reported and ignored.  With workers, the port
+must be shared, with ReusePort=yes.
+*/
 #else
 
 #include <stdio.h>
@@ -16,6 +104,8 @@
 #include <string.h>
 #include <glob.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "volumed.h"
 
 
@@ -24,19 +114,28 @@
  * file option and it cannot be opened.
  * 
  * @param options (option_t *) Pointer to our options struct.
+ * @param arena (arena_t *) The arena into which to copy the name of
+ *        the file that was opened.
+ * @param p_filename (char **) Pointer to a variable to receive the
+ *        name of the file that was opened.
+ * @param failcode (int) The code with which to fail if an explicit
+ *        config file cannot be opened, or 0 to just report it.
  * @return (FILE *) the opened config file.
  */
 static FILE *
-open_config_file(options_t *options, char **p_filename)
+open_config_file(options_t *options, arena_t *arena,
+		 char **p_filename, int failcode)
 {
     FILE *f = NULL;
     char *name;
+    char home_path[PATH_MAX];
+    const char *home;
     
     if (options->config_filename) {
 	/* Explicit config file was specified.  We *must* open this. */
 	f = fopen(name = options->config_filename, "r");
 	if (!f) {
-	    dofail(2, "unable to open file: \"%s\"", name);
+	    dofail(failcode, "unable to open file: \"%s\"", name);
 	}
     }
     else {
@@ -44,148 +143,141 @@ open_config_file(options_t *options, char **p_filename)
 	 * problem if we cannot open any of them. */
 		
 	if (!(f = fopen(name = "./" LOCAL_CONFIG_FILE, "r"))) {
-	    /* Nothing in the cur directory; try our home directory. */
+	    /* Nothing in the cur directory; try our home directory.  This
+	     * is on the path of every startup, so we use glob(), which
+	     * may look up our passwd entry, only when HOME is not set. */
 	    glob_t paths;
-	    int res;
-	    if ((res = glob("~/" LOCAL_CONFIG_FILE,
-			    GLOB_TILDE, NULL, &paths)) == 0)
+	    if ((home = getenv("HOME")) &&
+		(snprintf(home_path, sizeof(home_path), "%s/%s",
+			  home, LOCAL_CONFIG_FILE) < sizeof(home_path)))
 	    {
-		name = paths.gl_pathv[0];
-		STRCPY((*p_filename), name);
+		f = fopen(name = home_path, "r");
+	    }
+	    else if (!home &&
+		     (glob("~/" LOCAL_CONFIG_FILE, GLOB_TILDE,
+			   NULL, &paths) == 0))
+	    {
+		name = arena_strdup(arena, paths.gl_pathv[0]);
 	        f = fopen(name, "r");
 		globfree(&paths);
-		if (!f) {
-		    FREE(*p_filename);
-		    *p_filename = NULL;
-		}
-
 	    }
-	    else {
+	    if (!f) {
 		/* Nothing in our home directory; try the default config
 		 * file path. */ 
 		f = fopen(name = CONFIG_FILE, "r");
 	    }
 	}
     }
-    if (f && !*p_filename) {
-	STRCPY((*p_filename), name);
+    if (f) {
+	*p_filename = (name == options->config_filename) ? name:
+	    arena_strdup(arena, name);
     }
     return f;
 }
 
 
+/**
+ * @brief Read the whole of the config file \p f into a buffer
+ * allocated from \p arena, and close it.
+ *
+ * @param f (FILE *) The open config file.
+ * @param arena (arena_t *) The arena from which to allocate the buffer.
+ * @param p_len (size_t *) Pointer to a variable to receive the length
+ *        of the file.
+ *
+ * @return (char *) The buffer, which is null-terminated.
+ */
+static char *
+read_config_buffer(FILE *f, arena_t *arena, size_t *p_len)
+{
+    struct stat st;
+    size_t size = 0;
+    char *buf;
+
+    if ((fstat(fileno(f), &st) == 0) && (st.st_size > 0)) {
+	size = st.st_size;
+    }
+    buf = (char *) arena_alloc(arena, size + 1);
+    *p_len = fread(buf, 1, size, f);
+    buf[*p_len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/**
+ * @brief Trim leading and trailing whitespace from the text between
+ * \p start and \p end, null-terminating it in place.
+ *
+ * @return (char *) The start of the trimmed text.
+ */
+static char *
+trim(char *start, char *end)
+{
+    while ((start < end) && isspace((unsigned char) *start)) {
+	start++;
+    }
+    while ((end > start) && isspace((unsigned char) end[-1])) {
+	end--;
+    }
+    *end = '\0';
+    return start;
+}
+
 /**
  * @brief Read the next token and value pair from the config file.
- * 
- * Keep calling this until it returns NULL at which time \p f will have
- * been closed.
  *
- * @param f (FILE *) The file pointer for the configuration file.
+ * The file has already been read into a buffer by read_config_buffer().
+ * The buffer is tokenized in place, in a single pass, so that \p
+ * *p_token and \p *p_value point into it: nothing is allocated or
+ * copied.
+ *
+ * Keep calling this until it returns false.
+ *
+ * @param reader (config_reader_t *) The reader state, which is
+ *        positioned at the start of the next line to be read.
  * @param p_token (char **) Pointer to a (char *) string variable
- *        into which a dynamically allocated string will be placed for a
- *        configuration token.  The caller must free this.
+ *        into which the configuration token will be placed.
  * @param p_value (char **) Pointer to a (char *) string variable
- *        into which a dynamically allocated string will be placed for a
- *        configuration value.  The caller must free this.
+ *        into which the configuration value will be placed.
  * 
- * @return (FILE *) the file pointer for the config file until the last
- *         config setting has been returned, and then NULL.
+ * @return (bool) true if a setting has been returned, false if there
+ *         are no more.
  */
-extern FILE *
-next_config_setting(
-    FILE *f, char **p_token, char **p_value, int *p_line_no, char *filename)
+extern bool
+next_config_setting(config_reader_t *reader, char **p_token, char **p_value)
 {
-    char c;
-    char *idx;
-    char *trailing_space = NULL;
-    bool in_comment = false;
-    bool before_text = true;
-    int len = 0;
-    int size = 100;
-    
-    fflush(stdout);
+    char *line;
+    char *eol;
+    char *eq;
+    char *p;
 
-    *p_token = idx = (char *) MALLOC(size);
-    *p_value = NULL;
-
-    while ((c = fgetc(f)) != EOF) {
-	if (in_comment) {
-	    if (c != '\n') {
-		continue;
-	    }
+    while (reader->pos < reader->end) {
+	line = reader->pos;
+	if ((eol = memchr(line, '\n', reader->end - line))) {
+	    reader->pos = eol + 1;
 	}
-	switch (c) {
-	case '#':
-	    in_comment = true;
-	    continue;
-	case '=':
-	    *idx = '\0';
-	    *p_value = idx = (char *) malloc(size);
-	    before_text = true;
-	    if (trailing_space) {
-		*trailing_space = '\0';
-		trailing_space = NULL;
-	    }
-	    continue;
-	case '\n':
-	    in_comment = false;
-	    (*p_line_no)++;
-	    break;
-	default:
-	    if (before_text && isspace(c)) {
-		continue;
-	    }
-	    before_text = false;
-	    if (isspace(c)) {
-		if (!trailing_space) {
-		    trailing_space = idx;
-		}
-	    }
-	    else {
-		trailing_space = NULL;
-	    }
-	    *idx = c;
-	    idx++;
-	    len++;
-	    if (len >= size) {
-		size = size + 200;
-		if (*p_value) {
-		    *p_value = realloc((void *) *p_value, size);
-		    idx = *p_value + len;
-		}
-		else {
-		    *p_token = realloc((void *) *p_token, size);
-		    idx = *p_token + len;
-		}
-	    }
-	    continue;
-	}
-	/* Only get here at the end of a line. */
-	*idx = '\0';
-	if (trailing_space) {
-	    *trailing_space = '\0';
+	else {
+	    reader->pos = eol = reader->end;
 	}
-	if (idx == *p_token) {
-	    /* We read nothing, so go on to the next line. */
-	    continue;
+	reader->line_no++;
+	if ((p = memchr(line, '#', eol - line))) {
+	    eol = p;
 	}
-	if (!*p_value) {
-	    fflush(stdout);
-	    /* We have no value. */
-	    fprintf(stderr,
-		    "Warning: Invalid configuration entry \"%s\" "
-		    "(entry ignored) at %s:%d\n",
-		    *p_token, filename, *p_line_no);
-	    idx = *p_token;
+	eq = memchr(line, '=', eol - line);
+	*p_token = trim(line, eq ? eq: eol);
+	if (!eq) {
+	    if (**p_token) {
+		fprintf(stderr,
+			"Warning: Invalid configuration entry \"%s\" "
+			"(entry ignored) at %s:%d\n",
+			*p_token, reader->filename, reader->line_no);
+	    }
 	    continue;
 	}
-	return f;
+	*p_value = trim(eq + 1, eol);
+	return true;
     }
-
-    /* We reach this point only when eof has been reached, and there is
-     * nothing to return to the caller. */
-    fclose(f);
-    return NULL;
+    return false;
 }
 
 static cfg_option_t cfg_options[] = {
@@ -195,9 +287,66 @@ static cfg_option_t cfg_options[] = {
     {CFG_NAME_MPD_MIXER,  STRING},
     {CFG_NAME_ALSA_CARD,  STRING},
     {CFG_NAME_PORT,  INTEGER},
+    {CFG_NAME_MIXER,  STRING},
+    {CFG_NAME_MAX_CLIENTS,  INTEGER},
+    {CFG_NAME_SOCKET_PATH,  STRING},
+    {CFG_NAME_RAMP_STEP,  INTEGER},
+    {CFG_NAME_RAMP_INTERVAL,  INTEGER},
+    {CFG_NAME_WRITER_THREAD,  BOOLEAN},
+    {CFG_NAME_WRITER_PRIORITY,  INTEGER},
+    {CFG_NAME_WRITER_CPU,  INTEGER},
+    {CFG_NAME_ZONE,  STRING},
+    {CFG_NAME_WORKERS,  INTEGER},
+    {CFG_NAME_STATUS_PAGE,  STRING},
+    {CFG_NAME_LAZY_MIXER,  BOOLEAN},
     {NULL, NONE}
 };
 
+/* A power of 2, well above the number of options. */
+#define CFG_HASH_SIZE 32
+
+/**
+ * @brief Open-addressed hash table of #cfg_options, holding for each
+ * slot the option's index plus 1, or 0 for an empty slot.  This is
+ * generated from #cfg_options on first use.
+ */
+static signed char cfg_hash[CFG_HASH_SIZE];
+static bool cfg_hash_built = false;
+
+/**
+ * @brief The FNV-1a hash of \p name.
+ */
+static unsigned int
+hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+	hash ^= (unsigned char) *name++;
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Generate #cfg_hash from #cfg_options.
+ */
+static void
+build_option_hash()
+{
+    unsigned int slot;
+    int idx;
+
+    for (idx = 0; cfg_options[idx].option_name; idx++) {
+	slot = hash_name(cfg_options[idx].option_name);
+	while (cfg_hash[slot & (CFG_HASH_SIZE - 1)]) {
+	    slot++;
+	}
+	cfg_hash[slot & (CFG_HASH_SIZE - 1)] = idx + 1;
+    }
+    cfg_hash_built = true;
+}
+
 /**
  * @brief Identify the #cfg_options entry for \p name.
  * 
@@ -210,14 +359,17 @@ static cfg_option_t cfg_options[] = {
 static int
 get_option(const char *name)
 {
-    cfg_option_t *opt = cfg_options;
-    int idx = 0;
-    while (opt->option_name) {
-	if (strcmp(name, opt->option_name) == 0) {
-	    return idx;
+    unsigned int slot = hash_name(name);
+    int idx;
+
+    if (!cfg_hash_built) {
+	build_option_hash();
+    }
+    while ((idx = cfg_hash[slot & (CFG_HASH_SIZE - 1)])) {
+	if (strcmp(name, cfg_options[idx - 1].option_name) == 0) {
+	    return idx - 1;
 	}
-	opt++;
-	idx++;
+	slot++;
     }
     return -1;
 }
@@ -237,27 +389,160 @@ downcase(char *str)
 }
 
 /**
- * @brief Read our config file, updating the #options variable.
- * 
- * @param options (option_t *) Pointer to our options struct.
+ * @brief The options as they were before the config file was first
+ * read: built-in defaults, overridden by command line arguments.  Every
+ * read of the config file starts from these.
  */
-extern void
-read_config_file()
+static options_t base_options;
+
+/**
+ * @brief Free the strings in \p opts that were allocated when reading
+ * the config file, which all live in a single arena.  Strings shared
+ * with #base_options, which are built-in defaults or command line
+ * arguments, are not affected.
+ *
+ * @param opts (options_t *) The options whose strings are to be freed.
+ */
+void
+free_config_options(options_t *opts)
 {
+    arena_free(opts->arena);
+    opts->arena = NULL;
+    opts->config_path = NULL;
+    opts->alsa_mixer_name = base_options.alsa_mixer_name;
+    opts->mpd_mixer = base_options.mpd_mixer;
+    opts->alsa_card = base_options.alsa_card;
+    opts->mixer = base_options.mixer;
+    opts->socket_path = base_options.socket_path;
+    opts->status_page = base_options.status_page;
+    opts->nzones = 1;
+}
+
+/**
+ * @brief Start a new zone called \p name in \p opts, with the settings
+ * of the default zone as read so far.  A zone that cannot be added is
+ * reported, and the settings that follow it are ignored.
+ *
+ * @param opts (options_t *) The options being read.
+ * @param name (char *) The zone's name.
+ * @param reader (config_reader_t *) The reader, for reports.
+ *
+ * @return (zone_options_t *) The zone, to which the settings that
+ *         follow are to be applied.
+ */
+static zone_options_t *
+add_zone(options_t *opts, char *name, const config_reader_t *reader)
+{
+    static zone_options_t ignored;
+    zone_options_t *zone;
+    int i;
+
+    for (i = 1; i < opts->nzones; i++) {
+	if (strcmp(opts->zones[i].name, name) == 0) {
+	    break;
+	}
+    }
+    if ((i < opts->nzones) || (strcmp(name, DEFAULT_ZONE_NAME) == 0)) {
+	fprintf(stderr, "Warning: Duplicate zone \"%s\" (zone ignored) "
+		"at %s:%d\n", name, reader->filename, reader->line_no);
+	return &ignored;
+    }
+    if (opts->nzones == MAX_ZONES) {
+	fprintf(stderr, "Warning: Too many zones (max %d): \"%s\" "
+		"(zone ignored) at %s:%d\n", MAX_ZONES - 1, name,
+		reader->filename, reader->line_no);
+	return &ignored;
+    }
+    zone = &opts->zones[opts->nzones++];
+    zone->name = name;
+    zone->volcurve = opts->volcurve;
+    zone->max_pct = opts->max_pct;
+    zone->alsa_mixer_name = opts->alsa_mixer_name;
+    zone->mpd_mixer = opts->mpd_mixer;
+    zone->alsa_card = opts->alsa_card;
+    zone->mixer = opts->mixer;
+    return zone;
+}
+
+/**
+ * @brief Apply the setting for #cfg_options entry \p opt_id to \p zone,
+ * if it is a per-zone setting.
+ *
+ * @return (bool) true if the setting was applied.
+ */
+static bool
+zone_setting(zone_options_t *zone, int opt_id, char *value,
+	     bool bval, int ival)
+{
+    switch (opt_id) {
+    case 0:
+	zone->volcurve = bval;
+	return true;
+    case 1:
+	zone->max_pct = ival;
+	return true;
+    case 2:
+	zone->alsa_mixer_name = value;
+	return true;
+    case 3:
+	zone->mpd_mixer = value;
+	return true;
+    case 4:
+	zone->alsa_card = value;
+	return true;
+    case 6:
+	zone->mixer = value;
+	return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Read our config file into \p opts, which is first reset to
+ * the defaults and command line settings.
+ *
+ * The file is read into an arena belonging to \p opts, and the string
+ * options point directly into it, so the whole lot is freed in one go
+ * by free_config_options().
+ *
+ * @param opts (options_t *) The options struct to be filled in.
+ * @param failcode (int) The code with which to exit if an explicitly
+ *        named config file cannot be opened.  If 0, we just report the
+ *        problem and return false.
+ *
+ * @return (bool) false if the config file could not be opened.
+ */
+bool
+read_config_options(options_t *opts, int failcode)
+{
+    config_reader_t reader;
+    zone_options_t *zone = NULL;
+    arena_t *arena = arena_new("config", CONFIG_ARENA_CHUNK);
     char *filename = NULL;
-    FILE *f = open_config_file(&options, &filename);
-    char *token = NULL;
-    char *value = NULL;
+    FILE *f;
+    char *token;
+    char *value;
     char *ptr;
     char  c;
     bool  bval = false;
     int   ival = 0;
-    int   line_no = 0;
     int   opt_id;
+    size_t len;
     
-    while (f &&
-	   (f = next_config_setting(f, &token, &value, &line_no, filename)))
-    {
+    *opts = base_options;
+    if (!(f = open_config_file(opts, arena, &filename, failcode))) {
+	arena_free(arena);
+	return !opts->config_filename;
+    }
+
+    opts->arena = arena;
+    opts->config_path = filename;
+    reader.pos = read_config_buffer(f, arena, &len);
+    reader.end = reader.pos + len;
+    reader.line_no = 0;
+    reader.filename = filename;
+
+    while (next_config_setting(&reader, &token, &value)) {
         downcase(token);
 	opt_id = get_option(token);
 	if (opt_id >= 0) {
@@ -273,7 +558,7 @@ read_config_file()
 			fprintf(stderr,
 				"Warning: invalid value (%s) for boolean "
 				"\"%s\" (entry ignored) at %s:%d\n",
-				value, token, filename, line_no);
+				value, token, filename, reader.line_no);
 		    }
 		}
 		break;
@@ -290,44 +575,94 @@ read_config_file()
 			fprintf(stderr,
 				"Warning: Invalid value (%s) for integer "
 				"\"%s\" (entry ignored) at %s:%d\n",
-				value, token, filename, line_no);
+				value, token, filename, reader.line_no);
 		    }
 		}
 	    default:
 		break;
 	    }
+	    if (zone && zone_setting(zone, opt_id, value, bval, ival)) {
+		continue;
+	    }
 	    switch (opt_id) {
 	    case 0:
-		options.volcurve = bval;
-		FREE(value);
+		opts->volcurve = bval;
 		break;
 	    case 1:
-		options.max_pct = ival;
-		FREE(value);
+		opts->max_pct = ival;
 		break;
 	    case 2:
-		options.alsa_mixer_name = value;
+		opts->alsa_mixer_name = value;
 		break;
 	    case 3:
-		options.mpd_mixer = value;
+		opts->mpd_mixer = value;
 		break;
 	    case 4:
-		options.alsa_card = value;
+		opts->alsa_card = value;
 		break;
 	    case 5:
-		options.port = ival;
+		opts->port = ival;
+		break;
+	    case 6:
+		opts->mixer = value;
+		break;
+	    case 7:
+		opts->max_clients = ival;
+		break;
+	    case 8:
+		opts->socket_path = value;
+		break;
+	    case 9:
+		opts->ramp_step = ival;
+		break;
+	    case 10:
+		opts->ramp_interval = ival;
+		break;
+	    case 11:
+		opts->writer_thread = bval;
+		break;
+	    case 12:
+		opts->writer_priority = ival;
+		break;
+	    case 13:
+		opts->writer_cpu = ival;
+		break;
+	    case 14:
+		zone = add_zone(opts, value, &reader);
+		break;
+	    case 15:
+		opts->workers = ival;
+		break;
+	    case 16:
+		opts->status_page = value;
+		break;
+	    case 17:
+		opts->lazy_mixer = bval;
 		break;
 	    }
 	}
 	else {
 	    fprintf(stderr,
 		    "Warning: Unrecognized token \"%s\" "
-		    "(entry ignored) at %s:%d\n", token, filename, line_no);
+		    "(entry ignored) at %s:%d\n",
+		    token, filename, reader.line_no);
 	}
     }
-    FREE(filename);
+    arena_report(arena);
+    return true;
 }
 
+/**
+ * @brief Read our config file, updating the #options variable.  This
+ * is called once, at startup, after the command line has been
+ * processed.
+ */
+extern void
+read_config_file()
+{
+    base_options = options;
+    (void) read_config_options(&options, 2);
+}
 
 
 #endif
@@ -0,0 +1,208 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Shared output frames.  A message that goes to many clients, such as
+ * the status broadcast that follows each volume change, is encoded into
+ * a websocket frame just once.  The frame is reference counted, and each
+ * connection that cannot write it immediately queues a reference to it
+ * rather than a copy.  The frame is freed when the last connection
+ * has finished writing it.
+ *
+ * Once the server is running, frames come from a pool that is
+ * allocated when it starts, rather than from the heap.  Pool frames
+ * are big enough for any status message, and there are enough of them
+ * that the pool cannot run dry: a connection's queue holds at most one
+ * status frame being written, and one waiting behind it for each zone,
+ * so nzones + 1 per connection, plus the text and binary frames that
+ * each loop keeps for the latest status of each zone (see server.c),
+ * will always do.  Anything bigger, or anything created before the
+ * pool exists, comes from the heap.
+ *
+ * Frames are never shared between threads: each worker (see worker.c)
+ * encodes its own broadcasts, so the pool, and the reference counts,
+ * need no locking.  The pool is per-thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "volumed.h"
+
+/**
+ * @brief Count of frames created by this thread, for use in tests and
+ * statistics.
+ */
+__thread unsigned long frames_created = 0;
+
+#define FRAME_POOL_DATA (WS_MAX_HEADER + STATUS_BUFFER_SIZE)
+#define FRAME_POOL_SLOT ((offsetof(frame_t, data) + FRAME_POOL_DATA + 7) & ~7)
+
+/**
+ * @brief Memory for the frame pool, and the stack of free frames
+ * within it.  Each worker thread has a pool of its own.
+ */
+static __thread uint8_t *pool_mem = NULL;
+static __thread frame_t **pool_free = NULL;
+static __thread int pool_size = 0;
+static __thread int pool_nfree = 0;
+
+
+/**
+ * @brief Allocate the frame pool, with room for \p count frames.  Does
+ * nothing if the pool already exists and is at least that big.
+ *
+ * @param count (int) The number of frames needed.
+ */
+void
+frame_pool_init(int count)
+{
+    int i;
+
+    if (pool_size >= count) {
+	return;
+    }
+    frame_pool_free();
+    pool_mem = (uint8_t *) MALLOC((size_t) count * FRAME_POOL_SLOT);
+    pool_free = (frame_t **) MALLOC(count * sizeof(frame_t *));
+    for (i = 0; i < count; i++) {
+	pool_free[i] = (frame_t *) (pool_mem + (size_t) i * FRAME_POOL_SLOT);
+    }
+    pool_size = pool_nfree = count;
+}
+
+/**
+ * @brief Free the frame pool.  No pool frame may still be referenced.
+ */
+void
+frame_pool_free(void)
+{
+    free(pool_mem);
+    free(pool_free);
+    pool_mem = NULL;
+    pool_free = NULL;
+    pool_size = pool_nfree = 0;
+}
+
+/**
+ * @brief Allocate a frame able to hold \p size bytes, from \p arena or,
+ * if that is NULL, from the pool or the heap.  Returns NULL if \p arena
+ * is a fixed arena without room for the frame.
+ */
+static frame_t *
+frame_alloc(arena_t *arena, size_t size)
+{
+    size_t total = offsetof(frame_t, data) + size;
+    bool pooled = !arena && (size <= FRAME_POOL_DATA) && (pool_nfree > 0);
+    frame_t *frame;
+
+    if (arena) {
+	frame = (frame_t *) arena_alloc(arena, total);
+	if (!frame) {
+	    return NULL;
+	}
+    }
+    else if (pooled) {
+	frame = pool_free[--pool_nfree];
+    }
+    else {
+	frame = (frame_t *) MALLOC(total);
+    }
+    frame->pooled = pooled;
+    frame->arena = arena;
+    frame->refs = 1;
+    frame->status = false;
+    frame->zone = 0;
+    frame->hdr_len = 0;
+    frame->len = 0;
+    frames_created++;
+    return frame;
+}
+
+/**
+ * @brief Create a frame containing a single encoded websocket message.
+ * Local clients, which do not use websocket framing, are sent just the
+ * payload, which follows the first hdr_len bytes of the frame.
+ *
+ * @param opcode (int) The websocket opcode for the message.
+ * @param payload (void *) The message payload.
+ * @param len (size_t) The length of \p payload, which must not exceed
+ *        #WS_MAX_PAYLOAD.
+ *
+ * @return (frame_t *) The new frame, with a reference count of 1.
+ */
+frame_t *
+frame_new(int opcode, const void *payload, size_t len)
+{
+    frame_t *frame = frame_alloc(NULL, WS_MAX_HEADER + len);
+
+    frame->len = ws_encode_frame(frame->data, opcode, payload, len, NULL);
+    frame->hdr_len = frame->len - len;
+    return frame;
+}
+
+/**
+ * @brief Create a frame containing a copy of the raw bytes \p data.
+ * This is used for output, such as a handshake response or the unsent
+ * part of a message, that is not a complete websocket frame.
+ *
+ * @param arena (arena_t *) The arena from which to allocate the frame,
+ *        or NULL to allocate it from the heap.  A frame allocated from
+ *        an arena is not freed when its last reference is dropped, but
+ *        only when the arena is reset or freed.
+ * @param data (void *) The bytes to be copied.
+ * @param len (size_t) The length of \p data.
+ *
+ * @return (frame_t *) The new frame, with a reference count of 1, or
+ *         NULL if \p arena is a fixed arena without room for it.
+ */
+frame_t *
+frame_raw(arena_t *arena, const void *data, size_t len)
+{
+    frame_t *frame = frame_alloc(arena, len);
+
+    if (!frame) {
+	return NULL;
+    }
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    return frame;
+}
+
+/**
+ * @brief Add a reference to \p frame.
+ *
+ * @param frame (frame_t *) The frame.
+ *
+ * @return (frame_t *) \p frame.
+ */
+frame_t *
+frame_ref(frame_t *frame)
+{
+    frame->refs++;
+    return frame;
+}
+
+/**
+ * @brief Drop a reference to \p frame, freeing it, or returning it to
+ * the pool, if this was the last.
+ *
+ * @param frame (frame_t *) The frame.
+ */
+void
+frame_unref(frame_t *frame)
+{
+    if (--frame->refs > 0) {
+	return;
+    }
+    if (frame->pooled) {
+	pool_free[pool_nfree++] = frame;
+    }
+    else if (!frame->arena) {
+	free(frame);
+    }
+}
@@ -0,0 +1,187 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Remote control input, for volumec's lirc mode.  lircd sends a line
+ * for each button event on its socket, of the form:
+ *
+ *     <code> <repeat> <button> <remote>
+ *
+ * where code is 16 hex digits, repeat is a hex count that is 0 when a
+ * button is first pressed and increases while it is held down, and
+ * button and remote are the names from lircd.conf.
+ *
+ * The events for a held button make up a single gesture, over which
+ * the volume step accelerates, from 1 up to LIRC_MAX_STEP.  A gesture
+ * ends when the button is released, which we see only as the absence
+ * of further repeats, or when another button is pressed.  Mute toggles
+ * only on the initial press, so that holding the button down does not
+ * make it flap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "volumed.h"
+
+
+/**
+ * @brief Initialise \p lirc, for the buttons named in \p keys.
+ *
+ * @param lirc (lirc_t *) The lirc state to be initialised.
+ * @param keys (char *) Comma-separated names of the buttons for volume
+ *        up, volume down and mute, as in #LIRC_DEFAULT_KEYS.
+ *
+ * @return (bool) false if \p keys does not name three buttons.
+ */
+bool
+lirc_init(lirc_t *lirc, const char *keys)
+{
+    const char *p = keys;
+    const char *comma;
+    size_t len;
+    int i;
+
+    memset(lirc, 0, sizeof(*lirc));
+    for (i = 0; i < LIRC_KEYS; i++) {
+	comma = strchr(p, ',');
+	len = comma ? comma - p: strlen(p);
+	if ((len == 0) || (len >= LIRC_NAME_MAX) ||
+	    ((i < LIRC_KEYS - 1) != (comma != NULL)))
+	{
+	    return false;
+	}
+	memcpy(lirc->keys[i], p, len);
+	p += len + 1;
+    }
+    lirc->gesture = CMD_NONE;
+    return true;
+}
+
+/**
+ * @brief Parse the lircd event line \p line.
+ *
+ * @param line (char *) The line, without its newline.
+ * @param len (size_t) The length of \p line.
+ * @param p_repeat (unsigned *) Pointer to a variable into which the
+ *        repeat count will be returned.
+ * @param button (char *) Buffer, of #LIRC_NAME_MAX bytes, into which the
+ *        button name will be returned.
+ *
+ * @return (bool) true if \p line is a button event.  lircd also sends
+ *         replies to commands, which are not.
+ */
+static bool
+lirc_parse(const char *line, size_t len, unsigned *p_repeat, char *button)
+{
+    char buf[LIRC_LINE_MAX];
+    char *code;
+    char *repeat;
+    char *name;
+    char *end;
+    char *save;
+
+    if (len >= sizeof(buf)) {
+	return false;
+    }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    if (!(code = strtok_r(buf, " \t\r", &save)) ||
+	!(repeat = strtok_r(NULL, " \t\r", &save)) ||
+	!(name = strtok_r(NULL, " \t\r", &save)) ||
+	!strtok_r(NULL, " \t\r", &save) ||
+	(strlen(name) >= LIRC_NAME_MAX))
+    {
+	return false;
+    }
+    (void) strtoull(code, &end, 16);
+    if (*end) {
+	return false;
+    }
+    *p_repeat = strtoul(repeat, &end, 16);
+    if (*end) {
+	return false;
+    }
+    strcpy(button, name);
+    return true;
+}
+
+/**
+ * @brief Handle a press or repeat, at \p now_ms, of the button for
+ * \p type, folding the resulting command into \p batch.
+ */
+static void
+lirc_press(lirc_t *lirc, cmd_type_t type, unsigned repeat,
+	   uint64_t now_ms, cmd_batch_t *batch)
+{
+    command_t cmd;
+
+    if ((repeat == 0) || (type != lirc->gesture) ||
+	(now_ms - lirc->last_ms > LIRC_GESTURE_GAP_MS))
+    {
+	/* A new gesture.  A repeat that seems to begin one means that
+	 * we missed the initial press. */
+	lirc->gesture = type;
+	lirc->events = 0;
+    }
+    lirc->last_ms = now_ms;
+    cmd.type = type;
+    if (type == CMD_TOGGLE_MUTE) {
+	if (repeat != 0) {
+	    return;
+	}
+	cmd.value = 0;
+    }
+    else {
+	cmd.value = MIN(1 + lirc->events / LIRC_ACCEL_EVENTS, LIRC_MAX_STEP);
+    }
+    lirc->events++;
+    batch_add(batch, &cmd);
+}
+
+/**
+ * @brief Handle each complete line of lircd output in \p text, folding
+ * the resulting commands into \p batch.
+ *
+ * @param lirc (lirc_t *) The lirc state.
+ * @param text (char *) The text to be handled.  This need not be
+ *        NUL-terminated.
+ * @param len (size_t) The length of \p text.
+ * @param now_ms (uint64_t) The time, in milliseconds, at which the
+ *        text was read.
+ * @param batch (cmd_batch_t *) The batch into which to fold commands.
+ *
+ * @return (size_t) The number of bytes of \p text consumed.  As with
+ *         batch_parse(), anything after the last newline is left.
+ */
+size_t
+lirc_feed(lirc_t *lirc, const char *text, size_t len, uint64_t now_ms,
+	  cmd_batch_t *batch)
+{
+    static const cmd_type_t types[LIRC_KEYS] = {
+	CMD_UP, CMD_DOWN, CMD_TOGGLE_MUTE
+    };
+    const char *end = text + len;
+    const char *line = text;
+    const char *eol;
+    char button[LIRC_NAME_MAX];
+    unsigned repeat;
+    int i;
+
+    while ((eol = memchr(line, '\n', end - line))) {
+	if (lirc_parse(line, eol - line, &repeat, button)) {
+	    for (i = 0; i < LIRC_KEYS; i++) {
+		if (strcmp(button, lirc->keys[i]) == 0) {
+		    lirc_press(lirc, types[i], repeat, now_ms, batch);
+		    break;
+		}
+	    }
+	}
+	line = eol + 1;
+    }
+    return line - text;
+}
@@ -0,0 +1,173 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The event loop.  This is a single-threaded, edge-triggered epoll
+ * loop.  Anything that needs to be woken by the loop embeds an
+ * event_source_t, which records the file descriptor and the handler
+ * function to be called when it becomes ready.  Handlers must, because
+ * of edge-triggering, consume everything available from their file
+ * descriptor before returning.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "volumed.h"
+
+
+/**
+ * @brief Initialise \p loop, creating its epoll instance.
+ *
+ * @param loop (loop_t *) The loop to be initialised.
+ */
+void
+loop_init(loop_t *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->listener.fd = -1;
+    loop->local_listener.fd = -1;
+    loop->status_timer.fd = -1;
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	dofail(2, "unable to create epoll instance: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Register an event source with \p loop.
+ *
+ * @param loop (loop_t *) The loop with which to register.
+ * @param src (event_source_t *) The event source, which must remain
+ *        valid until it is removed using loop_del().
+ * @param events (uint32_t) The set of epoll events of interest.
+ */
+void
+loop_add(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+	dofail(2, "unable to add fd %d to epoll: %s",
+	       src->fd, strerror(errno));
+    }
+}
+
+/**
+ * @brief Remove an event source from \p loop.
+ *
+ * @param loop (loop_t *) The loop from which to remove.
+ * @param src (event_source_t *) The event source to be removed.
+ */
+void
+loop_del(loop_t *loop, event_source_t *src)
+{
+    (void) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/**
+ * @brief Register a hook function to be called by \p loop after each
+ * batch of events has been handled.
+ *
+ * @param loop (loop_t *) The loop with which to register.
+ * @param fn (loop_hook_t *) The hook function.
+ * @param arg (void *) Argument to be passed to \p fn.
+ */
+void
+loop_add_hook(loop_t *loop, loop_hook_t *fn, void *arg)
+{
+    if (loop->nhooks >= LOOP_MAX_HOOKS) {
+	dofail(2, "too many loop hooks");
+    }
+    loop->hooks[loop->nhooks].fn = fn;
+    loop->hooks[loop->nhooks].arg = arg;
+    loop->nhooks++;
+}
+
+/**
+ * @brief Wait for, and handle, a single batch of events.
+ *
+ * Once the batch has been handled, each of the loop's hooks is
+ * called.  Connections closed while handling the batch are freed only
+ * after that, so that neither handlers nor hooks ever see a dangling
+ * event source.
+ *
+ * @param loop (loop_t *) The loop to be run.
+ * @param timeout_ms (int) The maximum time to wait, in milliseconds,
+ *        or -1 to wait indefinitely.
+ *
+ * @return (int) The number of events handled.
+ */
+int
+loop_once(loop_t *loop, int timeout_ms)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    event_source_t *src;
+    int n;
+    int i;
+
+    n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+	if (errno == EINTR) {
+	    return 0;
+	}
+	dofail(2, "epoll_wait failed: %s", strerror(errno));
+    }
+    for (i = 0; i < n; i++) {
+	src = (event_source_t *) events[i].data.ptr;
+	src->handler(loop, src, events[i].events);
+    }
+    for (i = 0; i < loop->nhooks; i++) {
+	loop->hooks[i].fn(loop, loop->hooks[i].arg);
+    }
+    server_reap(loop);
+    return n;
+}
+
+/**
+ * @brief Run \p loop until loop_stop() is called.
+ *
+ * @param loop (loop_t *) The loop to be run.
+ */
+void
+loop_run(loop_t *loop)
+{
+    loop->running = true;
+    while (loop->running) {
+	(void) loop_once(loop, -1);
+    }
+}
+
+/**
+ * @brief Cause loop_run() to return once the current batch of events
+ * has been handled.
+ *
+ * @param loop (loop_t *) The loop to be stopped.
+ */
+void
+loop_stop(loop_t *loop)
+{
+    loop->running = false;
+}
+
+/**
+ * @brief Release the epoll instance for \p loop.
+ *
+ * @param loop (loop_t *) The loop to be closed.
+ */
+void
+loop_close(loop_t *loop)
+{
+    if (loop->epfd >= 0) {
+	close(loop->epfd);
+	loop->epfd = -1;
+    }
+}
@@ -0,0 +1,473 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The mixer interface.  The mixer is opened once, at startup, and its
+ * handle kept open for the life of the daemon so that each volume
+ * change costs no more than a direct write to the control.  The
+ * backends are:
+ *
+ *   alsa - an ALSA simple mixer control (see mixer_alsa.c);
+ *   fake - an in-memory mixer for testing, and for running without
+ *          sound hardware.
+ *
+ * Backends that can report changes made to their control by other
+ * programs, such as mpd or alsamixer, provide descriptors that are
+ * registered with the event loop by mixer_watch().  There is no
+ * polling: when a descriptor becomes readable, the control is re-read
+ * and, if it no longer holds what we last wrote, the change is passed
+ * on to the mixer's change function.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "volumed.h"
+
+#define FAKE_MIN     0
+#define FAKE_MAX     255
+#define FAKE_MIN_DB  -10200
+#define FAKE_MAX_DB  0
+
+/**
+ * @brief The mixer of the default zone.
+ */
+mixer_t mixer;
+
+static const mixer_ops_t *backends[] = {
+#ifdef HAVE_ALSA
+    &alsa_mixer_ops,
+#endif
+    &fake_mixer_ops,
+    NULL
+};
+
+/**
+ * @brief State for the fake mixer.
+ */
+typedef struct s_fake_mixer {
+    long raw;
+    bool mute;
+    unsigned long writes;
+    int  event_fd;		/* Readable when the state has changed */
+} fake_mixer_t;
+
+
+static bool
+fake_open(mixer_t *m)
+{
+    fake_mixer_t *fake = (fake_mixer_t *) MALLOC(sizeof(fake_mixer_t));
+
+    fake->raw = FAKE_MIN;
+    fake->mute = false;
+    fake->writes = 0;
+    fake->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fake->event_fd < 0) {
+	dofail(0, "unable to create eventfd: %s", strerror(errno));
+	FREE(fake);
+	return false;
+    }
+    m->handle = fake;
+    m->min = FAKE_MIN;
+    m->max = FAKE_MAX;
+    m->has_db = true;
+    m->min_db = FAKE_MIN_DB;
+    m->max_db = FAKE_MAX_DB;
+    m->has_switch = true;
+    return true;
+}
+
+static void
+fake_close(mixer_t *m)
+{
+    close(((fake_mixer_t *) m->handle)->event_fd);
+    FREE(m->handle);
+    m->handle = NULL;
+}
+
+/**
+ * @brief Signal a change to the fake mixer, as ALSA does for every
+ * change to a control, including our own.
+ */
+static void
+fake_notify(fake_mixer_t *fake)
+{
+    uint64_t one = 1;
+
+    (void) write(fake->event_fd, &one, sizeof(one));
+}
+
+static bool
+fake_set_volume(mixer_t *m, long raw)
+{
+    fake_mixer_t *fake = (fake_mixer_t *) m->handle;
+
+    fake->raw = raw;
+    fake->writes++;
+    fake_notify(fake);
+    return true;
+}
+
+static bool
+fake_get_volume(mixer_t *m, long *p_raw)
+{
+    *p_raw = ((fake_mixer_t *) m->handle)->raw;
+    return true;
+}
+
+static bool
+fake_set_mute(mixer_t *m, bool mute)
+{
+    fake_mixer_t *fake = (fake_mixer_t *) m->handle;
+
+    fake->mute = mute;
+    fake->writes++;
+    fake_notify(fake);
+    return true;
+}
+
+static bool
+fake_get_mute(mixer_t *m, bool *p_mute)
+{
+    *p_mute = ((fake_mixer_t *) m->handle)->mute;
+    return true;
+}
+
+static int
+fake_poll_fds(mixer_t *m, int *fds, int max)
+{
+    fds[0] = ((fake_mixer_t *) m->handle)->event_fd;
+    return 1;
+}
+
+static bool
+fake_handle_events(mixer_t *m)
+{
+    uint64_t count;
+
+    (void) read(((fake_mixer_t *) m->handle)->event_fd,
+		&count, sizeof(count));
+    return true;
+}
+
+/**
+ * @brief The in-memory mixer backend.
+ */
+const mixer_ops_t fake_mixer_ops = {
+    "fake",
+    fake_open,
+    fake_close,
+    fake_set_volume,
+    fake_get_volume,
+    fake_set_mute,
+    fake_get_mute,
+    NULL,
+    fake_poll_fds,
+    fake_handle_events
+};
+
+/**
+ * @brief Return the state of a fake mixer, for use in tests.
+ *
+ * @param m (mixer_t *) The mixer, which must be open using the fake
+ *        backend.
+ * @param p_raw (long *) Pointer to a variable to receive the raw volume.
+ * @param p_mute (bool *) Pointer to a variable to receive the mute
+ *        state.
+ * @param p_writes (unsigned long *) Pointer to a variable to receive the
+ *        number of writes made to the mixer.
+ */
+void
+fake_mixer_get(mixer_t *m, long *p_raw, bool *p_mute,
+	       unsigned long *p_writes)
+{
+    fake_mixer_t *fake = (fake_mixer_t *) m->handle;
+
+    *p_raw = fake->raw;
+    *p_mute = fake->mute;
+    *p_writes = fake->writes;
+}
+
+/**
+ * @brief Change the state of a fake mixer, as another program might
+ * change an ALSA control, for use in tests.
+ *
+ * @param m (mixer_t *) The mixer, which must be open using the fake
+ *        backend.
+ * @param raw (long) The new raw volume.
+ * @param mute (bool) The new mute state.
+ */
+void
+fake_mixer_set(mixer_t *m, long raw, bool mute)
+{
+    fake_mixer_t *fake = (fake_mixer_t *) m->handle;
+
+    fake->raw = raw;
+    fake->mute = mute;
+    fake_notify(fake);
+}
+
+/**
+ * @brief Open the mixer control \p control on \p card, using the
+ * mixer backend named \p backend, build its volume curve from
+ * options.volcurve and options.max_pct, and read its current state
+ * into m->raw and m->mute.
+ *
+ * @param m (mixer_t *) The mixer structure to be filled in.
+ * @param backend (char *) The name of the backend to use.
+ * @param card (char *) The sound card name, or NULL for the default.
+ * @param control (char *) The simple mixer control name.
+ *
+ * @return (bool) true if the mixer was successfully opened.
+ */
+bool
+mixer_open(mixer_t *m, const char *backend,
+	   const char *card, const char *control)
+{
+    const mixer_ops_t **ops;
+    volume_state_t state;
+
+    memset(m, 0, sizeof(*m));
+    for (ops = backends; *ops; ops++) {
+	if (strcmp((*ops)->name, backend) == 0) {
+	    break;
+	}
+    }
+    if (!*ops) {
+	dofail(0, "unknown mixer backend \"%s\"", backend);
+	return false;
+    }
+    m->ops = *ops;
+    m->card = card;
+    m->control = control;
+    if (!m->ops->open(m)) {
+	m->ops = NULL;
+	return false;
+    }
+    (void) volcurve_build(&m->curve, m, options.volcurve, options.max_pct);
+    if (!mixer_read(m, &state)) {
+	mixer_close(m);
+	return false;
+    }
+    if (options.verbosity) {
+	printf("Mixer: %s, card: %s, control: %s, range: %ld..%ld\n",
+	       m->ops->name, card ? card: "default", control,
+	       m->min, m->max);
+    }
+    return true;
+}
+
+/**
+ * @brief Close the mixer \p m, if it is open.
+ *
+ * @param m (mixer_t *) The mixer to be closed.
+ */
+void
+mixer_close(mixer_t *m)
+{
+    mixer_unwatch(m);
+    if (m->ops) {
+	m->ops->close(m);
+	m->ops = NULL;
+    }
+}
+
+/**
+ * @brief Rebuild the volume curve for \p m, if \p volcurve or
+ * \p max_pct differ from the settings it was built with.
+ *
+ * @param m (mixer_t *) The mixer.
+ * @param volcurve (bool) Whether to use a volume curve.
+ * @param max_pct (int) The maximum volume percentage.
+ *
+ * @return (bool) true if the curve was rebuilt.
+ */
+bool
+mixer_set_curve(mixer_t *m, bool volcurve, int max_pct)
+{
+    return volcurve_build(&m->curve, m, volcurve, max_pct);
+}
+
+/**
+ * @brief Convert a volume percentage into a raw mixer value.
+ *
+ * @param m (mixer_t *) The mixer.
+ * @param pct (int) The volume percentage.
+ *
+ * @return (long) The raw mixer volume.
+ */
+long
+mixer_pct_to_raw(mixer_t *m, int pct)
+{
+    return m->curve.raw[MAX(0, MIN(pct, VOLCURVE_STEPS - 1))];
+}
+
+/**
+ * @brief Convert a raw mixer value into a volume percentage.
+ *
+ * @param m (mixer_t *) The mixer.
+ * @param raw (long) The raw mixer volume.
+ *
+ * @return (int) The volume percentage.
+ */
+int
+mixer_raw_to_pct(mixer_t *m, long raw)
+{
+    return volcurve_pct(&m->curve, raw);
+}
+
+/**
+ * @brief Write \p state to the mixer \p m.  Only those parts of the
+ * state that differ from what the mixer already holds are written.
+ *
+ * @param m (mixer_t *) The mixer.
+ * @param state (volume_state_t *) The state to be written.
+ *
+ * @return (bool) true if the write succeeded.
+ */
+bool
+mixer_write(mixer_t *m, const volume_state_t *state)
+{
+    long raw = mixer_pct_to_raw(m, state->volume);
+
+    if (state->mute && !m->has_switch) {
+	raw = m->min;
+    }
+    if (raw != m->raw) {
+	if (!m->ops->set_volume(m, raw)) {
+	    return false;
+	}
+	m->raw = raw;
+    }
+    if (m->has_switch && (state->mute != m->mute)) {
+	if (!m->ops->set_mute(m, state->mute)) {
+	    return false;
+	}
+	m->mute = state->mute;
+    }
+    return true;
+}
+
+/**
+ * @brief Read the current state of the mixer \p m.
+ *
+ * @param m (mixer_t *) The mixer.
+ * @param state (volume_state_t *) The state to be filled in.
+ *
+ * @return (bool) true if the read succeeded.
+ */
+bool
+mixer_read(mixer_t *m, volume_state_t *state)
+{
+    if (!m->ops->get_volume(m, &m->raw)) {
+	return false;
+    }
+    if (m->has_switch && !m->ops->get_mute(m, &m->mute)) {
+	return false;
+    }
+    state->volume = mixer_raw_to_pct(m, m->raw);
+    state->mute = m->mute;
+    return true;
+}
+
+/**
+ * @brief Event handler for a mixer's poll descriptors.  Consume the
+ * backend's events and re-read the control, reporting the change if
+ * it no longer holds what we last wrote or read.
+ */
+static void
+mixer_event_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    mixer_t *m = CONTAINER_OF(src, mixer_watch_t, src)->mixer;
+    long raw = m->raw;
+    bool mute = m->mute;
+
+    if (!m->ops->handle_events(m)) {
+	return;
+    }
+    if (!m->ops->get_volume(m, &raw) ||
+	(m->has_switch && !m->ops->get_mute(m, &mute)))
+    {
+	return;
+    }
+    if ((raw == m->raw) && (mute == m->mute)) {
+	/* Nothing has changed, or this is the echo of our own write. */
+	return;
+    }
+    m->raw = raw;
+    m->mute = mute;
+    m->changes++;
+    if (options.verbosity > 1) {
+	printf("External mixer change: raw %ld, mute %d\n", raw, mute);
+    }
+    if (m->on_change) {
+	m->on_change(m, m->change_arg);
+    }
+}
+
+/**
+ * @brief Register the poll descriptors for mixer \p m with \p loop, so
+ * that changes made to the control by other programs are noticed as
+ * soon as they happen.
+ *
+ * @param m (mixer_t *) The open mixer.
+ * @param loop (loop_t *) The loop in which to watch for changes.
+ * @param fn (mixer_change_fn_t *) Function to be called after an
+ *        external change has been read into m->raw and m->mute.
+ * @param arg (void *) Argument to be passed to \p fn.
+ *
+ * @return (bool) true if the mixer is being watched, false if its
+ *         backend cannot report changes.
+ */
+bool
+mixer_watch(mixer_t *m, loop_t *loop, mixer_change_fn_t *fn, void *arg)
+{
+    int fds[MIXER_MAX_WATCH];
+    int i;
+
+    mixer_unwatch(m);
+    if (!m->ops || !m->ops->poll_fds || !m->ops->handle_events) {
+	return false;
+    }
+    m->nwatch = m->ops->poll_fds(m, fds, MIXER_MAX_WATCH);
+    if (m->nwatch <= 0) {
+	m->nwatch = 0;
+	return false;
+    }
+    m->loop = loop;
+    m->on_change = fn;
+    m->change_arg = arg;
+    for (i = 0; i < m->nwatch; i++) {
+	m->watch[i].src.fd = fds[i];
+	m->watch[i].src.handler = mixer_event_handler;
+	m->watch[i].mixer = m;
+	loop_add(loop, &m->watch[i].src, EPOLLIN);
+    }
+    return true;
+}
+
+/**
+ * @brief Stop watching mixer \p m for external changes.
+ *
+ * @param m (mixer_t *) The mixer.
+ */
+void
+mixer_unwatch(mixer_t *m)
+{
+    int i;
+
+    for (i = 0; i < m->nwatch; i++) {
+	loop_del(m->loop, &m->watch[i].src);
+    }
+    m->nwatch = 0;
+    m->loop = NULL;
+    m->on_change = NULL;
+}
@@ -0,0 +1,262 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The ALSA mixer backend.  This opens the simple mixer control named
+ * by options.alsa_mixer_name, on the card named by options.alsa_card,
+ * once at startup.  The snd_mixer handle is then held open so that each
+ * volume change is a single write to the control, rather than the
+ * fork and exec of an amixer process.
+ *
+ * The handle's poll descriptors are registered with the event loop so
+ * that we hear, through snd_mixer_handle_events(), of changes made to
+ * the control by mpd or any other program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+#include "volumed.h"
+
+#define ALSA_DEVICE_SIZE 64
+
+/**
+ * @brief Private data for the ALSA backend.
+ */
+typedef struct s_alsa_mixer {
+    snd_mixer_t      *handle;
+    snd_mixer_elem_t *elem;
+} alsa_mixer_t;
+
+
+/**
+ * @brief Report an ALSA error.
+ *
+ * @param m (mixer_t *) The mixer for which the error occurred.
+ * @param what (char *) Description of the failed operation.
+ * @param err (int) The ALSA error code.
+ */
+static void
+alsa_error(mixer_t *m, const char *what, int err)
+{
+    dofail(0, "%s failed for mixer control \"%s\": %s",
+	   what, m->control, snd_strerror(err));
+}
+
+/**
+ * @brief Get the ALSA device name for a card.  A bare card name, such
+ * as given by alsa_card_name in the config file, is turned into a
+ * hw: device name; anything that already looks like a device name is
+ * used as it is.
+ */
+static void
+alsa_device_name(const char *card, char *device, size_t size)
+{
+    if (!card) {
+	snprintf(device, size, "default");
+    }
+    else if (strchr(card, ':') || (strcmp(card, "default") == 0)) {
+	snprintf(device, size, "%s", card);
+    }
+    else {
+	snprintf(device, size, "hw:%s", card);
+    }
+}
+
+static void
+alsa_close(mixer_t *m)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+
+    if (alsa) {
+	if (alsa->handle) {
+	    snd_mixer_close(alsa->handle);
+	}
+	FREE(alsa);
+	m->handle = NULL;
+    }
+}
+
+static bool
+alsa_open(mixer_t *m)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) MALLOC(sizeof(alsa_mixer_t));
+    snd_mixer_selem_id_t *sid;
+    char device[ALSA_DEVICE_SIZE];
+    int err;
+
+    alsa->handle = NULL;
+    alsa->elem = NULL;
+    m->handle = alsa;
+    alsa_device_name(m->card, device, sizeof(device));
+
+    if ((err = snd_mixer_open(&alsa->handle, 0)) < 0) {
+	alsa_error(m, "snd_mixer_open", err);
+	goto fail;
+    }
+    if ((err = snd_mixer_attach(alsa->handle, device)) < 0) {
+	alsa_error(m, "snd_mixer_attach", err);
+	goto fail;
+    }
+    if ((err = snd_mixer_selem_register(alsa->handle, NULL, NULL)) < 0) {
+	alsa_error(m, "snd_mixer_selem_register", err);
+	goto fail;
+    }
+    if ((err = snd_mixer_load(alsa->handle)) < 0) {
+	alsa_error(m, "snd_mixer_load", err);
+	goto fail;
+    }
+
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_index(sid, 0);
+    snd_mixer_selem_id_set_name(sid, m->control);
+    if (!(alsa->elem = snd_mixer_find_selem(alsa->handle, sid)) ||
+	!snd_mixer_selem_has_playback_volume(alsa->elem))
+    {
+	dofail(0, "no playback volume control \"%s\" on %s",
+	       m->control, device);
+	goto fail;
+    }
+
+    if ((err = snd_mixer_selem_get_playback_volume_range(
+	     alsa->elem, &m->min, &m->max)) < 0)
+    {
+	alsa_error(m, "snd_mixer_selem_get_playback_volume_range", err);
+	goto fail;
+    }
+    m->has_db = (snd_mixer_selem_get_playback_dB_range(
+		     alsa->elem, &m->min_db, &m->max_db) == 0) &&
+	(m->min_db < m->max_db);
+    m->has_switch = snd_mixer_selem_has_playback_switch(alsa->elem) != 0;
+    return true;
+
+fail:
+    alsa_close(m);
+    return false;
+}
+
+static bool
+alsa_set_volume(mixer_t *m, long raw)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    int err;
+
+    if ((err = snd_mixer_selem_set_playback_volume_all(alsa->elem,
+						       raw)) < 0) {
+	alsa_error(m, "snd_mixer_selem_set_playback_volume_all", err);
+	return false;
+    }
+    return true;
+}
+
+static bool
+alsa_get_volume(mixer_t *m, long *p_raw)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    int err;
+
+    if ((err = snd_mixer_selem_get_playback_volume(
+	     alsa->elem, SND_MIXER_SCHN_FRONT_LEFT, p_raw)) < 0)
+    {
+	alsa_error(m, "snd_mixer_selem_get_playback_volume", err);
+	return false;
+    }
+    return true;
+}
+
+static bool
+alsa_set_mute(mixer_t *m, bool mute)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    int err;
+
+    /* For ALSA, a playback switch value of 1 means "on", ie unmuted. */
+    if ((err = snd_mixer_selem_set_playback_switch_all(alsa->elem,
+						       !mute)) < 0) {
+	alsa_error(m, "snd_mixer_selem_set_playback_switch_all", err);
+	return false;
+    }
+    return true;
+}
+
+static bool
+alsa_get_mute(mixer_t *m, bool *p_mute)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    int value;
+    int err;
+
+    if ((err = snd_mixer_selem_get_playback_switch(
+	     alsa->elem, SND_MIXER_SCHN_FRONT_LEFT, &value)) < 0)
+    {
+	alsa_error(m, "snd_mixer_selem_get_playback_switch", err);
+	return false;
+    }
+    *p_mute = !value;
+    return true;
+}
+
+static bool
+alsa_db_to_raw(mixer_t *m, long db, long *p_raw)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+
+    /* Round upwards, so that we never go below the requested level. */
+    return snd_mixer_selem_ask_playback_dB_vol(alsa->elem, db,
+					       1, p_raw) == 0;
+}
+
+static int
+alsa_poll_fds(mixer_t *m, int *fds, int max)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    struct pollfd pfds[MIXER_MAX_WATCH];
+    int count;
+    int i;
+
+    count = snd_mixer_poll_descriptors(alsa->handle, pfds,
+				       MIN(max, MIXER_MAX_WATCH));
+    if (count < 0) {
+	alsa_error(m, "snd_mixer_poll_descriptors", count);
+	return 0;
+    }
+    for (i = 0; i < count; i++) {
+	fds[i] = pfds[i].fd;
+    }
+    return count;
+}
+
+static bool
+alsa_handle_events(mixer_t *m)
+{
+    alsa_mixer_t *alsa = (alsa_mixer_t *) m->handle;
+    int err;
+
+    if ((err = snd_mixer_handle_events(alsa->handle)) < 0) {
+	alsa_error(m, "snd_mixer_handle_events", err);
+	return false;
+    }
+    return true;
+}
+
+/**
+ * @brief The ALSA simple mixer backend.
+ */
+const mixer_ops_t alsa_mixer_ops = {
+    "alsa",
+    alsa_open,
+    alsa_close,
+    alsa_set_volume,
+    alsa_get_volume,
+    alsa_set_mute,
+    alsa_get_mute,
+    alsa_db_to_raw,
+    alsa_poll_fds,
+    alsa_handle_events
+};
@@ -0,0 +1,245 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Write-behind of volume state into the moode database, for
+ * volume-config-moode.  moode keeps its volume and mute settings as
+ * rows in its cfg_system table, which its web UI reads.
+ *
+ * A sweep of the volume knob produces a status message for every step,
+ * and writing each one, with its own transaction and fsync, would
+ * hammer the SD card that the database usually lives on.  Instead, the
+ * first change after a quiet period starts a timer, changes that
+ * arrive before it expires simply replace the pending state, and when
+ * it expires the final state is written in a single transaction.  A
+ * long sweep is therefore written at most once per MOODE_DEBOUNCE_MS.
+ *
+ * The database is put into WAL mode, with synchronous=NORMAL, so that a
+ * commit appends to the log without an fsync; the log is synced only
+ * when it is checkpointed.  Statements are prepared once, when the
+ * database is opened.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "volumed.h"
+
+#define MOODE_PARAM_VOLUME "volknob"
+#define MOODE_PARAM_MUTE   "volmute"
+
+
+/**
+ * @brief Prepare the statement \p sql, for \p m, into \p p_stmt.
+ */
+static bool
+moode_prepare(moode_db_t *m, sqlite3_stmt **p_stmt, const char *sql)
+{
+    if (sqlite3_prepare_v2(m->db, sql, -1, p_stmt, NULL) != SQLITE_OK) {
+	dofail(0, "unable to prepare \"%s\": %s", sql, sqlite3_errmsg(m->db));
+	return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Run the prepared statement \p stmt, which returns no rows, and
+ * reset it for next time.
+ *
+ * @return (bool) true if the statement succeeded.
+ */
+static bool
+moode_run(sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+
+    (void) sqlite3_reset(stmt);
+    return rc == SQLITE_DONE;
+}
+
+/**
+ * @brief Put the database for \p m into WAL mode, so that commits need
+ * not be synced.  If the database cannot use WAL, as when it is on a
+ * network filesystem, we carry on in whatever mode it has.
+ */
+static bool
+moode_set_wal(moode_db_t *m)
+{
+    sqlite3_stmt *stmt;
+    const char *mode = NULL;
+
+    if (!moode_prepare(m, &stmt, "PRAGMA journal_mode = WAL")) {
+	return false;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+	mode = (const char *) sqlite3_column_text(stmt, 0);
+    }
+    if (!mode || (strcmp(mode, "wal") != 0)) {
+	fprintf(stderr, "Warning: moode database is not in WAL mode (%s)\n",
+		mode ? mode: sqlite3_errmsg(m->db));
+    }
+    (void) sqlite3_finalize(stmt);
+    return sqlite3_exec(m->db, "PRAGMA synchronous = NORMAL",
+			NULL, NULL, NULL) == SQLITE_OK;
+}
+
+/**
+ * @brief Open the moode database at \p path for \p m.
+ *
+ * @param m (moode_db_t *) The database handle to be initialised.
+ * @param path (char *) The path of the database file.
+ *
+ * @return (bool) true if the database was opened.  If not, the problem
+ *         has been reported.
+ */
+bool
+moode_open(moode_db_t *m, const char *path)
+{
+    memset(m, 0, sizeof(*m));
+    if (sqlite3_open_v2(path, &m->db, SQLITE_OPEN_READWRITE,
+			NULL) != SQLITE_OK)
+    {
+	dofail(0, "unable to open moode database %s: %s",
+	       path, sqlite3_errmsg(m->db));
+	moode_close(m);
+	return false;
+    }
+    /* The moode UI writes to the database too.  We would rather retry
+     * later than stall for long. */
+    (void) sqlite3_busy_timeout(m->db, MOODE_BUSY_TIMEOUT_MS);
+    if (!moode_set_wal(m) ||
+	!moode_prepare(m, &m->begin, "BEGIN IMMEDIATE") ||
+	!moode_prepare(m, &m->update,
+		       "UPDATE cfg_system SET value = ?1 WHERE param = ?2") ||
+	!moode_prepare(m, &m->commit, "COMMIT") ||
+	!moode_prepare(m, &m->rollback, "ROLLBACK"))
+    {
+	moode_close(m);
+	return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Note that volumed's state is now \p state.  It will be
+ * written to the database by moode_flush(), once the debounce period
+ * that this change starts, or is part of, has expired.
+ *
+ * @param m (moode_db_t *) The database handle.
+ * @param state (volume_state_t *) The new state.
+ * @param now_ms (uint64_t) The time now, in milliseconds.
+ */
+void
+moode_record(moode_db_t *m, const volume_state_t *state, uint64_t now_ms)
+{
+    m->changes++;
+    m->pending = *state;
+    if (!m->dirty) {
+	m->dirty = true;
+	m->due_ms = now_ms + MOODE_DEBOUNCE_MS;
+    }
+}
+
+/**
+ * @brief Return the time, in milliseconds from \p now_ms, until
+ * moode_flush() should next be called, or -1 if it need not be.
+ */
+int
+moode_timeout(const moode_db_t *m, uint64_t now_ms)
+{
+    if (!m->dirty) {
+	return -1;
+    }
+    return (m->due_ms > now_ms) ? (int) (m->due_ms - now_ms): 0;
+}
+
+/**
+ * @brief Set the moode setting \p param to \p value.
+ */
+static bool
+moode_update(moode_db_t *m, const char *param, int value)
+{
+    char text[16];
+
+    snprintf(text, sizeof(text), "%d", value);
+    (void) sqlite3_bind_text(m->update, 1, text, -1, SQLITE_TRANSIENT);
+    (void) sqlite3_bind_text(m->update, 2, param, -1, SQLITE_STATIC);
+    if (!moode_run(m->update)) {
+	return false;
+    }
+    if (sqlite3_changes(m->db) == 0) {
+	fprintf(stderr, "Warning: no %s setting in moode database\n", param);
+    }
+    return true;
+}
+
+/**
+ * @brief Write any pending state to the database, in a single
+ * transaction, if it differs from what was last written.  If the
+ * database is busy, the write is retried after another debounce period.
+ *
+ * @param m (moode_db_t *) The database handle.
+ * @param now_ms (uint64_t) The time now, in milliseconds.
+ *
+ * @return (bool) false if the state could not be written.
+ */
+bool
+moode_flush(moode_db_t *m, uint64_t now_ms)
+{
+    bool volume;
+    bool mute;
+
+    if (!m->dirty) {
+	return true;
+    }
+    volume = !m->written_valid || (m->pending.volume != m->written.volume);
+    mute = !m->written_valid || (m->pending.mute != m->written.mute);
+    if (volume || mute) {
+	if (!moode_run(m->begin)) {
+	    goto retry;
+	}
+	if ((volume &&
+	     !moode_update(m, MOODE_PARAM_VOLUME, m->pending.volume)) ||
+	    (mute && !moode_update(m, MOODE_PARAM_MUTE, m->pending.mute)) ||
+	    !moode_run(m->commit))
+	{
+	    (void) moode_run(m->rollback);
+	    goto retry;
+	}
+	m->transactions++;
+	m->written = m->pending;
+	m->written_valid = true;
+    }
+    m->dirty = false;
+    return true;
+
+retry:
+    fprintf(stderr, "Warning: unable to update moode database: %s "
+	    "(will retry)\n", sqlite3_errmsg(m->db));
+    m->due_ms = now_ms + MOODE_DEBOUNCE_MS;
+    return false;
+}
+
+/**
+ * @brief Close the database for \p m.  Pending state that has not been
+ * flushed is lost.
+ *
+ * @param m (moode_db_t *) The database handle.
+ */
+void
+moode_close(moode_db_t *m)
+{
+    (void) sqlite3_finalize(m->begin);
+    (void) sqlite3_finalize(m->update);
+    (void) sqlite3_finalize(m->commit);
+    (void) sqlite3_finalize(m->rollback);
+    m->begin = m->update = m->commit = m->rollback = NULL;
+    if (m->db) {
+	(void) sqlite3_close(m->db);
+	m->db = NULL;
+    }
+}
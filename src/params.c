@@ -18,6 +18,12 @@
  */
 char *progname = NULL;
 
+/**
+ * @brief Arena for strings that live as long as the process: the
+ * program name and copies of command line arguments.
+ */
+arena_t *process_arena = NULL;
+
 options_t options = {
     CONFIG_PORT,		/* default websocket port */
     0,    			/* default verbosity */
@@ -26,11 +32,35 @@ options_t options = {
     CONFIG_MAX_PCT,
     CONFIG_ALSA_MIXER_NAME,
     CONFIG_MPD_MIXER,
-    CONFIG_ALSA_CARD
+    CONFIG_ALSA_CARD,
+    CONFIG_MIXER,
+    CONFIG_MAX_CLIENTS,
+    CONFIG_SOCKET_PATH,
+    CONFIG_RAMP_STEP,
+    CONFIG_RAMP_INTERVAL,
+    CONFIG_WRITER_THREAD,
+    CONFIG_WRITER_PRIORITY,
+    CONFIG_WRITER_CPU,
+    CONFIG_WORKERS,
+    CONFIG_STATUS_PAGE,
+    CONFIG_LAZY_MIXER,
+    1,				/* nzones */
+    {{NULL}},			/* zones */
+    0,				/* generation */
+    NULL,			/* config path */
+    NULL			/* arena */
 };
 
 
 
+/**
+ * @brief Count of allocations made through checked_malloc().  Once the
+ * server is listening this should not change, and the tests check
+ * that it does not.  Workers allocate too, as they start, so this is
+ * updated atomically.
+ */
+unsigned long malloc_count = 0;
+
 /**
  * @brief Wrapper for malloc that tests result and fails if 0.
  *
@@ -40,6 +70,8 @@ void *
 checked_malloc(size_t size, const char *file, int line)
 {
     void *res = malloc(size);
+
+    __atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
     if (!res) {
 	dofail(2, "Unable to allocate memory of size %d at %s:%d",
 	     size, file, line);
@@ -58,13 +90,16 @@ usage(int exitcode)
 {
     fprintf(stderr,
 	    "usage: %s [-v | --verbose] [(-p | --port) port-number]\n"
-	    "        [(-c | --config) config-file] [-V | --version]\n"
+	    "        [(-c | --config) config-file] [(-m | --mixer) backend]\n"
+	    "        [-V | --version]\n"
 	    "    port-number: the port on which the websocket "
 	    "is to be created\n"
 	    "                 (default - %d);\n"
 	    "    config-file: the name of a configuration file to use\n"
+	    "                 (default - \"%s\");\n"
+	    "    backend:     the mixer backend, alsa or fake\n"
 	    "                 (default - \"%s\").\n"
-	    "\n" , progname, DEFAULT_PORT, CONFIG_FILE);
+	    "\n" , progname, DEFAULT_PORT, CONFIG_FILE, CONFIG_MIXER);
     closedown(exitcode);
 }
 
@@ -80,8 +115,8 @@ __attribute__((weak)) /* Enable this to be overridden in unit tests. */
 extern void
 closedown(int exitcode)
 {
-    free(progname);
-    FREE(options.config_filename);
+    free_config_options(&options);
+    arena_free(process_arena);
     exit(exitcode);
 }
 
@@ -119,9 +154,10 @@ dofail(int code, const char *fmt, ...)
 static void
 record_progname(char **argv)
 {
-    char *pname = (char *) malloc(strlen(argv[0]) + 1);
-    strcpy(pname, argv[0]);
-    progname = pname;
+    if (!process_arena) {
+	process_arena = arena_new("process", PROCESS_ARENA_CHUNK);
+    }
+    progname = arena_strdup(process_arena, argv[0]);
 }
 
 /**
@@ -150,9 +186,10 @@ process_args(int argc, char **argv)
 	{"verbose", no_argument, NULL, 0},
 	{"version", no_argument, NULL, 0},
 	{"config", required_argument, NULL, 0},
+	{"mixer", required_argument, NULL, 0},
 	{NULL, 0, NULL, 0}
     };
-    char option_map[] = {'p', 'v', 'V', 'c'};
+    char option_map[] = {'p', 'v', 'V', 'c', 'm'};
     int c;
     int oidx = 0;
     optind = 0;   /* Allow for multiple invocations - this simplifies
@@ -161,7 +198,7 @@ process_args(int argc, char **argv)
     record_progname(argv);
 
     while ((c = getopt_long(
-		argc, argv, "c:p:vV", option_defs, &oidx)) != -1)
+		argc, argv, "c:m:p:vV", option_defs, &oidx)) != -1)
     {
 	if (c == 0) {
 	    /* Get the shortcode that matches the long option. */
@@ -169,8 +206,10 @@ process_args(int argc, char **argv)
 	}	    
 	switch (c) {
 	case 'c':
-	    FREE(options.config_filename);
-	    STRCPY(options.config_filename, optarg);
+	    options.config_filename = arena_strdup(process_arena, optarg);
+	    break;
+	case 'm':
+	    options.mixer = optarg;
 	    break;
 	case 'p':
 	    options.port = atoi(optarg);
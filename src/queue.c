@@ -0,0 +1,511 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The command queue.  This is where commands are accumulated and
+ * batched while a mixer write is already running.
+ *
+ * A rotary encoder or an lirc repeat can easily deliver a hundred or
+ * more volume steps per second, far more than there is any point in
+ * writing to the mixer.  Rather than queueing each command, we fold
+ * each into a single pending state: relative steps are applied to
+ * whatever state was last requested, and absolute settings replace it.
+ * The pending state is written to the mixer only once the current
+ * batch of events has been handled, and only if no earlier write is
+ * still in flight.  Clients are sent the new status, which serves as
+ * the acknowledgement for their commands, as each write completes.  The
+ * client whose command was the last folded into a write (its origin)
+ * is sent the status first, so that its wait does not grow with the
+ * number of other clients.
+ *
+ * If ramp_step is set, a change in volume larger than that is not
+ * written all at once.  Instead a ramp is started: a timerfd, in the
+ * main loop, ticks every ramp_interval milliseconds and each tick
+ * writes one step of at most ramp_step towards the pending state.  The
+ * ramp counts as the write in flight, so commands that arrive during it
+ * are folded into the pending state as usual, and so retarget the ramp
+ * from wherever it has got to.  Clients are sent status at each step.
+ *
+ * Each write is timed, from the receipt of the first command folded
+ * into it, through the mixer write, to the queueing of the status
+ * broadcast that acknowledges it (see stats.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "volumed.h"
+
+/**
+ * @brief The command queue for the mixer of the default zone.
+ */
+cmdq_t command_queue;
+
+
+/**
+ * @brief Stop the ramp for \p q, releasing its timer.
+ */
+static void
+ramp_stop(cmdq_t *q)
+{
+    ramp_t *ramp = &q->ramp;
+
+    loop_del(q->loop, &ramp->src);
+    close(ramp->src.fd);
+    ramp->src.fd = -1;
+    if (options.verbosity) {
+	printf("Ramp ended at %d%% (all ramps: %lu ticks, %lu overruns, "
+	       "jitter max %lluus, mean %lluus)\n",
+	       q->target.volume, ramp->ticks, ramp->overruns,
+	       (unsigned long long) ramp->jitter_max_us,
+	       (unsigned long long) (ramp->samples ?
+				     ramp->jitter_total_us / ramp->samples: 0));
+    }
+}
+
+static mixer_change_fn_t cmdq_mixer_changed;
+
+/**
+ * @brief Record the completion of a write for \p q, which has left the
+ * mixer holding \p state.  If the write failed, whatever the mixer now
+ * holds is what clients must be told, and any ramp is abandoned.  A
+ * ramp is otherwise complete once it reaches the pending state.
+ */
+static void
+write_complete(cmdq_t *q, const volume_state_t *state, bool ok)
+{
+    hist_record(&q->stats.stage[STAGE_MIXER], now_us() - q->issued_us);
+    *q->zone->state = *state;
+    q->target = *state;
+    if (q->writer.running) {
+	/* The mixer is ours again. */
+	(void) mixer_watch(q->mixer, q->loop, cmdq_mixer_changed, q);
+    }
+    if (q->ramp.src.fd < 0) {
+	cmdq_write_done(q);
+	return;
+    }
+    if (!ok) {
+	q->pending_state = *state;
+    }
+    if ((q->pending_state.volume == q->target.volume) &&
+	(q->pending_state.mute == q->target.mute))
+    {
+	q->pending = false;
+	ramp_stop(q);
+	cmdq_write_done(q);
+    }
+    else {
+	server_broadcast_status(q->loop, q->zone, q->flight_origin);
+    }
+}
+
+/**
+ * @brief Writer done function, called in the loop with the result of a
+ * write made by the writer thread.
+ */
+static void
+cmdq_writer_done(void *arg, const writer_msg_t *msg)
+{
+    write_complete((cmdq_t *) arg, &msg->state, msg->ok);
+}
+
+/**
+ * @brief Write \p state to the mixer for \p q: by passing it to the
+ * writer thread, if there is one, or else at once.  Either way,
+ * write_complete() follows once the write is done.
+ *
+ * The writer thread owns the mixer until the write is done, so the
+ * loop stops watching it, and so stops reading it, in the meantime.
+ * Any change event that our write, or anyone else, causes in the
+ * meantime is seen once the mixer is watched again.
+ */
+static void
+start_write(cmdq_t *q, const volume_state_t *state)
+{
+    volume_state_t result = *state;
+    bool ok;
+
+    q->writes++;
+    q->issued_us = now_us();
+    if (q->writer.running) {
+	mixer_unwatch(q->mixer);
+	writer_post(&q->writer, state);
+	return;
+    }
+    if (!(ok = mixer_write(q->mixer, &result))) {
+	(void) mixer_read(q->mixer, &result);
+    }
+    write_complete(q, &result, ok);
+}
+
+/**
+ * @brief Write the next step of the ramp for \p q: the pending state,
+ * but with the volume moved no more than ramp_step from where the ramp
+ * has got to.  If the last step is still being written, by the writer
+ * thread, the tick is counted as an overrun.
+ */
+static void
+ramp_tick(cmdq_t *q)
+{
+    volume_state_t next = q->pending_state;
+    int step = MAX(options.ramp_step, 1);
+
+    if (q->writer.busy) {
+	q->ramp.overruns++;
+	return;
+    }
+    if (next.volume > q->target.volume + step) {
+	next.volume = q->target.volume + step;
+    }
+    else if (next.volume < q->target.volume - step) {
+	next.volume = q->target.volume - step;
+    }
+    q->ramp.ticks++;
+    start_write(q, &next);
+}
+
+/**
+ * @brief Event handler for a ramp's timerfd.  The lateness of the tick
+ * is measured against when it was due, and any ticks that were missed
+ * altogether are counted as overruns.  However many expirations there
+ * have been, only one step is taken.
+ */
+static void
+ramp_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    ramp_t *ramp = (ramp_t *) src;
+    uint64_t expirations;
+    uint64_t due;
+    uint64_t now;
+
+    if (read(src->fd, &expirations, sizeof(expirations)) !=
+	sizeof(expirations))
+    {
+	return;
+    }
+    now = now_us();
+    ramp->expirations += expirations;
+    ramp->overruns += expirations - 1;
+    due = ramp->start_us + ramp->expirations * ramp->interval_us;
+    if (now > due) {
+	ramp->jitter_max_us = MAX(ramp->jitter_max_us, now - due);
+	ramp->jitter_total_us += now - due;
+    }
+    ramp->samples++;
+    ramp_tick(ramp->q);
+}
+
+/**
+ * @brief Return whether the pending state for \p q is far enough from
+ * the current state that it should be reached by a ramp.  A change that
+ * ends muted is inaudible, so is never ramped.
+ */
+static bool
+ramp_wanted(cmdq_t *q)
+{
+    return q->loop && (options.ramp_step > 0) && !q->pending_state.mute &&
+	(abs(q->pending_state.volume - q->target.volume) > options.ramp_step);
+}
+
+/**
+ * @brief Start a ramp for \p q, arming a periodic timer for its ticks.
+ *
+ * @return (bool) false if the timer could not be created, in which case
+ *         the pending state should be written at once.
+ */
+static bool
+ramp_start(cmdq_t *q)
+{
+    ramp_t *ramp = &q->ramp;
+    struct itimerspec its;
+    int interval = MAX(options.ramp_interval, 1);
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+	dofail(0, "unable to create ramp timer: %s", strerror(errno));
+	return false;
+    }
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    ramp->start_us = now_us();
+    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+	dofail(0, "unable to arm ramp timer: %s", strerror(errno));
+	close(fd);
+	return false;
+    }
+    ramp->src.fd = fd;
+    ramp->src.handler = ramp_handler;
+    ramp->q = q;
+    ramp->interval_us = interval * 1000ULL;
+    ramp->expirations = 0;
+    ramp->ramps++;
+    loop_add(q->loop, &ramp->src, EPOLLIN | EPOLLET);
+    return true;
+}
+
+/**
+ * @brief Write the pending state to the mixer, or start a ramp towards
+ * it.
+ *
+ * @param q (cmdq_t *) The queue whose pending state is to be written.
+ */
+static void
+issue_write(cmdq_t *q)
+{
+    q->in_flight = true;
+    q->flight_us = q->pending_us;
+    q->flight_origin = q->pending_origin;
+    q->pending_origin = NULL;
+    hist_record(&q->stats.stage[STAGE_QUEUE], now_us() - q->flight_us);
+    if (ramp_wanted(q) && ramp_start(q)) {
+	/* The first step is taken at once.  The state remains pending
+	 * until the ramp reaches it. */
+	ramp_tick(q);
+	return;
+    }
+    q->pending = false;
+    q->target = q->pending_state;
+    start_write(q, &q->target);
+}
+
+/**
+ * @brief Loop hook, called after each batch of events, to flush the
+ * command queue.
+ */
+static void
+cmdq_hook(loop_t *loop, void *arg)
+{
+    cmdq_flush((cmdq_t *) arg);
+}
+
+/**
+ * @brief Mixer change function, called when the mixer has been changed
+ * by another program.  The new state becomes the base against which
+ * further relative commands are resolved, and is sent to clients at
+ * once.  Any ramp is abandoned: the latest change wins.
+ */
+static void
+cmdq_mixer_changed(mixer_t *m, void *arg)
+{
+    cmdq_t *q = (cmdq_t *) arg;
+
+    if (q->ramp.src.fd >= 0) {
+	ramp_stop(q);
+	q->pending = false;
+	q->in_flight = false;
+	q->pending_origin = q->flight_origin = NULL;
+    }
+    q->zone->state->volume = mixer_raw_to_pct(m, m->raw);
+    q->zone->state->mute = m->mute;
+    q->target = *q->zone->state;
+    if (!q->pending) {
+	q->pending_state = q->target;
+    }
+    if (q->loop) {
+	server_broadcast_status(q->loop, q->zone, NULL);
+    }
+}
+
+/**
+ * @brief Initialise the command queue \p q, for the zone to which it
+ * belongs (the default zone, unless it is the queue of another zone).
+ * The zone's state is taken from the mixer, as last read.
+ *
+ * @param q (cmdq_t *) The queue to be initialised.
+ * @param loop (loop_t *) The loop whose clients are to be told of
+ *        status changes, and after whose batches of events the queue
+ *        will be flushed.  The mixer is also watched, in this loop, for
+ *        changes made by other programs.  This may be NULL, in which
+ *        case the caller must call cmdq_flush() itself.
+ * @param mixer (mixer_t *) The open mixer to which the queue writes.
+ */
+void
+cmdq_init(cmdq_t *q, loop_t *loop, mixer_t *mixer)
+{
+    int id;
+
+    q->zone = &zones[0];
+    for (id = 1; id < nzones; id++) {
+	if (zones[id].queue == q) {
+	    q->zone = &zones[id];
+	}
+    }
+    q->zone->state->volume = mixer_raw_to_pct(mixer, mixer->raw);
+    q->zone->state->mute = mixer->mute;
+    q->loop = loop;
+    q->mixer = mixer;
+    q->pending = false;
+    q->in_flight = false;
+    q->target = *q->zone->state;
+    q->pending_state = q->target;
+    q->received = 0;
+    q->writes = 0;
+    q->pending_origin = NULL;
+    q->flight_origin = NULL;
+    memset(&q->ramp, 0, sizeof(q->ramp));
+    q->ramp.src.fd = -1;
+    stats_reset(&q->stats);
+    q->writer.running = false;
+    q->writer.busy = false;
+    if (loop) {
+	loop_add_hook(loop, cmdq_hook, q);
+	(void) mixer_watch(mixer, loop, cmdq_mixer_changed, q);
+	if (options.writer_thread) {
+	    (void) writer_start(&q->writer, loop, mixer, cmdq_writer_done, q);
+	}
+    }
+}
+
+/**
+ * @brief Wait for any write in flight, on the writer thread, for \p q
+ * to complete, after which the mixer may safely be used by the caller
+ * until control returns to the loop.
+ *
+ * @param q (cmdq_t *) The queue.
+ */
+void
+cmdq_wait(cmdq_t *q)
+{
+    if (q->writer.running) {
+	writer_wait(&q->writer);
+    }
+}
+
+/**
+ * @brief Stop any ramp, and the writer thread if there is one, for
+ * \p q, once its last write has completed.
+ *
+ * @param q (cmdq_t *) The queue.
+ */
+void
+cmdq_shutdown(cmdq_t *q)
+{
+    writer_stop(&q->writer);
+    if (q->ramp.src.fd >= 0) {
+	ramp_stop(q);
+    }
+}
+
+/**
+ * @brief Resynchronise \p q with its mixer, after the mixer has been
+ * reopened or its volume curve rebuilt.  The mixer is re-read, and
+ * watched again for external changes, and clients are sent the
+ * resulting status.  Any pending state is kept, so that commands that
+ * have been accepted but not yet written are not lost.
+ *
+ * @param q (cmdq_t *) The queue to be resynchronised.
+ */
+void
+cmdq_resync(cmdq_t *q)
+{
+    (void) mixer_read(q->mixer, q->zone->state);
+    q->target = *q->zone->state;
+    if (!q->pending) {
+	q->pending_state = q->target;
+    }
+    if (q->loop) {
+	(void) mixer_watch(q->mixer, q->loop, cmdq_mixer_changed, q);
+	server_broadcast_status(q->loop, q->zone, NULL);
+    }
+}
+
+/**
+ * @brief Fold \p cmd into the pending state for \p q.
+ *
+ * @param q (cmdq_t *) The queue to which the command is submitted.
+ * @param cmd (command_t *) The command.
+ * @param origin (conn_t *) The connection from which \p cmd came, to be
+ *        sent the acknowledging broadcast first, or NULL.
+ *
+ * @return (bool) true if a status broadcast will follow, which will
+ *         serve as the acknowledgement for \p cmd.  If false, \p cmd
+ *         made no difference and the caller should acknowledge it.
+ */
+bool
+cmdq_submit(cmdq_t *q, const command_t *cmd, conn_t *origin)
+{
+    q->received++;
+    q->stats.commands++;
+    if (q->pending) {
+	q->stats.coalesced++;
+    }
+    else {
+	q->pending_state = q->target;
+    }
+    if (apply_command(&q->pending_state, cmd) && !q->pending) {
+	q->pending = true;
+	q->pending_us = now_us();
+    }
+    if (q->pending) {
+	q->pending_origin = origin;
+    }
+    else if (q->in_flight) {
+	q->flight_origin = origin;
+    }
+    return q->pending || q->in_flight;
+}
+
+/**
+ * @brief Write any pending state to the mixer, unless a write is
+ * already in flight.
+ *
+ * If the folded commands have cancelled each other out, there is
+ * nothing to write but status is still sent, so that the clients whose
+ * commands were folded receive their acknowledgements.
+ *
+ * @param q (cmdq_t *) The queue to be flushed.
+ */
+void
+cmdq_flush(cmdq_t *q)
+{
+    if (!q->pending || q->in_flight) {
+	return;
+    }
+    if ((q->pending_state.volume == q->target.volume) &&
+	(q->pending_state.mute == q->target.mute))
+    {
+	q->pending = false;
+	if (q->loop) {
+	    server_broadcast_status(q->loop, q->zone, q->pending_origin);
+	}
+	q->pending_origin = NULL;
+	return;
+    }
+    issue_write(q);
+}
+
+/**
+ * @brief Record the completion of the in-flight write for \p q, tell
+ * clients of the new status, and issue any write that has become
+ * pending in the meantime.  The time taken to queue the status for
+ * clients completes the timing of the write.
+ *
+ * @param q (cmdq_t *) The queue whose write has completed.
+ */
+void
+cmdq_write_done(cmdq_t *q)
+{
+    uint64_t done = now_us();
+    uint64_t queued;
+
+    q->in_flight = false;
+    if (q->loop) {
+	server_broadcast_status(q->loop, q->zone, q->flight_origin);
+    }
+    q->flight_origin = NULL;
+    queued = now_us();
+    hist_record(&q->stats.stage[STAGE_BROADCAST], queued - done);
+    hist_record(&q->stats.stage[STAGE_TOTAL], queued - q->flight_us);
+    cmdq_flush(q);
+}
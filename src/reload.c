@@ -0,0 +1,179 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Configuration reloading.  On SIGHUP, or when the config file is
+ * rewritten, the config file is read into a fresh options_t, which is
+ * compared with the live #options.  Everything that can fail (opening a
+ * new mixer, binding a new port or socket) is done before anything is
+ * changed, so that a bad config file leaves the daemon exactly as it
+ * was.  The new options are then swapped in, and only the affected
+ * subsystems are touched: client connections stay open, and commands
+ * that have been accepted but not yet written to the mixer remain
+ * pending.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "volumed.h"
+
+
+/**
+ * @brief Compare two option strings, either of which may be NULL.
+ */
+static bool
+option_changed(const char *a, const char *b)
+{
+    if (!a || !b) {
+	return a != b;
+    }
+    return strcmp(a, b) != 0;
+}
+
+/**
+ * @brief Reload the config file and apply any changes.
+ *
+ * @param loop (loop_t *) The loop running the server and command queue.
+ *
+ * @return (bool) true if the new configuration was applied, false if
+ *         it could not be, in which case the old one remains in force.
+ */
+bool
+config_reload(loop_t *loop)
+{
+    options_t fresh;
+    options_t old;
+    mixer_t new_mixer;
+    bool opened = mixer.ops != NULL;
+    bool reopen;
+    bool rebind;
+    bool relocal;
+    bool recurve;
+    int fd = -1;
+    int local_fd = -1;
+
+    if (!read_config_options(&fresh, 0)) {
+	fprintf(stderr, "Warning: config reload failed; "
+		"keeping current configuration\n");
+	return false;
+    }
+    fresh.generation = options.generation + 1;
+    /* A mixer not yet opened, with lazy_mixer, will be opened with the
+     * new settings when it is needed. */
+    reopen = opened &&
+	(option_changed(fresh.mixer, options.mixer) ||
+	 option_changed(fresh.alsa_card, options.alsa_card) ||
+	 option_changed(fresh.alsa_mixer_name, options.alsa_mixer_name));
+    if (fresh.workers != options.workers) {
+	fprintf(stderr, "Warning: workers cannot be changed without "
+		"a restart (keeping %d)\n", options.workers);
+	fresh.workers = options.workers;
+    }
+    if ((fresh.port != options.port) && (options.workers > 1)) {
+	fprintf(stderr, "Warning: port cannot be changed without a restart "
+		"while there are workers (keeping %d)\n", options.port);
+	fresh.port = options.port;
+    }
+    if (option_changed(fresh.status_page, options.status_page)) {
+	fprintf(stderr, "Warning: status_page cannot be changed without "
+		"a restart (keeping %s)\n",
+		options.status_page ? options.status_page: "none");
+	fresh.status_page = options.status_page ?
+	    arena_strdup(fresh.arena, options.status_page): NULL;
+    }
+    if (fresh.lazy_mixer != options.lazy_mixer) {
+	fprintf(stderr, "Warning: lazy_mixer cannot be changed without "
+		"a restart\n");
+	fresh.lazy_mixer = options.lazy_mixer;
+    }
+    rebind = fresh.port != options.port;
+    relocal = option_changed(fresh.socket_path, options.socket_path);
+    if (fresh.max_clients != options.max_clients) {
+	fprintf(stderr, "Warning: max_clients cannot be changed without "
+		"a restart (keeping %d)\n", options.max_clients);
+	fresh.max_clients = options.max_clients;
+    }
+    if ((fresh.writer_thread != options.writer_thread) ||
+	(fresh.writer_priority != options.writer_priority) ||
+	(fresh.writer_cpu != options.writer_cpu))
+    {
+	fprintf(stderr, "Warning: writer thread settings cannot be changed "
+		"without a restart\n");
+	fresh.writer_thread = options.writer_thread;
+	fresh.writer_priority = options.writer_priority;
+	fresh.writer_cpu = options.writer_cpu;
+    }
+    (void) zones_reconfigure(&fresh);
+
+    if (rebind && ((fd = server_listen(fresh.port)) < 0)) {
+	goto fail;
+    }
+    if (relocal && fresh.socket_path &&
+	((local_fd = server_listen_local(fresh.socket_path)) < 0))
+    {
+	goto fail;
+    }
+    if (reopen && !mixer_open(&new_mixer, fresh.mixer, fresh.alsa_card,
+			      fresh.alsa_mixer_name))
+    {
+	goto fail;
+    }
+
+    /* The writer threads, if there are any, own the mixers until their
+     * writes are done. */
+    zones_wait();
+    old = options;
+    options = fresh;
+    if (rebind) {
+	server_set_listener(loop, fd);
+    }
+    if (relocal) {
+	server_set_local_listener(loop, local_fd);
+	if (old.socket_path) {
+	    (void) unlink(old.socket_path);
+	}
+    }
+    if (reopen) {
+	mixer_close(&mixer);
+	mixer = new_mixer;
+    }
+    else {
+	/* The names are unchanged, but the old strings are about to be
+	 * freed. */
+	mixer.card = options.alsa_card;
+	mixer.control = options.alsa_mixer_name;
+    }
+    recurve = opened &&
+	mixer_set_curve(&mixer, options.volcurve, options.max_pct);
+    if (reopen || recurve) {
+	cmdq_resync(&command_queue);
+    }
+    zones_apply();
+    free_config_options(&old);
+
+    if (options.verbosity) {
+	printf("Configuration reloaded (generation %lu):%s%s%s%s\n",
+	       options.generation, rebind ? " port": "",
+	       relocal ? " socket": "", reopen ? " mixer": "",
+	       recurve ? " curve": "");
+    }
+    return true;
+
+fail:
+    if (fd >= 0) {
+	close(fd);
+    }
+    if (local_fd >= 0) {
+	close(local_fd);
+	(void) unlink(fresh.socket_path);
+    }
+    free_config_options(&fresh);
+    fprintf(stderr, "Warning: config reload failed; "
+	    "keeping current configuration\n");
+    return false;
+}
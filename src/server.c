@@ -0,0 +1,1505 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The websocket server.  This accepts connections on options.port,
+ * performs the websocket handshake and then reads commands from, and
+ * writes status messages to, each client.  All sockets are
+ * non-blocking and are driven by the event loop in loop.c.
+ *
+ * Each connection is registered once, for both input and output, in
+ * edge-triggered mode.  Output is written directly to the socket
+ * whenever possible and is only queued when the socket would block,
+ * the queue being drained, with writev(), when epoll next reports the
+ * socket as writable.  Status broadcasts are encoded once into a shared
+ * frame (see frame.c), which is queued by reference rather than copied
+ * for each client.
+ *
+ * Each client is subscribed to the status of one or more zones (see
+ * zone.c), recorded as a bitmap in its connection, and status for a
+ * zone is broadcast only to its subscribers.  Every client starts out
+ * subscribed to zone 0.  A text client moves its subscription with the
+ * zone command, along with the zone that its commands address; a binary
+ * client is subscribed to each zone that its records address.
+ *
+ * With more than one worker (see worker.c), several loops, each on a
+ * thread of its own, run this same code for their own connections.
+ * Only the main loop has a local listener, and only it submits commands
+ * to the command queues: the others see each zone through their
+ * worker's view of it, and forward their commands to the main loop.
+ *
+ * Clients may negotiate the binary subprotocol, BIN_PROTOCOL, in which
+ * case they send and receive fixed-size binary records (see
+ * bin_record_t) rather than text, and each broadcast is also encoded,
+ * just once, as a binary frame.
+ *
+ * The client whose command a broadcast acknowledges is sent it first.
+ * If more than #STATUS_BATCH others are owed status, the rest of the
+ * broadcast is deferred, for up to #STATUS_DEFER_MS, so that the loop
+ * can get back to reading commands rather than spend its time on
+ * writes to clients that are only watching.  Those clients are then
+ * sent only the latest status of each zone, however many broadcasts
+ * there have been in the meantime, just as a client that is behind
+ * has its unsent status replaced.
+ *
+ * If options.socket_path is set, we also listen on a unix domain socket
+ * of type SOCK_SEQPACKET, for clients on the same machine.  These
+ * skip the websocket handshake and framing: each packet is a single
+ * message, text or binary records, the first deciding which the client
+ * speaks.  In all other respects local clients are treated like any
+ * other, and are sent the payloads of the same shared frames.
+ *
+ * Under socket activation, the listening sockets are passed to us by
+ * the service manager (see server_inherit()) rather than created here,
+ * so that clients can connect, and are queued by the kernel, before we
+ * are even running.
+ *
+ * Connections, with their buffers, come from a slab of
+ * options.max_clients entries allocated by server_init(), and shared
+ * frames from a pool allocated at the same time, so that once the
+ * server is listening it makes no further heap allocations.  A
+ * connection made when the slab is exhausted is closed at once.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "volumed.h"
+
+#define WS_CLOSE_GOING_AWAY 1001
+
+static const char invalid_command[] = "{\"error\":\"invalid command\"}";
+static const char mixer_unavailable[] = "{\"error\":\"mixer unavailable\"}";
+
+/**
+ * @brief Whether the local listener was passed to us, in which case
+ * its path belongs to the service manager, and is not removed.
+ */
+static bool local_inherited = false;
+
+
+/**
+ * @brief Drop the references held by the output queue for \p conn.
+ *
+ * @param conn (conn_t *) The connection whose queue is to be emptied.
+ */
+static void
+conn_clear_queue(conn_t *conn)
+{
+    while (conn->out_count > 0) {
+	frame_unref(conn->outq[conn->out_head]);
+	conn->out_head = (conn->out_head + 1) % CONN_MAX_QUEUED;
+	conn->out_count--;
+    }
+    conn->out_head = 0;
+    conn->out_off = 0;
+    arena_reset(&conn->arena);
+}
+
+/**
+ * @brief Remove \p conn from its loop and close its socket.  The
+ * connection structure is not freed until server_reap() is called.
+ *
+ * @param conn (conn_t *) The connection to be killed.
+ */
+static void
+conn_kill(conn_t *conn)
+{
+    loop_t *loop = conn->loop;
+
+    if (conn->state == CONN_DEAD) {
+	return;
+    }
+    loop_del(loop, &conn->src);
+    close(conn->src.fd);
+    conn->src.fd = -1;
+    conn->state = CONN_DEAD;
+    conn_clear_queue(conn);
+    if (conn->owed) {
+	conn->owed = 0;
+	loop->owed_conns--;
+    }
+
+    if (conn->prev) {
+	conn->prev->next = conn->next;
+    }
+    else {
+	loop->conns = conn->next;
+    }
+    if (conn->next) {
+	conn->next->prev = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = loop->dead;
+    loop->dead = conn;
+    loop->nconns--;
+    if (options.verbosity > 1) {
+	printf("Connection closed (%d remaining)\n", loop->nconns);
+    }
+}
+
+/**
+ * @brief Return the number of bytes at the start of \p frame that are
+ * not sent to \p conn: local clients are not sent websocket headers.
+ */
+static inline size_t
+frame_skip(const conn_t *conn, const frame_t *frame)
+{
+    return conn->local ? frame->hdr_len: 0;
+}
+
+/**
+ * @brief Write as much of the output queue for \p conn as the socket
+ * will accept, using a single writev() for the whole queue.  On the
+ * local socket, where each write is a message, the frames are written
+ * one at a time.
+ *
+ * @param conn (conn_t *) The connection to be flushed.
+ */
+void
+conn_flush(conn_t *conn)
+{
+    struct iovec iov[CONN_MAX_QUEUED];
+    frame_t *frame;
+    ssize_t n;
+    size_t len;
+    int count;
+    int i;
+
+    while ((conn->state != CONN_DEAD) && (conn->out_count > 0)) {
+	count = conn->local ? 1: conn->out_count;
+	for (i = 0; i < count; i++) {
+	    frame = conn->outq[(conn->out_head + i) % CONN_MAX_QUEUED];
+	    iov[i].iov_base = frame->data + frame_skip(conn, frame);
+	    iov[i].iov_len = frame->len - frame_skip(conn, frame);
+	}
+	iov[0].iov_base = (uint8_t *) iov[0].iov_base + conn->out_off;
+	iov[0].iov_len -= conn->out_off;
+
+	n = writev(conn->src.fd, iov, count);
+	if ((n < 0) && (errno == EINTR)) {
+	    continue;
+	}
+	if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+	    return;
+	}
+	if (n <= 0) {
+	    conn_kill(conn);
+	    return;
+	}
+	/* Release each frame that has been completely written. */
+	while (n > 0) {
+	    frame = conn->outq[conn->out_head];
+	    len = frame->len - frame_skip(conn, frame) - conn->out_off;
+	    if ((size_t) n < len) {
+		conn->out_off += n;
+		break;
+	    }
+	    n -= len;
+	    frame_unref(frame);
+	    conn->out_head = (conn->out_head + 1) % CONN_MAX_QUEUED;
+	    conn->out_count--;
+	    conn->out_off = 0;
+	}
+    }
+    if (conn->out_count == 0) {
+	/* Nothing can still refer to the private frames. */
+	arena_reset(&conn->arena);
+    }
+}
+
+/**
+ * @brief Write directly to the socket for \p conn.
+ *
+ * @param conn (conn_t *) The connection to which to write.
+ * @param data (void *) The data to be written.
+ * @param len (size_t) The length of \p data.
+ *
+ * @return (ssize_t) The number of bytes written, which may be less than
+ *         \p len if the socket would block, or -1 if the connection has
+ *         failed and been killed.
+ */
+static ssize_t
+conn_write(conn_t *conn, const uint8_t *data, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+	n = write(conn->src.fd, data + done, len - done);
+	if (n > 0) {
+	    done += n;
+	}
+	else if ((n < 0) && (errno == EINTR)) {
+	    continue;
+	}
+	else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+	    break;
+	}
+	else {
+	    conn_kill(conn);
+	    return -1;
+	}
+    }
+    return done;
+}
+
+/**
+ * @brief Add a reference to \p frame to the output queue for \p conn.
+ *
+ * A status message replaces any earlier status message for the same
+ * zone that is still waiting, unwritten, in the queue: a client that is
+ * behind needs only the latest status of each zone.  A client whose
+ * queue is full is not reading its output quickly enough, and is
+ * disconnected.
+ *
+ * @param conn (conn_t *) The connection.
+ * @param frame (frame_t *) The frame to be queued.
+ * @param off (size_t) The number of bytes of \p frame that have already
+ *        been written.
+ */
+static void
+conn_enqueue(conn_t *conn, frame_t *frame, size_t off)
+{
+    int i;
+    int idx;
+
+    if (frame->status && (off == 0)) {
+	for (i = conn->out_count - 1; i >= 0; i--) {
+	    idx = (conn->out_head + i) % CONN_MAX_QUEUED;
+	    if ((i == 0) && (conn->out_off > 0)) {
+		break;
+	    }
+	    if (conn->outq[idx]->status &&
+		(conn->outq[idx]->zone == frame->zone))
+	    {
+		frame_unref(conn->outq[idx]);
+		conn->outq[idx] = frame_ref(frame);
+		return;
+	    }
+	}
+    }
+    if (conn->out_count == CONN_MAX_QUEUED) {
+	if (options.verbosity) {
+	    fprintf(stderr, "Warning: dropping slow client (fd %d)\n",
+		    conn->src.fd);
+	}
+	conn_kill(conn);
+	return;
+    }
+    if (conn->out_count == 0) {
+	conn->out_off = off;
+    }
+    idx = (conn->out_head + conn->out_count) % CONN_MAX_QUEUED;
+    conn->outq[idx] = frame_ref(frame);
+    conn->out_count++;
+}
+
+/**
+ * @brief Send \p data to the client of \p conn.
+ *
+ * If nothing is already queued, we attempt to write directly to the
+ * socket, copying into a new frame only what cannot be written.  That
+ * frame is allocated from the connection's arena; a client that has
+ * left so much unread that the arena is full is disconnected.
+ *
+ * @param conn (conn_t *) The connection to which to send.
+ * @param data (void *) The data to be sent.
+ * @param len (size_t) The length of \p data.
+ */
+void
+conn_send(conn_t *conn, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    frame_t *frame;
+    ssize_t n = 0;
+
+    if (conn->state == CONN_DEAD) {
+	return;
+    }
+    if (conn->out_count == 0) {
+	if ((n = conn_write(conn, p, len)) < 0) {
+	    return;
+	}
+    }
+    if ((size_t) n < len) {
+	if (!(frame = frame_raw(&conn->arena, p + n, len - n))) {
+	    if (options.verbosity) {
+		fprintf(stderr, "Warning: dropping slow client (fd %d)\n",
+			conn->src.fd);
+	    }
+	    conn_kill(conn);
+	    return;
+	}
+	conn_enqueue(conn, frame, 0);
+	frame_unref(frame);
+    }
+}
+
+/**
+ * @brief Send the shared frame \p frame to the client of \p conn.
+ *
+ * If nothing is already queued, we attempt to write directly to the
+ * socket.  Whatever cannot be written is queued by reference, so that
+ * the frame is never copied.
+ *
+ * @param conn (conn_t *) The connection to which to send.
+ * @param frame (frame_t *) The frame to be sent.
+ */
+void
+conn_send_shared(conn_t *conn, frame_t *frame)
+{
+    size_t skip = frame_skip(conn, frame);
+    ssize_t n = 0;
+
+    if (conn->state == CONN_DEAD) {
+	return;
+    }
+    if (conn->out_count == 0) {
+	if ((n = conn_write(conn, frame->data + skip,
+			    frame->len - skip)) < 0)
+	{
+	    return;
+	}
+    }
+    if ((size_t) n < frame->len - skip) {
+	conn_enqueue(conn, frame, n);
+    }
+}
+
+/**
+ * @brief Send a single websocket frame to the client of \p conn or,
+ * for a local client, just its payload.
+ *
+ * @param conn (conn_t *) The connection to which to send.
+ * @param opcode (int) The websocket opcode for the frame.
+ * @param payload (void *) The payload for the frame.
+ * @param len (size_t) The length of \p payload, which must not exceed
+ *        #WS_MAX_PAYLOAD.
+ */
+void
+conn_send_frame(conn_t *conn, int opcode, const void *payload, size_t len)
+{
+    uint8_t frame[WS_MAX_HEADER + WS_MAX_PAYLOAD];
+
+    if (conn->local) {
+	conn_send(conn, payload, len);
+	return;
+    }
+    conn_send(conn, frame,
+	      ws_encode_frame(frame, opcode, payload, len, NULL));
+}
+
+/**
+ * @brief Close \p conn, first sending a websocket close frame if
+ * \p code is non-zero and the handshake has been completed.
+ *
+ * @param conn (conn_t *) The connection to be closed.
+ * @param code (int) The websocket close status code, or 0.
+ */
+void
+conn_close(conn_t *conn, int code)
+{
+    uint8_t payload[2];
+
+    if (code && (conn->state == CONN_OPEN) && !conn->local) {
+	payload[0] = (uint8_t) (code >> 8);
+	payload[1] = (uint8_t) code;
+	conn_send_frame(conn, WS_OP_CLOSE, payload, sizeof(payload));
+    }
+    conn_kill(conn);
+}
+
+/**
+ * @brief Create a shared status frame for the current status of
+ * \p zone, in the text or binary form.
+ */
+static frame_t *
+status_frame(const zone_t *zone, bool binary)
+{
+    char status[STATUS_BUFFER_SIZE];
+    uint8_t record[BIN_RECORD_SIZE];
+    bin_record_t rec;
+    frame_t *frame;
+
+    if (binary) {
+	bin_status(&rec, zone, 0);
+	bin_encode(record, &rec);
+	frame = frame_new(WS_OP_BINARY, record, sizeof(record));
+    }
+    else {
+	frame = frame_new(WS_OP_TEXT, status,
+			  format_status(zone, status, sizeof(status)));
+    }
+    frame->status = true;
+    frame->zone = zone->id;
+    return frame;
+}
+
+/**
+ * @brief Send the current status of \p zone to \p conn, if it is open
+ * and subscribed to the zone, settling any status of the zone that it
+ * is owed.  The shared frame for the form it needs is created, in the
+ * loop's frames for the zone, if this is the first connection to need
+ * it since the zone's last broadcast.
+ */
+static void
+conn_send_status(conn_t *conn, const zone_t *zone)
+{
+    frame_t **frames = conn->loop->status_frames[zone->id];
+    uint32_t bit = 1u << zone->id;
+    int i = conn->binary;
+
+    if (conn->owed & bit) {
+	conn->owed &= ~bit;
+	if (!conn->owed) {
+	    conn->loop->owed_conns--;
+	}
+    }
+    if ((conn->state != CONN_OPEN) || !(conn->zones & bit)) {
+	return;
+    }
+    if (!frames[i]) {
+	frames[i] = status_frame(zone, conn->binary);
+    }
+    conn_send_shared(conn, frames[i]);
+    stats_first_response();
+}
+
+/**
+ * @brief Send every connection on \p loop the status that it is owed.
+ */
+static void
+server_send_owed(loop_t *loop)
+{
+    conn_t *conn;
+    conn_t *next;
+
+    for (conn = loop->conns; conn && (loop->owed_conns > 0); conn = next) {
+	next = conn->next;
+	while (conn->owed) {
+	    conn_send_status(conn,
+			     loop->owed_zones[__builtin_ctz(conn->owed)]);
+	}
+    }
+}
+
+/**
+ * @brief Event handler for the status timer of \p loop, which sends
+ * the status deferred by server_broadcast_status().
+ */
+static void
+status_timer_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    uint64_t expirations;
+
+    (void) read(src->fd, &expirations, sizeof(expirations));
+    loop->status_armed = false;
+    server_send_owed(loop);
+}
+
+/**
+ * @brief Arm the status timer for \p loop, unless it is already armed,
+ * to go off in #STATUS_DEFER_MS.
+ *
+ * @return (bool) false if there is no timer, or it could not be armed,
+ *         in which case owed status should be sent at once.
+ */
+static bool
+status_timer_arm(loop_t *loop)
+{
+    struct itimerspec its;
+
+    if (loop->status_armed) {
+	return true;
+    }
+    if (loop->status_timer.fd < 0) {
+	return false;
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = STATUS_DEFER_MS * 1000000L;
+    if (timerfd_settime(loop->status_timer.fd, 0, &its, NULL) < 0) {
+	return false;
+    }
+    loop->status_armed = true;
+    return true;
+}
+
+/**
+ * @brief Create the status timer for \p loop.  Without one, no
+ * broadcast is deferred.
+ */
+static void
+status_timer_init(loop_t *loop)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0) {
+	dofail(0, "unable to create status timer: %s", strerror(errno));
+	return;
+    }
+    loop->status_timer.fd = fd;
+    loop->status_timer.handler = status_timer_handler;
+    loop->status_armed = false;
+    loop_add(loop, &loop->status_timer, EPOLLIN | EPOLLET);
+}
+
+/**
+ * @brief Drop the frames kept for the status of \p id on \p loop.
+ */
+static void
+status_frames_drop(loop_t *loop, int id)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	if (loop->status_frames[id][i]) {
+	    frame_unref(loop->status_frames[id][i]);
+	    loop->status_frames[id][i] = NULL;
+	}
+    }
+}
+
+/**
+ * @brief Send the current status of \p zone to every open connection
+ * on \p loop that is subscribed to it.  The status is formatted and
+ * encoded just once for each form in which it is needed, into a shared
+ * frame.  If, besides \p origin, more than #STATUS_BATCH connections
+ * are owed status, they are sent it only when the status timer goes
+ * off.  A broadcast from the main loop is published to the workers
+ * too, for their own connections, and to the status page, if any.
+ *
+ * @param loop (loop_t *) The loop whose connections are to be sent to.
+ * @param zone (zone_t *) The zone whose status has changed.
+ * @param origin (conn_t *) The connection, on \p loop, whose command
+ *        the broadcast acknowledges, or NULL.  It is sent to first, so
+ *        that its client's wait does not grow with the number of other
+ *        connections.  It may since have been closed.
+ */
+void
+server_broadcast_status(loop_t *loop, const zone_t *zone, conn_t *origin)
+{
+    uint32_t bit = 1u << zone->id;
+    conn_t *conn;
+
+    status_frames_drop(loop, zone->id);
+    loop->owed_zones[zone->id] = zone;
+    if (origin) {
+	conn_send_status(origin, zone);
+    }
+    for (conn = loop->conns; conn; conn = conn->next) {
+	if ((conn != origin) && (conn->state == CONN_OPEN) &&
+	    (conn->zones & bit))
+	{
+	    if (!conn->owed) {
+		loop->owed_conns++;
+	    }
+	    conn->owed |= bit;
+	}
+    }
+    if ((loop->owed_conns <= STATUS_BATCH) || !status_timer_arm(loop)) {
+	server_send_owed(loop);
+    }
+    if (!loop->worker) {
+	workers_publish(zone);
+	status_page_update(zone);
+    }
+}
+
+/**
+ * @brief Return the zone with id \p id, as seen by the loop for
+ * \p conn: for a worker, that is the worker's view of the zone.
+ *
+ * @return (zone_t *) The zone, or NULL if there is no such zone.
+ */
+static zone_t *
+conn_zone(const conn_t *conn, int id)
+{
+    zone_t *zone = zone_find(id);
+
+    if (zone && conn->loop->worker) {
+	zone = &conn->loop->worker->zones[id];
+    }
+    return zone;
+}
+
+/**
+ * @brief Make sure that the mixer for \p zone, from conn_zone(), is
+ * open, opening it now if it has yet to be.  Workers are started only
+ * once every mixer is open (see workers_start()).
+ *
+ * @return (bool) false if the mixer could not be opened.
+ */
+static bool
+conn_zone_ready(const conn_t *conn, zone_t *zone)
+{
+    return conn->loop->worker || zone_ready(zone);
+}
+
+/**
+ * @brief Submit \p cmd for \p zone, from \p conn, to the zone's
+ * command queue or, on a worker, forward it to the main loop to be
+ * submitted there.  Returns as cmdq_submit() does.
+ */
+static bool
+conn_submit(conn_t *conn, const zone_t *zone, const command_t *cmd)
+{
+    if (conn->loop->worker) {
+	return worker_submit(conn->loop->worker, zone, cmd, conn);
+    }
+    return cmdq_submit(zone->queue, cmd, conn);
+}
+
+/**
+ * @brief Handle a text message from a client.
+ *
+ * State-changing commands are submitted to the command queue of the
+ * zone that the client addresses, and are acknowledged by the status
+ * broadcast that follows the mixer write.  Commands that make no
+ * difference to the state, including status and stats queries, are
+ * answered immediately, as is a change of zone.  Anything but a stats
+ * query is refused if the zone's mixer cannot be opened.
+ *
+ * @param conn (conn_t *) The connection on which the message arrived.
+ * @param text (char *) The message text.
+ * @param len (size_t) The length of \p text.
+ */
+static void
+handle_text_message(conn_t *conn, const char *text, size_t len)
+{
+    command_t cmd;
+    zone_t *zone;
+    char status[STATUS_BUFFER_SIZE];
+    char stats[WS_MAX_PAYLOAD];
+
+    if (!parse_command(text, len, &cmd) ||
+	!(zone = conn_zone(conn, (cmd.type == CMD_ZONE) ?
+			   cmd.value: conn->zone)))
+    {
+	conn_send_frame(conn, WS_OP_TEXT, invalid_command,
+			sizeof(invalid_command) - 1);
+	return;
+    }
+    if (cmd.type == CMD_STATS) {
+	conn_send_frame(conn, WS_OP_TEXT, stats,
+			stats_format(&zone->queue->stats,
+				     stats, sizeof(stats)));
+	return;
+    }
+    if (!conn_zone_ready(conn, zone)) {
+	conn_send_frame(conn, WS_OP_TEXT, mixer_unavailable,
+			sizeof(mixer_unavailable) - 1);
+	return;
+    }
+    if (cmd.type == CMD_ZONE) {
+	conn->zone = zone->id;
+	conn->zones = 1u << zone->id;
+    }
+    if ((cmd.type == CMD_STATUS) || (cmd.type == CMD_ZONE) ||
+	!conn_submit(conn, zone, &cmd))
+    {
+	conn_send_frame(conn, WS_OP_TEXT, status,
+			format_status(zone, status, sizeof(status)));
+	stats_first_response();
+    }
+}
+
+/**
+ * @brief Handle a binary message, of one or more records, from a
+ * client that has negotiated the binary subprotocol.  The replies to
+ * all of the records are sent together, in a single message.
+ *
+ * @param conn (conn_t *) The connection on which the message arrived.
+ * @param data (uint8_t *) The message.
+ * @param len (size_t) The length of \p data.
+ */
+static void
+handle_binary_message(conn_t *conn, const uint8_t *data, size_t len)
+{
+    uint8_t replies[WS_MAX_PAYLOAD];
+    size_t nreplies = 0;
+    bin_record_t rec;
+    command_t cmd;
+    zone_t *zone;
+    size_t off;
+
+    if ((len == 0) || (len % BIN_RECORD_SIZE)) {
+	conn_close(conn, WS_CLOSE_PROTOCOL);
+	return;
+    }
+    for (off = 0; off < len; off += BIN_RECORD_SIZE) {
+	bin_decode(data + off, &rec);
+	/* bin_command() checks that the zone exists. */
+	if (!bin_command(&rec, &cmd)) {
+	    rec.op = BIN_OP_ERROR;
+	    rec.value = BIN_ERR_INVALID;
+	}
+	else if (!conn_zone_ready(conn, zone = conn_zone(conn, rec.zone))) {
+	    rec.op = BIN_OP_ERROR;
+	    rec.value = BIN_ERR_MIXER;
+	}
+	else {
+	    conn->zones |= 1u << zone->id;
+	    if ((cmd.type != CMD_STATUS) && conn_submit(conn, zone, &cmd)) {
+		continue;
+	    }
+	    bin_status(&rec, zone, rec.seq);
+	}
+	bin_encode(replies + nreplies, &rec);
+	nreplies += BIN_RECORD_SIZE;
+    }
+    if (nreplies) {
+	conn_send_frame(conn, WS_OP_BINARY, replies, nreplies);
+	stats_first_response();
+    }
+}
+
+/**
+ * @brief Handle a single frame received from a client.
+ *
+ * Fragmented messages are not supported: our messages are tiny, and
+ * browsers never fragment messages of this size.  Text that is not
+ * valid UTF-8 is, as RFC 6455 requires, treated as fatal.  A client
+ * sends text or binary messages, according to the subprotocol it has
+ * negotiated, but not both.
+ *
+ * @param conn (conn_t *) The connection on which the frame arrived.
+ * @param frame (ws_frame_t *) The frame.
+ */
+static void
+handle_frame(conn_t *conn, ws_frame_t *frame)
+{
+    if (!frame->masked) {
+	conn_close(conn, WS_CLOSE_PROTOCOL);
+	return;
+    }
+    if (((frame->opcode == WS_OP_TEXT) && conn->binary) ||
+	((frame->opcode == WS_OP_BINARY) && !conn->binary))
+    {
+	conn_close(conn, WS_CLOSE_DATATYPE);
+	return;
+    }
+    switch (frame->opcode) {
+    case WS_OP_TEXT:
+	if (!frame->fin) {
+	    conn_close(conn, WS_CLOSE_PROTOCOL);
+	    return;
+	}
+	if (!utf8_valid(frame->payload, frame->len)) {
+	    conn_close(conn, WS_CLOSE_BAD_DATA);
+	    return;
+	}
+	handle_text_message(conn, (char *) frame->payload, frame->len);
+	break;
+    case WS_OP_BINARY:
+	if (!frame->fin) {
+	    conn_close(conn, WS_CLOSE_PROTOCOL);
+	    return;
+	}
+	handle_binary_message(conn, frame->payload, frame->len);
+	break;
+    case WS_OP_PING:
+	conn_send_frame(conn, WS_OP_PONG, frame->payload, frame->len);
+	break;
+    case WS_OP_PONG:
+	break;
+    case WS_OP_CLOSE:
+	conn_send_frame(conn, WS_OP_CLOSE, frame->payload,
+			MIN(frame->len, 2));
+	conn_kill(conn);
+	break;
+    default:
+	conn_close(conn, WS_CLOSE_PROTOCOL);
+	break;
+    }
+}
+
+/**
+ * @brief Process whatever complete handshake or frames are in the
+ * input buffer for \p conn.
+ *
+ * @param conn (conn_t *) The connection to be processed.
+ */
+static void
+conn_process(conn_t *conn)
+{
+    char resp[256];
+    size_t resp_len;
+    size_t off = 0;
+    ssize_t n;
+    ws_frame_t frame;
+
+    if (conn->state == CONN_HANDSHAKE) {
+	n = ws_handshake((char *) conn->in, conn->in_len, BIN_PROTOCOL,
+			 resp, sizeof(resp), &resp_len, &conn->binary);
+	if (n == 0) {
+	    return;
+	}
+	conn_send(conn, resp, resp_len);
+	if (n < 0) {
+	    conn_kill(conn);
+	    return;
+	}
+	conn->state = CONN_OPEN;
+	off = n;
+    }
+    while ((conn->state == CONN_OPEN) && (off < conn->in_len)) {
+	n = ws_parse_frame(conn->in + off, conn->in_len - off, &frame);
+	if (n == 0) {
+	    break;
+	}
+	if (n < 0) {
+	    conn_close(conn, WS_CLOSE_TOO_BIG);
+	    return;
+	}
+	off += n;
+	handle_frame(conn, &frame);
+    }
+    if (conn->state == CONN_DEAD) {
+	return;
+    }
+    if (off) {
+	memmove(conn->in, conn->in + off, conn->in_len - off);
+	conn->in_len -= off;
+    }
+}
+
+/**
+ * @brief Read everything available from the socket for \p conn,
+ * processing it as we go.
+ *
+ * @param conn (conn_t *) The connection to be read.
+ */
+static void
+conn_read(conn_t *conn)
+{
+    ssize_t n;
+
+    for (;;) {
+	n = read(conn->src.fd, conn->in + conn->in_len,
+		 CONN_INBUF_SIZE - conn->in_len);
+	if (n > 0) {
+	    conn->in_len += n;
+	    conn_process(conn);
+	    if (conn->state == CONN_DEAD) {
+		return;
+	    }
+	    if (conn->in_len == CONN_INBUF_SIZE) {
+		/* The buffer is full, yet contains no complete request
+		 * or frame. */
+		conn_close(conn, WS_CLOSE_TOO_BIG);
+		return;
+	    }
+	}
+	else if (n == 0) {
+	    conn_kill(conn);
+	    return;
+	}
+	else if (errno == EINTR) {
+	    continue;
+	}
+	else {
+	    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		conn_kill(conn);
+	    }
+	    return;
+	}
+    }
+}
+
+/**
+ * @brief Handle a single message from a local client.  The first
+ * message decides, as the subprotocol does for websocket clients,
+ * whether the client speaks text or binary: text commands always start
+ * with a printable character, and binary records never do.
+ *
+ * @param conn (conn_t *) The connection on which the message arrived.
+ * @param data (uint8_t *) The message.
+ * @param len (size_t) The length of \p data.
+ */
+static void
+handle_local_message(conn_t *conn, const uint8_t *data, size_t len)
+{
+    if (conn->state == CONN_HANDSHAKE) {
+	conn->binary = data[0] < ' ';
+	conn->state = CONN_OPEN;
+    }
+    if (conn->binary) {
+	handle_binary_message(conn, data, len);
+    }
+    else if (!utf8_valid(data, len)) {
+	conn_kill(conn);
+    }
+    else {
+	handle_text_message(conn, (const char *) data, len);
+    }
+}
+
+/**
+ * @brief Read and handle every message available from the local
+ * socket for \p conn.  Each packet is one message, so there is no
+ * buffering between reads.
+ *
+ * @param conn (conn_t *) The connection to be read.
+ */
+static void
+conn_read_local(conn_t *conn)
+{
+    ssize_t n;
+
+    while (conn->state != CONN_DEAD) {
+	n = recv(conn->src.fd, conn->in, CONN_INBUF_SIZE, 0);
+	if (n > WS_MAX_PAYLOAD) {
+	    conn_kill(conn);
+	}
+	else if (n > 0) {
+	    handle_local_message(conn, conn->in, n);
+	}
+	else if (n == 0) {
+	    conn_kill(conn);
+	}
+	else if (errno != EINTR) {
+	    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		conn_kill(conn);
+	    }
+	    return;
+	}
+    }
+}
+
+/**
+ * @brief Event handler for client connections.
+ */
+static void
+conn_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    conn_t *conn = CONTAINER_OF(src, conn_t, src);
+
+    if (conn->state == CONN_DEAD) {
+	return;
+    }
+    if (events & EPOLLERR) {
+	conn_kill(conn);
+	return;
+    }
+    if (events & EPOLLOUT) {
+	conn_flush(conn);
+    }
+    if ((conn->state != CONN_DEAD) &&
+	(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+    {
+	if (conn->local) {
+	    conn_read_local(conn);
+	}
+	else {
+	    conn_read(conn);
+	}
+    }
+}
+
+/**
+ * @brief Initialise \p conn, for the socket \p fd, as a new connection
+ * awaiting its handshake.  The connection is not added to \p loop.
+ *
+ * @param conn (conn_t *) The connection to be initialised.
+ * @param loop (loop_t *) The loop that will handle the connection.
+ * @param fd (int) The connection's socket.
+ */
+void
+conn_init(conn_t *conn, loop_t *loop, int fd)
+{
+    conn->src.fd = fd;
+    conn->src.handler = conn_handler;
+    conn->loop = loop;
+    conn->state = CONN_HANDSHAKE;
+    conn->local = false;
+    conn->binary = false;
+    conn->zone = 0;
+    conn->zones = 1;
+    conn->owed = 0;
+    conn->next = conn->prev = NULL;
+    conn->in_len = conn->out_off = 0;
+    conn->out_head = conn->out_count = 0;
+    arena_init(&conn->arena, "connection",
+	       conn->arena_mem, sizeof(conn->arena_mem));
+}
+
+/**
+ * @brief Create a connection, from the slab for \p loop, for the newly
+ * accepted socket \p fd.  If the slab is exhausted, the socket is
+ * closed.
+ *
+ * @param loop (loop_t *) The loop that will handle the connection.
+ * @param fd (int) The accepted socket.
+ * @param local (bool) Whether \p fd is on the local socket.
+ */
+static void
+conn_new(loop_t *loop, int fd, bool local)
+{
+    conn_t *conn = loop->free_conns;
+    int one = 1;
+
+    if (!conn) {
+	if (options.verbosity) {
+	    fprintf(stderr, "Warning: connection limit (%d) reached; "
+		    "refusing connection\n", loop->max_conns);
+	}
+	close(fd);
+	return;
+    }
+    loop->free_conns = conn->next;
+    if (!local) {
+	(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    conn_init(conn, loop, fd);
+    conn->local = local;
+    conn->next = loop->conns;
+    if (loop->conns) {
+	loop->conns->prev = conn;
+    }
+    loop->conns = conn;
+    loop->nconns++;
+    loop_add(loop, &conn->src, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    if (options.verbosity > 1) {
+	printf("Connection accepted (%d open)\n", loop->nconns);
+    }
+}
+
+/**
+ * @brief Event handler for the listening sockets.  Accepts all pending
+ * connections.
+ */
+static void
+listener_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    int fd;
+
+    for (;;) {
+	fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd >= 0) {
+	    conn_new(loop, fd, src == &loop->local_listener);
+	}
+	else if ((errno == EINTR) || (errno == ECONNABORTED)) {
+	    continue;
+	}
+	else {
+	    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		fprintf(stderr, "Warning: accept failed: %s\n",
+			strerror(errno));
+	    }
+	    return;
+	}
+    }
+}
+
+/**
+ * @brief Create a listening socket for \p port.  With more than one
+ * worker, the port is opened with SO_REUSEPORT, so that each worker's
+ * loop can have a listening socket of its own on it.
+ *
+ * @param port (int) The port number, or 0 to let the kernel choose.
+ *
+ * @return (int) The socket, or -1 if it could not be created, in which
+ *         case the problem has been reported.
+ */
+int
+server_listen(int port)
+{
+    struct sockaddr_in addr;
+    int fd;
+    int one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	dofail(0, "unable to create socket: %s", strerror(errno));
+	return -1;
+    }
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((options.workers > 1) &&
+	(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0))
+    {
+	dofail(0, "unable to share port %d: %s", port, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	dofail(0, "unable to bind to port %d: %s", port, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
+	dofail(0, "unable to listen on port %d: %s", port, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Create a local listening socket at \p path.  A socket left
+ * behind at \p path by an earlier run is removed first.
+ *
+ * @param path (char *) The path for the socket.
+ *
+ * @return (int) The socket, or -1 if it could not be created, in which
+ *         case the problem has been reported.
+ */
+int
+server_listen_local(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	dofail(0, "socket path %s is too long", path);
+	return -1;
+    }
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+	(void) unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	dofail(0, "unable to create local socket: %s", strerror(errno));
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	dofail(0, "unable to bind to %s: %s", path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
+	dofail(0, "unable to listen on %s: %s", path, strerror(errno));
+	close(fd);
+	(void) unlink(path);
+	return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Make \p fd the listening socket for \p src, closing any
+ * previous one.
+ */
+static void
+set_listener(loop_t *loop, event_source_t *src, int fd)
+{
+    if (src->fd >= 0) {
+	loop_del(loop, src);
+	close(src->fd);
+    }
+    src->fd = fd;
+    src->handler = listener_handler;
+    if (fd >= 0) {
+	loop_add(loop, src, EPOLLIN | EPOLLET);
+    }
+}
+
+/**
+ * @brief Make \p fd the listening socket for \p loop, closing any
+ * previous listener.  Established connections are not affected.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ * @param fd (int) The listening socket, from server_listen().
+ */
+void
+server_set_listener(loop_t *loop, int fd)
+{
+    set_listener(loop, &loop->listener, fd);
+    if (options.verbosity) {
+	printf("Listening on port %d\n", server_port(loop));
+    }
+}
+
+/**
+ * @brief Make \p fd the local listening socket for \p loop, closing
+ * any previous one.  Established connections are not affected.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ * @param fd (int) The listening socket, from server_listen_local(), or
+ *        -1 to stop listening locally.
+ */
+void
+server_set_local_listener(loop_t *loop, int fd)
+{
+    set_listener(loop, &loop->local_listener, fd);
+    local_inherited = false;
+    if (options.verbosity && (fd >= 0)) {
+	printf("Listening on %s\n", options.socket_path);
+    }
+}
+
+/**
+ * @brief Allocate the connection slab for \p loop, and the frame pool,
+ * for options.max_clients connections.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ */
+static void
+server_alloc_slab(loop_t *loop)
+{
+    int i;
+
+    loop->max_conns = MAX(options.max_clients, 1);
+    loop->slab = (conn_t *) MALLOC(loop->max_conns * sizeof(conn_t));
+    loop->free_conns = NULL;
+    for (i = loop->max_conns - 1; i >= 0; i--) {
+	loop->slab[i].next = loop->free_conns;
+	loop->free_conns = &loop->slab[i];
+    }
+    frame_pool_init((options.nzones + 1) * loop->max_conns +
+		    2 * options.nzones);
+}
+
+/**
+ * @brief Take over the listening sockets, if any, passed to us by a
+ * service manager such as systemd.  By its LISTEN_FDS convention, there
+ * are LISTEN_FDS of them, from #LISTEN_FDS_START on, provided that
+ * LISTEN_PID is our pid: otherwise they were meant for some other
+ * process.  A unix domain socket becomes the local listener, and an
+ * internet socket the listener for options.port.  A socket that is not
+ * listening, or is not of the type we would have created (see
+ * server_listen() and server_listen_local()), is reported and left
+ * alone.  The variables are removed from the environment, so that no
+ * child of ours mistakes the sockets for its own.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ *
+ * @return (int) The number of sockets taken over.
+ */
+static int
+server_inherit(loop_t *loop)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    event_source_t *src;
+    socklen_t optlen;
+    int count = 0;
+    int listening;
+    int type;
+    int nfds;
+    int fd;
+
+    if (!pid || !fds || (atol(pid) != getpid()) ||
+	((nfds = atoi(fds)) <= 0))
+    {
+	return 0;
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + nfds; fd++) {
+	len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+	    dofail(0, "inherited descriptor %d is not a socket", fd);
+	    continue;
+	}
+	optlen = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0) {
+	    type = -1;
+	}
+	optlen = sizeof(listening);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+		       &optlen) < 0)
+	{
+	    listening = 0;
+	}
+	if (type != ((addr.ss_family == AF_UNIX) ?
+		     SOCK_SEQPACKET: SOCK_STREAM))
+	{
+	    dofail(0, "inherited socket %d is of the wrong type", fd);
+	    continue;
+	}
+	if (!listening) {
+	    dofail(0, "inherited socket %d is not listening", fd);
+	    continue;
+	}
+	src = (addr.ss_family == AF_UNIX) ?
+	    &loop->local_listener: &loop->listener;
+	if (src->fd >= 0) {
+	    dofail(0, "ignoring extra inherited socket %d", fd);
+	    continue;
+	}
+	/* The service manager may have left them blocking, and open
+	 * across exec. */
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	set_listener(loop, src, fd);
+	count++;
+    }
+    local_inherited = loop->local_listener.fd >= 0;
+    if (options.verbosity) {
+	printf("Inherited %d listening socket%s\n", count,
+	       (count == 1) ? "": "s");
+    }
+    return count;
+}
+
+/**
+ * @brief Allocate the connection slab, take over any sockets passed to
+ * us by socket activation, create the listening sockets, for
+ * options.port and options.socket_path, that were not passed, and
+ * register them with \p loop.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ */
+void
+server_init(loop_t *loop)
+{
+    int fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    server_alloc_slab(loop);
+    status_timer_init(loop);
+    (void) server_inherit(loop);
+    if (loop->listener.fd >= 0) {
+	if (options.verbosity) {
+	    printf("Listening on port %d\n", server_port(loop));
+	}
+    }
+    else if ((fd = server_listen(options.port)) < 0) {
+	dofail(2, "unable to start server");
+    }
+    else {
+	server_set_listener(loop, fd);
+    }
+    if (local_inherited) {
+	if (options.verbosity) {
+	    printf("Listening on inherited local socket\n");
+	}
+    }
+    else if (options.socket_path) {
+	if ((fd = server_listen_local(options.socket_path)) < 0) {
+	    dofail(2, "unable to start server");
+	}
+	server_set_local_listener(loop, fd);
+    }
+}
+
+/**
+ * @brief Allocate the connection slab for the loop of a worker, and
+ * register its listening socket.  Workers do not listen on the local
+ * socket.
+ *
+ * @param loop (loop_t *) The loop that will handle connections.
+ * @param fd (int) The listening socket, from server_listen(), sharing
+ *        its port with the other loops.
+ */
+void
+server_init_worker(loop_t *loop, int fd)
+{
+    server_alloc_slab(loop);
+    status_timer_init(loop);
+    set_listener(loop, &loop->listener, fd);
+}
+
+/**
+ * @brief Return the port number on which \p loop is listening.  This
+ * is useful when options.port is 0, and the kernel has chosen it.
+ *
+ * @param loop (loop_t *) The loop whose listening port we want.
+ *
+ * @return (int) The port number, or -1 if there is no listener.
+ */
+int
+server_port(loop_t *loop)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if ((loop->listener.fd < 0) ||
+	(getsockname(loop->listener.fd,
+		     (struct sockaddr *) &addr, &len) < 0))
+    {
+	return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Return all connections that have been killed since the last
+ * call to the slab.
+ *
+ * @param loop (loop_t *) The loop whose dead connections are to be
+ *        reaped.
+ */
+void
+server_reap(loop_t *loop)
+{
+    conn_t *conn;
+
+    while ((conn = loop->dead)) {
+	loop->dead = conn->next;
+	arena_report(&conn->arena);
+	conn->next = loop->free_conns;
+	loop->free_conns = conn;
+    }
+}
+
+/**
+ * @brief Close all connections and the listening sockets for \p loop,
+ * and free the connection slab and frame pool.
+ *
+ * @param loop (loop_t *) The loop to be shut down.
+ */
+void
+server_shutdown(loop_t *loop)
+{
+    int id;
+
+    while (loop->conns) {
+	conn_close(loop->conns, WS_CLOSE_GOING_AWAY);
+    }
+    server_reap(loop);
+    for (id = 0; id < MAX_ZONES; id++) {
+	status_frames_drop(loop, id);
+    }
+    if (loop->status_timer.fd >= 0) {
+	loop_del(loop, &loop->status_timer);
+	close(loop->status_timer.fd);
+	loop->status_timer.fd = -1;
+	loop->status_armed = false;
+    }
+    if (loop->listener.fd >= 0) {
+	loop_del(loop, &loop->listener);
+	close(loop->listener.fd);
+	loop->listener.fd = -1;
+    }
+    if (loop->local_listener.fd >= 0) {
+	set_listener(loop, &loop->local_listener, -1);
+	if (options.socket_path && !local_inherited) {
+	    (void) unlink(options.socket_path);
+	}
+	local_inherited = false;
+    }
+    free(loop->slab);
+    loop->slab = loop->free_conns = NULL;
+    loop->max_conns = 0;
+    frame_pool_free();
+}
@@ -0,0 +1,152 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * SHA-1 and base64 encoding, as needed for the websocket opening
+ * handshake (RFC 6455 section 4.2.2).  These are only used once per
+ * connection, so they are written for clarity rather than speed.
+ */
+
+#include <string.h>
+#include "volumed.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/**
+ * @brief Process a single 64-byte block of input.
+ *
+ * @param h (uint32_t *) The five words of hash state.
+ * @param block (uint8_t *) The block to be processed.
+ */
+static void
+sha1_block(uint32_t h[5], const uint8_t *block)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	w[i] = ((uint32_t) block[i * 4] << 24) |
+	    ((uint32_t) block[i * 4 + 1] << 16) |
+	    ((uint32_t) block[i * 4 + 2] << 8) |
+	    (uint32_t) block[i * 4 + 3];
+    }
+    for (i = 16; i < 80; i++) {
+	w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5a827999;
+	}
+	else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ed9eba1;
+	}
+	else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8f1bbcdc;
+	}
+	else {
+	    f = b ^ c ^ d;
+	    k = 0xca62c1d6;
+	}
+	t = ROL(a, 5) + f + e + k + w[i];
+	e = d;
+	d = c;
+	c = ROL(b, 30);
+	b = a;
+	a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/**
+ * @brief Compute the SHA-1 digest of \p data.
+ *
+ * @param data (void *) The data to be hashed.
+ * @param len (size_t) The length of \p data in bytes.
+ * @param digest (uint8_t *) Buffer of 20 bytes into which the digest
+ *        will be written.
+ */
+void
+sha1(const void *data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+		     0x10325476, 0xc3d2e1f0};
+    const uint8_t *p = (const uint8_t *) data;
+    uint8_t block[64];
+    uint64_t bits = (uint64_t) len * 8;
+    size_t remaining = len;
+    int i;
+
+    while (remaining >= 64) {
+	sha1_block(h, p);
+	p += 64;
+	remaining -= 64;
+    }
+    memset(block, 0, sizeof(block));
+    memcpy(block, p, remaining);
+    block[remaining] = 0x80;
+    if (remaining >= 56) {
+	sha1_block(h, block);
+	memset(block, 0, sizeof(block));
+    }
+    for (i = 0; i < 8; i++) {
+	block[63 - i] = (uint8_t) (bits >> (i * 8));
+    }
+    sha1_block(h, block);
+
+    for (i = 0; i < 5; i++) {
+	digest[i * 4] = (uint8_t) (h[i] >> 24);
+	digest[i * 4 + 1] = (uint8_t) (h[i] >> 16);
+	digest[i * 4 + 2] = (uint8_t) (h[i] >> 8);
+	digest[i * 4 + 3] = (uint8_t) h[i];
+    }
+}
+
+/**
+ * @brief Base64 encode \p data.
+ *
+ * @param data (uint8_t *) The data to be encoded.
+ * @param len (size_t) The length of \p data in bytes.
+ * @param out (char *) Buffer into which the NUL-terminated result will
+ *        be written.  This must be at least 4 * ((len + 2) / 3) + 1
+ *        bytes long.
+ *
+ * @return (size_t) The length of the encoded string.
+ */
+size_t
+base64_encode(const uint8_t *data, size_t len, char *out)
+{
+    static const char alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *o = out;
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i + 2 < len; i += 3) {
+	v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+	*o++ = alphabet[(v >> 18) & 0x3f];
+	*o++ = alphabet[(v >> 12) & 0x3f];
+	*o++ = alphabet[(v >> 6) & 0x3f];
+	*o++ = alphabet[v & 0x3f];
+    }
+    if (i < len) {
+	v = data[i] << 16;
+	if (i + 1 < len) {
+	    v |= data[i + 1] << 8;
+	}
+	*o++ = alphabet[(v >> 18) & 0x3f];
+	*o++ = alphabet[(v >> 12) & 0x3f];
+	*o++ = (i + 1 < len) ? alphabet[(v >> 6) & 0x3f]: '=';
+	*o++ = '=';
+    }
+    *o = '\0';
+    return o - out;
+}
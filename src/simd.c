@@ -0,0 +1,440 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Vectorised kernels for the two loops that touch every byte a client
+ * sends us: unmasking websocket payloads, and validating that text
+ * payloads are UTF-8.  Each set of kernels is described by a
+ * simd_kernels_t, much as mixer backends are described by a
+ * mixer_ops_t, and the best set that the CPU supports is chosen the
+ * first time either kernel is needed.
+ *
+ * We have:
+ *   - scalar: plain C, working a 64-bit word at a time where it can;
+ *   - sse2 and avx2: for x86, built with function target attributes so
+ *     that no special compiler flags are needed, and chosen according
+ *     to what the CPU reports;
+ *   - neon: for ARM.  On aarch64 NEON is always there; on 32-bit ARM
+ *     the kernels are built, like the x86 ones, with a target
+ *     attribute, so that even a toolchain for CPUs without NEON (such
+ *     as the default armhf one for Raspbian) has them, and they are
+ *     chosen only if the CPU reports NEON.  Soft-float builds, which
+ *     cannot use the NEON registers, do without.
+ *
+ * The UTF-8 kernels use vectors only to skip quickly over runs of
+ * ASCII, which is all that our clients normally send; any block
+ * containing other characters is checked a sequence at a time by the
+ * scalar code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "volumed.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define SIMD_NEON
+#define NEON_TARGET
+#include <arm_neon.h>
+#elif defined(__arm__) && !defined(__SOFTFP__)
+#define SIMD_NEON
+#define NEON_TARGET __attribute__ ((target("fpu=neon")))
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define ASCII_MASK_64 0x8080808080808080ULL
+
+/**
+ * @brief The kernels in use, chosen by simd_init().
+ */
+static const simd_kernels_t *simd = NULL;
+
+
+/**
+ * @brief Return the length of the valid UTF-8 sequence at \p s, or 0
+ * if it is not valid.  Overlong encodings, surrogates and code points
+ * above U+10FFFF are all invalid (RFC 3629).
+ */
+static size_t
+utf8_sequence(const uint8_t *s, size_t len)
+{
+    uint8_t c = s[0];
+
+    if (c < 0x80) {
+	return 1;
+    }
+    if (c < 0xc2) {
+	return 0;		/* Continuation byte, or overlong */
+    }
+    if (c < 0xe0) {
+	return ((len >= 2) && ((s[1] & 0xc0) == 0x80)) ? 2: 0;
+    }
+    if (c < 0xf0) {
+	if ((len < 3) || ((s[1] & 0xc0) != 0x80) ||
+	    ((s[2] & 0xc0) != 0x80) ||
+	    ((c == 0xe0) && (s[1] < 0xa0)) ||
+	    ((c == 0xed) && (s[1] > 0x9f)))
+	{
+	    return 0;
+	}
+	return 3;
+    }
+    if (c < 0xf5) {
+	if ((len < 4) || ((s[1] & 0xc0) != 0x80) ||
+	    ((s[2] & 0xc0) != 0x80) || ((s[3] & 0xc0) != 0x80) ||
+	    ((c == 0xf0) && (s[1] < 0x90)) ||
+	    ((c == 0xf4) && (s[1] > 0x8f)))
+	{
+	    return 0;
+	}
+	return 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check, a sequence at a time, the UTF-8 in \p s from offset
+ * \p i up to at least offset \p end.
+ *
+ * @return (size_t) The offset reached, or 0 if the text is invalid.
+ */
+static size_t
+utf8_check_block(const uint8_t *s, size_t len, size_t i, size_t end)
+{
+    size_t n;
+
+    while (i < end) {
+	if (!(n = utf8_sequence(s + i, len - i))) {
+	    return 0;
+	}
+	i += n;
+    }
+    return i;
+}
+
+/**
+ * @brief Unmask the bytes of \p data from offset \p i, which must be a
+ * multiple of 4, a 64-bit word at a time and then a byte at a time.
+ * The vector kernels use this for whatever is left over after their
+ * last full vector, which for a short command is everything.
+ */
+static void
+unmask_tail(uint8_t *data, size_t len, const uint8_t *mask, size_t i)
+{
+    uint64_t m;
+    uint64_t w;
+
+    memcpy(&m, mask, 4);
+    memcpy((uint8_t *) &m + 4, mask, 4);
+    for (; i + 8 <= len; i += 8) {
+	memcpy(&w, data + i, 8);
+	w ^= m;
+	memcpy(data + i, &w, 8);
+    }
+    for (; i < len; i++) {
+	data[i] ^= mask[i & 3];
+    }
+}
+
+/**
+ * @brief Check the UTF-8 in \p s from offset \p i, skipping ASCII a
+ * 64-bit word at a time.  Like unmask_tail(), this also serves the
+ * vector kernels for what is left after their last full vector.
+ */
+static bool
+utf8_valid_tail(const uint8_t *s, size_t len, size_t i)
+{
+    uint64_t w;
+
+    while (i < len) {
+	if (i + 8 <= len) {
+	    memcpy(&w, s + i, 8);
+	    if (!(w & ASCII_MASK_64)) {
+		i += 8;
+		continue;
+	    }
+	}
+	if (!(i = utf8_check_block(s, len, i, MIN(i + 8, len)))) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static bool
+scalar_supported(void)
+{
+    return true;
+}
+
+static void
+unmask_scalar(uint8_t *data, size_t len, const uint8_t *mask)
+{
+    unmask_tail(data, len, mask, 0);
+}
+
+static bool
+utf8_valid_scalar(const uint8_t *s, size_t len)
+{
+    return utf8_valid_tail(s, len, 0);
+}
+
+#ifdef SIMD_X86
+
+static bool
+sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__ ((target("sse2")))
+static void
+unmask_sse2(uint8_t *data, size_t len, const uint8_t *mask)
+{
+    int32_t m;
+    __m128i vm;
+    __m128i v;
+    size_t i;
+
+    memcpy(&m, mask, 4);
+    vm = _mm_set1_epi32(m);
+    for (i = 0; i + 16 <= len; i += 16) {
+	v = _mm_loadu_si128((const __m128i *) (data + i));
+	_mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(v, vm));
+    }
+    unmask_tail(data, len, mask, i);
+}
+
+__attribute__ ((target("sse2")))
+static bool
+utf8_valid_sse2(const uint8_t *s, size_t len)
+{
+    __m128i v;
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+	v = _mm_loadu_si128((const __m128i *) (s + i));
+	if (!_mm_movemask_epi8(v)) {
+	    i += 16;
+	}
+	else if (!(i = utf8_check_block(s, len, i, i + 16))) {
+	    return false;
+	}
+    }
+    return utf8_valid_tail(s, len, i);
+}
+
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__ ((target("avx2")))
+static void
+unmask_avx2(uint8_t *data, size_t len, const uint8_t *mask)
+{
+    int32_t m;
+    __m256i vm;
+    __m256i v;
+    size_t i;
+
+    memcpy(&m, mask, 4);
+    vm = _mm256_set1_epi32(m);
+    for (i = 0; i + 32 <= len; i += 32) {
+	v = _mm256_loadu_si256((const __m256i *) (data + i));
+	_mm256_storeu_si256((__m256i *) (data + i),
+			    _mm256_xor_si256(v, vm));
+    }
+    /* The compiler does not clear the upper halves of the registers
+     * before a tail call, and the legacy SSE code that follows would
+     * pay dearly for that. */
+    _mm256_zeroupper();
+    unmask_tail(data, len, mask, i);
+}
+
+__attribute__ ((target("avx2")))
+static bool
+utf8_valid_avx2(const uint8_t *s, size_t len)
+{
+    __m256i v;
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+	v = _mm256_loadu_si256((const __m256i *) (s + i));
+	if (!_mm256_movemask_epi8(v)) {
+	    i += 32;
+	}
+	else if (!(i = utf8_check_block(s, len, i, i + 32))) {
+	    return false;
+	}
+    }
+    _mm256_zeroupper();
+    return utf8_valid_tail(s, len, i);
+}
+
+#endif /* SIMD_X86 */
+
+#ifdef SIMD_NEON
+
+static bool
+neon_supported(void)
+{
+#ifdef __aarch64__
+    return true;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+NEON_TARGET
+static void
+unmask_neon(uint8_t *data, size_t len, const uint8_t *mask)
+{
+    uint32_t m;
+    uint8x16_t vm;
+    size_t i;
+
+    memcpy(&m, mask, 4);
+    vm = vreinterpretq_u8_u32(vdupq_n_u32(m));
+    for (i = 0; i + 16 <= len; i += 16) {
+	vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), vm));
+    }
+    unmask_tail(data, len, mask, i);
+}
+
+/**
+ * @brief Return whether any byte of \p v has its top bit set.
+ */
+NEON_TARGET
+static inline bool
+neon_any_high(uint8x16_t v)
+{
+#ifdef __aarch64__
+    return vmaxvq_u8(v) >= 0x80;
+#else
+    uint8x8_t r = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+
+    return (vget_lane_u64(vreinterpret_u64_u8(r), 0) & ASCII_MASK_64) != 0;
+#endif
+}
+
+NEON_TARGET
+static bool
+utf8_valid_neon(const uint8_t *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+	if (!neon_any_high(vld1q_u8(s + i))) {
+	    i += 16;
+	}
+	else if (!(i = utf8_check_block(s, len, i, i + 16))) {
+	    return false;
+	}
+    }
+    return utf8_valid_tail(s, len, i);
+}
+
+#endif /* SIMD_NEON */
+
+/**
+ * @brief All of the kernel sets built into this executable, best
+ * first, terminated by an entry with a NULL name.
+ */
+const simd_kernels_t simd_kernels[] = {
+#ifdef SIMD_X86
+    {"avx2", avx2_supported, unmask_avx2, utf8_valid_avx2},
+    {"sse2", sse2_supported, unmask_sse2, utf8_valid_sse2},
+#endif
+#ifdef SIMD_NEON
+    {"neon", neon_supported, unmask_neon, utf8_valid_neon},
+#endif
+    {"scalar", scalar_supported, unmask_scalar, utf8_valid_scalar},
+    {NULL, NULL, NULL, NULL}
+};
+
+/**
+ * @brief Find the kernel set named \p name.
+ *
+ * @param name (char *) The name of the kernel set.
+ *
+ * @return (simd_kernels_t *) The kernel set, or NULL if there is none
+ *         by that name or the CPU does not support it.
+ */
+const simd_kernels_t *
+simd_find(const char *name)
+{
+    const simd_kernels_t *k;
+
+    for (k = simd_kernels; k->name; k++) {
+	if (strcmp(k->name, name) == 0) {
+	    return k->supported() ? k: NULL;
+	}
+    }
+    return NULL;
+}
+
+/**
+ * @brief Use the kernel set \p kernels or, if that is NULL, the best
+ * that the CPU supports.
+ *
+ * @param kernels (simd_kernels_t *) The kernel set, or NULL.
+ *
+ * @return (simd_kernels_t *) The kernel set now in use.
+ */
+const simd_kernels_t *
+simd_init(const simd_kernels_t *kernels)
+{
+    if (!kernels) {
+	for (kernels = simd_kernels; !kernels->supported(); kernels++) {
+	}
+    }
+    simd = kernels;
+    return simd;
+}
+
+/**
+ * @brief Unmask, in place, the \p len bytes of websocket payload at
+ * \p data, using the 4-byte masking key \p mask.
+ *
+ * @param data (uint8_t *) The payload.
+ * @param len (size_t) The length of \p data.
+ * @param mask (uint8_t *) The masking key.
+ */
+void
+ws_unmask(uint8_t *data, size_t len, const uint8_t *mask)
+{
+    if (!simd) {
+	(void) simd_init(NULL);
+    }
+    simd->unmask(data, len, mask);
+}
+
+/**
+ * @brief Check whether the \p len bytes at \p s are valid UTF-8.
+ *
+ * @param s (uint8_t *) The text.
+ * @param len (size_t) The length of \p s.
+ *
+ * @return (bool) true if \p s is valid UTF-8.
+ */
+bool
+utf8_valid(const uint8_t *s, size_t len)
+{
+    if (!simd) {
+	(void) simd_init(NULL);
+    }
+    return simd->utf8_valid(s, len);
+}
@@ -0,0 +1,275 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Latency statistics.  The command queue timestamps each write at the
+ * stages described by stage_t, and records the time spent in each into
+ * a log-linear histogram.  Recording a value costs a clock read and an
+ * increment: there is no allocation and no sorting, and the histograms
+ * have a fixed size however long the daemon runs.
+ *
+ * Percentiles are read from the histograms, and so are accurate to
+ * within the width of a bucket (12.5%).  The maximum is exact.
+ *
+ * The statistics are returned to clients by the "stats" command, and
+ * are reported on stdout on SIGUSR1.  So is the time that volumed took,
+ * from starting up, to send its first response to a client: with
+ * socket activation and lazy_mixer, this includes everything that the
+ * first client has to wait for.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "volumed.h"
+
+static const char *stage_names[STAGE_COUNT] = {
+    "queue", "mixer", "broadcast", "total"
+};
+
+/**
+ * @brief When volumed started, and when it first sent a response to a
+ * client, by now_us(), or 0 if it has yet to.
+ */
+uint64_t startup_us = 0;
+uint64_t first_response_us = 0;
+
+/**
+ * @brief Return the time, in microseconds, on the monotonic clock.
+ */
+uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Note that a response has been sent to a client.  The first,
+ * after startup_us has been set, is recorded, and reported if verbose.
+ * This may be called from any loop.
+ */
+void
+stats_first_response(void)
+{
+    uint64_t none = 0;
+    uint64_t now;
+
+    if (!startup_us ||
+	__atomic_load_n(&first_response_us, __ATOMIC_RELAXED))
+    {
+	return;
+    }
+    now = now_us();
+    if (__atomic_compare_exchange_n(&first_response_us, &none, now, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+	options.verbosity)
+    {
+	printf("First response %lluus after startup\n",
+	       (unsigned long long) (now - startup_us));
+    }
+}
+
+/**
+ * @brief Return the index of the histogram bucket for \p us.  Values
+ * below #HIST_SUB_BUCKETS have a bucket each; above that, the top
+ * bit of the value picks the octave and the next #HIST_SUB_BITS bits
+ * the bucket within it.
+ */
+static int
+hist_bucket(uint64_t us)
+{
+    int bit;
+
+    if (us >= (1ULL << HIST_MAX_BITS)) {
+	us = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if (us < HIST_SUB_BUCKETS) {
+	return (int) us;
+    }
+    bit = 63 - __builtin_clzll(us);
+    return ((bit - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+	(int) ((us >> (bit - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Return the smallest value recorded in bucket \p idx.  An
+ * \p idx of #HIST_BUCKETS gives the limit of the last bucket.
+ */
+static uint64_t
+hist_bucket_min(int idx)
+{
+    int bit;
+
+    if (idx < HIST_SUB_BUCKETS) {
+	return idx;
+    }
+    bit = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return ((uint64_t) (HIST_SUB_BUCKETS + (idx & (HIST_SUB_BUCKETS - 1))))
+	<< (bit - HIST_SUB_BITS);
+}
+
+/**
+ * @brief Record the latency \p us in \p hist.
+ *
+ * @param hist (histogram_t *) The histogram.
+ * @param us (uint64_t) The latency, in microseconds.
+ */
+void
+hist_record(histogram_t *hist, uint64_t us)
+{
+    hist->buckets[hist_bucket(us)]++;
+    hist->count++;
+    hist->total_us += us;
+    if (us > hist->max_us) {
+	hist->max_us = us;
+    }
+}
+
+/**
+ * @brief Return the \p pct percentile of the values recorded in
+ * \p hist.  This is the largest value that could be in the bucket
+ * holding that percentile, but never more than the largest value
+ * recorded.  The last bucket, which holds everything too large for
+ * the others, gives the largest value recorded.
+ *
+ * @param hist (histogram_t *) The histogram.
+ * @param pct (double) The percentile, from 0 to 100.
+ *
+ * @return (uint64_t) The percentile, in microseconds, or 0 if nothing
+ *         has been recorded.
+ */
+uint64_t
+hist_percentile(const histogram_t *hist, double pct)
+{
+    unsigned long rank;
+    unsigned long seen = 0;
+    int i;
+
+    if (hist->count == 0) {
+	return 0;
+    }
+    rank = (unsigned long) (pct * hist->count / 100.0 + 0.999999);
+    rank = MAX(rank, 1);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += hist->buckets[i];
+	if ((seen >= rank) && (i < HIST_BUCKETS - 1)) {
+	    return MIN(hist_bucket_min(i + 1) - 1, hist->max_us);
+	}
+    }
+    return hist->max_us;
+}
+
+/**
+ * @brief Clear \p stats, and start timing them afresh from now.
+ *
+ * @param stats (stats_t *) The statistics.
+ */
+void
+stats_reset(stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->start_us = now_us();
+}
+
+/**
+ * @brief Return the time, in microseconds, from startup to the first
+ * response, or 0 if there has yet to be one.
+ */
+uint64_t
+stats_startup_time(void)
+{
+    uint64_t first = __atomic_load_n(&first_response_us, __ATOMIC_RELAXED);
+
+    return first ? first - startup_us: 0;
+}
+
+/**
+ * @brief Format \p stats as a JSON object, as returned by the stats
+ * command.  All times are in microseconds.
+ *
+ * @param stats (stats_t *) The statistics.
+ * @param buf (char *) The buffer into which to write the object.
+ * @param size (size_t) The size of \p buf.
+ *
+ * @return (size_t) The length of the object.
+ */
+size_t
+stats_format(const stats_t *stats, char *buf, size_t size)
+{
+    const histogram_t *hist;
+    size_t len;
+    int i;
+
+    len = snprintf(buf, size,
+		   "{\"uptime_s\":%llu,\"first_response_us\":%llu,"
+		   "\"commands\":%lu,\"coalesced\":%lu",
+		   (unsigned long long) ((now_us() - stats->start_us) /
+					 1000000),
+		   (unsigned long long) stats_startup_time(),
+		   stats->commands, stats->coalesced);
+    for (i = 0; (i < STAGE_COUNT) && (len < size); i++) {
+	hist = &stats->stage[i];
+	len += snprintf(buf + len, size - len,
+			",\"%s\":{\"count\":%lu,\"p50\":%llu,\"p99\":%llu,"
+			"\"p999\":%llu,\"max\":%llu}",
+			stage_names[i], hist->count,
+			(unsigned long long) hist_percentile(hist, 50),
+			(unsigned long long) hist_percentile(hist, 99),
+			(unsigned long long) hist_percentile(hist, 99.9),
+			(unsigned long long) hist->max_us);
+    }
+    if (len < size) {
+	len += snprintf(buf + len, size - len, "}");
+    }
+    return MIN(len, size - 1);
+}
+
+/**
+ * @brief Report \p stats, in human-readable form, on \p out.  Each
+ * stage is summarised on a line of its own; with a verbosity of more
+ * than 1, the non-empty buckets of each histogram are listed too.
+ *
+ * @param stats (stats_t *) The statistics.
+ * @param out (FILE *) The stream to which to report.
+ */
+void
+stats_report(const stats_t *stats, FILE *out)
+{
+    const histogram_t *hist;
+    int i;
+    int b;
+
+    fprintf(out, "Statistics for the last %llus: %lu commands, "
+	    "%lu coalesced\n",
+	    (unsigned long long) ((now_us() - stats->start_us) / 1000000),
+	    stats->commands, stats->coalesced);
+    for (i = 0; i < STAGE_COUNT; i++) {
+	hist = &stats->stage[i];
+	fprintf(out, "  %-9s %8lu: p50 %lluus, p99 %lluus, p999 %lluus, "
+		"max %lluus, mean %lluus\n", stage_names[i], hist->count,
+		(unsigned long long) hist_percentile(hist, 50),
+		(unsigned long long) hist_percentile(hist, 99),
+		(unsigned long long) hist_percentile(hist, 99.9),
+		(unsigned long long) hist->max_us,
+		(unsigned long long) (hist->count ?
+				      hist->total_us / hist->count: 0));
+	if (options.verbosity > 1) {
+	    for (b = 0; b < HIST_BUCKETS; b++) {
+		if (hist->buckets[b]) {
+		    fprintf(out, "    %10llu..%-10llu %8u\n",
+			    (unsigned long long) hist_bucket_min(b),
+			    (unsigned long long) hist_bucket_min(b + 1) - 1,
+			    hist->buckets[b]);
+		}
+	    }
+	}
+    }
+    fflush(out);
+}
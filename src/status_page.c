@@ -0,0 +1,293 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The status page.  If status_page is set, volumed publishes the state
+ * of every zone in a small file, typically under /run, which local
+ * readers (moode's PHP, status bars, volumec status) map into memory.
+ * A reader then has the current state without a socket, a round trip,
+ * or waking volumed at all.
+ *
+ * The file holds a single status_page_t.  Its layout, in host byte
+ * order, is:
+ *
+ *     offset  size
+ *          0     4  magic, "VOLS" (0x564f4c53)
+ *          4     4  version, 1
+ *          8     4  seq, the seqlock sequence
+ *         12     4  pid of volumed
+ *         16     8  generation, incremented on every update
+ *         24     4  nzones
+ *         28     4  zone, the zone most recently updated
+ *         32  8 * 8 volume (int32) and mute (uint32, 0 or 1) for each
+ *                   of up to 8 zones
+ *
+ * The page is protected by a seqlock, so that volumed, the only writer,
+ * never waits for readers, and readers never block it.  The writer
+ * makes seq odd, updates the page and makes seq even again.  A reader
+ * reads seq, then the fields it wants, then seq once more: if the two
+ * are equal and even, nothing changed under it; otherwise it tries
+ * again.  A reader in another language can do the same, provided it
+ * reads seq before and after the fields, and does not rely on a torn
+ * read being impossible.
+ *
+ * The page is created under a temporary name and renamed into place,
+ * so that a reader never sees it half-initialised, and is removed when
+ * volumed exits cleanly.  A reader that wants to know whether volumed
+ * is still running can check pid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "volumed.h"
+
+/**
+ * @brief The page being written, or NULL, and its path, allocated from
+ * #process_arena.
+ */
+static status_page_t *page = NULL;
+static char *page_path = NULL;
+
+
+/**
+ * @brief Create the status page at \p path, replacing any page left by
+ * an earlier run, for the #nzones zones.  The state of each zone must
+ * then be recorded with status_page_update().
+ *
+ * @param path (char *) The path of the page.
+ *
+ * @return (bool) true if the page was created.  If not, the problem
+ *         has been reported.
+ */
+bool
+status_page_open(const char *path)
+{
+    char tmp[PATH_MAX];
+    void *mem;
+    int fd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+	dofail(0, "status page path %s is too long", path);
+	return false;
+    }
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	dofail(0, "unable to create status page %s: %s",
+	       tmp, strerror(errno));
+	return false;
+    }
+    if (ftruncate(fd, sizeof(status_page_t)) < 0) {
+	dofail(0, "unable to size status page %s: %s", tmp, strerror(errno));
+	goto fail;
+    }
+    mem = mmap(NULL, sizeof(status_page_t), PROT_READ | PROT_WRITE,
+	       MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+	dofail(0, "unable to map status page %s: %s", tmp, strerror(errno));
+	goto fail;
+    }
+    page = (status_page_t *) mem;
+    page->magic = STATUS_PAGE_MAGIC;
+    page->version = STATUS_PAGE_VERSION;
+    page->pid = getpid();
+    page->nzones = nzones;
+    if (rename(tmp, path) < 0) {
+	dofail(0, "unable to rename status page to %s: %s",
+	       path, strerror(errno));
+	munmap(mem, sizeof(status_page_t));
+	page = NULL;
+	goto fail;
+    }
+    close(fd);
+    page_path = arena_strdup(process_arena, path);
+    return true;
+
+fail:
+    close(fd);
+    (void) unlink(tmp);
+    return false;
+}
+
+/**
+ * @brief Record the current state of \p zone in the status page, if
+ * there is one.
+ *
+ * @param zone (zone_t *) The zone.
+ */
+void
+status_page_update(const zone_t *zone)
+{
+    uint32_t seq;
+
+    if (!page) {
+	return;
+    }
+    seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    /* Readers must see the odd seq before any of the changes. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&page->zones[zone->id].volume, zone->state->volume,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&page->zones[zone->id].mute, zone->state->mute ? 1: 0,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&page->zone, zone->id, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->generation, page->generation + 1,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Remove the status page, if there is one.
+ */
+void
+status_page_close(void)
+{
+    if (!page) {
+	return;
+    }
+    munmap(page, sizeof(status_page_t));
+    (void) unlink(page_path);
+    page = NULL;
+    page_path = NULL;
+}
+
+/**
+ * @brief Map the status page at \p path, for reading.
+ *
+ * @param path (char *) The path of the page.
+ *
+ * @return (status_page_t *) The page, or NULL if it could not be
+ *         mapped or is not a status page of this version.
+ */
+const status_page_t *
+status_page_map(const char *path)
+{
+    status_page_t *mapped;
+    struct stat st;
+    void *mem;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+	return NULL;
+    }
+    if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(status_page_t))) {
+	close(fd);
+	return NULL;
+    }
+    mem = mmap(NULL, sizeof(status_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+	return NULL;
+    }
+    mapped = (status_page_t *) mem;
+    if ((mapped->magic != STATUS_PAGE_MAGIC) ||
+	(mapped->version != STATUS_PAGE_VERSION))
+    {
+	munmap(mem, sizeof(status_page_t));
+	return NULL;
+    }
+    return mapped;
+}
+
+/**
+ * @brief Copy a consistent snapshot of \p page into \p copy.  If the
+ * page is being written, we try again, yielding the CPU to the writer
+ * between attempts.
+ *
+ * @param page (status_page_t *) The page, from status_page_map().
+ * @param copy (status_page_t *) The snapshot.
+ *
+ * @return (bool) false if no consistent snapshot could be had in
+ *         #STATUS_PAGE_RETRIES attempts, as when volumed has died in
+ *         the middle of an update.
+ */
+bool
+status_page_snapshot(const status_page_t *page, status_page_t *copy)
+{
+    uint32_t seq;
+    int tries;
+    int i;
+
+    for (tries = 0; tries < STATUS_PAGE_RETRIES; tries++) {
+	seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+	    sched_yield();
+	    continue;
+	}
+	copy->pid = __atomic_load_n(&page->pid, __ATOMIC_RELAXED);
+	copy->generation = __atomic_load_n(&page->generation,
+					   __ATOMIC_RELAXED);
+	copy->nzones = __atomic_load_n(&page->nzones, __ATOMIC_RELAXED);
+	copy->zone = __atomic_load_n(&page->zone, __ATOMIC_RELAXED);
+	for (i = 0; i < MAX_ZONES; i++) {
+	    copy->zones[i].volume =
+		__atomic_load_n(&page->zones[i].volume, __ATOMIC_RELAXED);
+	    copy->zones[i].mute =
+		__atomic_load_n(&page->zones[i].mute, __ATOMIC_RELAXED);
+	}
+	/* The fields must all be read before seq is checked again. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+	    copy->magic = page->magic;
+	    copy->version = page->version;
+	    copy->seq = seq;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/**
+ * @brief Read the state of zone \p zone from \p page.
+ *
+ * @param page (status_page_t *) The page, from status_page_map().
+ * @param zone (int) The zone id.
+ * @param state (volume_state_t *) The zone's state.
+ * @param p_generation (uint64_t *) If not NULL, the page's generation
+ *        at the time of the read.  This changes with every update, so
+ *        a reader that polls can tell cheaply whether anything has.
+ *
+ * @return (bool) false if there is no such zone, or the page could not
+ *         be read.
+ */
+bool
+status_page_read(const status_page_t *page, int zone,
+		 volume_state_t *state, uint64_t *p_generation)
+{
+    status_page_t copy;
+
+    if (!status_page_snapshot(page, &copy) ||
+	(zone < 0) || (zone >= copy.nzones))
+    {
+	return false;
+    }
+    state->volume = copy.zones[zone].volume;
+    state->mute = copy.zones[zone].mute != 0;
+    if (p_generation) {
+	*p_generation = copy.generation;
+    }
+    return true;
+}
+
+/**
+ * @brief Unmap \p page.
+ *
+ * @param page (status_page_t *) The page, from status_page_map().
+ */
+void
+status_page_unmap(const status_page_t *page)
+{
+    munmap((void *) page, sizeof(status_page_t));
+}
@@ -0,0 +1,149 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The volume curve.  Volume percentages, as seen by clients, are mapped
+ * onto raw mixer values through a table built from the mixer's range
+ * and the volcurve and max_pct settings.  All of the floating point
+ * work happens when the table is built; converting a percentage when
+ * handling a command is a single array index.
+ *
+ * The max_pct setting caps the volume: a request for 100% is treated
+ * as a request for max_pct% of the mixer's range, and every other
+ * percentage is scaled to match.
+ *
+ * With volcurve disabled, percentages map linearly onto the raw range.
+ * With it enabled, we follow the mapping used by alsamixer: controls
+ * with a dB range of more than 24dB are mapped so that equal steps in
+ * percentage give roughly equal steps in perceived loudness; controls
+ * with a smaller dB range are mapped linearly; and controls with no dB
+ * information at all are given a cubic curve, which approximates the
+ * same thing.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "volumed.h"
+
+#define MAX_LINEAR_DB_SCALE 2400   /* Hundredths of a dB */
+
+
+/**
+ * @brief Get the raw value for \p db on mixer \p m.
+ */
+static long
+db_to_raw(mixer_t *m, long db)
+{
+    long raw;
+
+    if (m->ops && m->ops->db_to_raw && m->ops->db_to_raw(m, db, &raw)) {
+	return raw;
+    }
+    return m->min + (long) ceil((double) (db - m->min_db) *
+				(m->max - m->min) / (m->max_db - m->min_db));
+}
+
+/**
+ * @brief Build, if necessary, the table mapping percentages to raw
+ * values for mixer \p m.
+ *
+ * @param curve (volcurve_t *) The table to be built.
+ * @param m (mixer_t *) The mixer, whose range must already be known.
+ * @param volcurve (bool) Whether to use a volume curve, rather than a
+ *        linear mapping.
+ * @param max_pct (int) The maximum volume, as a percentage of the
+ *        mixer's range.
+ *
+ * @return (bool) true if the table was (re)built, false if it was
+ *         already built for these settings.
+ */
+bool
+volcurve_build(volcurve_t *curve, mixer_t *m, bool volcurve, int max_pct)
+{
+    long range = m->max - m->min;
+    long db_range = m->max_db - m->min_db;
+    double min_norm;
+    double frac;
+    double db;
+    long raw;
+    int pct;
+
+    max_pct = MAX(0, MIN(max_pct, 100));
+    if (curve->builds && (curve->volcurve == volcurve) &&
+	(curve->max_pct == max_pct))
+    {
+	return false;
+    }
+    curve->volcurve = volcurve;
+    curve->max_pct = max_pct;
+    curve->has_db = m->has_db;
+    curve->builds++;
+    min_norm = m->has_db ? pow(10, -(double) db_range / 6000): 0;
+
+    for (pct = 0; pct < VOLCURVE_STEPS; pct++) {
+	frac = (double) pct * max_pct / 10000;
+	if (!volcurve || (m->has_db && (db_range <= MAX_LINEAR_DB_SCALE))) {
+	    raw = m->min + lround(range * frac);
+	    db = m->min_db + (double) db_range * frac;
+	}
+	else if (m->has_db) {
+	    db = (pct == 0) ? m->min_db:
+		6000 * log10(frac * (1 - min_norm) + min_norm) + m->max_db;
+	    raw = db_to_raw(m, lround(db));
+	}
+	else {
+	    raw = m->min + lround(range * frac * frac * frac);
+	    db = 0;
+	}
+	raw = MAX(m->min, MIN(raw, m->max));
+	if ((pct > 0) && (raw < curve->raw[pct - 1])) {
+	    raw = curve->raw[pct - 1];
+	}
+	curve->raw[pct] = raw;
+	curve->db[pct] = lround(db);
+    }
+    if (options.verbosity > 1) {
+	printf("Volume curve (%s, max %d%%): raw %ld..%ld\n",
+	       volcurve ? "curved": "linear", max_pct,
+	       curve->raw[0], curve->raw[VOLCURVE_STEPS - 1]);
+    }
+    return true;
+}
+
+/**
+ * @brief Find the percentage whose raw value is nearest to \p raw.
+ *
+ * @param curve (volcurve_t *) The table.
+ * @param raw (long) The raw mixer value.
+ *
+ * @return (int) The percentage.
+ */
+int
+volcurve_pct(const volcurve_t *curve, long raw)
+{
+    int lo = 0;
+    int hi = VOLCURVE_STEPS - 1;
+    int mid;
+
+    if (raw > curve->raw[hi]) {
+	return hi;
+    }
+    /* Find the first entry that is >= raw. */
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (curve->raw[mid] < raw) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+    if ((lo > 0) && (raw - curve->raw[lo - 1] < curve->raw[lo] - raw)) {
+	lo--;
+    }
+    return lo;
+}
@@ -0,0 +1,263 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * volume-config-moode: the moode-specific volumed client.  It runs as a
+ * daemon, listening for volumed's status broadcasts and recording each
+ * volume and mute change in the moode database, so that moode's web UI
+ * shows the same state as volumed.
+ *
+ * Writes to the database are debounced and batched, as described in
+ * moode.c, so that a sweep of the volume knob costs one transaction
+ * rather than one for each step.  Any pending state is written before
+ * we exit on SIGINT or SIGTERM.
+ *
+ * Like volumec, we read volumed's config file to find its port and
+ * local socket, and use the local socket if there is one.  If volumed
+ * goes away, we keep trying to reconnect.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include "volumed.h"
+
+#define DEFAULT_HOST      "localhost"
+
+/**
+ * @brief The path of the moode database.
+ */
+static char *db_path = MOODE_DB;
+
+/**
+ * @brief Our connection to volumed.
+ */
+static client_t client = {-1};
+
+/**
+ * @brief The moode database, and the state waiting to be written to it.
+ */
+static moode_db_t moode;
+
+
+static void
+usage(int exitcode)
+{
+    fprintf(stderr,
+	    "usage: %s [-v | --verbose] [(-c | --config) config-file]\n"
+	    "        [(-d | --database) moode-db] [-V | --version]\n"
+	    "    config-file: volumed's configuration file, from which the\n"
+	    "                 port and socket path are read (default - "
+	    "\"%s\");\n"
+	    "    moode-db:    the moode database (default - %s).\n"
+	    "\n", progname, CONFIG_FILE, MOODE_DB);
+    closedown(exitcode);
+}
+
+static void
+process_moode_args(int argc, char **argv)
+{
+    struct option option_defs[] = {
+	{"config", required_argument, NULL, 'c'},
+	{"database", required_argument, NULL, 'd'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"version", no_argument, NULL, 'V'},
+	{NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while ((c = getopt_long(argc, argv, "c:d:vV", option_defs, NULL)) != -1) {
+	switch (c) {
+	case 'c':
+	    options.config_filename = optarg;
+	    break;
+	case 'd':
+	    db_path = optarg;
+	    break;
+	case 'v':
+	    options.verbosity++;
+	    break;
+	case 'V':
+	    printf("%s - volumed moode client, version: %s\n%s\n%s\n\n",
+		   progname, VERSION, COPYRIGHT, WARRANTY);
+	    closedown(0);
+	    break;
+	default:
+	    usage(2);
+	    break;
+	}
+    }
+    if (optind < argc) {
+	usage(2);
+    }
+}
+
+/**
+ * @brief Return the time, in milliseconds, on the monotonic clock.
+ */
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Connect to volumed, and ask for its current state so that the
+ * database is brought up to date with any changes made while we were
+ * not connected.
+ */
+static bool
+connect_volumed(void)
+{
+    command_t cmd = {CMD_STATUS, 0};
+
+    if (!client_open(&client, DEFAULT_HOST, options.port,
+		     options.socket_path))
+    {
+	return false;
+    }
+    if (options.verbosity) {
+	fprintf(stderr, "Connected to volumed\n");
+    }
+    (void) client_queue_command(&client, &cmd);
+    if (!client_flush(&client)) {
+	client_close(&client);
+	return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Record a status message from volumed.  Anything else is
+ * ignored.
+ */
+static void
+record_status(const char *msg, size_t len, void *arg)
+{
+    volume_state_t state;
+
+    if (parse_status(msg, len, &state)) {
+	moode_record(&moode, &state, now_ms());
+    }
+}
+
+/**
+ * @brief Block SIGINT and SIGTERM, and return a signalfd through which
+ * they will be delivered instead, so that we can flush the database
+ * before exiting.
+ */
+static int
+setup_signals(void)
+{
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+	dofail(2, "unable to block signals: %s", strerror(errno));
+    }
+    if ((fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+	dofail(2, "unable to create signalfd: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * @brief Record volumed's status changes until we receive a signal.
+ *
+ * @param sigfd (int) The signalfd from setup_signals().
+ */
+static void
+run(int sigfd)
+{
+    struct pollfd pfds[2];
+    uint64_t retry = 0;
+    uint64_t now;
+    int timeout;
+    int wait;
+
+    for (;;) {
+	now = now_ms();
+	if ((client.fd < 0) && (now >= retry) && !connect_volumed()) {
+	    retry = now + MOODE_RETRY_MS;
+	}
+	if (moode_timeout(&moode, now) == 0) {
+	    (void) moode_flush(&moode, now);
+	}
+	timeout = moode_timeout(&moode, now);
+	if (client.fd < 0) {
+	    wait = (retry > now) ? (int) (retry - now): 0;
+	    if ((timeout < 0) || (wait < timeout)) {
+		timeout = wait;
+	    }
+	}
+	pfds[0].fd = sigfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = client.fd;
+	pfds[1].events = POLLIN;
+	if ((poll(pfds, 2, timeout) < 0) && (errno != EINTR)) {
+	    dofail(2, "poll failed: %s", strerror(errno));
+	}
+	if (pfds[0].revents) {
+	    return;
+	}
+	if ((client.fd >= 0) && pfds[1].revents &&
+	    (client_read(&client, record_status, NULL) < 0))
+	{
+	    fprintf(stderr, "Warning: connection to volumed lost\n");
+	    client_close(&client);
+	    retry = now_ms() + MOODE_RETRY_MS;
+	}
+    }
+}
+
+/**
+ * @brief Main entry point to volume-config-moode.
+ *
+ * @param argc (int) The number of arguments passed to us.
+ * @param argv (char **) The array of command line arguments.
+ */
+int
+main(int argc, char **argv)
+{
+    int sigfd;
+
+    process_arena = arena_new("process", PROCESS_ARENA_CHUNK);
+    progname = arena_strdup(process_arena, argv[0]);
+    process_moode_args(argc, argv);
+    read_config_file();
+    sigfd = setup_signals();
+    if (!moode_open(&moode, db_path)) {
+	closedown(2);
+    }
+    run(sigfd);
+
+    /* Write whatever is still pending, without waiting for its debounce
+     * period to expire. */
+    (void) moode_flush(&moode, now_ms());
+    if (options.verbosity) {
+	fprintf(stderr, "Changes seen: %lu, transactions: %lu\n",
+		moode.changes, moode.transactions);
+    }
+    moode_close(&moode);
+    client_close(&client);
+    close(sigfd);
+    closedown(0);
+    return 0;
+}
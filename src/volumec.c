@@ -0,0 +1,744 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * volumec: the volumed client.  It runs:
+ *   - as a command line tool: "volumec up 5" sends a single command and
+ *     prints volumed's reply;
+ *   - interactively, reading commands from stdin and printing replies;
+ *   - as an interface from a named pipe ("volumec -f fifo"), so that
+ *     scripts and other programs can control the volume simply by
+ *     writing commands, one per line, to the pipe;
+ *   - as an lirc client daemon ("volumec -l"), turning remote control
+ *     button presses from lircd into commands (see lirc.c).
+ *
+ * When reading from stdin or a pipe, input is read in large chunks,
+ * each of which may hold many commands, and the commands are collapsed
+ * (see cmd_batch_t) before being sent.  Commands are pipelined over a
+ * single connection rather than each waiting for its reply.  Input is
+ * read as fast as it arrives, whether or not volumed is keeping up, so
+ * that writers to the pipe are never blocked: while the connection is
+ * busy, new commands are folded into the pending batch.
+ *
+ * In lirc mode, commands are sent at no more than a fixed rate, those
+ * arising in between being folded into the pending batch, so that a
+ * held button cannot flood volumed.  As the rate interval is shorter
+ * than lircd's repeat interval, and nothing is queued beyond the
+ * pending batch, the volume stops changing within one repeat interval
+ * of the button being released.
+ *
+ * volumec reads volumed's config file to find its port and local
+ * socket, and uses the local socket if there is one.  If volumed
+ * publishes a status page (see status_page.c), "volumec status" reads
+ * the status from that, without connecting at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "volumed.h"
+
+#define DEFAULT_HOST      "localhost"
+#define REPLY_TIMEOUT_MS  2000
+#define LINGER_MS         200
+#define FIFO_MODE         0660
+
+/**
+ * @brief The host on which volumed is running.
+ */
+static char *host = DEFAULT_HOST;
+
+/**
+ * @brief The port given on the command line, or 0.  Like the socket
+ * path, this overrides the config file.
+ */
+static int port_arg = 0;
+
+/**
+ * @brief The local socket given on the command line, or NULL.
+ */
+static char *socket_arg = NULL;
+
+/**
+ * @brief Whether the websocket, rather than the local socket, has been
+ * asked for on the command line.
+ */
+static bool use_websocket = false;
+
+/**
+ * @brief The named pipe from which commands are to be read, or NULL.
+ */
+static char *fifo_path = NULL;
+
+/**
+ * @brief Whether we are to run as an lirc client daemon.
+ */
+static bool lirc_mode = false;
+
+/**
+ * @brief The path of lircd's socket.
+ */
+static char *lircd_path = LIRCD_SOCKET;
+
+/**
+ * @brief The lircd button names for volume up, volume down and mute.
+ */
+static char *lirc_keys = LIRC_DEFAULT_KEYS;
+
+/**
+ * @brief The maximum rate, in commands per second, at which commands
+ * from lirc are sent.
+ */
+static int lirc_rate = LIRC_DEFAULT_RATE;
+
+/**
+ * @brief Our connection to volumed.
+ */
+static client_t client = {-1};
+
+/**
+ * @brief Commands read but not yet sent.
+ */
+static cmd_batch_t batch;
+
+/**
+ * @brief Input read but not yet parsed: the start of a command whose
+ * newline has not yet arrived.
+ */
+static struct {
+    size_t len;
+    char   buf[INGEST_BUFFER_SIZE];
+} input;
+
+/**
+ * @brief Counts, for the summary shown when verbose.
+ */
+static unsigned long commands_read = 0;
+static unsigned long commands_sent = 0;
+static unsigned long commands_invalid = 0;
+
+
+static void
+usage(int exitcode)
+{
+    fprintf(stderr,
+	    "usage: %s [-v | --verbose] [(-c | --config) config-file]\n"
+	    "        [(-H | --host) host] [(-p | --port) port-number]\n"
+	    "        [(-s | --socket) socket-path] [(-f | --fifo) fifo]\n"
+	    "        [-l | --lirc] [(-L | --lircd) lircd-socket]\n"
+	    "        [(-k | --keys) up,down,mute] [(-r | --rate) rate]\n"
+	    "        [-V | --version] [command]\n"
+	    "    config-file: volumed's configuration file, from which the\n"
+	    "                 port and socket path are read (default - "
+	    "\"%s\");\n"
+	    "    host:        the host on which volumed runs "
+	    "(default - %s);\n"
+	    "    socket-path: volumed's local socket, which is used in\n"
+	    "                 preference to the port if it is configured;\n"
+	    "    fifo:        a named pipe from which to read commands;\n"
+	    "    -l:          run as an lirc client daemon;\n"
+	    "    lircd-socket: the socket on which lircd reports events\n"
+	    "                 (default - %s);\n"
+	    "    up,down,mute: the lirc button names (default - %s);\n"
+	    "    rate:        the maximum rate at which lirc commands are\n"
+	    "                 sent, per second (default - %d).  Below about\n"
+	    "                 10, the volume may not stop promptly when a\n"
+	    "                 button is released;\n"
+	    "    command:     a single command to send; without this, a\n"
+	    "                 fifo, or -l, commands are read from stdin.\n"
+	    "\n", progname, CONFIG_FILE, DEFAULT_HOST, LIRCD_SOCKET,
+	    LIRC_DEFAULT_KEYS, LIRC_DEFAULT_RATE);
+    closedown(exitcode);
+}
+
+static void
+process_volumec_args(int argc, char **argv)
+{
+    struct option option_defs[] = {
+	{"config", required_argument, NULL, 'c'},
+	{"fifo", required_argument, NULL, 'f'},
+	{"host", required_argument, NULL, 'H'},
+	{"keys", required_argument, NULL, 'k'},
+	{"lirc", no_argument, NULL, 'l'},
+	{"lircd", required_argument, NULL, 'L'},
+	{"port", required_argument, NULL, 'p'},
+	{"rate", required_argument, NULL, 'r'},
+	{"socket", required_argument, NULL, 's'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"version", no_argument, NULL, 'V'},
+	{NULL, 0, NULL, 0}
+    };
+    int c;
+
+    /* Stop at the first non-option, so that "volumec down 5" is not
+     * mistaken for options. */
+    while ((c = getopt_long(argc, argv, "+c:f:H:k:lL:p:r:s:vV",
+			    option_defs, NULL)) != -1)
+    {
+	switch (c) {
+	case 'c':
+	    options.config_filename = optarg;
+	    break;
+	case 'f':
+	    fifo_path = optarg;
+	    break;
+	case 'H':
+	    host = optarg;
+	    use_websocket = true;
+	    break;
+	case 'p':
+	    port_arg = atoi(optarg);
+	    if ((port_arg <= 0) || (port_arg > 65535)) {
+		dofail(2, "port must be a number in the range 1 .. 65535");
+	    }
+	    use_websocket = true;
+	    break;
+	case 'k':
+	    lirc_keys = optarg;
+	    break;
+	case 'l':
+	    lirc_mode = true;
+	    break;
+	case 'L':
+	    lircd_path = optarg;
+	    break;
+	case 'r':
+	    lirc_rate = atoi(optarg);
+	    if ((lirc_rate <= 0) || (lirc_rate > 1000)) {
+		dofail(2, "rate must be a number in the range 1 .. 1000");
+	    }
+	    break;
+	case 's':
+	    socket_arg = optarg;
+	    break;
+	case 'v':
+	    options.verbosity++;
+	    break;
+	case 'V':
+	    printf("%s - volumed client, version: %s\n%s\n%s\n\n",
+		   progname, VERSION, COPYRIGHT, WARRANTY);
+	    closedown(0);
+	    break;
+	default:
+	    usage(2);
+	    break;
+	}
+    }
+}
+
+/**
+ * @brief Connect to volumed, using the local socket unless a host or
+ * port has been given on the command line.
+ */
+static bool
+connect_volumed(void)
+{
+    const char *path = options.socket_path;
+
+    if (use_websocket) {
+	path = NULL;
+    }
+    if (!client_open(&client, host, options.port, path)) {
+	return false;
+    }
+    if (options.verbosity) {
+	if (path) {
+	    fprintf(stderr, "Connected to %s\n", path);
+	}
+	else {
+	    fprintf(stderr, "Connected to %s:%d\n", host, options.port);
+	}
+    }
+    return true;
+}
+
+/**
+ * @brief Print a message received from volumed.
+ */
+static void
+print_reply(const char *msg, size_t len, void *arg)
+{
+    printf("%.*s\n", (int) len, msg);
+    fflush(stdout);
+}
+
+/**
+ * @brief Note that the connection to volumed has been lost.  In fifo
+ * mode we reconnect when there is next something to send.
+ */
+static void
+connection_lost(void)
+{
+    fprintf(stderr, "Warning: connection to volumed lost\n");
+    client_close(&client);
+}
+
+/**
+ * @brief Send the pending batch of commands, unless the connection is
+ * still busy with the last, in which case the batch continues to
+ * collect commands until it can be sent.
+ */
+static void
+send_batch(void)
+{
+    command_t cmds[BATCH_MAX_COMMANDS];
+    int n;
+    int i;
+
+    if (batch_empty(&batch) || client_pending(&client)) {
+	return;
+    }
+    if ((client.fd < 0) && !connect_volumed()) {
+	fprintf(stderr, "Warning: %lu command(s) discarded\n",
+		batch.commands);
+	batch_init(&batch);
+	return;
+    }
+    n = batch_commands(&batch, cmds);
+    for (i = 0; i < n; i++) {
+	(void) client_queue_command(&client, &cmds[i]);
+    }
+    commands_sent += n;
+    batch_init(&batch);
+    if (!client_flush(&client)) {
+	connection_lost();
+    }
+}
+
+/**
+ * @brief Return the time, in milliseconds, on the monotonic clock.
+ */
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Parse what has been read into #input, folding complete
+ * commands, or lircd events if \p lirc is not NULL, into #batch.
+ */
+static void
+parse_input(lirc_t *lirc)
+{
+    size_t used;
+    unsigned long before = batch.commands;
+    unsigned long invalid = batch.invalid;
+
+    if (lirc) {
+	used = lirc_feed(lirc, input.buf, input.len, now_ms(), &batch);
+    }
+    else {
+	used = batch_parse(&batch, input.buf, input.len);
+    }
+    if ((used == 0) && (input.len == sizeof(input.buf))) {
+	/* A line too long to be any command. */
+	batch.invalid++;
+	used = input.len;
+    }
+    memmove(input.buf, input.buf + used, input.len - used);
+    input.len -= used;
+    commands_read += batch.commands - before;
+    if (batch.invalid != invalid) {
+	commands_invalid += batch.invalid - invalid;
+	fprintf(stderr, "Warning: %lu invalid command(s) ignored\n",
+		batch.invalid - invalid);
+	batch.invalid = invalid;
+    }
+}
+
+/**
+ * @brief Read everything available from \p fd, without blocking.
+ *
+ * @param fd (int) The descriptor from which to read.
+ * @param lirc (lirc_t *) The lirc state, if \p fd is lircd's socket,
+ *        or NULL if it provides commands.
+ *
+ * @return (bool) false at end of file.
+ */
+static bool
+read_input(int fd, lirc_t *lirc)
+{
+    ssize_t n;
+
+    for (;;) {
+	n = read(fd, input.buf + input.len, sizeof(input.buf) - input.len);
+	if (n > 0) {
+	    input.len += n;
+	    parse_input(lirc);
+	}
+	else if (n == 0) {
+	    if (input.len) {
+		/* An unterminated last line. */
+		input.buf[input.len++] = '\n';
+		parse_input(lirc);
+	    }
+	    return false;
+	}
+	else if (errno != EINTR) {
+	    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		dofail(0, "error reading commands: %s", strerror(errno));
+		return false;
+	    }
+	    return true;
+	}
+    }
+}
+
+/**
+ * @brief Read commands from \p fd until end of file, sending them to
+ * volumed as described at the top of this file.
+ *
+ * @param fd (int) The non-blocking descriptor from which to read.
+ * @param show (bool) Whether to print volumed's replies.
+ */
+static void
+run_commands(int fd, bool show)
+{
+    struct pollfd pfds[2];
+    bool eof = false;
+    int timeout;
+    int n;
+
+    batch_init(&batch);
+    for (;;) {
+	send_batch();
+	timeout = -1;
+	if (eof && batch_empty(&batch)) {
+	    if ((client.fd < 0) || !client_pending(&client)) {
+		/* Give the last replies a chance to arrive. */
+		if (!show || (client.fd < 0)) {
+		    break;
+		}
+		timeout = LINGER_MS;
+	    }
+	}
+	pfds[0].fd = eof ? -1: fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = client.fd;
+	pfds[1].events = POLLIN | (client_pending(&client) ? POLLOUT: 0);
+	while ((n = poll(pfds, 2, timeout)) < 0) {
+	    if (errno != EINTR) {
+		dofail(2, "poll failed: %s", strerror(errno));
+	    }
+	}
+	if (n == 0) {
+	    return;
+	}
+	if (pfds[0].revents) {
+	    eof = !read_input(fd, NULL);
+	}
+	if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if (client_read(&client, show ? print_reply: NULL, NULL) < 0) {
+		connection_lost();
+	    }
+	}
+	if ((client.fd >= 0) && (pfds[1].revents & POLLOUT) &&
+	    !client_flush(&client))
+	{
+	    connection_lost();
+	}
+    }
+}
+
+/**
+ * @brief Connect to lircd's socket at \p path.
+ *
+ * @return (int) The non-blocking socket, or -1 if we could not connect,
+ *         in which case the problem has been reported.
+ */
+static int
+connect_lircd(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	dofail(2, "lircd socket path %s is too long", path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	dofail(2, "unable to create socket: %s", strerror(errno));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	dofail(0, "unable to connect to lircd at %s: %s",
+	       path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    if (options.verbosity) {
+	fprintf(stderr, "Connected to lircd at %s\n", path);
+    }
+    return fd;
+}
+
+/**
+ * @brief Run as an lirc client daemon, as described at the top of this
+ * file.  If lircd goes away, we keep trying to reconnect.
+ */
+static void
+run_lirc(void)
+{
+    struct pollfd pfds[2];
+    lirc_t lirc;
+    uint64_t interval = 1000 / lirc_rate;
+    uint64_t next_send = 0;
+    uint64_t retry = 0;
+    uint64_t now;
+    int timeout;
+    int fd = -1;
+
+    if (!lirc_init(&lirc, lirc_keys)) {
+	dofail(2, "expected three button names, not \"%s\"", lirc_keys);
+    }
+    batch_init(&batch);
+    for (;;) {
+	now = now_ms();
+	if ((fd < 0) && (now >= retry) &&
+	    ((fd = connect_lircd(lircd_path)) < 0))
+	{
+	    retry = now + LIRC_RETRY_MS;
+	}
+	if (!batch_empty(&batch) && (now >= next_send) &&
+	    !client_pending(&client))
+	{
+	    send_batch();
+	    next_send = now + interval;
+	}
+	timeout = -1;
+	if (!batch_empty(&batch) && !client_pending(&client)) {
+	    timeout = next_send - now;
+	}
+	if ((fd < 0) && ((timeout < 0) || (retry - now < timeout))) {
+	    timeout = retry - now;
+	}
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = client.fd;
+	pfds[1].events = POLLIN | (client_pending(&client) ? POLLOUT: 0);
+	if ((poll(pfds, 2, timeout) < 0) && (errno != EINTR)) {
+	    dofail(2, "poll failed: %s", strerror(errno));
+	}
+	if ((fd >= 0) && pfds[0].revents && !read_input(fd, &lirc)) {
+	    fprintf(stderr, "Warning: connection to lircd lost\n");
+	    close(fd);
+	    fd = -1;
+	    input.len = 0;
+	    retry = now_ms() + LIRC_RETRY_MS;
+	}
+	if ((client.fd >= 0) &&
+	    (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+	    (client_read(&client, options.verbosity ? print_reply: NULL,
+			 NULL) < 0))
+	{
+	    connection_lost();
+	}
+	if ((client.fd >= 0) && (pfds[1].revents & POLLOUT) &&
+	    !client_flush(&client))
+	{
+	    connection_lost();
+	}
+    }
+}
+
+/**
+ * @brief Open the named pipe \p path, creating it if need be.  We also
+ * open it for writing, though we never write to it, so that we do not
+ * see end of file each time a writer closes it.
+ *
+ * @return (int) The descriptor from which to read.
+ */
+static int
+open_fifo(const char *path)
+{
+    struct stat st;
+    int fd;
+
+    if ((mkfifo(path, FIFO_MODE) < 0) && (errno != EEXIST)) {
+	dofail(2, "unable to create fifo %s: %s", path, strerror(errno));
+    }
+    if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+	dofail(2, "unable to open fifo %s: %s", path, strerror(errno));
+    }
+    if ((fstat(fd, &st) < 0) || !S_ISFIFO(st.st_mode)) {
+	dofail(2, "%s is not a fifo", path);
+    }
+    if (open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC) < 0) {
+	dofail(2, "unable to open fifo %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * @brief Print the status of the default zone from volumed's status
+ * page, if it has one and is still running.
+ *
+ * @return (bool) false if there is no usable status page, in which
+ *         case the status must be asked for.
+ */
+static bool
+print_page_status(void)
+{
+    const status_page_t *page;
+    char text[STATUS_BUFFER_SIZE];
+    volume_state_t state;
+    zone_t zone = {0, DEFAULT_ZONE_NAME, NULL, NULL, &state};
+    bool ok;
+
+    if (!options.status_page ||
+	!(page = status_page_map(options.status_page)))
+    {
+	return false;
+    }
+    /* A page left behind by a volumed that died is out of date. */
+    ok = ((kill(page->pid, 0) == 0) || (errno == EPERM)) &&
+	status_page_read(page, 0, &state, NULL);
+    status_page_unmap(page);
+    if (ok) {
+	format_status(&zone, text, sizeof(text));
+	printf("%s\n", text);
+    }
+    return ok;
+}
+
+/**
+ * @brief Send the single command given by \p words, and print the
+ * reply.
+ *
+ * @return (int) The exit code: 0 if the command succeeded, 1 if it was
+ *         rejected, or 2 if volumed could not be reached.
+ */
+static int
+run_single(int nwords, char **words)
+{
+    char text[WS_MAX_PAYLOAD];
+    struct pollfd pfd;
+    command_t cmd;
+    size_t len = 0;
+    int i;
+    int n;
+
+    for (i = 0; i < nwords; i++) {
+	len += snprintf(text + len, sizeof(text) - len, "%s%s",
+			i ? " ": "", words[i]);
+	if (len >= sizeof(text)) {
+	    len = sizeof(text) - 1;
+	}
+    }
+    if (!parse_command(text, len, &cmd)) {
+	dofail(0, "invalid command: %s", text);
+	return 1;
+    }
+    if ((cmd.type == CMD_STATUS) && print_page_status()) {
+	return 0;
+    }
+    if (!connect_volumed() || !client_queue_command(&client, &cmd)) {
+	return 2;
+    }
+    pfd.fd = client.fd;
+    while (client_pending(&client)) {
+	pfd.events = POLLOUT;
+	if (!client_flush(&client) ||
+	    (client_pending(&client) && (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)))
+	{
+	    dofail(0, "unable to send command");
+	    return 2;
+	}
+    }
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, REPLY_TIMEOUT_MS) > 0) {
+	if ((n = client_read(&client, print_reply, NULL)) < 0) {
+	    break;
+	}
+	if (n > 0) {
+	    return 0;
+	}
+    }
+    dofail(0, "no reply from volumed");
+    return 2;
+}
+
+/**
+ * @brief Main entry point to volumec.
+ *
+ * @param argc (int) The number of arguments passed to us.
+ * @param argv (char **) The array of command line arguments.
+ */
+int
+main(int argc, char **argv)
+{
+    int exitcode = 0;
+    int flags;
+    int fd;
+
+    process_arena = arena_new("process", PROCESS_ARENA_CHUNK);
+    progname = arena_strdup(process_arena, argv[0]);
+    process_volumec_args(argc, argv);
+    read_config_file();
+    if (port_arg) {
+	options.port = port_arg;
+    }
+    if (socket_arg) {
+	options.socket_path = socket_arg;
+    }
+
+    if (optind < argc) {
+	if (fifo_path || lirc_mode) {
+	    usage(2);
+	}
+	exitcode = run_single(argc - optind, argv + optind);
+    }
+    else if (lirc_mode) {
+	if (fifo_path) {
+	    usage(2);
+	}
+	(void) connect_volumed();
+	run_lirc();
+    }
+    else if (fifo_path) {
+	fd = open_fifo(fifo_path);
+	(void) connect_volumed();
+	run_commands(fd, options.verbosity > 0);
+    }
+    else {
+	/* Stdin may be shared with our parent, so its flags are put back
+	 * as they were. */
+	fd = STDIN_FILENO;
+	flags = fcntl(fd, F_GETFL);
+	(void) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (connect_volumed()) {
+	    run_commands(fd, true);
+	}
+	else {
+	    exitcode = 2;
+	}
+	(void) fcntl(fd, F_SETFL, flags);
+    }
+    if (options.verbosity && (optind >= argc)) {
+	fprintf(stderr, "Commands read: %lu, sent: %lu, invalid: %lu\n",
+		commands_read, commands_sent, commands_invalid);
+    }
+    client_close(&client);
+    closedown(exitcode);
+    return exitcode;
+}
@@ -39,17 +39,208 @@ It does this by:
 
 /*
  * PLAN:
- *   - create basic websocket service
- *   - create volumec
- *   - create volume-config-moode
  *   - man page?
  *   - debianize
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
 #include "volumed.h"
 
+#define INOTIFY_BUFFER_SIZE 4096
+
+/**
+ * @brief The main event loop.
+ */
+static loop_t main_loop;
+
+/**
+ * @brief Event source for signals, which are delivered through a
+ * signalfd so that they are handled synchronously by the main loop.
+ */
+static event_source_t signal_source = {-1, NULL};
+
+/**
+ * @brief Event source for an inotify watch on the directory containing
+ * our config file, so that the config is reloaded when the file is
+ * rewritten.
+ */
+static event_source_t config_watch_source = {-1, NULL};
+
+/**
+ * @brief The base name of the config file being watched, allocated
+ * from #process_arena.
+ */
+static char *config_watch_name = NULL;
+
+
+/**
+ * @brief Report the time to the first response, if there has been one,
+ * and the statistics of each zone on stdout, headed by the zone's id
+ * and name if there is more than one zone.
+ *
+ * @param counts (bool) Whether to report the numbers of commands
+ *        received and mixer writes too.
+ */
+static void
+report_stats(bool counts)
+{
+    int id;
+
+    if (stats_startup_time()) {
+	printf("First response %lluus after startup\n",
+	       (unsigned long long) stats_startup_time());
+    }
+    for (id = 0; id < nzones; id++) {
+	if (nzones > 1) {
+	    printf("Zone %d (%s):\n", id, zones[id].name);
+	}
+	if (!zones[id].mixer->ops) {
+	    printf("Mixer not yet opened\n");
+	    continue;
+	}
+	if (counts) {
+	    printf("Commands received: %lu, mixer writes: %lu\n",
+		   zones[id].queue->received, zones[id].queue->writes);
+	}
+	stats_report(&zones[id].queue->stats, stdout);
+    }
+}
+
+/**
+ * @brief Event handler for #signal_source.
+ */
+static void
+signal_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    struct signalfd_siginfo info;
+
+    while (read(src->fd, &info, sizeof(info)) == sizeof(info)) {
+	switch (info.ssi_signo) {
+	case SIGINT:
+	case SIGTERM:
+	    if (options.verbosity) {
+		printf("Received signal %d: shutting down\n", info.ssi_signo);
+	    }
+	    loop_stop(loop);
+	    break;
+	case SIGHUP:
+	    if (options.verbosity) {
+		printf("Received SIGHUP: reloading configuration\n");
+	    }
+	    (void) config_reload(loop);
+	    break;
+	case SIGUSR1:
+	    report_stats(false);
+	    break;
+	}
+    }
+}
+
+/**
+ * @brief Event handler for #config_watch_source.  Reloads the config
+ * if our config file has been written, or replaced by a rename as
+ * most editors do.
+ */
+static void
+config_watch_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    char buf[INOTIFY_BUFFER_SIZE]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    bool changed = false;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(src->fd, buf, sizeof(buf))) > 0) {
+	for (p = buf; p < buf + len;
+	     p += sizeof(struct inotify_event) + event->len)
+	{
+	    event = (const struct inotify_event *) p;
+	    if (event->len && (strcmp(event->name, config_watch_name) == 0)) {
+		changed = true;
+	    }
+	}
+    }
+    if (changed) {
+	if (options.verbosity) {
+	    printf("Config file changed: reloading configuration\n");
+	}
+	(void) config_reload(loop);
+    }
+}
+
+/**
+ * @brief Watch the config file that was read at startup, if any, for
+ * changes.  We watch its directory rather than the file itself, so that
+ * the watch survives the file being replaced.
+ *
+ * @param loop (loop_t *) The loop in which changes will be handled.
+ */
+static void
+setup_config_watch(loop_t *loop)
+{
+    char *dir;
+    char *base;
+
+    if (!options.config_path) {
+	return;
+    }
+    dir = arena_strdup(process_arena, options.config_path);
+    base = arena_strdup(process_arena, options.config_path);
+    config_watch_name = basename(base);
+    config_watch_source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((config_watch_source.fd < 0) ||
+	(inotify_add_watch(config_watch_source.fd, dirname(dir),
+			   IN_CLOSE_WRITE | IN_MOVED_TO) < 0))
+    {
+	fprintf(stderr, "Warning: unable to watch config file %s: %s\n",
+		options.config_path, strerror(errno));
+	if (config_watch_source.fd >= 0) {
+	    close(config_watch_source.fd);
+	    config_watch_source.fd = -1;
+	}
+    }
+    else {
+	config_watch_source.handler = config_watch_handler;
+	loop_add(loop, &config_watch_source, EPOLLIN | EPOLLET);
+    }
+}
+
+/**
+ * @brief Block the signals that we handle, and arrange for them to be
+ * delivered through #signal_source instead.
+ *
+ * @param loop (loop_t *) The loop in which signals will be handled.
+ */
+static void
+setup_signals(loop_t *loop)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+	dofail(2, "unable to block signals: %s", strerror(errno));
+    }
+    signal_source.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_source.fd < 0) {
+	dofail(2, "unable to create signalfd: %s", strerror(errno));
+    }
+    signal_source.handler = signal_handler;
+    loop_add(loop, &signal_source, EPOLLIN | EPOLLET);
+}
 
 /**
  * @brief Main entry point to \ref index.
@@ -60,13 +251,70 @@ It does this by:
 int
 main(int argc, char **argv)
 {
+    int id;
+
+    startup_us = now_us();
     process_args(argc, argv);
     read_config_file();
-    printf("Port: %d, Verbosity: %d\n", options.port, options.verbosity);
-    printf("volcurve: %d, max_pct: %d\n", options.volcurve, options.max_pct);
-    printf("alsa_mixer: %s, mpd_mixer: %s\n",
-	   options.alsa_mixer_name, options.mpd_mixer);
-    printf("alsa_card: %s\n", options.alsa_card);
+    if (options.verbosity) {
+	printf("Port: %d, Verbosity: %d, max_clients: %d\n",
+	       options.port, options.verbosity, options.max_clients);
+	printf("volcurve: %d, max_pct: %d\n",
+	       options.volcurve, options.max_pct);
+	printf("alsa_mixer: %s, mpd_mixer: %s\n",
+	       options.alsa_mixer_name, options.mpd_mixer);
+	printf("alsa_card: %s, mixer: %s\n",
+	       options.alsa_card, options.mixer);
+	printf("SIMD kernels: %s\n", simd_init(NULL)->name);
+	printf("writer_thread: %d, writer_priority: %d, writer_cpu: %d\n",
+	       options.writer_thread, options.writer_priority,
+	       options.writer_cpu);
+	printf("zones: %d, workers: %d\n", options.nzones, options.workers);
+	printf("status_page: %s, lazy_mixer: %d\n",
+	       options.status_page ? options.status_page: "none",
+	       options.lazy_mixer);
+    }
+    if (options.lazy_mixer && ((options.workers > 1) || options.status_page)) {
+	fprintf(stderr, "Warning: lazy_mixer has no effect with %s: every "
+		"mixer is opened at startup (set lazy_mixer = no to "
+		"say so)\n", options.status_page ? "status_page": "workers");
+    }
+
+    /* Listen before opening any mixer, so that clients can connect
+     * while the card is probed. */
+    loop_init(&main_loop);
+    setup_signals(&main_loop);
+    setup_config_watch(&main_loop);
+    server_init(&main_loop);
+    zones_open();
+    fflush(stdout);
+    zones_start(&main_loop);
+    workers_start(&main_loop);
+    if (options.status_page) {
+	if (!zones_ready()) {
+	    dofail(2, "unable to publish status page");
+	}
+	if (!status_page_open(options.status_page)) {
+	    dofail(2, "unable to publish status page");
+	}
+	for (id = 0; id < nzones; id++) {
+	    status_page_update(&zones[id]);
+	}
+    }
+    loop_run(&main_loop);
+
+    if (options.verbosity) {
+	report_stats(true);
+    }
+    workers_stop();
+    server_shutdown(&main_loop);
+    status_page_close();
+    zones_shutdown();
+    close(signal_source.fd);
+    if (config_watch_source.fd >= 0) {
+	close(config_watch_source.fd);
+    }
+    loop_close(&main_loop);
     closedown(0);
     return 0;
 }
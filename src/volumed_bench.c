@@ -0,0 +1,675 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * volumed-bench: a load generator for volumed.  It starts volumed with
+ * the fake mixer (or uses one that is already running), opens a number
+ * of websocket clients to it, and has them send a mix of commands, at
+ * a target rate, of the kinds that real clients send:
+ *
+ *   drag - "volume N", with N moving steadily, as from a slider being
+ *          dragged in a web UI;
+ *   key  - "up 1" or "down 1", as from a held remote control button;
+ *   mute - "toggle".
+ *
+ * When the run is over it reports:
+ *   - throughput: commands sent, and messages received, per second;
+ *   - end-to-end latency: the time from a client sending a command
+ *     until it next receives status from volumed, which is what a UI
+ *     waiting for its acknowledgement sees;
+ *   - broadcast fan-out delay: for each status broadcast, the delay
+ *     between the first client receiving it and each of the others;
+ *   - volumed's own per-stage latencies, from its stats command;
+ *   - the CPU time used by volumed, which is read from /proc.
+ *
+ * Broadcasts are recognised by their content, so when the same status
+ * recurs within a short time the fan-out delay is approximate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "volumed.h"
+
+#define DEFAULT_HOST      "localhost"
+#define DEFAULT_VOLUMED   "./volumed"
+#define DEFAULT_CLIENTS   8
+#define DEFAULT_RATE      200	/* Commands per second, for all clients */
+#define DEFAULT_DURATION  10	/* Seconds */
+#define DEFAULT_MIX       "60,30,10"	/* drag,key,mute */
+#define BENCH_OUTSTANDING 64	/* Unacknowledged commands per client */
+#define BENCH_RECENT      32	/* Broadcasts remembered for fan-out */
+#define BENCH_FANOUT_US   100000 /* Longest plausible fan-out */
+#define BENCH_START_MS    5000	/* Time allowed for volumed to start */
+#define BENCH_STATS_MS    2000	/* Time allowed for the stats reply */
+#define KEY_REPEATS       20	/* Repeats before the key changes */
+
+typedef enum {MIX_DRAG, MIX_KEY, MIX_MUTE, MIX_COUNT} mix_t;
+
+/**
+ * @brief A benchmark client: its connection, the state of its simulated
+ * slider and button, and the send times of its commands that are yet
+ * to be acknowledged.
+ */
+typedef struct s_bench_client {
+    client_t cl;
+    int      slider;		/* Position of the slider */
+    int      slider_dir;	/* Direction in which it is being dragged */
+    bool     key_up;		/* Whether the up button is held */
+    int      key_repeats;	/* Repeats of the button so far */
+    int      head;		/* Oldest unacknowledged command */
+    int      count;
+    uint64_t sent_us[BENCH_OUTSTANDING];
+} bench_client_t;
+
+static char *host = DEFAULT_HOST;
+static int   port = 0;
+static pid_t daemon_pid = 0;
+static bool  spawned = false;
+static char *volumed_path = DEFAULT_VOLUMED;
+static char  config_path[] = "/tmp/volumed-bench.XXXXXX";
+static int   nclients = DEFAULT_CLIENTS;
+static int   rate = DEFAULT_RATE;
+static int   duration = DEFAULT_DURATION;
+static int   mix[MIX_COUNT];
+static int   mix_total;
+
+static bench_client_t *clients;
+static histogram_t latency;
+static histogram_t fanout;
+static unsigned long sent[MIX_COUNT];
+static unsigned long received = 0;
+static unsigned long overflows = 0;
+static char daemon_stats[WS_MAX_PAYLOAD + 1];
+
+/**
+ * @brief Status broadcasts recently received, by content, with the
+ * time at which the first client received each, and the number of
+ * clients that have received it so far.
+ */
+static struct {
+    volume_state_t state;
+    uint64_t first_us;
+    int      arrivals;
+} recent[BENCH_RECENT];
+static int recent_next = 0;
+
+
+static void
+usage(int exitcode)
+{
+    fprintf(stderr,
+	    "usage: %s [-v | --verbose] [(-n | --clients) clients]\n"
+	    "        [(-r | --rate) rate] [(-d | --duration) seconds]\n"
+	    "        [(-m | --mix) drag,key,mute] [(-e | --volumed) path]\n"
+	    "        [(-H | --host) host] [(-p | --port) port-number]\n"
+	    "        [(-P | --pid) pid] [-V | --version]\n"
+	    "    clients:     the number of websocket clients "
+	    "(default - %d);\n"
+	    "    rate:        the commands per second sent by all clients\n"
+	    "                 together (default - %d);\n"
+	    "    seconds:     the length of the run (default - %d);\n"
+	    "    drag,key,mute: the relative weights of slider drags, key\n"
+	    "                 repeats and mute toggles (default - %s);\n"
+	    "    path:        the volumed to start, with the fake mixer\n"
+	    "                 (default - %s);\n"
+	    "    host, port-number: the host and port of a volumed that is\n"
+	    "                 already running, which is used instead;\n"
+	    "    pid:         the process id of that volumed, so that its\n"
+	    "                 CPU time can be reported.\n"
+	    "\n", progname, DEFAULT_CLIENTS, DEFAULT_RATE, DEFAULT_DURATION,
+	    DEFAULT_MIX, DEFAULT_VOLUMED);
+    closedown(exitcode);
+}
+
+/**
+ * @brief Parse the command mix, a comma-separated list of weights, into
+ * #mix.
+ */
+static void
+parse_mix(const char *arg)
+{
+    const char *p = arg;
+    char *end;
+    int i;
+
+    mix_total = 0;
+    for (i = 0; i < MIX_COUNT; i++) {
+	mix[i] = (int) strtol(p, &end, 10);
+	if ((end == p) || (mix[i] < 0) ||
+	    (*end != ((i < MIX_COUNT - 1) ? ',': '\0')))
+	{
+	    dofail(2, "mix must be three weights, such as %s", DEFAULT_MIX);
+	}
+	mix_total += mix[i];
+	p = end + 1;
+    }
+    if (mix_total == 0) {
+	dofail(2, "mix must have a non-zero weight");
+    }
+}
+
+static void
+process_bench_args(int argc, char **argv)
+{
+    struct option option_defs[] = {
+	{"clients", required_argument, NULL, 'n'},
+	{"duration", required_argument, NULL, 'd'},
+	{"host", required_argument, NULL, 'H'},
+	{"mix", required_argument, NULL, 'm'},
+	{"pid", required_argument, NULL, 'P'},
+	{"port", required_argument, NULL, 'p'},
+	{"rate", required_argument, NULL, 'r'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"version", no_argument, NULL, 'V'},
+	{"volumed", required_argument, NULL, 'e'},
+	{NULL, 0, NULL, 0}
+    };
+    int c;
+
+    parse_mix(DEFAULT_MIX);
+    while ((c = getopt_long(argc, argv, "d:e:H:m:n:p:P:r:vV",
+			    option_defs, NULL)) != -1)
+    {
+	switch (c) {
+	case 'd':
+	    if ((duration = atoi(optarg)) <= 0) {
+		dofail(2, "duration must be a positive number of seconds");
+	    }
+	    break;
+	case 'e':
+	    volumed_path = optarg;
+	    break;
+	case 'H':
+	    host = optarg;
+	    break;
+	case 'm':
+	    parse_mix(optarg);
+	    break;
+	case 'n':
+	    if ((nclients = atoi(optarg)) <= 0) {
+		dofail(2, "clients must be a positive number");
+	    }
+	    break;
+	case 'p':
+	    port = atoi(optarg);
+	    if ((port <= 0) || (port > 65535)) {
+		dofail(2, "port must be a number in the range 1 .. 65535");
+	    }
+	    break;
+	case 'P':
+	    daemon_pid = atoi(optarg);
+	    break;
+	case 'r':
+	    if ((rate = atoi(optarg)) <= 0) {
+		dofail(2, "rate must be a positive number");
+	    }
+	    break;
+	case 'v':
+	    options.verbosity++;
+	    break;
+	case 'V':
+	    printf("%s - volumed load generator, version: %s\n%s\n%s\n\n",
+		   progname, VERSION, COPYRIGHT, WARRANTY);
+	    closedown(0);
+	    break;
+	default:
+	    usage(2);
+	    break;
+	}
+    }
+    if (optind < argc) {
+	usage(2);
+    }
+}
+
+/**
+ * @brief Return a port that is, for the moment, free.
+ */
+static int
+free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int result = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((fd >= 0) && (bind(fd, (struct sockaddr *) &addr, len) == 0) &&
+	(getsockname(fd, (struct sockaddr *) &addr, &len) == 0))
+    {
+	result = ntohs(addr.sin_port);
+    }
+    if (fd >= 0) {
+	close(fd);
+    }
+    return result;
+}
+
+/**
+ * @brief Return whether something is accepting connections on #port.
+ */
+static bool
+port_open(void)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool open;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    open = (fd >= 0) &&
+	(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    if (fd >= 0) {
+	close(fd);
+    }
+    return open;
+}
+
+/**
+ * @brief Stop the volumed that we started, if any.  This is called on
+ * exit, however we come to exit.
+ */
+static void
+stop_volumed(void)
+{
+    if (spawned) {
+	kill(daemon_pid, SIGTERM);
+	(void) waitpid(daemon_pid, NULL, 0);
+	unlink(config_path);
+	spawned = false;
+    }
+}
+
+/**
+ * @brief Start volumed, with the fake mixer and a config file of our
+ * own that allows for all of our clients, and wait for it to listen.
+ */
+static void
+spawn_volumed(void)
+{
+    char *args[] = {volumed_path, "-m", "fake", "-c", config_path, NULL};
+    FILE *f;
+    int fd;
+    int i;
+
+    if (((port = free_port()) < 0) || ((fd = mkstemp(config_path)) < 0) ||
+	!(f = fdopen(fd, "w")))
+    {
+	dofail(2, "unable to set up volumed: %s", strerror(errno));
+    }
+    fprintf(f, "port = %d\nmax_clients = %d\n", port, nclients + 1);
+    fclose(f);
+    if ((daemon_pid = fork()) < 0) {
+	dofail(2, "unable to fork: %s", strerror(errno));
+    }
+    if (daemon_pid == 0) {
+	execv(volumed_path, args);
+	dofail(0, "unable to run %s: %s", volumed_path, strerror(errno));
+	_exit(2);
+    }
+    spawned = true;
+    atexit(stop_volumed);
+    for (i = 0; !port_open(); i++) {
+	if ((i * 10 >= BENCH_START_MS) ||
+	    (waitpid(daemon_pid, NULL, WNOHANG) == daemon_pid))
+	{
+	    spawned = false;
+	    unlink(config_path);
+	    dofail(2, "volumed did not start");
+	}
+	usleep(10000);
+    }
+}
+
+
+/**
+ * @brief Return the CPU time, user and system, used so far by volumed,
+ * in seconds, or -1 if it is not known.
+ */
+static double
+daemon_cpu(void)
+{
+    char path[64];
+    char buf[1024];
+    unsigned long utime;
+    unsigned long stime;
+    char *p;
+    FILE *f;
+    size_t len;
+
+    if (daemon_pid <= 0) {
+	return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) daemon_pid);
+    if (!(f = fopen(path, "r"))) {
+	return -1;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    /* The command name may contain spaces, so skip past it. */
+    if (!(p = strrchr(buf, ')')) ||
+	(sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2))
+    {
+	return -1;
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @brief Record the arrival, at \p now, of the status \p state as a
+ * broadcast.  The first arrival of each broadcast is remembered, and
+ * the delay of each later arrival behind it is recorded.  Once every
+ * client has received a broadcast, the same status arriving again must
+ * be a new broadcast.
+ */
+static void
+record_broadcast(const volume_state_t *state, uint64_t now)
+{
+    int i;
+    int idx;
+
+    for (i = 1; i <= BENCH_RECENT; i++) {
+	idx = (recent_next - i + BENCH_RECENT) % BENCH_RECENT;
+	if (recent[idx].first_us == 0) {
+	    break;
+	}
+	if (now - recent[idx].first_us > BENCH_FANOUT_US) {
+	    break;
+	}
+	if ((recent[idx].state.volume == state->volume) &&
+	    (recent[idx].state.mute == state->mute))
+	{
+	    if (recent[idx].arrivals == nclients) {
+		break;
+	    }
+	    recent[idx].arrivals++;
+	    hist_record(&fanout, now - recent[idx].first_us);
+	    return;
+	}
+    }
+    recent[recent_next].state = *state;
+    recent[recent_next].first_us = now;
+    recent[recent_next].arrivals = 1;
+    recent_next = (recent_next + 1) % BENCH_RECENT;
+}
+
+/**
+ * @brief Handle a message from volumed for the client \p arg.  Status
+ * acknowledges all of the client's outstanding commands.
+ */
+static void
+handle_message(const char *msg, size_t len, void *arg)
+{
+    bench_client_t *bc = (bench_client_t *) arg;
+    volume_state_t state;
+    uint64_t now = now_us();
+
+    received++;
+    if (parse_status(msg, len, &state)) {
+	while (bc->count > 0) {
+	    hist_record(&latency, now - bc->sent_us[bc->head]);
+	    bc->head = (bc->head + 1) % BENCH_OUTSTANDING;
+	    bc->count--;
+	}
+	record_broadcast(&state, now);
+    }
+    else if ((len < sizeof(daemon_stats)) &&
+	     (strncmp(msg, "{\"uptime_s\"", 11) == 0))
+    {
+	memcpy(daemon_stats, msg, len);
+	daemon_stats[len] = '\0';
+    }
+}
+
+/**
+ * @brief Choose the next command for \p bc, according to the mix.
+ */
+static mix_t
+next_command(bench_client_t *bc, command_t *cmd)
+{
+    int pick = random() % mix_total;
+    mix_t kind;
+
+    for (kind = MIX_DRAG; pick >= mix[kind]; kind++) {
+	pick -= mix[kind];
+    }
+    switch (kind) {
+    case MIX_DRAG:
+	bc->slider += bc->slider_dir;
+	if ((bc->slider <= 0) || (bc->slider >= 100)) {
+	    bc->slider_dir = -bc->slider_dir;
+	}
+	cmd->type = CMD_VOLUME;
+	cmd->value = bc->slider;
+	break;
+    case MIX_KEY:
+	if (++bc->key_repeats >= KEY_REPEATS) {
+	    bc->key_up = !bc->key_up;
+	    bc->key_repeats = 0;
+	}
+	cmd->type = bc->key_up ? CMD_UP: CMD_DOWN;
+	cmd->value = 1;
+	break;
+    default:
+	cmd->type = CMD_TOGGLE_MUTE;
+	cmd->value = 0;
+	break;
+    }
+    return kind;
+}
+
+/**
+ * @brief Send the next command from \p bc.
+ */
+static void
+send_command(bench_client_t *bc)
+{
+    command_t cmd;
+    mix_t kind = next_command(bc, &cmd);
+
+    if (!client_queue_command(&bc->cl, &cmd)) {
+	overflows++;
+	return;
+    }
+    sent[kind]++;
+    if (bc->count == BENCH_OUTSTANDING) {
+	/* Never acknowledged: forget the oldest. */
+	bc->head = (bc->head + 1) % BENCH_OUTSTANDING;
+	bc->count--;
+	overflows++;
+    }
+    bc->sent_us[(bc->head + bc->count) % BENCH_OUTSTANDING] = now_us();
+    bc->count++;
+    if (!client_flush(&bc->cl)) {
+	dofail(2, "connection to volumed lost");
+    }
+}
+
+/**
+ * @brief Read, and flush output for, every client that \p pfds shows
+ * to be ready.
+ */
+static void
+service_clients(struct pollfd *pfds)
+{
+    int i;
+
+    for (i = 0; i < nclients; i++) {
+	if (pfds[i].revents & POLLOUT) {
+	    if (!client_flush(&clients[i].cl)) {
+		dofail(2, "connection to volumed lost");
+	    }
+	}
+	if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if (client_read(&clients[i].cl, handle_message, &clients[i]) < 0) {
+		dofail(2, "connection to volumed lost");
+	    }
+	}
+    }
+}
+
+/**
+ * @brief Wait for, and handle, events on the clients' sockets until
+ * \p until, on the monotonic clock in microseconds.
+ */
+static void
+poll_clients(struct pollfd *pfds, uint64_t until)
+{
+    uint64_t now;
+    int i;
+
+    while ((now = now_us()) < until) {
+	for (i = 0; i < nclients; i++) {
+	    pfds[i].events = POLLIN |
+		(client_pending(&clients[i].cl) ? POLLOUT: 0);
+	}
+	if (poll(pfds, nclients, (int) ((until - now + 999) / 1000)) > 0) {
+	    service_clients(pfds);
+	}
+    }
+}
+
+/**
+ * @brief Ask volumed, on the first client, for its stats, and wait for
+ * the reply.
+ */
+static void
+fetch_daemon_stats(struct pollfd *pfds)
+{
+    command_t cmd = {CMD_STATS, 0};
+    uint64_t until = now_us() + BENCH_STATS_MS * 1000ULL;
+
+    if (!client_queue_command(&clients[0].cl, &cmd) ||
+	!client_flush(&clients[0].cl))
+    {
+	return;
+    }
+    while (!daemon_stats[0] && (now_us() < until)) {
+	poll_clients(pfds, MIN(until, now_us() + 10000));
+    }
+}
+
+/**
+ * @brief Print a summary line for \p hist.
+ */
+static void
+report_hist(const char *name, const histogram_t *hist)
+{
+    printf("%-22s p50 %6lluus  p99 %6lluus  p999 %6lluus  max %6lluus "
+	   "(%lu)\n", name,
+	   (unsigned long long) hist_percentile(hist, 50),
+	   (unsigned long long) hist_percentile(hist, 99),
+	   (unsigned long long) hist_percentile(hist, 99.9),
+	   (unsigned long long) hist->max_us, hist->count);
+}
+
+/**
+ * @brief Main entry point to volumed-bench.
+ *
+ * @param argc (int) The number of arguments passed to us.
+ * @param argv (char **) The array of command line arguments.
+ */
+int
+main(int argc, char **argv)
+{
+    struct pollfd *pfds;
+    uint64_t interval_us;
+    uint64_t start;
+    uint64_t end;
+    uint64_t next;
+    double cpu_start;
+    double cpu_end;
+    double secs;
+    unsigned long total;
+    int i;
+
+    process_arena = arena_new("process", PROCESS_ARENA_CHUNK);
+    progname = arena_strdup(process_arena, argv[0]);
+    process_bench_args(argc, argv);
+    srandom(getpid());
+    if (!port) {
+	spawn_volumed();
+    }
+
+    clients = (bench_client_t *) MALLOC(nclients * sizeof(bench_client_t));
+    pfds = (struct pollfd *) MALLOC(nclients * sizeof(struct pollfd));
+    memset(clients, 0, nclients * sizeof(bench_client_t));
+    for (i = 0; i < nclients; i++) {
+	if (!client_open(&clients[i].cl, host, port, NULL)) {
+	    dofail(2, "unable to open client %d", i + 1);
+	}
+	clients[i].slider = (i * 37) % 100;
+	clients[i].slider_dir = (i % 2) ? -1: 1;
+	clients[i].key_up = i % 2;
+	pfds[i].fd = clients[i].cl.fd;
+    }
+    if (options.verbosity) {
+	printf("%d clients on port %d, %d commands/s for %ds, "
+	       "mix %d,%d,%d\n", nclients, port, rate, duration,
+	       mix[MIX_DRAG], mix[MIX_KEY], mix[MIX_MUTE]);
+	fflush(stdout);
+    }
+
+    /* Commands are sent open-loop, on a fixed schedule, round-robin
+     * across the clients. */
+    interval_us = MAX(1000000ULL / rate, 1);
+    cpu_start = daemon_cpu();
+    start = next = now_us();
+    end = start + duration * 1000000ULL;
+    for (i = 0; next < end; i = (i + 1) % nclients) {
+	poll_clients(pfds, next);
+	send_command(&clients[i]);
+	next += interval_us;
+    }
+    /* Allow the last acknowledgements to arrive. */
+    poll_clients(pfds, now_us() + 100000);
+    secs = (now_us() - start) / 1e6;
+    cpu_end = daemon_cpu();
+    fetch_daemon_stats(pfds);
+
+    total = sent[MIX_DRAG] + sent[MIX_KEY] + sent[MIX_MUTE];
+    printf("Commands sent:         %lu (drag %lu, key %lu, mute %lu) "
+	   "in %.2fs\n", total, sent[MIX_DRAG], sent[MIX_KEY],
+	   sent[MIX_MUTE], secs);
+    printf("Throughput:            %.0f commands/s sent, "
+	   "%.0f messages/s received\n", total / secs, received / secs);
+    if (overflows) {
+	printf("Unacknowledged or unsent commands: %lu\n", overflows);
+    }
+    report_hist("End-to-end latency:", &latency);
+    report_hist("Broadcast fan-out:", &fanout);
+    if ((cpu_start >= 0) && (cpu_end >= 0)) {
+	printf("volumed CPU:           %.2fs (%.1f%% of one core)\n",
+	       cpu_end - cpu_start, 100 * (cpu_end - cpu_start) / secs);
+    }
+    if (daemon_stats[0]) {
+	printf("volumed stats:         %s\n", daemon_stats);
+    }
+
+    for (i = 0; i < nclients; i++) {
+	client_close(&clients[i].cl);
+    }
+    FREE(clients);
+    FREE(pfds);
+    closedown(0);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The websocket protocol (RFC 6455): the HTTP upgrade handshake, and
+ * the encoding and decoding of frames.  Nothing in here does any I/O;
+ * this works purely on buffers so that it can be used equally by the
+ * server, by clients and by the unit tests.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "volumed.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_MAX 64
+
+/**
+ * @brief Find the value of the HTTP header \p name within \p headers.
+ *
+ * @param headers (char *) The request headers, starting after the
+ *        request line.
+ * @param end (char *) The end of the headers.
+ * @param name (char *) The header name to look for (case-insensitive).
+ * @param p_len (size_t *) Pointer to a variable into which the length
+ *        of the value will be returned.
+ *
+ * @return (char *) Pointer to the start of the value, with leading
+ *         whitespace skipped, or NULL if the header was not found.
+ */
+static const char *
+find_header(const char *headers, const char *end,
+	    const char *name, size_t *p_len)
+{
+    size_t name_len = strlen(name);
+    const char *line = headers;
+    const char *eol;
+    const char *val;
+
+    while (line < end) {
+	if (!(eol = memmem(line, end - line, "\r\n", 2))) {
+	    eol = end;
+	}
+	if ((eol - line > name_len) && (line[name_len] == ':') &&
+	    (strncasecmp(line, name, name_len) == 0))
+	{
+	    val = line + name_len + 1;
+	    while ((val < eol) && isspace(*val)) {
+		val++;
+	    }
+	    while ((eol > val) && isspace(eol[-1])) {
+		eol--;
+	    }
+	    *p_len = eol - val;
+	    return val;
+	}
+	line = eol + 2;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Case-insensitively check whether the comma-separated header
+ * value \p val contains \p token.
+ */
+static bool
+header_has_token(const char *val, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *end = val + len;
+
+    while (val < end) {
+	while ((val < end) && (isspace(*val) || (*val == ','))) {
+	    val++;
+	}
+	if ((end - val >= token_len) &&
+	    (strncasecmp(val, token, token_len) == 0) &&
+	    ((end - val == token_len) || (val[token_len] == ',') ||
+	     isspace(val[token_len])))
+	{
+	    return true;
+	}
+	while ((val < end) && (*val != ',')) {
+	    val++;
+	}
+    }
+    return false;
+}
+
+/**
+ * @brief Handle a websocket opening handshake request.
+ *
+ * @param req (char *) The data received so far from the client.
+ * @param len (size_t) The length of \p req.
+ * @param subprotocol (char *) A subprotocol that we support, to be
+ *        selected if the client offers it, or NULL.
+ * @param resp (char *) Buffer into which the HTTP response will be
+ *        written.
+ * @param resp_size (size_t) The size of \p resp.
+ * @param p_resp_len (size_t *) Pointer to a variable into which the
+ *        length of the response will be returned.
+ * @param p_selected (bool *) Pointer to a variable into which will be
+ *        returned whether \p subprotocol was selected, or NULL.
+ *
+ * @return (int) The number of bytes of \p req consumed by the
+ *         handshake, 0 if the request is not yet complete, or -1 if the
+ *         request is invalid, in which case \p resp will contain an
+ *         error response for the client.
+ */
+int
+ws_handshake(const char *req, size_t len, const char *subprotocol,
+	     char *resp, size_t resp_size, size_t *p_resp_len,
+	     bool *p_selected)
+{
+    const char *end = memmem(req, len, "\r\n\r\n", 4);
+    const char *headers;
+    const char *val;
+    size_t val_len;
+    char key[WS_KEY_MAX + sizeof(WS_GUID)];
+    uint8_t digest[20];
+    char accept[32];
+    bool selected;
+
+    if (!end) {
+	return 0;
+    }
+    if ((len < 4) || (strncmp(req, "GET ", 4) != 0) ||
+	!(headers = memmem(req, end - req, "\r\n", 2)))
+    {
+	goto bad_request;
+    }
+    headers += 2;
+    if (!(val = find_header(headers, end, "Upgrade", &val_len)) ||
+	!header_has_token(val, val_len, "websocket"))
+    {
+	goto bad_request;
+    }
+    if (!(val = find_header(headers, end, "Sec-WebSocket-Version",
+			    &val_len)) ||
+	(val_len != 2) || (strncmp(val, "13", 2) != 0))
+    {
+	*p_resp_len = snprintf(
+	    resp, resp_size,
+	    "HTTP/1.1 426 Upgrade Required\r\n"
+	    "Sec-WebSocket-Version: 13\r\n"
+	    "Content-Length: 0\r\n\r\n");
+	return -1;
+    }
+    if (!(val = find_header(headers, end, "Sec-WebSocket-Key", &val_len)) ||
+	(val_len == 0) || (val_len > WS_KEY_MAX))
+    {
+	goto bad_request;
+    }
+    memcpy(key, val, val_len);
+    memcpy(key + val_len, WS_GUID, sizeof(WS_GUID) - 1);
+    sha1(key, val_len + sizeof(WS_GUID) - 1, digest);
+    base64_encode(digest, sizeof(digest), accept);
+    selected = subprotocol &&
+	(val = find_header(headers, end, "Sec-WebSocket-Protocol",
+			   &val_len)) &&
+	header_has_token(val, val_len, subprotocol);
+    if (p_selected) {
+	*p_selected = selected;
+    }
+
+    *p_resp_len = snprintf(
+	resp, resp_size,
+	"HTTP/1.1 101 Switching Protocols\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Accept: %s\r\n%s%s%s\r\n", accept,
+	selected ? "Sec-WebSocket-Protocol: ": "",
+	selected ? subprotocol: "", selected ? "\r\n": "");
+    return (end + 4) - req;
+
+bad_request:
+    *p_resp_len = snprintf(
+	resp, resp_size,
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 0\r\n\r\n");
+    return -1;
+}
+
+/**
+ * @brief Parse a single websocket frame from \p buf, unmasking its
+ * payload in place.
+ *
+ * @param buf (uint8_t *) The buffered input.
+ * @param len (size_t) The number of bytes in \p buf.
+ * @param frame (ws_frame_t *) The frame structure to be filled in.
+ *
+ * @return (ssize_t) The number of bytes used by the frame, 0 if a
+ *         complete frame is not yet available, or -1 if the frame is
+ *         too large for us to handle.
+ */
+ssize_t
+ws_parse_frame(uint8_t *buf, size_t len, ws_frame_t *frame)
+{
+    size_t hdr_len = 2;
+    uint64_t payload_len;
+    uint8_t *mask = NULL;
+    size_t i;
+
+    if (len < 2) {
+	return 0;
+    }
+    frame->fin = (buf[0] & 0x80) != 0;
+    frame->opcode = buf[0] & 0x0f;
+    frame->masked = (buf[1] & 0x80) != 0;
+    payload_len = buf[1] & 0x7f;
+    if (payload_len == 126) {
+	if (len < 4) {
+	    return 0;
+	}
+	payload_len = (buf[2] << 8) | buf[3];
+	hdr_len = 4;
+    }
+    else if (payload_len == 127) {
+	if (len < 10) {
+	    return 0;
+	}
+	payload_len = 0;
+	for (i = 2; i < 10; i++) {
+	    payload_len = (payload_len << 8) | buf[i];
+	}
+	hdr_len = 10;
+    }
+    if (payload_len > WS_MAX_PAYLOAD) {
+	return -1;
+    }
+    if (frame->masked) {
+	mask = buf + hdr_len;
+	hdr_len += 4;
+    }
+    if (len < hdr_len + payload_len) {
+	return 0;
+    }
+    frame->payload = buf + hdr_len;
+    frame->len = (size_t) payload_len;
+    if (mask) {
+	ws_unmask(frame->payload, frame->len, mask);
+    }
+    return hdr_len + frame->len;
+}
+
+/**
+ * @brief Encode a complete (FIN) websocket frame into \p out.
+ *
+ * @param out (uint8_t *) Buffer for the frame.  This must have room
+ *        for at least \p len + #WS_MAX_HEADER bytes.
+ * @param opcode (int) The frame opcode.
+ * @param payload (void *) The payload data.
+ * @param len (size_t) The length of \p payload.
+ * @param mask (uint8_t *) A 4-byte masking key, or NULL.  Clients
+ *        must mask their frames; servers must not.
+ *
+ * @return (size_t) The length of the encoded frame.
+ */
+size_t
+ws_encode_frame(uint8_t *out, int opcode, const void *payload,
+		size_t len, const uint8_t *mask)
+{
+    const uint8_t *p = (const uint8_t *) payload;
+    uint8_t mask_bit = mask ? 0x80: 0;
+    size_t hdr_len;
+    size_t i;
+
+    out[0] = 0x80 | (opcode & 0x0f);
+    if (len < 126) {
+	out[1] = mask_bit | (uint8_t) len;
+	hdr_len = 2;
+    }
+    else if (len <= 0xffff) {
+	out[1] = mask_bit | 126;
+	out[2] = (uint8_t) (len >> 8);
+	out[3] = (uint8_t) len;
+	hdr_len = 4;
+    }
+    else {
+	out[1] = mask_bit | 127;
+	for (i = 0; i < 8; i++) {
+	    out[2 + i] = (uint8_t) ((uint64_t) len >> (56 - i * 8));
+	}
+	hdr_len = 10;
+    }
+    if (mask) {
+	memcpy(out + hdr_len, mask, 4);
+	hdr_len += 4;
+	for (i = 0; i < len; i++) {
+	    out[hdr_len + i] = p[i] ^ mask[i & 3];
+	}
+    }
+    else {
+	memcpy(out + hdr_len, p, len);
+    }
+    return hdr_len + len;
+}
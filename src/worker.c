@@ -0,0 +1,340 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Workers.  With workers set to more than 1, connections are accepted
+ * not only by the main loop but by further loops, each on a thread of
+ * its own, all listening on options.port with SO_REUSEPORT so that the
+ * kernel spreads new connections between them.  Each loop handles its
+ * own connections entirely, from the handshake through the parsing of
+ * frames to the sending of status, so that with many clients this work
+ * is spread across the CPUs.
+ *
+ * The mixers, and the command queues, remain with the main loop, so
+ * that commands from every loop are folded and written in the order in
+ * which they arrive there.  A worker forwards each state-changing
+ * command, as a worker_cmd_t, through a pipe shared by all workers to
+ * the main loop, which submits it just as it would one of its own.  A
+ * write of no more than PIPE_BUF bytes to a pipe is atomic, so the
+ * workers need no lock to share it.
+ *
+ * Status goes the other way.  Whenever the main loop broadcasts the
+ * status of a zone, the status is published in a single atomic word for
+ * the zone, the zone is marked dirty for each worker, and any worker
+ * for which it was not already dirty is woken through its eventfd.  The
+ * worker then broadcasts the latest status of each dirty zone to its
+ * own clients.  Status published again before a worker has looked
+ * simply replaces what was there, much as a client's unsent status is
+ * replaced by newer status (see server.c).
+ *
+ * The main loop cannot reply to a client of another loop, so a
+ * forwarded command that makes no difference is acknowledged by
+ * publishing the zone's status again.  A worker answers status queries
+ * from its own view of each zone, which holds the status last published
+ * to it.  The stats command reads the statistics of the zone's queue
+ * without synchronisation, so on a worker its figures may be a command
+ * or two out of step with each other.
+ */
+
+#define _GNU_SOURCE		/* For pipe2() */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "volumed.h"
+
+/**
+ * @brief The workers, other than the main loop, of which there are
+ * #nworkers.
+ */
+worker_t workers[MAX_WORKERS];
+int nworkers = 0;
+
+/**
+ * @brief The status of each zone as last published to the workers:
+ * the volume, with BIN_STATE_MUTE set if muted.
+ */
+static uint32_t published[MAX_ZONES];
+
+/**
+ * @brief The pipe through which workers forward commands: the main
+ * loop's event source for its read end, and its write end.
+ */
+static event_source_t cmd_source = {-1, NULL};
+static int cmd_fd = -1;
+static loop_t *cmd_loop = NULL;
+
+
+/**
+ * @brief Wake whoever is waiting on the eventfd \p fd.
+ */
+static void
+worker_wake(int fd)
+{
+    uint64_t one = 1;
+
+    while ((write(fd, &one, sizeof(one)) < 0) && (errno == EINTR)) {
+    }
+}
+
+/**
+ * @brief Event handler, in a worker, for its eventfd.  Broadcasts the
+ * newly published status of each dirty zone, and stops the worker's
+ * loop if it has been told to.
+ */
+static void
+worker_wake_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    worker_t *w = CONTAINER_OF(src, worker_t, wake);
+    uint64_t count;
+    uint32_t dirty;
+    uint32_t word;
+    int id;
+
+    (void) read(src->fd, &count, sizeof(count));
+    dirty = __atomic_exchange_n(&w->dirty, 0, __ATOMIC_ACQ_REL);
+    for (id = 0; id < nzones; id++) {
+	if (dirty & (1u << id)) {
+	    word = __atomic_load_n(&published[id], __ATOMIC_ACQUIRE);
+	    w->states[id].volume = (int) (word & ~BIN_STATE_MUTE);
+	    w->states[id].mute = (word & BIN_STATE_MUTE) != 0;
+	    server_broadcast_status(loop, &w->zones[id], w->origin[id]);
+	    w->origin[id] = NULL;
+	}
+    }
+    if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+	loop_stop(loop);
+    }
+}
+
+/**
+ * @brief A worker thread's main function.  The worker's server is
+ * started here, rather than by workers_start(), so that its frame pool
+ * belongs to the worker's thread.
+ */
+static void *
+worker_main(void *arg)
+{
+    worker_t *w = (worker_t *) arg;
+
+    server_init_worker(&w->loop, w->listen_fd);
+    loop_run(&w->loop);
+    server_shutdown(&w->loop);
+    loop_del(&w->loop, &w->wake);
+    loop_close(&w->loop);
+    return NULL;
+}
+
+/**
+ * @brief Event handler, in the main loop, for the pipe through which
+ * workers forward their commands.  Each is submitted to its zone's
+ * command queue.
+ */
+static void
+cmd_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    worker_cmd_t cmds[LOOP_MAX_EVENTS];
+    zone_t *zone;
+    ssize_t n;
+    int i;
+
+    for (;;) {
+	n = read(src->fd, cmds, sizeof(cmds));
+	if (n <= 0) {
+	    if ((n < 0) && (errno == EINTR)) {
+		continue;
+	    }
+	    return;
+	}
+	/* Each command was written atomically, so none is split. */
+	for (i = 0; i < n / (ssize_t) sizeof(cmds[0]); i++) {
+	    zone = &zones[cmds[i].zone];
+	    if (!cmdq_submit(zone->queue, &cmds[i].cmd, NULL)) {
+		workers_publish(zone);
+	    }
+	}
+    }
+}
+
+/**
+ * @brief Start options.workers - 1 workers, each listening on the port
+ * on which \p loop, the main loop, is listening.  Does nothing if
+ * there is to be only the main loop.
+ *
+ * @param loop (loop_t *) The main loop, to which workers forward their
+ *        commands.
+ */
+void
+workers_start(loop_t *loop)
+{
+    worker_t *w;
+    int port = server_port(loop);
+    int fds[2];
+    int err;
+    int id;
+    int i;
+
+    nworkers = MIN(MAX(options.workers, 1), MAX_WORKERS) - 1;
+    if (nworkers == 0) {
+	return;
+    }
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+	dofail(2, "unable to create pipe for workers: %s", strerror(errno));
+    }
+    cmd_source.fd = fds[0];
+    cmd_source.handler = cmd_handler;
+    cmd_fd = fds[1];
+    cmd_loop = loop;
+    loop_add(loop, &cmd_source, EPOLLIN | EPOLLET);
+    /* Workers answer status queries from their own view of each zone,
+     * so every zone must have its state from the start. */
+    if (!zones_ready()) {
+	dofail(2, "unable to start workers");
+    }
+    for (id = 0; id < nzones; id++) {
+	published[id] = zones[id].state->volume |
+	    (zones[id].state->mute ? BIN_STATE_MUTE: 0);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+	w = &workers[i];
+	memset(w, 0, sizeof(*w));
+	w->id = i + 1;
+	loop_init(&w->loop);
+	w->loop.worker = w;
+	for (id = 0; id < nzones; id++) {
+	    /* The queue is there only for its statistics: commands go
+	     * through worker_submit(). */
+	    w->zones[id].id = id;
+	    w->zones[id].queue = zones[id].queue;
+	    w->zones[id].state = &w->states[id];
+	    w->states[id] = *zones[id].state;
+	}
+	if ((w->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	    dofail(2, "unable to create eventfd: %s", strerror(errno));
+	}
+	w->wake.handler = worker_wake_handler;
+	loop_add(&w->loop, &w->wake, EPOLLIN | EPOLLET);
+	/* Listen now, so that the port is shared from the moment we
+	 * return, even if the thread has yet to start accepting. */
+	if ((w->listen_fd = server_listen(port)) < 0) {
+	    dofail(2, "unable to start worker");
+	}
+	if ((err = pthread_create(&w->thread, NULL, worker_main, w)) != 0) {
+	    dofail(2, "unable to start worker thread: %s", strerror(err));
+	}
+	w->running = true;
+    }
+    if (options.verbosity) {
+	printf("Started %d workers on port %d\n", nworkers, port);
+    }
+}
+
+/**
+ * @brief Forward \p cmd, for \p zone, from the worker \p w to the main
+ * loop.  Called by the worker.
+ *
+ * @param w (worker_t *) The worker.
+ * @param zone (zone_t *) The worker's view of the zone addressed.
+ * @param cmd (command_t *) The command.
+ * @param origin (conn_t *) The worker's connection from which \p cmd
+ *        came, to be sent the next status of the zone first.
+ *
+ * @return (bool) true if the command has been forwarded, in which case
+ *         a status broadcast will follow.  If false, the main loop has
+ *         so much forwarded already that it could not be, and the
+ *         caller should acknowledge it.
+ */
+bool
+worker_submit(worker_t *w, const zone_t *zone, const command_t *cmd,
+	      conn_t *origin)
+{
+    worker_cmd_t wc;
+    ssize_t n;
+
+    memset(&wc, 0, sizeof(wc));
+    wc.zone = zone->id;
+    wc.cmd = *cmd;
+    while (((n = write(cmd_fd, &wc, sizeof(wc))) < 0) && (errno == EINTR)) {
+    }
+    if (n != sizeof(wc)) {
+	w->dropped++;
+	return false;
+    }
+    w->forwarded++;
+    w->origin[zone->id] = origin;
+    return true;
+}
+
+/**
+ * @brief Publish the current status of \p zone to the workers, waking
+ * each for which the zone was not already dirty.  Called by the main
+ * loop.
+ *
+ * @param zone (zone_t *) The zone.
+ */
+void
+workers_publish(const zone_t *zone)
+{
+    uint32_t bit = 1u << zone->id;
+    int i;
+
+    if (nworkers == 0) {
+	return;
+    }
+    __atomic_store_n(&published[zone->id], zone->state->volume |
+		     (zone->state->mute ? BIN_STATE_MUTE: 0),
+		     __ATOMIC_RELEASE);
+    for (i = 0; i < nworkers; i++) {
+	if (!(__atomic_fetch_or(&workers[i].dirty, bit,
+				__ATOMIC_ACQ_REL) & bit))
+	{
+	    worker_wake(workers[i].wake.fd);
+	}
+    }
+}
+
+/**
+ * @brief Stop every worker, closing its connections, and wait for its
+ * thread to exit.
+ */
+void
+workers_stop(void)
+{
+    worker_t *w;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+	w = &workers[i];
+	__atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+	worker_wake(w->wake.fd);
+    }
+    for (i = 0; i < nworkers; i++) {
+	w = &workers[i];
+	if (w->running) {
+	    (void) pthread_join(w->thread, NULL);
+	    w->running = false;
+	}
+	close(w->wake.fd);
+	w->wake.fd = -1;
+	if (options.verbosity) {
+	    printf("Worker %d: %lu commands forwarded, %lu dropped\n",
+		   w->id, w->forwarded, w->dropped);
+	}
+    }
+    if (cmd_loop) {
+	loop_del(cmd_loop, &cmd_source);
+	close(cmd_source.fd);
+	close(cmd_fd);
+	cmd_source.fd = cmd_fd = -1;
+	cmd_loop = NULL;
+    }
+    nworkers = 0;
+}
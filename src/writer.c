@@ -0,0 +1,318 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * The mixer writer thread, used when writer_thread is set.  Mixer
+ * writes are made on a thread of their own, which may be given a
+ * SCHED_FIFO priority and pinned to a CPU, so that however busy the
+ * network loop gets, with bursts of websocket traffic or slow clients,
+ * a volume change reaches the hardware as soon as it is issued.
+ *
+ * The loop and the writer talk through a pair of single-producer,
+ * single-consumer rings: states to be written go from the loop to the
+ * writer, and the states that resulted come back.  Neither side ever
+ * takes a lock.  Each side is woken, when the other has put something
+ * into a ring, through an eventfd: the writer blocks reading its
+ * eventfd, and the loop watches its own eventfd like any other event
+ * source.
+ *
+ * While a write is in flight the writer owns the mixer, and the loop
+ * must not touch it (see queue.c).
+ */
+
+#define _GNU_SOURCE		/* For pthread_setaffinity_np() */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "volumed.h"
+
+
+/**
+ * @brief Add \p msg to \p ring.  This must only be called by the
+ * ring's single producer.
+ *
+ * @param ring (spsc_ring_t *) The ring.
+ * @param msg (writer_msg_t *) The message to be added.
+ *
+ * @return (bool) false if the ring is full.
+ */
+bool
+spsc_push(spsc_ring_t *ring, const writer_msg_t *msg)
+{
+    uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	WRITER_RING_SIZE)
+    {
+	return false;
+    }
+    ring->slots[head & (WRITER_RING_SIZE - 1)] = *msg;
+    /* Publish the slot's contents before the new head. */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Take the oldest message from \p ring.  This must only be
+ * called by the ring's single consumer.
+ *
+ * @param ring (spsc_ring_t *) The ring.
+ * @param msg (writer_msg_t *) The message to be filled in.
+ *
+ * @return (bool) false if the ring is empty.
+ */
+bool
+spsc_pop(spsc_ring_t *ring, writer_msg_t *msg)
+{
+    uint32_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+	return false;
+    }
+    *msg = ring->slots[tail & (WRITER_RING_SIZE - 1)];
+    /* Release the slot only once it has been copied out. */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Wake whoever is waiting on the eventfd \p fd.
+ */
+static void
+wake(int fd)
+{
+    uint64_t one = 1;
+
+    while ((write(fd, &one, sizeof(one)) < 0) && (errno == EINTR)) {
+    }
+}
+
+/**
+ * @brief Give the calling thread the scheduling priority and CPU
+ * affinity asked for by writer_priority and writer_cpu.  Failure, which
+ * usually means that we lack CAP_SYS_NICE, is reported but is not
+ * fatal: the writer still runs, just without the guarantees.
+ */
+static void
+writer_set_scheduling(void)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    if (options.writer_priority > 0) {
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = options.writer_priority;
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+	    fprintf(stderr, "Warning: unable to give mixer writer SCHED_FIFO "
+		    "priority %d: %s\n", options.writer_priority,
+		    strerror(err));
+	}
+    }
+    if (options.writer_cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(options.writer_cpu, &cpus);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (err) {
+	    fprintf(stderr, "Warning: unable to pin mixer writer to CPU %d: "
+		    "%s\n", options.writer_cpu, strerror(err));
+	}
+    }
+}
+
+/**
+ * @brief The writer thread's main function.  It writes each state that
+ * it is given, and returns whatever the mixer then holds, until it is
+ * told to stop.
+ */
+static void *
+writer_main(void *arg)
+{
+    writer_t *w = (writer_t *) arg;
+    writer_msg_t msg;
+    uint64_t count;
+
+    writer_set_scheduling();
+    for (;;) {
+	while (spsc_pop(&w->requests, &msg)) {
+	    if (msg.stop) {
+		return NULL;
+	    }
+	    msg.ok = mixer_write(w->mixer, &msg.state);
+	    if (!msg.ok) {
+		(void) mixer_read(w->mixer, &msg.state);
+	    }
+	    /* At most one request is outstanding, so there is always
+	     * room for its result. */
+	    (void) spsc_push(&w->results, &msg);
+	    wake(w->done.fd);
+	}
+	if ((read(w->wake_fd, &count, sizeof(count)) < 0) &&
+	    (errno != EINTR))
+	{
+	    dofail(2, "mixer writer unable to wait: %s", strerror(errno));
+	}
+    }
+}
+
+/**
+ * @brief Pass each result from the writer to its done function.
+ *
+ * @return (int) The number of results.
+ */
+static int
+writer_collect(writer_t *w)
+{
+    writer_msg_t msg;
+    int count = 0;
+
+    while (spsc_pop(&w->results, &msg)) {
+	w->busy = false;
+	count++;
+	w->done_fn(w->done_arg, &msg);
+    }
+    return count;
+}
+
+/**
+ * @brief Event handler for the eventfd through which the writer
+ * reports its results to the loop.
+ */
+static void
+writer_done_handler(loop_t *loop, event_source_t *src, uint32_t events)
+{
+    writer_t *w = CONTAINER_OF(src, writer_t, done);
+    uint64_t count;
+
+    (void) read(src->fd, &count, sizeof(count));
+    (void) writer_collect(w);
+}
+
+/**
+ * @brief Start the mixer writer thread \p w.
+ *
+ * @param w (writer_t *) The writer to be started.
+ * @param loop (loop_t *) The loop to which results are to be reported.
+ * @param mixer (mixer_t *) The mixer to be written.
+ * @param fn (writer_done_fn_t *) Function to be called, in the loop,
+ *        with the result of each write.
+ * @param arg (void *) Argument to be passed to \p fn.
+ *
+ * @return (bool) true if the thread was started.  If not, the problem
+ *         has been reported, and writes must be made by the loop.
+ */
+bool
+writer_start(writer_t *w, loop_t *loop, mixer_t *mixer,
+	     writer_done_fn_t *fn, void *arg)
+{
+    int err;
+
+    memset(w, 0, sizeof(*w));
+    w->loop = loop;
+    w->mixer = mixer;
+    w->done_fn = fn;
+    w->done_arg = arg;
+    w->wake_fd = eventfd(0, EFD_CLOEXEC);
+    w->done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    w->done.handler = writer_done_handler;
+    if ((w->wake_fd < 0) || (w->done.fd < 0)) {
+	dofail(0, "unable to create eventfd: %s", strerror(errno));
+	goto fail;
+    }
+    if ((err = pthread_create(&w->thread, NULL, writer_main, w)) != 0) {
+	dofail(0, "unable to start mixer writer thread: %s", strerror(err));
+	goto fail;
+    }
+    loop_add(loop, &w->done, EPOLLIN | EPOLLET);
+    w->running = true;
+    return true;
+
+fail:
+    if (w->wake_fd >= 0) {
+	close(w->wake_fd);
+    }
+    if (w->done.fd >= 0) {
+	close(w->done.fd);
+    }
+    w->wake_fd = w->done.fd = -1;
+    return false;
+}
+
+/**
+ * @brief Pass \p state to the writer thread \p w to be written.  Only
+ * one write may be outstanding at a time.
+ *
+ * @param w (writer_t *) The writer, which must be running and not busy.
+ * @param state (volume_state_t *) The state to be written.
+ */
+void
+writer_post(writer_t *w, const volume_state_t *state)
+{
+    writer_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.state = *state;
+    w->busy = true;
+    w->posted++;
+    (void) spsc_push(&w->requests, &msg);
+    wake(w->wake_fd);
+}
+
+/**
+ * @brief Wait, without returning to the loop, for the outstanding write
+ * on \p w to complete, and pass its result to the done function.
+ *
+ * @param w (writer_t *) The writer.
+ */
+void
+writer_wait(writer_t *w)
+{
+    struct pollfd pfd;
+    uint64_t count;
+
+    pfd.fd = w->done.fd;
+    pfd.events = POLLIN;
+    while (w->busy) {
+	if (writer_collect(w) == 0) {
+	    (void) poll(&pfd, 1, -1);
+	    (void) read(w->done.fd, &count, sizeof(count));
+	}
+    }
+}
+
+/**
+ * @brief Stop the writer thread \p w, once any outstanding write has
+ * completed.
+ *
+ * @param w (writer_t *) The writer.
+ */
+void
+writer_stop(writer_t *w)
+{
+    writer_msg_t msg;
+
+    if (!w->running) {
+	return;
+    }
+    writer_wait(w);
+    memset(&msg, 0, sizeof(msg));
+    msg.stop = true;
+    (void) spsc_push(&w->requests, &msg);
+    wake(w->wake_fd);
+    (void) pthread_join(w->thread, NULL);
+    loop_del(w->loop, &w->done);
+    close(w->wake_fd);
+    close(w->done.fd);
+    w->wake_fd = w->done.fd = -1;
+    w->running = false;
+}
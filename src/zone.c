@@ -0,0 +1,327 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     Author:  Marc Munro
+ *     License: GPL V3
+ *
+ */
+
+/*
+ * Zones.  A zone is a mixer, with its own volume curve, command queue
+ * and subscribed clients, so that one daemon, on one port, can control
+ * several outputs.  Zone 0, the default zone, is configured by the
+ * top-level mixer settings, and is made up of #mixer, #command_queue
+ * and #volume_state, just as when there was only one.  Further zones
+ * are declared in the config file (see zone_options_t), and are
+ * numbered in the order of their declaration.
+ *
+ * All zones are served by the same event loop, but each has its own
+ * queue, and so its own write in flight: while one zone's mixer is
+ * being written, commands for the others are still written as they
+ * arrive.  With writer_thread set, each zone has its own writer thread,
+ * so that not even a mixer that blocks can delay another zone.
+ *
+ * Clients address zones by id: text clients with the zone command,
+ * which selects the zone for the commands that follow, and binary
+ * clients with the zone field of each record (see server.c).
+ *
+ * With lazy_mixer set, a zone's mixer is not opened, nor its command
+ * queue started, until the zone is first addressed by a client (see
+ * zone_ready()).  Probing a sound card can take a while, particularly
+ * early in boot, and this way volumed can accept connections, and
+ * answer anything else, in the meantime.  A mixer that cannot yet be
+ * opened fails only the command that needed it; the next such command
+ * tries again.  A zone whose mixer is open is one whose mixer has ops.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "volumed.h"
+
+static mixer_t zone_mixers[MAX_ZONES];
+static cmdq_t zone_queues[MAX_ZONES];
+static volume_state_t zone_states[MAX_ZONES];
+
+/**
+ * @brief The loop in which the command queues run, once zones_start()
+ * has been called.
+ */
+static loop_t *zones_loop = NULL;
+
+/**
+ * @brief All zones, of which there are #nzones.  The storage for zones
+ * other than zone 0 is in the arrays above, entry 0 of which is unused.
+ */
+zone_t zones[MAX_ZONES] = {
+    {0, DEFAULT_ZONE_NAME, &mixer, &command_queue, &volume_state}
+};
+
+/**
+ * @brief Return the zone with id \p id.
+ *
+ * @param id (int) The zone id.
+ *
+ * @return (zone_t *) The zone, or NULL if there is no such zone.
+ */
+zone_t *
+zone_find(int id)
+{
+    if ((id < 0) || (id >= nzones)) {
+	return NULL;
+    }
+    return &zones[id];
+}
+
+/**
+ * @brief Return the settings from \p opts for zone \p id.
+ */
+static zone_options_t
+zone_settings(const options_t *opts, int id)
+{
+    zone_options_t zo;
+
+    if (id) {
+	return opts->zones[id];
+    }
+    zo.name = DEFAULT_ZONE_NAME;
+    zo.volcurve = opts->volcurve;
+    zo.max_pct = opts->max_pct;
+    zo.alsa_mixer_name = opts->alsa_mixer_name;
+    zo.mpd_mixer = opts->mpd_mixer;
+    zo.alsa_card = opts->alsa_card;
+    zo.mixer = opts->mixer;
+    return zo;
+}
+
+/**
+ * @brief Open the mixer for \p zone, failing with \p code, as
+ * dofail() does, if it cannot be opened.
+ *
+ * @return (bool) true if the mixer was opened.
+ */
+static bool
+zone_open_mixer(zone_t *zone, int code)
+{
+    zone_options_t zo = zone_settings(&options, zone->id);
+
+    if (!mixer_open(zone->mixer, zo.mixer, zo.alsa_card,
+		    zo.alsa_mixer_name))
+    {
+	dofail(code, "unable to open mixer for zone %d (%s)",
+	       zone->id, zo.name);
+	return false;
+    }
+    (void) mixer_set_curve(zone->mixer, zo.volcurve, zo.max_pct);
+    if (options.verbosity && (nzones > 1)) {
+	printf("Zone %d: %s, card: %s, control: %s\n", zone->id, zo.name,
+	       zo.alsa_card ? zo.alsa_card: "default", zo.alsa_mixer_name);
+    }
+    return true;
+}
+
+/**
+ * @brief Set up each zone in #options and, unless lazy_mixer is set,
+ * open its mixer, failing if any cannot be opened.
+ */
+void
+zones_open(void)
+{
+    zone_t *zone;
+    int id;
+
+    nzones = options.nzones;
+    for (id = 0; id < nzones; id++) {
+	zone = &zones[id];
+	if (id) {
+	    zone->id = id;
+	    zone->mixer = &zone_mixers[id];
+	    zone->queue = &zone_queues[id];
+	    zone->state = &zone_states[id];
+	}
+	zone->name = zone_settings(&options, id).name;
+	if (!options.lazy_mixer) {
+	    (void) zone_open_mixer(zone, 2);
+	}
+    }
+}
+
+/**
+ * @brief Start the command queue, in \p loop, for each zone whose
+ * mixer is open.  The others are started by zone_ready().
+ *
+ * @param loop (loop_t *) The loop running the server.
+ */
+void
+zones_start(loop_t *loop)
+{
+    int id;
+
+    zones_loop = loop;
+    for (id = 0; id < nzones; id++) {
+	if (zones[id].mixer->ops) {
+	    cmdq_init(zones[id].queue, loop, zones[id].mixer);
+	}
+    }
+}
+
+/**
+ * @brief Make sure that the mixer for \p zone is open, and its command
+ * queue started, opening it now if it was left unopened by lazy_mixer.
+ * This must be called, once zones_start() has been, before anything
+ * uses the zone's mixer, queue or state.
+ *
+ * @param zone (zone_t *) The zone, which must be one of #zones rather
+ *        than a worker's view of one.
+ *
+ * @return (bool) false if the mixer could not be opened.  The problem
+ *         has been reported, and the next call will try again.
+ */
+bool
+zone_ready(zone_t *zone)
+{
+    uint64_t start;
+
+    if (zone->mixer->ops) {
+	return true;
+    }
+    start = now_us();
+    if (!zone_open_mixer(zone, 0)) {
+	return false;
+    }
+    cmdq_init(zone->queue, zones_loop, zone->mixer);
+    if (options.verbosity) {
+	printf("Opened mixer for zone %d in %lluus\n", zone->id,
+	       (unsigned long long) (now_us() - start));
+    }
+    return true;
+}
+
+/**
+ * @brief Make sure that the mixer for every zone is open.  See
+ * zone_ready().
+ *
+ * @return (bool) false if any mixer could not be opened.
+ */
+bool
+zones_ready(void)
+{
+    bool ready = true;
+    int id;
+
+    for (id = 0; id < nzones; id++) {
+	ready = zone_ready(&zones[id]) && ready;
+    }
+    return ready;
+}
+
+/**
+ * @brief Wait for any writes in flight, on writer threads, for every
+ * zone.  See cmdq_wait().
+ */
+void
+zones_wait(void)
+{
+    int id;
+
+    for (id = 0; id < nzones; id++) {
+	cmdq_wait(zones[id].queue);
+    }
+}
+
+/**
+ * @brief Check the zones in the freshly read options \p fresh against
+ * those in force.  Zones cannot be added, removed or given a different
+ * mixer without a restart, so if any such change has been made it is
+ * reported, and \p fresh is given the current zones back.  The volume
+ * curve of each zone can be changed, and is applied by zones_apply().
+ *
+ * @param fresh (options_t *) The new options.  The strings of any
+ *        zones given back are copied into its arena.
+ *
+ * @return (bool) false if the zones have been given back.
+ */
+bool
+zones_reconfigure(options_t *fresh)
+{
+    const zone_options_t *cur;
+    zone_options_t *zo;
+    bool changed = fresh->nzones != options.nzones;
+    int id;
+
+    for (id = 1; !changed && (id < fresh->nzones); id++) {
+	cur = &options.zones[id];
+	zo = &fresh->zones[id];
+	changed = (strcmp(zo->name, cur->name) != 0) ||
+	    (strcmp(zo->mixer, cur->mixer) != 0) ||
+	    (strcmp(zo->alsa_mixer_name, cur->alsa_mixer_name) != 0) ||
+	    ((zo->alsa_card || cur->alsa_card) &&
+	     (!zo->alsa_card || !cur->alsa_card ||
+	      (strcmp(zo->alsa_card, cur->alsa_card) != 0)));
+    }
+    if (!changed) {
+	return true;
+    }
+    fprintf(stderr, "Warning: zones cannot be added, removed or given "
+	    "a new mixer without a restart (keeping %d)\n", options.nzones);
+    fresh->nzones = options.nzones;
+    for (id = 1; id < options.nzones; id++) {
+	cur = &options.zones[id];
+	zo = &fresh->zones[id];
+	*zo = *cur;
+	zo->name = arena_strdup(fresh->arena, cur->name);
+	zo->mixer = arena_strdup(fresh->arena, cur->mixer);
+	zo->alsa_mixer_name = arena_strdup(fresh->arena,
+					   cur->alsa_mixer_name);
+	zo->mpd_mixer = arena_strdup(fresh->arena, cur->mpd_mixer);
+	zo->alsa_card = cur->alsa_card ?
+	    arena_strdup(fresh->arena, cur->alsa_card): NULL;
+    }
+    return false;
+}
+
+/**
+ * @brief Apply the settings, in the newly installed #options, to each
+ * zone other than zone 0, which is handled by config_reload() itself.
+ * Any zone whose volume curve changes is resynchronised with its mixer.
+ * A zone whose mixer has yet to be opened needs nothing more than its
+ * name: it is opened with whatever settings are then in force.
+ */
+void
+zones_apply(void)
+{
+    zone_options_t *zo;
+    zone_t *zone;
+    int id;
+
+    for (id = 1; id < nzones; id++) {
+	zone = &zones[id];
+	zo = &options.zones[id];
+	/* The old strings are about to be freed. */
+	zone->name = zo->name;
+	if (!zone->mixer->ops) {
+	    continue;
+	}
+	zone->mixer->card = zo->alsa_card;
+	zone->mixer->control = zo->alsa_mixer_name;
+	if (mixer_set_curve(zone->mixer, zo->volcurve, zo->max_pct)) {
+	    cmdq_resync(zone->queue);
+	}
+    }
+}
+
+/**
+ * @brief Stop the command queue, and close the mixer, of every zone
+ * whose mixer is open.
+ */
+void
+zones_shutdown(void)
+{
+    int id;
+
+    for (id = 0; id < nzones; id++) {
+	if (zones[id].mixer->ops) {
+	    cmdq_shutdown(zones[id].queue);
+	    mixer_close(zones[id].mixer);
+	}
+    }
+    zones_loop = NULL;
+}
@@ -0,0 +1,134 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     License: GPL V3
+ *
+ * Microbenchmark for the websocket unmasking and UTF-8 validation
+ * kernels in simd.c.  Each kernel set that the CPU supports is timed
+ * over payloads of the sizes that clients send, from a short command
+ * up to WS_MAX_PAYLOAD.
+ *
+ * Build with "make tests/bench_simd".  Usage: bench_simd [kernels]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/volumed.h"
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static const size_t sizes[] = {12, 64, 256, WS_MAX_PAYLOAD};
+
+/* Text with a sprinkling of non-ASCII characters, such as a zone or
+ * track name might contain. */
+static const char mixed[] = "Sigur R\xc3\xb3s \xe2\x80\x93 Hopp\xc3\xadpolla ";
+
+static double
+elapsed_nsecs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+	(end->tv_nsec - start->tv_nsec);
+}
+
+/* Time iters calls of the unmask kernel, returning nsecs per call. */
+static double
+time_unmask(const simd_kernels_t *k, uint8_t *buf, size_t len, long iters)
+{
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    struct timespec start;
+    struct timespec end;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++) {
+	k->unmask(buf, len, mask);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_nsecs(&start, &end) / iters;
+}
+
+/* Time iters calls of the UTF-8 kernel, returning nsecs per call. */
+static double
+time_utf8(const simd_kernels_t *k, const uint8_t *buf, size_t len,
+	  long iters)
+{
+    struct timespec start;
+    struct timespec end;
+    long valid = 0;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++) {
+	valid += k->utf8_valid(buf, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (valid != iters) {
+	fprintf(stderr, "%s: UTF-8 kernel rejected valid text\n", k->name);
+	exit(1);
+    }
+    return elapsed_nsecs(&start, &end) / iters;
+}
+
+static void
+bench(const simd_kernels_t *k)
+{
+    uint8_t ascii[WS_MAX_PAYLOAD];
+    uint8_t text[WS_MAX_PAYLOAD];
+    size_t len;
+    long iters;
+    double ns[3];
+    int i;
+
+    memset(ascii, 'v', sizeof(ascii));
+    for (len = 0; len < sizeof(text); len++) {
+	text[len] = mixed[len % (sizeof(mixed) - 1)];
+    }
+    printf("%s:\n", k->name);
+    /* Warm up the caches, and the CPU's clock. */
+    (void) time_unmask(k, ascii, sizeof(ascii), BENCH_BYTES / sizeof(ascii));
+    memset(ascii, 'v', sizeof(ascii));
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	len = sizes[i];
+	/* Don't split a multi-byte character at the end of the text. */
+	while ((len > 0) && (len < sizeof(text)) &&
+	       ((text[len] & 0xc0) == 0x80))
+	{
+	    len--;
+	}
+	iters = BENCH_BYTES / sizes[i];
+	ns[0] = time_unmask(k, ascii, sizes[i], iters);
+	memset(ascii, 'v', sizeof(ascii));
+	ns[1] = time_utf8(k, ascii, sizes[i], iters);
+	ns[2] = time_utf8(k, text, len, iters);
+	printf("  %4zu bytes: unmask %6.1f ns (%6.0f MB/s), "
+	       "utf8 ascii %6.1f ns (%6.0f MB/s), mixed %6.1f ns\n",
+	       sizes[i], ns[0], sizes[i] * 1e3 / ns[0],
+	       ns[1], sizes[i] * 1e3 / ns[1], ns[2]);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const simd_kernels_t *k;
+    int i;
+
+    if (argc > 1) {
+	for (i = 1; i < argc; i++) {
+	    if (!(k = simd_find(argv[i]))) {
+		fprintf(stderr, "%s: kernels unknown or unsupported\n",
+			argv[i]);
+		return 1;
+	    }
+	    bench(k);
+	}
+	return 0;
+    }
+    for (k = simd_kernels; k->name; k++) {
+	if (k->supported()) {
+	    bench(k);
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,365 @@
+/*
+ *     Copyright (c) 2017 Marc Munro
+ *     License: GPL V3
+ *
+ * Microbenchmarks for the hot paths of volumed that do not involve a
+ * socket or a mixer: reading the config file, mapping volumes through
+ * the volume curve, encoding and decoding websocket frames and parsing
+ * commands.
+ *
+ * Each benchmark is run several times, and the fastest run is
+ * reported, as nanoseconds per operation, on stdout in the form:
+ *
+ *     <name> <ns>
+ *
+ * one benchmark per line.  This is also the format of the baseline
+ * file, so that the output of one run can be saved as the baseline for
+ * the next.  Given a baseline, each result is compared against it on
+ * stderr, and the exit status is 1 if any benchmark is slower than its
+ * baseline by more than the tolerance, even after being re-run.
+ *
+ * Build and run with "make bench", and record a baseline with "make
+ * bench-baseline".  Usage:
+ *
+ *     bench_volumed [-b baseline] [-t tolerance_pct] [benchmark]...
+ *
+ * Like tests/check_volumed, this must be run from the top of the build
+ * tree, as it reads tests/configfile.tst2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../src/volumed.h"
+
+#define BENCH_RUNS       7
+#define BENCH_RUN_NSECS  20000000.0	/* Target length of each run */
+#define BENCH_MAX_NAME   32
+#define BENCH_TOLERANCE  25
+#define BENCH_RETRIES    2	/* Re-runs before a regression is reported */
+
+#define BENCH_CONFIG     "tests/configfile.tst2"
+
+typedef void (bench_fn_t)(long iters);
+
+typedef struct s_bench {
+    const char *name;
+    bench_fn_t *fn;
+    double ns;			/* Result: nsecs per operation */
+} bench_t;
+
+/* Defeats the optimiser: each benchmark accumulates into this. */
+static volatile long sink;
+
+/* A config file of a realistic size, with comments and blank lines. */
+static const char config_text[] =
+    "# volumed configuration\n"
+    "\n"
+    "port = 8888            # websocket port\n"
+    "socket_path = /run/volumed.sock\n"
+    "max_clients = 64\n"
+    "\n"
+    "# Mixer\n"
+    "mixer = alsa\n"
+    "alsa_card_name = hw:0\n"
+    "alsa_mixer_name = Digital\n"
+    "mpd_mixer = hardware\n"
+    "volcurve = yes\n"
+    "max_pct = 90\n"
+    "\n"
+    "# Ramping\n"
+    "ramp_step = 10\n"
+    "ramp_interval = 15\n";
+
+static const char *commands[] = {
+    "volume 50", "up 1", "down 5", "mute", "  Volume   100  ", "toggle",
+    "unmute", "status", "wibble 3"
+};
+
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static mixer_t bench_mixer;
+static options_t bench_options;
+
+static void
+bench_config_tokenize(long iters)
+{
+    char buf[sizeof(config_text)];
+    config_reader_t reader;
+    char *token;
+    char *value;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+	/* The reader tokenizes in place, so needs a fresh copy each time. */
+	memcpy(buf, config_text, sizeof(buf));
+	reader.pos = buf;
+	reader.end = buf + sizeof(buf) - 1;
+	reader.line_no = 0;
+	reader.filename = "bench";
+	while (next_config_setting(&reader, &token, &value)) {
+	    sink += *value;
+	}
+    }
+}
+
+static void
+bench_config_read(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++) {
+	(void) read_config_options(&bench_options, 0);
+	sink += bench_options.port;
+	free_config_options(&bench_options);
+    }
+}
+
+static void
+bench_volcurve_build(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++) {
+	bench_mixer.curve.builds = 0;
+	(void) volcurve_build(&bench_mixer.curve, &bench_mixer,
+			      (i & 1) == 0, 90);
+	sink += bench_mixer.curve.raw[50];
+    }
+}
+
+/* One operation is a percentage mapped to raw, and back. */
+static void
+bench_volcurve_map(long iters)
+{
+    long raw;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+	raw = mixer_pct_to_raw(&bench_mixer, i % VOLCURVE_STEPS);
+	sink += mixer_raw_to_pct(&bench_mixer, raw + (i & 3));
+    }
+}
+
+static void
+bench_ws_encode(long iters)
+{
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t buf[64];
+    long i;
+
+    for (i = 0; i < iters; i++) {
+	sink += ws_encode_frame(buf, WS_OP_TEXT, commands[i % NCOMMANDS],
+				strlen(commands[i % NCOMMANDS]), mask);
+    }
+}
+
+static void
+bench_ws_decode(long iters)
+{
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t frames[NCOMMANDS][64];
+    size_t lens[NCOMMANDS];
+    uint8_t buf[64];
+    ws_frame_t frame;
+    int n;
+    long i;
+
+    for (n = 0; n < NCOMMANDS; n++) {
+	lens[n] = ws_encode_frame(frames[n], WS_OP_TEXT, commands[n],
+				  strlen(commands[n]), mask);
+    }
+    for (i = 0; i < iters; i++) {
+	/* Frames are unmasked in place, so parse a copy. */
+	n = i % NCOMMANDS;
+	memcpy(buf, frames[n], lens[n]);
+	sink += ws_parse_frame(buf, lens[n], &frame);
+    }
+}
+
+static void
+bench_parse_command(long iters)
+{
+    size_t lens[NCOMMANDS];
+    command_t cmd;
+    int n;
+    long i;
+
+    for (n = 0; n < NCOMMANDS; n++) {
+	lens[n] = strlen(commands[n]);
+    }
+    for (i = 0; i < iters; i++) {
+	n = i % NCOMMANDS;
+	sink += parse_command(commands[n], lens[n], &cmd) + cmd.value;
+    }
+}
+
+static bench_t benches[] = {
+    {"config_tokenize", bench_config_tokenize},
+    {"config_read", bench_config_read},
+    {"volcurve_build", bench_volcurve_build},
+    {"volcurve_map", bench_volcurve_map},
+    {"ws_encode", bench_ws_encode},
+    {"ws_decode", bench_ws_decode},
+    {"parse_command", bench_parse_command},
+    {NULL, NULL}
+};
+
+static double
+elapsed_nsecs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+	(end->tv_nsec - start->tv_nsec);
+}
+
+static double
+time_run(bench_fn_t *fn, long iters)
+{
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fn(iters);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_nsecs(&start, &end);
+}
+
+/*
+ * Time b, returning the fastest of BENCH_RUNS runs in nsecs per
+ * operation.  The number of iterations in each run is first doubled
+ * until a run takes long enough to be timed reliably, which also warms
+ * the caches and the CPU's clock.
+ */
+static double
+run_bench(bench_t *b)
+{
+    double best = 0;
+    double ns;
+    long iters = 1;
+    int run;
+
+    while ((ns = time_run(b->fn, iters)) < BENCH_RUN_NSECS / 8) {
+	iters *= 2;
+    }
+    iters = (long) (iters * BENCH_RUN_NSECS / ns) + 1;
+    for (run = 0; run < BENCH_RUNS; run++) {
+	ns = time_run(b->fn, iters) / iters;
+	if ((run == 0) || (ns < best)) {
+	    best = ns;
+	}
+    }
+    return best;
+}
+
+/*
+ * Compare the results against the baseline file at path, reporting on
+ * stderr.  A benchmark that appears to have regressed is re-run, up to
+ * BENCH_RETRIES times, keeping its best result, so that a burst of
+ * activity elsewhere on the machine is not mistaken for a regression.
+ * Returns the number of regressions.
+ */
+static int
+compare_baseline(const char *path, double tolerance)
+{
+    char name[BENCH_MAX_NAME];
+    double base;
+    double change;
+    bench_t *b;
+    FILE *f;
+    int retry;
+    int regressions = 0;
+
+    if (!(f = fopen(path, "r"))) {
+	fprintf(stderr, "%s: unable to open baseline\n", path);
+	exit(2);
+    }
+    fprintf(stderr, "%-16s %10s %10s %8s\n",
+	    "benchmark", "baseline", "now", "change");
+    while (fscanf(f, "%31s %lf", name, &base) == 2) {
+	for (b = benches; b->name; b++) {
+	    if (b->ns && (strcmp(b->name, name) == 0)) {
+		for (retry = 0; retry < BENCH_RETRIES; retry++) {
+		    if ((b->ns - base) * 100 / base <= tolerance) {
+			break;
+		    }
+		    b->ns = MIN(b->ns, run_bench(b));
+		}
+		change = (b->ns - base) * 100 / base;
+		fprintf(stderr, "%-16s %8.1fns %8.1fns %+7.1f%%%s\n",
+			name, base, b->ns, change,
+			(change > tolerance) ? "  REGRESSION": "");
+		if (change > tolerance) {
+		    regressions++;
+		}
+		break;
+	    }
+	}
+    }
+    fclose(f);
+    if (regressions) {
+	fprintf(stderr, "%d benchmark(s) more than %g%% slower than %s\n",
+		regressions, tolerance, path);
+    }
+    return regressions;
+}
+
+static void
+bench_init(void)
+{
+    char *argv[] = {"bench_volumed", "-c", BENCH_CONFIG};
+
+    process_args(3, argv);
+    read_config_file();
+    if (!mixer_open(&bench_mixer, "fake", NULL, "Digital")) {
+	fprintf(stderr, "unable to open fake mixer\n");
+	exit(2);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *baseline = NULL;
+    double tolerance = BENCH_TOLERANCE;
+    bench_t *b;
+    int regressions;
+    int first;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+	switch (opt) {
+	case 'b': baseline = optarg; break;
+	case 't': tolerance = atof(optarg); break;
+	default:
+	    fprintf(stderr, "Usage: %s [-b baseline] [-t tolerance_pct] "
+		    "[benchmark]...\n", argv[0]);
+	    return 2;
+	}
+    }
+    /* process_args(), called by bench_init(), uses getopt too. */
+    first = optind;
+    bench_init();
+    for (b = benches; b->name; b++) {
+	if (first < argc) {
+	    for (i = first; i < argc; i++) {
+		if (strcmp(argv[i], b->name) == 0) {
+		    break;
+		}
+	    }
+	    if (i == argc) {
+		continue;
+	    }
+	}
+	b->ns = run_bench(b);
+    }
+    regressions = baseline ? compare_baseline(baseline, tolerance): 0;
+    for (b = benches; b->name; b++) {
+	if (b->ns) {
+	    printf("%s %.1f\n", b->name, b->ns);
+	}
+    }
+    return regressions ? 1: 0;
+}
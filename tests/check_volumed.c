@@ -13,9 +13,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <check.h>
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
 #include "../src/volumed.h"
 
 #define PROGNAME "./volumed"
@@ -73,6 +89,20 @@ START_TEST(param_port)
 }
 END_TEST
 
+/* Test the handling of the --mixer option. */
+START_TEST(param_mixer)
+{
+    char *argv[] = {PROGNAME, "-m", "fake"};
+    char *argv2[] = {PROGNAME, "--mixer=alsa"};
+
+    process_args(3, argv);
+    ck_assert(strcmp(options.mixer, "fake") == 0);
+
+    process_args(2, argv2);
+    ck_assert(strcmp(options.mixer, "alsa") == 0);
+}
+END_TEST
+
 typedef void (redirect_checker_fn_t)(void);
 static FILE *my_stderr;
 static redirect_checker_fn_t *chk_redirect;
@@ -268,6 +298,7 @@ tcase_params(char *tests)
     add_test(tc_params, param_progname, tests);
     add_test(tc_params, param_configfile, tests);
     add_test(tc_params, param_port, tests);
+    add_test(tc_params, param_mixer, tests);
     add_test(tc_params, param_missing_port, tests);
     add_test(tc_params, param_missing_config, tests);
     add_test(tc_params, param_version, tests);
@@ -289,6 +320,7 @@ START_TEST(config_base)
     ck_assert(strcmp(options.alsa_mixer_name, "Digital") == 0);
     ck_assert(strcmp(options.mpd_mixer, "hardware") == 0);
     ck_assert(options.alsa_card == NULL);   
+    ck_assert(strcmp(options.mixer, CONFIG_MIXER) == 0);
 }
 END_TEST
 
@@ -388,6 +420,114 @@ START_TEST(config_tst4)
 }
 END_TEST
 
+START_TEST(config_zones)
+{
+    char *argv[] = {PROGNAME,  "-c", "tests/configfile.tst3"};
+    int r;
+
+    redirect(stderr, "stderr.log");
+    process_args(3, argv);
+    read_config_file();
+    fflush(stderr);
+    r = system("grep \"Duplicate zone \\\"kitchen\\\".*tst3:15\""
+	       " stderr.log >/dev/null");
+    unlink("stderr.log");
+    ck_assert_int_eq(r, 0);
+
+    /* The top-level settings are those of zone 0, and are unaffected by
+     * settings within zones. */
+    ck_assert_int_eq(options.nzones, 3);
+    ck_assert_int_eq(options.port, 8890);
+    ck_assert_int_eq(options.max_pct, 90);
+    ck_assert(options.volcurve);
+    ck_assert(options.alsa_card == NULL);
+    ck_assert_str_eq(options.alsa_mixer_name, "Digital");
+
+    ck_assert_str_eq(options.zones[1].name, "kitchen");
+    ck_assert_str_eq(options.zones[1].alsa_card, "hw:1");
+    ck_assert_str_eq(options.zones[1].alsa_mixer_name, "PCM");
+    ck_assert_str_eq(options.zones[1].mixer, "fake");
+    ck_assert_int_eq(options.zones[1].max_pct, 90);
+    ck_assert(options.zones[1].volcurve);
+
+    /* Zones inherit from the top level, not from each other. */
+    ck_assert_str_eq(options.zones[2].name, "study");
+    ck_assert(options.zones[2].alsa_card == NULL);
+    ck_assert_str_eq(options.zones[2].alsa_mixer_name, "Digital");
+    ck_assert_int_eq(options.zones[2].max_pct, 75);
+    ck_assert(!options.zones[2].volcurve);
+}
+END_TEST
+
+START_TEST(config_tokenize)
+{
+    char buf[] =
+	"  # comment\n"
+	"\n"
+	"key = value with spaces  # comment\n"
+	"bare\n"
+	" a=b=c \r\n"
+	"last=1";
+    config_reader_t reader = {buf, buf + sizeof(buf) - 1, 0, "buf"};
+    char *token;
+    char *value;
+
+    redirect(stderr, "stderr.log");
+    ck_assert(next_config_setting(&reader, &token, &value));
+    ck_assert_str_eq(token, "key");
+    ck_assert_str_eq(value, "value with spaces");
+    ck_assert_int_eq(reader.line_no, 3);
+    ck_assert(next_config_setting(&reader, &token, &value));
+    ck_assert_str_eq(token, "a");
+    ck_assert_str_eq(value, "b=c");
+    ck_assert_int_eq(reader.line_no, 5);
+    ck_assert(next_config_setting(&reader, &token, &value));
+    ck_assert_str_eq(token, "last");
+    ck_assert_str_eq(value, "1");
+    ck_assert(!next_config_setting(&reader, &token, &value));
+    fflush(stderr);
+    ck_assert_int_eq(system("grep \"Invalid configuration entry "
+			    "\\\"bare\\\".*buf:4\" stderr.log >/dev/null"), 0);
+    unlink("stderr.log");
+
+    /* Values are views into the buffer, not copies. */
+    ck_assert(value > buf && value < buf + sizeof(buf));
+}
+END_TEST
+
+START_TEST(config_arena)
+{
+    arena_t *arena = arena_new("test", 64);
+    char *s1;
+    char *s2;
+    void *big;
+
+    s1 = arena_strdup(arena, "hello");
+    s2 = arena_strdup(arena, "world");
+    ck_assert_str_eq(s1, "hello");
+    ck_assert_str_eq(s2, "world");
+    ck_assert_int_eq(((uintptr_t) s2) % 8, 0);
+    ck_assert_int_eq(arena->allocated, 64);
+    ck_assert_int_eq(arena->used, 16);
+
+    /* An allocation larger than a chunk gets a chunk of its own. */
+    big = arena_alloc(arena, 1000);
+    memset(big, 0, 1000);
+    ck_assert_int_eq(arena->allocated, 64 + 1000);
+    ck_assert_str_eq(s1, "hello");
+
+    /* Resetting keeps only the first chunk. */
+    arena_reset(arena);
+    ck_assert_int_eq(arena->nchunks, 1);
+    ck_assert_int_eq(arena->allocated, 64);
+    ck_assert_int_eq(arena->used, 0);
+    ck_assert_int_eq(arena->peak, 1016);
+    s1 = arena_strdup(arena, "again");
+    ck_assert_int_eq(arena->used, 8);
+    arena_free(arena);
+}
+END_TEST
+
 static TCase *
 tcase_config(char *tests)
 {
@@ -398,10 +538,2663 @@ tcase_config(char *tests)
     add_test(tc_config, config_tst2, tests);
     add_test(tc_config, config_tst3, tests);
     add_test(tc_config, config_tst4, tests);
+    add_test(tc_config, config_zones, tests);
+    add_test(tc_config, config_tokenize, tests);
+    add_test(tc_config, config_arena, tests);
 
     return tc_config;
 }
 
+START_TEST(ws_accept_key)
+{
+    /* The sample handshake from RFC 6455 section 1.3. */
+    char req[] =
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n\r\n";
+    static const char proto_req[] =
+	"GET / HTTP/1.1\r\n"
+	"Upgrade: websocket\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Protocol: chat, " BIN_PROTOCOL "\r\n"
+	"Sec-WebSocket-Version: 13\r\n\r\n";
+    char resp[256];
+    size_t resp_len;
+    bool selected;
+
+    ck_assert_int_eq(ws_handshake(req, 20, NULL, resp, sizeof(resp),
+				  &resp_len, NULL), 0);
+    ck_assert_int_eq(ws_handshake(req, strlen(req), BIN_PROTOCOL, resp,
+				  sizeof(resp), &resp_len, &selected),
+		     strlen(req));
+    resp[resp_len] = '\0';
+    ck_assert(strncmp(resp, "HTTP/1.1 101 ", 13) == 0);
+    ck_assert(strstr(resp, "Sec-WebSocket-Accept: "
+		     "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != NULL);
+    ck_assert(!selected);
+    ck_assert(strstr(resp, "Sec-WebSocket-Protocol") == NULL);
+
+    /* A subprotocol is selected only if the client offers it. */
+    ck_assert_int_eq(ws_handshake(proto_req, strlen(proto_req), BIN_PROTOCOL,
+				  resp, sizeof(resp), &resp_len, &selected),
+		     strlen(proto_req));
+    resp[resp_len] = '\0';
+    ck_assert(selected);
+    ck_assert(strstr(resp, "\r\nSec-WebSocket-Protocol: " BIN_PROTOCOL
+		     "\r\n\r\n") != NULL);
+    ck_assert_int_eq(ws_handshake(proto_req, strlen(proto_req), "other",
+				  resp, sizeof(resp), &resp_len, &selected),
+		     strlen(proto_req));
+    ck_assert(!selected);
+
+    ck_assert_int_eq(ws_handshake("GET / HTTP/1.1\r\n\r\n", 18, NULL, resp,
+				  sizeof(resp), &resp_len, NULL), -1);
+    resp[resp_len] = '\0';
+    ck_assert(strncmp(resp, "HTTP/1.1 400 ", 13) == 0);
+}
+END_TEST
+
+START_TEST(ws_frames)
+{
+    uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t buf[WS_MAX_HEADER + WS_MAX_PAYLOAD];
+    char payload[300];
+    ws_frame_t frame;
+    size_t len;
+
+    len = ws_encode_frame(buf, WS_OP_TEXT, "Hello", 5, mask);
+    /* The masked frame example from RFC 6455 section 5.7. */
+    ck_assert_int_eq(len, 11);
+    ck_assert(memcmp(buf, "\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58",
+		     11) == 0);
+    ck_assert_int_eq(ws_parse_frame(buf, len - 1, &frame), 0);
+    ck_assert_int_eq(ws_parse_frame(buf, len, &frame), len);
+    ck_assert(frame.fin && frame.masked);
+    ck_assert_int_eq(frame.opcode, WS_OP_TEXT);
+    ck_assert_int_eq(frame.len, 5);
+    ck_assert(memcmp(frame.payload, "Hello", 5) == 0);
+
+    memset(payload, 'x', sizeof(payload));
+    len = ws_encode_frame(buf, WS_OP_BINARY, payload, sizeof(payload), NULL);
+    ck_assert_int_eq(len, sizeof(payload) + 4);
+    ck_assert_int_eq(ws_parse_frame(buf, len, &frame), len);
+    ck_assert(!frame.masked);
+    ck_assert_int_eq(frame.len, sizeof(payload));
+
+    /* Anything larger than WS_MAX_PAYLOAD is refused. */
+    buf[1] = 127;
+    memset(buf + 2, 0, 8);
+    buf[8] = 0x10;
+    ck_assert_int_eq(ws_parse_frame(buf, 10, &frame), -1);
+}
+END_TEST
+
+/* Every kernel set that the CPU supports unmasks and validates exactly
+ * as the byte-at-a-time definitions do, whatever the length of the
+ * payload and wherever in it a multi-byte character falls. */
+START_TEST(simd_kernels_agree)
+{
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    static const struct {
+	const char *text;
+	bool valid;
+    } cases[] = {
+	{"\xc3\xb3", true},		/* U+00F3 */
+	{"\xe2\x80\x93", true},		/* U+2013 */
+	{"\xf0\x9f\x8e\xb5", true},	/* U+1F3B5 */
+	{"\xf4\x8f\xbf\xbf", true},	/* U+10FFFF */
+	{"\x80", false},		/* Lone continuation */
+	{"\xc3", false},		/* Truncated */
+	{"\xc0\xaf", false},		/* Overlong */
+	{"\xe0\x80\xaf", false},	/* Overlong */
+	{"\xed\xa0\x80", false},	/* Surrogate */
+	{"\xf4\x90\x80\x80", false},	/* Above U+10FFFF */
+	{"\xff", false},
+    };
+    const simd_kernels_t *k;
+    uint8_t buf[80];
+    uint8_t expected[80];
+    size_t len;
+    size_t pos;
+    size_t i;
+    int c;
+
+    for (k = simd_kernels; k->name; k++) {
+	if (!k->supported()) {
+	    continue;
+	}
+	for (len = 0; len <= sizeof(buf); len++) {
+	    for (i = 0; i < len; i++) {
+		buf[i] = expected[i] = (uint8_t) (i * 7 + len);
+		expected[i] ^= mask[i & 3];
+	    }
+	    k->unmask(buf, len, mask);
+	    ck_assert_msg(memcmp(buf, expected, len) == 0,
+			  "%s unmask, length %zu", k->name, len);
+	}
+	for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+	    for (pos = 0; pos + strlen(cases[c].text) <= sizeof(buf); pos++) {
+		memset(buf, 'x', sizeof(buf));
+		memcpy(buf + pos, cases[c].text, strlen(cases[c].text));
+		len = pos + strlen(cases[c].text);
+		ck_assert_msg(k->utf8_valid(buf, len) == cases[c].valid,
+			      "%s utf8 case %d at %zu", k->name, c, pos);
+		ck_assert_msg(k->utf8_valid(buf, sizeof(buf)) == cases[c].valid,
+			      "%s utf8 case %d at %zu, padded",
+			      k->name, c, pos);
+	    }
+	}
+	ck_assert(k->utf8_valid((const uint8_t *) "", 0));
+    }
+    ck_assert(simd_find("scalar") != NULL);
+    ck_assert(simd_find("wibble") == NULL);
+}
+END_TEST
+
+START_TEST(command_parse)
+{
+    command_t cmd;
+
+    ck_assert(parse_command("volume 40", 9, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_VOLUME);
+    ck_assert_int_eq(cmd.value, 40);
+    ck_assert(parse_command("  UP  ", 6, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_UP);
+    ck_assert_int_eq(cmd.value, 1);
+    ck_assert(parse_command("down 5", 6, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_DOWN);
+    ck_assert_int_eq(cmd.value, 5);
+    ck_assert(parse_command("toggle", 6, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_TOGGLE_MUTE);
+    ck_assert(parse_command("status", 6, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_STATUS);
+    ck_assert(!parse_command("volume", 6, &cmd));
+    ck_assert(!parse_command("mute 3", 6, &cmd));
+    ck_assert(!parse_command("volume 4x", 9, &cmd));
+    ck_assert(!parse_command("wibble", 6, &cmd));
+}
+END_TEST
+
+/* Parse text into a fresh batch, and format the commands it would
+ * send as a single string. */
+static char *
+batch_result(const char *text, char *buf, size_t size, size_t *p_used)
+{
+    cmd_batch_t batch;
+    command_t cmds[BATCH_MAX_COMMANDS];
+    size_t len = 0;
+    int n;
+    int i;
+
+    batch_init(&batch);
+    *p_used = batch_parse(&batch, text, strlen(text));
+    n = batch_commands(&batch, cmds);
+    buf[0] = '\0';
+    for (i = 0; i < n; i++) {
+	len += snprintf(buf + len, size - len, "%s", i ? ";": "");
+	len += format_command(&cmds[i], buf + len, size - len);
+    }
+    return buf;
+}
+
+START_TEST(client_batch)
+{
+    char buf[64];
+    size_t used;
+
+    ck_assert_str_eq(batch_result("up\nup 3\ndown\n", buf, sizeof(buf),
+				  &used), "up 3");
+    ck_assert_str_eq(batch_result("up 5\ndown 5\n", buf, sizeof(buf),
+				  &used), "");
+    ck_assert_str_eq(batch_result("down 2\nvolume 40\nup 5\n", buf,
+				  sizeof(buf), &used), "volume 45");
+    ck_assert_str_eq(batch_result("volume 3\ndown 5\nup 1\n", buf,
+				  sizeof(buf), &used), "volume 1");
+    ck_assert_str_eq(batch_result("toggle\ntoggle\n", buf, sizeof(buf),
+				  &used), "");
+    ck_assert_str_eq(batch_result("toggle\ntoggle\ntoggle\n", buf,
+				  sizeof(buf), &used), "toggle");
+    ck_assert_str_eq(batch_result("mute\ntoggle\n", buf, sizeof(buf),
+				  &used), "unmute");
+    ck_assert_str_eq(batch_result("status\ndown\nunmute\n", buf,
+				  sizeof(buf), &used),
+		     "down 1;unmute;status");
+
+    /* An unterminated line is left for later; blank lines and invalid
+     * commands are skipped. */
+    ck_assert_str_eq(batch_result("up\n\n  \r\nwibble\nup", buf,
+				  sizeof(buf), &used), "up 1");
+    ck_assert_int_eq(used, 15);
+}
+END_TEST
+
+/* Feed a single lircd event, at time now, to lirc. */
+static void
+lirc_event(lirc_t *lirc, cmd_batch_t *batch, const char *button,
+	   int repeat, uint64_t now)
+{
+    char line[LIRC_LINE_MAX];
+    size_t len;
+
+    len = snprintf(line, sizeof(line), "000000000000%04x %02x %s remote\n",
+		   0x1234, repeat, button);
+    ck_assert_int_eq(lirc_feed(lirc, line, len, now, batch), len);
+}
+
+/* Holding a button down is a single gesture, over which the step
+ * accelerates; mute toggles only on the initial press. */
+START_TEST(lirc_gestures)
+{
+    lirc_t lirc;
+    cmd_batch_t batch;
+    uint64_t now = 1000;
+    int expected = 0;
+    int i;
+
+    ck_assert(!lirc_init(&lirc, "KEY_VOLUMEUP,KEY_VOLUMEDOWN"));
+    ck_assert(!lirc_init(&lirc, "KEY_VOLUMEUP,,KEY_MUTE"));
+    ck_assert(lirc_init(&lirc, LIRC_DEFAULT_KEYS));
+    batch_init(&batch);
+
+    for (i = 0; i < 30; i++, now += 110) {
+	lirc_event(&lirc, &batch, "KEY_VOLUMEUP", i, now);
+	expected += MIN(1 + i / LIRC_ACCEL_EVENTS, LIRC_MAX_STEP);
+	ck_assert_int_eq(batch.step, MIN(expected, 100));
+    }
+    ck_assert_int_eq(MIN(1 + 29 / LIRC_ACCEL_EVENTS, LIRC_MAX_STEP),
+		     LIRC_MAX_STEP);
+
+    /* A new press starts again at 1, as does a repeat that follows a
+     * long gap, since we must have missed its initial press. */
+    batch_init(&batch);
+    lirc_event(&lirc, &batch, "KEY_VOLUMEDOWN", 0, now);
+    ck_assert_int_eq(batch.step, -1);
+    for (i = 1; i <= LIRC_ACCEL_EVENTS; i++) {
+	lirc_event(&lirc, &batch, "KEY_VOLUMEDOWN", i, now += 110);
+    }
+    ck_assert_int_eq(batch.step, -(LIRC_ACCEL_EVENTS + 2));
+    lirc_event(&lirc, &batch, "KEY_VOLUMEDOWN", i,
+	       now += LIRC_GESTURE_GAP_MS + 1);
+    ck_assert_int_eq(batch.step, -(LIRC_ACCEL_EVENTS + 3));
+
+    batch_init(&batch);
+    lirc_event(&lirc, &batch, "KEY_MUTE", 0, now += 110);
+    lirc_event(&lirc, &batch, "KEY_MUTE", 1, now += 110);
+    lirc_event(&lirc, &batch, "KEY_MUTE", 2, now += 110);
+    ck_assert_int_eq(batch.mute, CMD_TOGGLE_MUTE);
+
+    /* Other buttons, and lircd's replies to commands, are ignored. */
+    batch_init(&batch);
+    lirc_event(&lirc, &batch, "KEY_PLAY", 0, now += 110);
+    ck_assert_int_eq(lirc_feed(&lirc, "BEGIN\nSIGHUP\nEND\n", 17, now,
+			       &batch), 17);
+    ck_assert_int_eq(lirc_feed(&lirc, "0000000000001234 00 KEY_MU", 26,
+			       now, &batch), 0);
+    ck_assert(batch_empty(&batch));
+}
+END_TEST
+
+START_TEST(bin_records)
+{
+    static const uint8_t volume[BIN_RECORD_SIZE] =
+	{BIN_OP_VOLUME, 0, 0x12, 0x34, 0, 0, 0, 40};
+    uint8_t buf[BIN_RECORD_SIZE];
+    bin_record_t rec;
+    command_t cmd;
+
+    bin_decode(volume, &rec);
+    ck_assert_int_eq(rec.op, BIN_OP_VOLUME);
+    ck_assert_int_eq(rec.seq, 0x1234);
+    ck_assert_int_eq(rec.value, 40);
+    ck_assert(bin_command(&rec, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_VOLUME);
+    ck_assert_int_eq(cmd.value, 40);
+    bin_encode(buf, &rec);
+    ck_assert(memcmp(buf, volume, sizeof(buf)) == 0);
+
+    rec.op = BIN_OP_TOGGLE_MUTE;
+    ck_assert(bin_command(&rec, &cmd));
+    ck_assert_int_eq(cmd.type, CMD_TOGGLE_MUTE);
+
+    /* Out of range values, unknown ops and other zones are refused. */
+    rec.op = BIN_OP_UP;
+    rec.value = -1;
+    ck_assert(!bin_command(&rec, &cmd));
+    rec.value = 1001;
+    ck_assert(!bin_command(&rec, &cmd));
+    rec.value = 1;
+    rec.zone = 1;
+    ck_assert(!bin_command(&rec, &cmd));
+    rec.zone = 0;
+    rec.op = BIN_OP_STATE;
+    ck_assert(!bin_command(&rec, &cmd));
+
+    volume_state.volume = 55;
+    volume_state.mute = true;
+    bin_status(&rec, &zones[0], 7);
+    bin_encode(buf, &rec);
+    ck_assert(memcmp(buf, "\x80\x00\x00\x07\x00\x00\x01\x37", 8) == 0);
+}
+END_TEST
+
+START_TEST(command_apply)
+{
+    volume_state_t state = {0, false};
+    command_t cmd = {CMD_VOLUME, 95};
+
+    ck_assert(apply_command(&state, &cmd));
+    ck_assert(!apply_command(&state, &cmd));
+    cmd.type = CMD_UP;
+    cmd.value = 10;
+    ck_assert(apply_command(&state, &cmd));
+    ck_assert_int_eq(state.volume, 100);
+    ck_assert(!apply_command(&state, &cmd));
+    cmd.type = CMD_TOGGLE_MUTE;
+    ck_assert(apply_command(&state, &cmd));
+    ck_assert(state.mute);
+}
+END_TEST
+
+START_TEST(command_status)
+{
+    char buf[STATUS_BUFFER_SIZE];
+    volume_state_t state;
+
+    volume_state.volume = 100;
+    volume_state.mute = true;
+    format_status(&zones[0], buf, sizeof(buf));
+    ck_assert_str_eq(buf, "{\"volume\":100,\"mute\":true}");
+    ck_assert(parse_status(buf, strlen(buf), &state));
+    ck_assert_int_eq(state.volume, 100);
+    ck_assert(state.mute);
+    ck_assert(parse_status("{\"zone\":2,\"volume\":9,\"mute\":false}",
+			   34, &state));
+    ck_assert_int_eq(state.volume, 9);
+    ck_assert(parse_status("{\"volume\":7,\"mute\":false}", 25, &state));
+    ck_assert_int_eq(state.volume, 7);
+    ck_assert(!state.mute);
+    ck_assert(!parse_status(buf, strlen(buf) - 1, &state));
+    ck_assert(!parse_status("{\"volume\":7,\"mute\":maybe}", 25, &state));
+    ck_assert(!parse_status("ok", 2, &state));
+}
+END_TEST
+
+#ifdef HAVE_SQLITE
+#define MOODE_TEST_DB "moode.db"
+
+/**
+ * @brief Return the value of the moode setting \p param, from \p db.
+ */
+static int
+moode_setting(sqlite3 *db, const char *param)
+{
+    sqlite3_stmt *stmt;
+    int value = -1;
+
+    ck_assert_int_eq(sqlite3_prepare_v2(db, "SELECT value FROM cfg_system "
+					"WHERE param = ?1", -1, &stmt, NULL),
+		     SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, param, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+	value = atoi((const char *) sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+START_TEST(moode_write_behind)
+{
+    moode_db_t m;
+    volume_state_t state = {0, false};
+    sqlite3 *db;
+    uint64_t now = 1000;
+    int i;
+
+    /* A local stand-in for the moode database. */
+    unlink(MOODE_TEST_DB);
+    ck_assert_int_eq(sqlite3_open(MOODE_TEST_DB, &db), SQLITE_OK);
+    ck_assert_int_eq(sqlite3_exec(
+			 db, "CREATE TABLE cfg_system (id INTEGER PRIMARY KEY, "
+			 "param CHAR (32), value CHAR (32));"
+			 "INSERT INTO cfg_system (param, value) VALUES "
+			 "('volknob', '0'), ('volmute', '0');",
+			 NULL, NULL, NULL), SQLITE_OK);
+
+    ck_assert(!moode_open(&m, "no_such_dir/moode.db"));
+    ck_assert(moode_open(&m, MOODE_TEST_DB));
+    ck_assert_int_eq(moode_timeout(&m, now), -1);
+
+    /* A knob sweep is written, as its final state, in one transaction
+     * once the debounce period has expired. */
+    for (i = 1; i <= 100; i++, now++) {
+	state.volume = i;
+	moode_record(&m, &state, now);
+    }
+    ck_assert_int_eq(moode_timeout(&m, now), MOODE_DEBOUNCE_MS - 100);
+    ck_assert_int_eq(moode_setting(db, "volknob"), 0);
+    now += moode_timeout(&m, now);
+    ck_assert(moode_flush(&m, now));
+    ck_assert_int_eq(m.changes, 100);
+    ck_assert_int_eq(m.transactions, 1);
+    ck_assert_int_eq(moode_setting(db, "volknob"), 100);
+    ck_assert_int_eq(moode_setting(db, "volmute"), 0);
+    ck_assert_int_eq(moode_timeout(&m, now), -1);
+
+    /* Changes that end where they started are not written. */
+    state.mute = true;
+    moode_record(&m, &state, now);
+    state.mute = false;
+    moode_record(&m, &state, now);
+    ck_assert(moode_flush(&m, now + MOODE_DEBOUNCE_MS));
+    ck_assert_int_eq(m.transactions, 1);
+
+    /* While someone else holds the write lock, the write is put off. */
+    state.mute = true;
+    moode_record(&m, &state, now);
+    ck_assert_int_eq(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL),
+		     SQLITE_OK);
+    ck_assert(!moode_flush(&m, now));
+    ck_assert_int_eq(moode_timeout(&m, now), MOODE_DEBOUNCE_MS);
+    ck_assert_int_eq(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL),
+		     SQLITE_OK);
+    ck_assert(moode_flush(&m, now + MOODE_DEBOUNCE_MS));
+    ck_assert_int_eq(m.transactions, 2);
+    ck_assert_int_eq(moode_setting(db, "volmute"), 1);
+    ck_assert_int_eq(moode_setting(db, "volknob"), 100);
+    moode_close(&m);
+
+    /* The database has been left in WAL mode. */
+    ck_assert_int_eq(access(MOODE_TEST_DB "-wal", F_OK), 0);
+    sqlite3_close(db);
+    unlink(MOODE_TEST_DB);
+    unlink(MOODE_TEST_DB "-wal");
+    unlink(MOODE_TEST_DB "-shm");
+}
+END_TEST
+#endif
+
+START_TEST(queue_coalesce)
+{
+    command_t up = {CMD_UP, 1};
+    command_t down = {CMD_DOWN, 2};
+    command_t set = {CMD_VOLUME, 30};
+    command_t toggle = {CMD_TOGGLE_MUTE, 0};
+    int i;
+
+    long raw;
+    bool mute;
+    unsigned long writes;
+
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, NULL, &mixer);
+
+    /* A burst of relative steps becomes a single write. */
+    for (i = 0; i < 120; i++) {
+	cmdq_submit(&command_queue, &up, NULL);
+    }
+    ck_assert_int_eq(command_queue.writes, 0);
+    cmdq_flush(&command_queue);
+    ck_assert_int_eq(command_queue.received, 120);
+    ck_assert_int_eq(command_queue.writes, 1);
+    ck_assert_int_eq(volume_state.volume, 100);
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(raw, 255);
+    ck_assert_int_eq(writes, 1);
+
+    /* Absolute settings replace whatever is pending. */
+    cmdq_submit(&command_queue, &down, NULL);
+    cmdq_submit(&command_queue, &set, NULL);
+    cmdq_submit(&command_queue, &down, NULL);
+    cmdq_flush(&command_queue);
+    ck_assert_int_eq(command_queue.writes, 2);
+    ck_assert_int_eq(volume_state.volume, 28);
+
+    /* Commands that cancel out cause no write at all. */
+    cmdq_submit(&command_queue, &toggle, NULL);
+    cmdq_submit(&command_queue, &toggle, NULL);
+    cmdq_flush(&command_queue);
+    ck_assert_int_eq(command_queue.received, 125);
+    ck_assert_int_eq(command_queue.writes, 2);
+    ck_assert(!command_queue.pending);
+    mixer_close(&mixer);
+}
+END_TEST
+
+START_TEST(spsc_ring_order)
+{
+    static spsc_ring_t ring;
+    writer_msg_t msg;
+    int i;
+
+    /* The indexes are about to wrap around. */
+    ring.head = ring.tail = UINT32_MAX - 2;
+    for (i = 0; i < WRITER_RING_SIZE; i++) {
+	msg.state.volume = i;
+	ck_assert(spsc_push(&ring, &msg));
+    }
+    ck_assert(!spsc_push(&ring, &msg));
+    for (i = 0; i < WRITER_RING_SIZE; i++) {
+	ck_assert(spsc_pop(&ring, &msg));
+	ck_assert_int_eq(msg.state.volume, i);
+    }
+    ck_assert(!spsc_pop(&ring, &msg));
+    ck_assert_int_lt(ring.head, 8);
+}
+END_TEST
+
+#define RING_STRESS_COUNT 100000
+
+static void *
+ring_producer(void *arg)
+{
+    spsc_ring_t *ring = (spsc_ring_t *) arg;
+    writer_msg_t msg;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < RING_STRESS_COUNT; i++) {
+	msg.state.volume = i;
+	while (!spsc_push(ring, &msg)) {
+	    sched_yield();
+	}
+    }
+    return NULL;
+}
+
+/* With a producer and consumer on separate threads, every message
+ * arrives, intact and in order. */
+START_TEST(spsc_ring_threads)
+{
+    static spsc_ring_t ring;
+    pthread_t producer;
+    writer_msg_t msg;
+    int expected = 0;
+
+    ck_assert_int_eq(pthread_create(&producer, NULL, ring_producer, &ring),
+		     0);
+    while (expected < RING_STRESS_COUNT) {
+	if (spsc_pop(&ring, &msg)) {
+	    ck_assert_int_eq(msg.state.volume, expected);
+	    expected++;
+	}
+	else {
+	    sched_yield();
+	}
+    }
+    pthread_join(producer, NULL);
+    ck_assert(!spsc_pop(&ring, &msg));
+}
+END_TEST
+
+#define PAGE_UPDATES 200000
+#define PAGE_PATH "status.page"
+
+typedef struct {
+    const status_page_t *page;
+    long reads;
+    long torn;			/* Snapshots that were not consistent */
+    long backwards;		/* Generations that went backwards */
+    long failed;
+    bool started;
+    bool done;
+} page_reader_t;
+
+/* Whether zone holds the state written in update i of the hammer. */
+static bool
+page_zone_is(const status_zone_t *zone, long i)
+{
+    if (i < 0) {
+	return (zone->volume == 0) && (zone->mute == 0);
+    }
+    return (zone->volume == i % 100) && (zone->mute == (i & 1));
+}
+
+/* Check that every snapshot is one the writer could have published: in
+ * update i, zone 0 is changed and then zone 1, each advancing the
+ * generation. */
+static void *
+page_reader(void *arg)
+{
+    page_reader_t *r = (page_reader_t *) arg;
+    status_page_t copy;
+    uint64_t last = 0;
+    long i;
+
+    __atomic_store_n(&r->started, true, __ATOMIC_RELEASE);
+    do {
+	if (!status_page_snapshot(r->page, &copy)) {
+	    r->failed++;
+	    continue;
+	}
+	r->reads++;
+	if (copy.generation < last) {
+	    r->backwards++;
+	}
+	last = copy.generation;
+	if (copy.generation == 0) {
+	    continue;
+	}
+	i = (copy.generation - 1) / 2;
+	if (copy.generation & 1) {
+	    if ((copy.zone != 0) || !page_zone_is(&copy.zones[0], i) ||
+		!page_zone_is(&copy.zones[1], i - 1))
+	    {
+		r->torn++;
+	    }
+	}
+	else if ((copy.zone != 1) || !page_zone_is(&copy.zones[0], i) ||
+		 !page_zone_is(&copy.zones[1], i))
+	{
+	    r->torn++;
+	}
+    } while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+/* A reader of the status page, on another thread, never sees an update
+ * half made, however fast the updates come. */
+START_TEST(status_page_hammer)
+{
+    char *argv[] = {PROGNAME};
+    volume_state_t states[2];
+    zone_t page_zones[2] = {
+	{0, DEFAULT_ZONE_NAME, NULL, NULL, &states[0]},
+	{1, "other", NULL, NULL, &states[1]},
+    };
+    page_reader_t reader;
+    pthread_t thread;
+    volume_state_t state;
+    uint64_t generation;
+    long i;
+    int id;
+
+    process_args(1, argv);
+    memset(states, 0, sizeof(states));
+    memset(&reader, 0, sizeof(reader));
+    nzones = 2;
+    ck_assert(status_page_open(PAGE_PATH));
+    nzones = 1;
+    ck_assert(access(PAGE_PATH ".tmp", F_OK) < 0);
+    ck_assert((reader.page = status_page_map(PAGE_PATH)) != NULL);
+    ck_assert_int_eq(reader.page->magic, STATUS_PAGE_MAGIC);
+    ck_assert_int_eq(reader.page->pid, getpid());
+    ck_assert_int_eq(pthread_create(&thread, NULL, page_reader, &reader), 0);
+    while (!__atomic_load_n(&reader.started, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+    for (i = 0; i < PAGE_UPDATES; i++) {
+	for (id = 0; id < 2; id++) {
+	    states[id].volume = i % 100;
+	    states[id].mute = i & 1;
+	    status_page_update(&page_zones[id]);
+	}
+    }
+    __atomic_store_n(&reader.done, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    ck_assert_int_gt(reader.reads, 0);
+    ck_assert_int_eq(reader.torn, 0);
+    ck_assert_int_eq(reader.backwards, 0);
+    ck_assert_int_eq(reader.failed, 0);
+
+    ck_assert(status_page_read(reader.page, 1, &state, &generation));
+    ck_assert_int_eq(state.volume, (PAGE_UPDATES - 1) % 100);
+    ck_assert_int_eq(state.mute, (PAGE_UPDATES - 1) & 1);
+    ck_assert_int_eq(generation, PAGE_UPDATES * 2);
+    ck_assert(!status_page_read(reader.page, 2, &state, NULL));
+    status_page_unmap(reader.page);
+
+    status_page_close();
+    ck_assert(access(PAGE_PATH, F_OK) < 0);
+    ck_assert(status_page_map(PAGE_PATH) == NULL);
+}
+END_TEST
+
+START_TEST(stats_histogram)
+{
+    histogram_t hist;
+    command_t up = {CMD_UP, 1};
+    uint64_t us;
+    int i;
+
+    /* Small values are exact, and larger ones are within 12.5%. */
+    memset(&hist, 0, sizeof(hist));
+    for (i = 1; i <= 1000; i++) {
+	hist_record(&hist, i);
+    }
+    ck_assert_int_eq(hist.count, 1000);
+    ck_assert_int_eq(hist.max_us, 1000);
+    us = hist_percentile(&hist, 50);
+    ck_assert_int_ge(us, 500);
+    ck_assert_int_le(us, 500 + 500 / 8);
+    us = hist_percentile(&hist, 99);
+    ck_assert_int_ge(us, 990);
+    ck_assert_int_le(us, 1000);
+    ck_assert_int_eq(hist_percentile(&hist, 100), 1000);
+    memset(&hist, 0, sizeof(hist));
+    ck_assert_int_eq(hist_percentile(&hist, 99), 0);
+    hist_record(&hist, 3);
+    ck_assert_int_eq(hist_percentile(&hist, 50), 3);
+    hist_record(&hist, 1ULL << 40);
+    ck_assert_int_eq(hist_percentile(&hist, 100), 1ULL << 40);
+
+    /* Commands folded into a pending write are counted as coalesced,
+     * and the write is timed through each stage. */
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, NULL, &mixer);
+    for (i = 0; i < 10; i++) {
+	cmdq_submit(&command_queue, &up, NULL);
+    }
+    cmdq_flush(&command_queue);
+    ck_assert_int_eq(command_queue.stats.commands, 10);
+    ck_assert_int_eq(command_queue.stats.coalesced, 9);
+    for (i = 0; i < STAGE_COUNT; i++) {
+	ck_assert_int_eq(command_queue.stats.stage[i].count, 1);
+    }
+    ck_assert_int_ge(command_queue.stats.stage[STAGE_TOTAL].max_us,
+		     command_queue.stats.stage[STAGE_MIXER].max_us);
+    mixer_close(&mixer);
+}
+END_TEST
+
+static TCase *
+tcase_protocol(char *tests)
+{
+    TCase *tc_protocol = tcase_create("protocol");
+
+    add_test(tc_protocol, ws_accept_key, tests);
+    add_test(tc_protocol, ws_frames, tests);
+    add_test(tc_protocol, simd_kernels_agree, tests);
+    add_test(tc_protocol, command_parse, tests);
+    add_test(tc_protocol, bin_records, tests);
+    add_test(tc_protocol, client_batch, tests);
+    add_test(tc_protocol, lirc_gestures, tests);
+    add_test(tc_protocol, command_apply, tests);
+    add_test(tc_protocol, command_status, tests);
+#ifdef HAVE_SQLITE
+    add_test(tc_protocol, moode_write_behind, tests);
+#endif
+    add_test(tc_protocol, queue_coalesce, tests);
+    add_test(tc_protocol, spsc_ring_order, tests);
+    add_test(tc_protocol, spsc_ring_threads, tests);
+    add_test(tc_protocol, status_page_hammer, tests);
+    add_test(tc_protocol, stats_histogram, tests);
+
+    return tc_protocol;
+}
+
+START_TEST(mixer_fake)
+{
+    volume_state_t state = {50, false};
+    long raw;
+    bool mute;
+    unsigned long writes;
+
+    ck_assert(!mixer_open(&mixer, "wibble", NULL, "Digital"));
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    ck_assert(mixer_set_curve(&mixer, false, 100));
+    ck_assert(mixer_write(&mixer, &state));
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(raw, 128);
+    ck_assert(!mute);
+    ck_assert_int_eq(writes, 1);
+
+    /* Only the parts of the state that change are written. */
+    state.mute = true;
+    ck_assert(mixer_write(&mixer, &state));
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert(mute);
+    ck_assert_int_eq(writes, 2);
+
+    state.volume = 0;
+    state.mute = false;
+    ck_assert(mixer_read(&mixer, &state));
+    ck_assert_int_eq(state.volume, 50);
+    ck_assert(state.mute);
+    mixer_close(&mixer);
+    ck_assert(mixer.ops == NULL);
+}
+END_TEST
+
+static void
+make_test_mixer(mixer_t *m, bool has_db)
+{
+    memset(m, 0, sizeof(*m));
+    m->min = 0;
+    m->max = 255;
+    m->has_db = has_db;
+    m->min_db = -10200;
+    m->max_db = 0;
+}
+
+START_TEST(volcurve_monotonic)
+{
+    static const int caps[] = {100, 96, 80, 50, 1};
+    volcurve_t curve;
+    mixer_t m;
+    int has_db;
+    int volcurve;
+    int i;
+    int pct;
+
+    for (has_db = 0; has_db < 2; has_db++) {
+	make_test_mixer(&m, has_db);
+	for (volcurve = 0; volcurve < 2; volcurve++) {
+	    for (i = 0; i < sizeof(caps) / sizeof(int); i++) {
+		memset(&curve, 0, sizeof(curve));
+		ck_assert(volcurve_build(&curve, &m, volcurve, caps[i]));
+		ck_assert_int_eq(curve.raw[0], m.min);
+		ck_assert_int_le(curve.raw[VOLCURVE_STEPS - 1], m.max);
+		for (pct = 1; pct < VOLCURVE_STEPS; pct++) {
+		    ck_assert_int_ge(curve.raw[pct], curve.raw[pct - 1]);
+		    if (has_db) {
+			ck_assert_int_ge(curve.db[pct], curve.db[pct - 1]);
+		    }
+		    if (curve.raw[pct] > curve.raw[pct - 1]) {
+			ck_assert_int_eq(volcurve_pct(&curve, curve.raw[pct]),
+					 pct);
+		    }
+		}
+	    }
+	}
+    }
+}
+END_TEST
+
+START_TEST(volcurve_cap)
+{
+    volcurve_t full;
+    volcurve_t capped;
+    mixer_t m;
+    int volcurve;
+
+    make_test_mixer(&m, true);
+    for (volcurve = 0; volcurve < 2; volcurve++) {
+	memset(&full, 0, sizeof(full));
+	memset(&capped, 0, sizeof(capped));
+	volcurve_build(&full, &m, volcurve, 100);
+	volcurve_build(&capped, &m, volcurve, 80);
+	ck_assert_int_eq(full.raw[100], m.max);
+	ck_assert_int_eq(capped.raw[100], full.raw[80]);
+	ck_assert_int_eq(capped.raw[50], full.raw[40]);
+	ck_assert_int_lt(capped.raw[100], m.max);
+    }
+    ck_assert_int_eq(capped.db[100], full.db[80]);
+    ck_assert_int_eq(full.db[100], 0);
+    /* Half volume, on the curve, is around -17.5dB. */
+    ck_assert_int_gt(full.db[50], -1800);
+    ck_assert_int_lt(full.db[50], -1700);
+
+    /* Without dB information, the curve is cubic. */
+    make_test_mixer(&m, false);
+    memset(&full, 0, sizeof(full));
+    volcurve_build(&full, &m, true, 100);
+    ck_assert_int_eq(full.raw[50], 32);
+}
+END_TEST
+
+START_TEST(volcurve_rebuild)
+{
+    volume_state_t state = {50, false};
+    long raw;
+    bool mute;
+    unsigned long writes;
+
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    ck_assert_int_eq(mixer.curve.builds, 1);
+    ck_assert(!mixer_set_curve(&mixer, options.volcurve, options.max_pct));
+    ck_assert_int_eq(mixer.curve.builds, 1);
+    ck_assert(mixer_set_curve(&mixer, true, 50));
+    ck_assert_int_eq(mixer.curve.builds, 2);
+
+    ck_assert(mixer_write(&mixer, &state));
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(raw, mixer.curve.raw[50]);
+    mixer_close(&mixer);
+}
+END_TEST
+
+static TCase *
+tcase_mixer(char *tests)
+{
+    TCase *tc_mixer = tcase_create("mixer");
+
+    add_test(tc_mixer, mixer_fake, tests);
+    add_test(tc_mixer, volcurve_monotonic, tests);
+    add_test(tc_mixer, volcurve_cap, tests);
+    add_test(tc_mixer, volcurve_rebuild, tests);
+
+    return tc_mixer;
+}
+
+/*
+ * Minimal websocket client functions for testing the server.  If the
+ * server is running in this process, its loop is passed in so that we
+ * can run it while waiting for responses.
+ */
+
+static void
+await_readable(int fd, loop_t *loop)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+	if (loop) {
+	    (void) loop_once(loop, 1);
+	}
+	if (poll(&pfd, 1, loop ? 0: 1000) > 0) {
+	    return;
+	}
+    }
+    ck_abort_msg("timed out waiting for the server");
+}
+
+static void
+read_fully(int fd, loop_t *loop, void *buf, size_t len)
+{
+    ssize_t n;
+    
+    while (len > 0) {
+	await_readable(fd, loop);
+	n = recv(fd, buf, len, 0);
+	ck_assert_msg(n > 0, "connection closed by server");
+	buf = (char *) buf + n;
+	len -= n;
+    }
+}
+
+/* Connect to the server, offering the websocket subprotocol protocol
+ * if that is not NULL. */
+static int
+client_connect_proto(int port, loop_t *loop, const char *protocol)
+{
+    struct sockaddr_in addr;
+    char req[256];
+    size_t req_len;
+    char resp[256];
+    size_t len = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    ck_assert(fd >= 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    ck_assert(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    req_len = snprintf(req, sizeof(req),
+		       "GET / HTTP/1.1\r\n"
+		       "Host: localhost\r\n"
+		       "Upgrade: websocket\r\n"
+		       "Connection: Upgrade\r\n"
+		       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		       "%s%s%s"
+		       "Sec-WebSocket-Version: 13\r\n\r\n",
+		       protocol ? "Sec-WebSocket-Protocol: ": "",
+		       protocol ? protocol: "", protocol ? "\r\n": "");
+    ck_assert(write(fd, req, req_len) == req_len);
+    while ((len < 4) || (memcmp(resp + len - 4, "\r\n\r\n", 4) != 0)) {
+	ck_assert(len < sizeof(resp) - 1);
+	read_fully(fd, loop, resp + len, 1);
+	len++;
+    }
+    resp[len] = '\0';
+    ck_assert(strncmp(resp, "HTTP/1.1 101 ", 13) == 0);
+    ck_assert((strstr(resp, "Sec-WebSocket-Protocol") != NULL) ==
+	      (protocol != NULL));
+    return fd;
+}
+
+static int
+client_connect(int port, loop_t *loop)
+{
+    return client_connect_proto(port, loop, NULL);
+}
+
+static void
+client_send(int fd, const char *text)
+{
+    static const uint8_t mask[4] = {1, 2, 3, 4};
+    uint8_t buf[WS_MAX_HEADER + WS_MAX_PAYLOAD];
+    size_t len = ws_encode_frame(buf, WS_OP_TEXT, text, strlen(text), mask);
+
+    ck_assert(write(fd, buf, len) == len);
+}
+
+/* Receive a single frame from the server, returning its payload as a
+ * string. */
+static char *
+client_recv(int fd, loop_t *loop, char *buf, size_t size)
+{
+    uint8_t hdr[4];
+    size_t len;
+
+    read_fully(fd, loop, hdr, 2);
+    ck_assert(!(hdr[1] & 0x80));
+    len = hdr[1] & 0x7f;
+    if (len == 126) {
+	read_fully(fd, loop, hdr + 2, 2);
+	len = (hdr[2] << 8) | hdr[3];
+    }
+    ck_assert(len < size);
+    read_fully(fd, loop, buf, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+START_TEST(server_loopback)
+{
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    int fd1;
+    int fd2;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd1 = client_connect(server_port(&loop), &loop);
+    fd2 = client_connect(server_port(&loop), &loop);
+    ck_assert_int_eq(loop.nconns, 2);
+
+    client_send(fd1, "status");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+    client_send(fd1, "wibble");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"error\":\"invalid command\"}");
+
+    /* A state change is broadcast to all clients. */
+    client_send(fd1, "volume 40");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+    ck_assert_str_eq(client_recv(fd2, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+
+    close(fd2);
+    while (loop.nconns > 1) {
+	(void) loop_once(&loop, 10);
+    }
+    server_shutdown(&loop);
+    ck_assert_int_eq(loop.nconns, 0);
+    close(fd1);
+    loop_close(&loop);
+}
+END_TEST
+
+START_TEST(server_stats)
+{
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    int fd;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd = client_connect(server_port(&loop), &loop);
+
+    client_send(fd, "up 5");
+    client_send(fd, "up 5");
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":10,\"mute\":false}");
+    client_send(fd, "stats");
+    client_recv(fd, &loop, buf, sizeof(buf));
+    ck_assert_msg(strstr(buf, "\"commands\":2,\"coalesced\":1,") != NULL,
+		  "unexpected stats: %s", buf);
+    ck_assert_msg(strstr(buf, "\"total\":{\"count\":1,") != NULL,
+		  "unexpected stats: %s", buf);
+    ck_assert_int_eq(buf[strlen(buf) - 1], '}');
+
+    server_shutdown(&loop);
+    close(fd);
+    loop_close(&loop);
+    mixer_close(&mixer);
+}
+END_TEST
+
+/* Send the n binary records in recs, as a single message. */
+static void
+client_send_records(int fd, const bin_record_t *recs, int n)
+{
+    static const uint8_t mask[4] = {1, 2, 3, 4};
+    uint8_t payload[WS_MAX_PAYLOAD];
+    uint8_t buf[WS_MAX_HEADER + WS_MAX_PAYLOAD];
+    size_t len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	bin_encode(payload + i * BIN_RECORD_SIZE, &recs[i]);
+    }
+    len = ws_encode_frame(buf, WS_OP_BINARY, payload,
+			  n * BIN_RECORD_SIZE, mask);
+    ck_assert(write(fd, buf, len) == len);
+}
+
+/* Receive a single binary message, of up to max records, returning the
+ * number of records. */
+static int
+client_recv_records(int fd, loop_t *loop, bin_record_t *recs, int max)
+{
+    uint8_t hdr[2];
+    uint8_t payload[125];
+    int i;
+
+    read_fully(fd, loop, hdr, 2);
+    ck_assert_int_eq(hdr[0], 0x80 | WS_OP_BINARY);
+    ck_assert(hdr[1] <= MIN(max * BIN_RECORD_SIZE, sizeof(payload)));
+    ck_assert_int_eq(hdr[1] % BIN_RECORD_SIZE, 0);
+    read_fully(fd, loop, payload, hdr[1]);
+    for (i = 0; i < hdr[1] / BIN_RECORD_SIZE; i++) {
+	bin_decode(payload + i * BIN_RECORD_SIZE, &recs[i]);
+    }
+    return i;
+}
+
+/* Clients that negotiate the binary subprotocol send and receive
+ * binary records, while other clients continue to see text. */
+START_TEST(server_binary)
+{
+    static const bin_record_t cmds[] = {
+	{BIN_OP_STATUS, 0, 1, 0},
+	{BIN_OP_VOLUME, 0, 2, 40},
+	{99, 0, 3, 0},
+    };
+    loop_t loop;
+    bin_record_t recs[4];
+    char buf[WS_MAX_PAYLOAD];
+    uint8_t closing[4];
+    int bin_fd;
+    int text_fd;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    bin_fd = client_connect_proto(server_port(&loop), &loop, BIN_PROTOCOL);
+    text_fd = client_connect(server_port(&loop), &loop);
+
+    /* The status query and the invalid command are answered together;
+     * the volume change is acknowledged by the broadcast. */
+    client_send_records(bin_fd, cmds, 3);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 2);
+    ck_assert_int_eq(recs[0].op, BIN_OP_STATE);
+    ck_assert_int_eq(recs[0].seq, 1);
+    ck_assert_int_eq(recs[0].value, 0);
+    ck_assert_int_eq(recs[1].op, BIN_OP_ERROR);
+    ck_assert_int_eq(recs[1].seq, 3);
+    ck_assert_int_eq(recs[1].value, BIN_ERR_INVALID);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 1);
+    ck_assert_int_eq(recs[0].op, BIN_OP_STATE);
+    ck_assert_int_eq(recs[0].seq, 0);
+    ck_assert_int_eq(recs[0].value, 40);
+    ck_assert_str_eq(client_recv(text_fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+
+    recs[0].op = BIN_OP_MUTE;
+    recs[0].seq = 4;
+    client_send_records(bin_fd, recs, 1);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 1);
+    ck_assert_int_eq(recs[0].value, 40 | BIN_STATE_MUTE);
+    ck_assert_str_eq(client_recv(text_fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":true}");
+
+    /* A binary client may not send text. */
+    client_send(bin_fd, "status");
+    read_fully(bin_fd, &loop, closing, sizeof(closing));
+    ck_assert(memcmp(closing, "\x88\x02\x03\xeb", 4) == 0);
+
+    server_shutdown(&loop);
+    close(bin_fd);
+    close(text_fd);
+    loop_close(&loop);
+}
+END_TEST
+
+/*
+ * Clients of the local socket send and receive bare messages, one per
+ * packet.
+ */
+
+static int
+local_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    ck_assert(fd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    ck_assert(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+static void
+local_send(int fd, const void *msg, size_t len)
+{
+    ck_assert(send(fd, msg, len, 0) == len);
+}
+
+static size_t
+local_recv(int fd, loop_t *loop, void *buf, size_t size)
+{
+    ssize_t n;
+
+    await_readable(fd, loop);
+    n = recv(fd, buf, size, 0);
+    ck_assert_msg(n > 0, "connection closed by server");
+    return n;
+}
+
+static char *
+local_recv_text(int fd, loop_t *loop, char *buf, size_t size)
+{
+    size_t len = local_recv(fd, loop, buf, size - 1);
+
+    buf[len] = '\0';
+    return buf;
+}
+
+#define LOCAL_PATH "local.sock"
+
+/* Local clients speak the same command set as websocket clients, in
+ * text or binary, and see the same broadcasts. */
+START_TEST(server_local)
+{
+    static const bin_record_t cmds[] = {
+	{BIN_OP_STATUS, 0, 1, 0},
+	{BIN_OP_VOLUME, 0, 2, 40},
+    };
+    loop_t loop;
+    bin_record_t rec;
+    uint8_t payload[WS_MAX_PAYLOAD];
+    char buf[WS_MAX_PAYLOAD];
+    int ws_fd;
+    int text_fd;
+    int bin_fd;
+
+    options.port = 0;
+    options.socket_path = LOCAL_PATH;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    ws_fd = client_connect(server_port(&loop), &loop);
+    text_fd = local_connect(LOCAL_PATH);
+    bin_fd = local_connect(LOCAL_PATH);
+
+    local_send(text_fd, "status", 6);
+    ck_assert_str_eq(local_recv_text(text_fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+    ck_assert_int_eq(loop.nconns, 3);
+    local_send(text_fd, "wibble", 6);
+    ck_assert_str_eq(local_recv_text(text_fd, &loop, buf, sizeof(buf)),
+		     "{\"error\":\"invalid command\"}");
+
+    bin_encode(payload, &cmds[0]);
+    bin_encode(payload + BIN_RECORD_SIZE, &cmds[1]);
+    local_send(bin_fd, payload, 2 * BIN_RECORD_SIZE);
+    ck_assert_int_eq(local_recv(bin_fd, &loop, payload, sizeof(payload)),
+		     BIN_RECORD_SIZE);
+    bin_decode(payload, &rec);
+    ck_assert_int_eq(rec.op, BIN_OP_STATE);
+    ck_assert_int_eq(rec.seq, 1);
+    ck_assert_int_eq(rec.value, 0);
+
+    /* The change is broadcast to every client, in its own form. */
+    ck_assert_int_eq(local_recv(bin_fd, &loop, payload, sizeof(payload)),
+		     BIN_RECORD_SIZE);
+    bin_decode(payload, &rec);
+    ck_assert_int_eq(rec.value, 40);
+    ck_assert_str_eq(local_recv_text(text_fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+    ck_assert_str_eq(client_recv(ws_fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+
+    /* Closing the local socket is seen as the end of the connection. */
+    close(text_fd);
+    while (loop.nconns > 2) {
+	(void) loop_once(&loop, 10);
+    }
+
+    server_shutdown(&loop);
+    ck_assert(access(LOCAL_PATH, F_OK) != 0);
+    options.socket_path = NULL;
+    close(ws_fd);
+    close(bin_fd);
+    loop_close(&loop);
+}
+END_TEST
+
+/**
+ * @brief Read, without blocking, every message waiting on the local
+ * socket \p fd.
+ *
+ * @return (int) The number of messages read.
+ */
+static int
+local_drain(int fd)
+{
+    char buf[WS_MAX_PAYLOAD];
+    int count = 0;
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+	count++;
+    }
+    return count;
+}
+
+/* A large jump is made as a ramp, one mixer write per timer tick, which
+ * a new command retargets rather than restarts.  The ticks stay regular
+ * while another client keeps the loop busy. */
+START_TEST(server_ramp)
+{
+    loop_t loop;
+    ramp_t *ramp = &command_queue.ramp;
+    long raw;
+    bool mute;
+    unsigned long writes;
+    int fd;
+    int load_fd;
+    int broadcasts = 0;
+    bool retargeted = false;
+
+    options.port = 0;
+    options.socket_path = LOCAL_PATH;
+    options.ramp_step = 5;
+    options.ramp_interval = 5;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd = local_connect(LOCAL_PATH);
+    load_fd = local_connect(LOCAL_PATH);
+
+    local_send(fd, "volume 100", 10);
+    do {
+	local_send(load_fd, "status", 6);
+	(void) loop_once(&loop, 10);
+	(void) local_drain(load_fd);
+	broadcasts += local_drain(fd);
+	if (!retargeted && (ramp->ticks >= 4)) {
+	    local_send(fd, "volume 50", 9);
+	    retargeted = true;
+	}
+    } while (!retargeted || command_queue.in_flight || command_queue.pending);
+
+    ck_assert_int_eq(volume_state.volume, 50);
+    ck_assert_int_eq(ramp->ramps, 1);
+    ck_assert_int_eq(ramp->ticks, 50 / 5);
+    ck_assert_int_eq(command_queue.writes, ramp->ticks);
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(writes, ramp->ticks);
+    ck_assert_int_eq(ramp->samples, ramp->ticks - 1);
+    ck_assert_int_ge(broadcasts, ramp->ticks - 1);
+    ck_assert_int_eq(ramp->src.fd, -1);
+    ck_assert_msg(ramp->jitter_total_us / ramp->samples < 20000,
+		  "mean ramp jitter %lluus",
+		  (unsigned long long) (ramp->jitter_total_us / ramp->samples));
+
+    /* Small changes, and changes to a muted state, are not ramped. */
+    local_send(fd, "down 3", 6);
+    local_send(fd, "mute", 4);
+    local_send(fd, "volume 0", 8);
+    while (volume_state.volume != 0) {
+	(void) loop_once(&loop, 10);
+    }
+    ck_assert_int_eq(ramp->ramps, 1);
+
+    server_shutdown(&loop);
+    options.socket_path = NULL;
+    options.ramp_step = CONFIG_RAMP_STEP;
+    options.ramp_interval = CONFIG_RAMP_INTERVAL;
+    close(fd);
+    close(load_fd);
+    mixer_close(&mixer);
+    loop_close(&loop);
+}
+END_TEST
+
+/* With writer_thread, writes are made by the writer thread, and the
+ * results still reach clients, both for plain writes and for ramps. */
+START_TEST(server_writer_thread)
+{
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    long raw;
+    bool mute;
+    unsigned long writes;
+    int fd;
+
+    options.port = 0;
+    options.socket_path = LOCAL_PATH;
+    options.writer_thread = true;
+    options.writer_priority = 0;
+    options.writer_cpu = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    ck_assert(command_queue.writer.running);
+    fd = local_connect(LOCAL_PATH);
+
+    local_send(fd, "volume 40", 9);
+    ck_assert_str_eq(local_recv_text(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":40,\"mute\":false}");
+    ck_assert_int_eq(command_queue.writer.posted, 1);
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(writes, 1);
+
+    /* Commands arriving while a write is in flight are folded, and
+     * resolved against the state being written. */
+    local_send(fd, "up 5", 4);
+    local_send(fd, "up 5", 4);
+    local_send(fd, "mute", 4);
+    while (!command_queue.writer.busy && !volume_state.mute) {
+	(void) loop_once(&loop, 10);
+    }
+    local_send(fd, "up 5", 4);
+    while (command_queue.pending || command_queue.in_flight ||
+	   (command_queue.received < 5))
+    {
+	(void) loop_once(&loop, 10);
+    }
+    ck_assert_int_eq(volume_state.volume, 55);
+    ck_assert(volume_state.mute);
+
+    options.ramp_step = 10;
+    options.ramp_interval = 2;
+    local_send(fd, "volume 100", 10);
+    local_send(fd, "unmute", 6);
+    while (command_queue.pending || command_queue.in_flight ||
+	   (command_queue.received < 7))
+    {
+	(void) loop_once(&loop, 10);
+    }
+    ck_assert_int_eq(volume_state.volume, 100);
+    ck_assert(!volume_state.mute);
+    ck_assert_int_eq(command_queue.ramp.ramps, 1);
+    ck_assert_int_eq(command_queue.ramp.ticks, 5);
+    ck_assert_int_eq(command_queue.writer.posted, command_queue.writes);
+
+    cmdq_shutdown(&command_queue);
+    ck_assert(!command_queue.writer.running);
+    server_shutdown(&loop);
+    options.socket_path = NULL;
+    options.writer_thread = CONFIG_WRITER_THREAD;
+    options.writer_cpu = CONFIG_WRITER_CPU;
+    options.ramp_step = CONFIG_RAMP_STEP;
+    options.ramp_interval = CONFIG_RAMP_INTERVAL;
+    close(fd);
+    mixer_close(&mixer);
+    loop_close(&loop);
+}
+END_TEST
+
+/* A burst of commands, as from a rotary encoder, arriving within a
+ * single read results in only one mixer write. */
+START_TEST(server_burst)
+{
+    static const uint8_t mask[4] = {1, 2, 3, 4};
+    uint8_t burst[150 * (WS_MAX_HEADER + 8)];
+    size_t len = 0;
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    int fd;
+    int i;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd = client_connect(server_port(&loop), &loop);
+
+    for (i = 0; i < 150; i++) {
+	len += ws_encode_frame(burst + len, WS_OP_TEXT, "up 1", 4, mask);
+    }
+    ck_assert(write(fd, burst, len) == len);
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":100,\"mute\":false}");
+    ck_assert_int_eq(command_queue.received, 150);
+    ck_assert_int_eq(command_queue.writes, 1);
+
+    server_shutdown(&loop);
+    close(fd);
+    loop_close(&loop);
+}
+END_TEST
+
+/* A status broadcast is encoded once, however many clients there are. */
+START_TEST(server_shared_frames)
+{
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    unsigned long created;
+    int fds[3];
+    int i;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    for (i = 0; i < 3; i++) {
+	fds[i] = client_connect(server_port(&loop), &loop);
+    }
+
+    created = frames_created;
+    server_broadcast_status(&loop, &zones[0], NULL);
+    ck_assert_int_eq(frames_created - created, 1);
+    for (i = 0; i < 3; i++) {
+	ck_assert_str_eq(client_recv(fds[i], &loop, buf, sizeof(buf)),
+			 "{\"volume\":0,\"mute\":false}");
+    }
+
+    server_shutdown(&loop);
+    for (i = 0; i < 3; i++) {
+	close(fds[i]);
+    }
+    loop_close(&loop);
+}
+END_TEST
+
+/* Create a connection on one end of a socketpair, whose socket buffer
+ * has been filled so that anything further sent to it must be queued.
+ * Returns the number of bytes used to fill it. */
+static conn_t *
+blocked_conn(loop_t *loop, int sv[2], size_t *p_filled)
+{
+    static uint8_t junk[4096];
+    conn_t *conn = (conn_t *) calloc(1, sizeof(conn_t));
+    ssize_t n;
+
+    ck_assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+    conn_init(conn, loop, sv[0]);
+    conn->state = CONN_OPEN;
+    *p_filled = 0;
+    while ((n = write(sv[0], junk, sizeof(junk))) > 0) {
+	*p_filled += n;
+    }
+    return conn;
+}
+
+/* Read and discard len bytes from fd. */
+static void
+drain(int fd, size_t len)
+{
+    uint8_t junk[4096];
+    ssize_t n;
+
+    while (len > 0) {
+	n = read(fd, junk, MIN(len, sizeof(junk)));
+	ck_assert(n > 0);
+	len -= n;
+    }
+}
+
+/* A status frame queued for a client that is not keeping up is replaced
+ * by the next status frame, rather than queued behind it. */
+START_TEST(conn_status_replace)
+{
+    loop_t loop;
+    conn_t *conn;
+    frame_t *first;
+    frame_t *second;
+    uint8_t buf[WS_MAX_HEADER + 8];
+    size_t filled;
+    int sv[2];
+
+    loop_init(&loop);
+    conn = blocked_conn(&loop, sv, &filled);
+
+    first = frame_new(WS_OP_TEXT, "first", 5);
+    first->status = true;
+    second = frame_new(WS_OP_TEXT, "second", 6);
+    second->status = true;
+    conn_send_shared(conn, first);
+    conn_send_shared(conn, second);
+    ck_assert_int_eq(conn->out_count, 1);
+    ck_assert_int_eq(first->refs, 1);
+    ck_assert_int_eq(second->refs, 2);
+    frame_unref(first);
+    frame_unref(second);
+
+    drain(sv[1], filled);
+    conn_flush(conn);
+    ck_assert_int_eq(conn->out_count, 0);
+    ck_assert(read(sv[1], buf, sizeof(buf)) == 8);
+    ck_assert(memcmp(buf + 2, "second", 6) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+    free(conn);
+    loop_close(&loop);
+}
+END_TEST
+
+/* Read the status message, in a text frame, that is next on fd. */
+static char *
+read_status_frame(int fd, char *buf, size_t size)
+{
+    uint8_t hdr[2];
+
+    ck_assert(read(fd, hdr, 2) == 2);
+    ck_assert_int_eq(hdr[0], 0x80 | WS_OP_TEXT);
+    ck_assert(hdr[1] < size);
+    ck_assert(read(fd, buf, hdr[1]) == hdr[1]);
+    buf[hdr[1]] = '\0';
+    return buf;
+}
+
+/* A client subscribed to several zones, that is not keeping up, is
+ * sent the latest status of each: a status frame replaces only one
+ * waiting for the same zone. */
+START_TEST(conn_status_replace_zones)
+{
+    volume_state_t states[2] = {{10, false}, {20, false}};
+    zone_t zone0 = {0, DEFAULT_ZONE_NAME, &mixer, &command_queue, &states[0]};
+    zone_t zone1 = {1, "kitchen", &mixer, &command_queue, &states[1]};
+    char buf[STATUS_BUFFER_SIZE];
+    loop_t loop;
+    conn_t *conn;
+    size_t filled;
+    int sv[2];
+
+    loop_init(&loop);
+    conn = blocked_conn(&loop, sv, &filled);
+    conn->zones = 3;
+    loop.conns = conn;
+
+    server_broadcast_status(&loop, &zone0, NULL);
+    server_broadcast_status(&loop, &zone1, NULL);
+    states[0].volume = 30;
+    server_broadcast_status(&loop, &zone0, NULL);
+    states[1].volume = 40;
+    server_broadcast_status(&loop, &zone1, NULL);
+    ck_assert_int_eq(conn->out_count, 2);
+
+    drain(sv[1], filled);
+    conn_flush(conn);
+    ck_assert_int_eq(conn->out_count, 0);
+    ck_assert_str_eq(read_status_frame(sv[1], buf, sizeof(buf)),
+		     "{\"volume\":30,\"mute\":false}");
+    ck_assert_str_eq(read_status_frame(sv[1], buf, sizeof(buf)),
+		     "{\"zone\":1,\"volume\":40,\"mute\":false}");
+
+    close(sv[0]);
+    close(sv[1]);
+    free(conn);
+    loop_close(&loop);
+}
+END_TEST
+
+/* Output private to a connection is queued in the connection's arena,
+ * which is reset once the output has been written.  A client that
+ * leaves enough unread to fill the arena is dropped. */
+START_TEST(conn_private_output)
+{
+    static const char big[WS_MAX_PAYLOAD] = "";
+    loop_t loop;
+    conn_t *conn;
+    char buf[16];
+    size_t filled;
+    int sv[2];
+    int i;
+
+    loop_init(&loop);
+    conn = blocked_conn(&loop, sv, &filled);
+    conn_send(conn, "hello", 5);
+    conn_send(conn, "world", 5);
+    ck_assert_int_eq(conn->out_count, 2);
+    ck_assert(conn->arena.used > 10);
+
+    drain(sv[1], filled);
+    conn_flush(conn);
+    ck_assert_int_eq(conn->out_count, 0);
+    ck_assert_int_eq(conn->arena.used, 0);
+    ck_assert_int_eq(conn->arena.nchunks, 1);
+    ck_assert(read(sv[1], buf, sizeof(buf)) == 10);
+    ck_assert(memcmp(buf, "helloworld", 10) == 0);
+    close(sv[0]);
+    close(sv[1]);
+    free(conn);
+
+    conn = blocked_conn(&loop, sv, &filled);
+    for (i = 0; (conn->state != CONN_DEAD) && (i < CONN_MAX_QUEUED); i++) {
+	conn_send(conn, big, sizeof(big));
+    }
+    ck_assert_int_eq(conn->state, CONN_DEAD);
+    ck_assert(i < CONN_MAX_QUEUED);
+    ck_assert_int_eq(conn->arena.used, 0);
+    close(sv[1]);
+    free(conn);
+    loop_close(&loop);
+}
+END_TEST
+
+/* A change made to the mixer by another program is pushed to clients,
+ * while the echoes of our own writes are not. */
+START_TEST(server_external_change)
+{
+    struct pollfd pfd;
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    int fd;
+    int i;
+
+    options.port = 0;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd = client_connect(server_port(&loop), &loop);
+
+    fake_mixer_set(&mixer, mixer_pct_to_raw(&mixer, 50), true);
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":50,\"mute\":true}");
+    ck_assert_int_eq(mixer.changes, 1);
+
+    /* Relative commands now apply to the externally set volume. */
+    client_send(fd, "up 5");
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":55,\"mute\":true}");
+    for (i = 0; i < 10; i++) {
+	(void) loop_once(&loop, 1);
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+    ck_assert_int_eq(mixer.changes, 1);
+
+    mixer_close(&mixer);
+    server_shutdown(&loop);
+    close(fd);
+    loop_close(&loop);
+}
+END_TEST
+
+/* Once the server is listening, clients connecting, sending commands,
+ * pings and rubbish, receiving broadcasts and disconnecting cause no
+ * heap allocations at all. */
+START_TEST(server_no_malloc)
+{
+    static const uint8_t mask[4] = {1, 2, 3, 4};
+    uint8_t ping[WS_MAX_HEADER + 4];
+    size_t ping_len = ws_encode_frame(ping, WS_OP_PING, "ping", 4, mask);
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    char cmd[16];
+    char expected[STATUS_BUFFER_SIZE];
+    unsigned long before;
+    int fds[4];
+    int round;
+    int i;
+
+    options.port = 0;
+    options.max_clients = 4;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    before = malloc_count;
+
+    for (round = 0; round < 3; round++) {
+	for (i = 0; i < 4; i++) {
+	    fds[i] = client_connect(server_port(&loop), &loop);
+	}
+	client_send(fds[0], "status");
+	(void) client_recv(fds[0], &loop, buf, sizeof(buf));
+	client_send(fds[1], "wibble");
+	ck_assert_str_eq(client_recv(fds[1], &loop, buf, sizeof(buf)),
+			 "{\"error\":\"invalid command\"}");
+	ck_assert(write(fds[2], ping, ping_len) == ping_len);
+	ck_assert_str_eq(client_recv(fds[2], &loop, buf, sizeof(buf)),
+			 "ping");
+
+	snprintf(cmd, sizeof(cmd), "volume %d", 10 + round);
+	snprintf(expected, sizeof(expected),
+		 "{\"volume\":%d,\"mute\":false}", 10 + round);
+	client_send(fds[3], cmd);
+	for (i = 0; i < 4; i++) {
+	    ck_assert_str_eq(client_recv(fds[i], &loop, buf, sizeof(buf)),
+			     expected);
+	}
+	fake_mixer_set(&mixer, mixer_pct_to_raw(&mixer, 50), false);
+	for (i = 0; i < 4; i++) {
+	    ck_assert_str_eq(client_recv(fds[i], &loop, buf, sizeof(buf)),
+			     "{\"volume\":50,\"mute\":false}");
+	}
+	ck_assert_int_eq(mixer.changes, round + 1);
+
+	for (i = 0; i < 4; i++) {
+	    close(fds[i]);
+	}
+	while (loop.nconns > 0) {
+	    (void) loop_once(&loop, 10);
+	}
+    }
+    ck_assert_int_eq(malloc_count, before);
+
+    mixer_close(&mixer);
+    server_shutdown(&loop);
+    loop_close(&loop);
+}
+END_TEST
+
+/* A connection made when all max_clients connections are in use is
+ * closed at once, without disturbing the others. */
+START_TEST(server_conn_limit)
+{
+    struct sockaddr_in addr;
+    loop_t loop;
+    char buf[WS_MAX_PAYLOAD];
+    int fds[2];
+    int fd;
+
+    options.port = 0;
+    options.max_clients = 2;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fds[0] = client_connect(server_port(&loop), &loop);
+    fds[1] = client_connect(server_port(&loop), &loop);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(server_port(&loop));
+    ck_assert(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    await_readable(fd, &loop);
+    ck_assert(recv(fd, buf, sizeof(buf), 0) == 0);
+    close(fd);
+    ck_assert_int_eq(loop.nconns, 2);
+
+    /* Once a connection closes, its slot can be reused. */
+    close(fds[1]);
+    while (loop.nconns > 1) {
+	(void) loop_once(&loop, 10);
+    }
+    fds[1] = client_connect(server_port(&loop), &loop);
+    client_send(fds[1], "status");
+    ck_assert_str_eq(client_recv(fds[1], &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+
+    server_shutdown(&loop);
+    close(fds[0]);
+    close(fds[1]);
+    loop_close(&loop);
+}
+END_TEST
+
+/* Find a port that is free for us to listen on. */
+static int
+free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    ck_assert(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    ck_assert(getsockname(fd, (struct sockaddr *) &addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *f = fopen(path, "w");
+
+    ck_assert(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+/* Reloading the config applies changes without dropping clients, and
+ * a config that cannot be applied leaves everything as it was. */
+START_TEST(server_reload)
+{
+    char *argv[] = {PROGNAME, "-c", "reload.conf"};
+    char config[128];
+    char buf[WS_MAX_PAYLOAD];
+    loop_t loop;
+    long raw;
+    long raw50;
+    bool mute;
+    unsigned long writes;
+    int port = free_port();
+    int fd1;
+    int fd2;
+    int fd3;
+
+    write_file("reload.conf", "max_pct = 50\nport = 0\nmixer = fake\n");
+    process_args(3, argv);
+    read_config_file();
+    ck_assert_int_eq(options.max_pct, 50);
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, options.mixer, options.alsa_card,
+			 options.alsa_mixer_name));
+    cmdq_init(&command_queue, &loop, &mixer);
+    fd1 = client_connect(server_port(&loop), &loop);
+    client_send(fd1, "volume 100");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"volume\":100,\"mute\":false}");
+    fake_mixer_get(&mixer, &raw50, &mute, &writes);
+
+    snprintf(config, sizeof(config), "max_pct = 80\nport = %d\n"
+	     "mixer = fake\nalsa_mixer_name = Master\n"
+	     "socket_path = reload.sock\n", port);
+    write_file("reload.conf", config);
+    ck_assert(config_reload(&loop));
+    ck_assert_int_eq(options.generation, 1);
+    ck_assert_int_eq(options.max_pct, 80);
+    ck_assert_str_eq(mixer.control, "Master");
+    ck_assert_int_eq(server_port(&loop), port);
+
+    /* The existing client is told the state of the new mixer, and can
+     * still control it. */
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+    client_send(fd1, "volume 100");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"volume\":100,\"mute\":false}");
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert(raw > raw50);
+    fd2 = client_connect(port, &loop);
+    fd3 = local_connect("reload.sock");
+    while (loop.nconns < 3) {
+	(void) loop_once(&loop, 10);
+    }
+
+    write_file("reload.conf", "mixer = wibble\n");
+    ck_assert(!config_reload(&loop));
+    ck_assert_int_eq(options.generation, 1);
+    ck_assert_int_eq(options.max_pct, 80);
+    ck_assert_str_eq(mixer.control, "Master");
+    ck_assert_int_eq(server_port(&loop), port);
+    ck_assert_int_eq(loop.nconns, 3);
+
+    unlink("reload.conf");
+    server_shutdown(&loop);
+    ck_assert(access("reload.sock", F_OK) != 0);
+    close(fd1);
+    close(fd2);
+    close(fd3);
+    loop_close(&loop);
+}
+END_TEST
+
+static double
+elapsed_usecs(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e6 +
+	(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Run a server, with the fake mixer, in a child process, returning
+ * the child's pid and, in *p_port, the port on which it listens. */
+static pid_t
+fork_server(int *p_port)
+{
+    loop_t loop;
+    int pipefd[2];
+    int port;
+    pid_t pid;
+
+    ck_assert(pipe(pipefd) == 0);
+    if ((pid = fork()) == 0) {
+	options.port = 0;
+	loop_init(&loop);
+	server_init(&loop);
+	mixer_open(&mixer, "fake", NULL, "Digital");
+	cmdq_init(&command_queue, &loop, &mixer);
+	port = server_port(&loop);
+	if (write(pipefd[1], &port, sizeof(port)) != sizeof(port)) {
+	    _exit(1);
+	}
+	loop_run(&loop);
+	_exit(0);
+    }
+    ck_assert(read(pipefd[0], p_port, sizeof(*p_port)) == sizeof(*p_port));
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return pid;
+}
+
+#define LOAD_SAMPLES 400
+
+/* Measure round-trip latency, from sending a command to receiving its
+ * acknowledgement, on fd.  If changes is true, each command changes
+ * the volume, and so is broadcast to every connection; otherwise each
+ * is a status query.  Returns the median and 99th percentile. */
+static void
+measure_latency(int fd, bool changes, double *p_median, double *p_p99)
+{
+    static double samples[LOAD_SAMPLES];
+    struct timespec start;
+    struct timespec end;
+    char cmd[32];
+    char buf[WS_MAX_PAYLOAD];
+    int i;
+
+    for (i = 0; i < LOAD_SAMPLES; i++) {
+	snprintf(cmd, sizeof(cmd), changes ? "volume %d": "status", i & 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	client_send(fd, cmd);
+	client_recv(fd, NULL, buf, sizeof(buf));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	samples[i] = elapsed_usecs(&start, &end);
+    }
+    qsort(samples, LOAD_SAMPLES, sizeof(double), compare_doubles);
+    *p_median = samples[LOAD_SAMPLES / 2];
+    *p_p99 = samples[LOAD_SAMPLES * 99 / 100];
+}
+
+/* As measure_latency(), for a status query over the local socket. */
+static void
+measure_local_latency(int fd, double *p_median, double *p_p99)
+{
+    static double samples[LOAD_SAMPLES];
+    struct timespec start;
+    struct timespec end;
+    char buf[WS_MAX_PAYLOAD];
+    int i;
+
+    for (i = 0; i < LOAD_SAMPLES; i++) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	local_send(fd, "status", 6);
+	(void) local_recv(fd, NULL, buf, sizeof(buf));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	samples[i] = elapsed_usecs(&start, &end);
+    }
+    qsort(samples, LOAD_SAMPLES, sizeof(double), compare_doubles);
+    *p_median = samples[LOAD_SAMPLES / 2];
+    *p_p99 = samples[LOAD_SAMPLES * 99 / 100];
+}
+
+/* Each zone has its own mixer, and its status goes only to the clients
+ * that have addressed it. */
+START_TEST(server_zones)
+{
+    char *argv[] = {PROGNAME, "-c", "zones.conf"};
+    static const bin_record_t cmds[] = {
+	{BIN_OP_VOLUME, 2, 1, 20},
+	{BIN_OP_VOLUME, 3, 2, 20},
+    };
+    char buf[WS_MAX_PAYLOAD];
+    bin_record_t recs[4];
+    loop_t loop;
+    long raw;
+    bool mute;
+    unsigned long writes;
+    int fd0;
+    int fd1;
+    int bin_fd;
+
+    write_file("zones.conf", "port = 0\nmixer = fake\n"
+	       "zone = kitchen\nzone = study\n");
+    process_args(3, argv);
+    read_config_file();
+    zones_open();
+    ck_assert_int_eq(nzones, 3);
+    ck_assert_str_eq(zones[2].name, "study");
+    loop_init(&loop);
+    server_init(&loop);
+    zones_start(&loop);
+    fd0 = client_connect(server_port(&loop), &loop);
+    fd1 = client_connect(server_port(&loop), &loop);
+    bin_fd = client_connect_proto(server_port(&loop), &loop, BIN_PROTOCOL);
+
+    /* With lazy_mixer, the default, this opens zone 0's mixer. */
+    client_send(fd0, "status");
+    ck_assert_str_eq(client_recv(fd0, &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+    client_send(fd1, "zone 3");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"error\":\"invalid command\"}");
+    client_send(fd1, "zone 1");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"zone\":1,\"volume\":0,\"mute\":false}");
+    client_send(fd1, "volume 30");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"zone\":1,\"volume\":30,\"mute\":false}");
+    fake_mixer_get(zones[1].mixer, &raw, &mute, &writes);
+    ck_assert(raw > 0);
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(writes, 0);
+
+    /* Neither the zone 0 client nor the binary client, which has not
+     * yet addressed zone 1, saw that change. */
+    client_send(fd0, "status");
+    ck_assert_str_eq(client_recv(fd0, &loop, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+
+    /* Binary records address zones directly; zone 3 does not exist. */
+    client_send_records(bin_fd, cmds, 2);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 1);
+    ck_assert_int_eq(recs[0].op, BIN_OP_ERROR);
+    ck_assert_int_eq(recs[0].seq, 2);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 1);
+    ck_assert_int_eq(recs[0].op, BIN_OP_STATE);
+    ck_assert_int_eq(recs[0].zone, 2);
+    ck_assert_int_eq(recs[0].value, 20);
+    ck_assert_int_eq(zones[2].state->volume, 20);
+    ck_assert_int_eq(zones[1].state->volume, 30);
+    ck_assert_int_eq(volume_state.volume, 0);
+
+    /* Zone 0 changes still reach the binary client, which is subscribed
+     * to it from the start, but not the text client in zone 1. */
+    client_send(fd0, "volume 10");
+    ck_assert_str_eq(client_recv(fd0, &loop, buf, sizeof(buf)),
+		     "{\"volume\":10,\"mute\":false}");
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, recs, 4), 1);
+    ck_assert_int_eq(recs[0].zone, 0);
+    ck_assert_int_eq(recs[0].value, 10);
+    client_send(fd1, "status");
+    ck_assert_str_eq(client_recv(fd1, &loop, buf, sizeof(buf)),
+		     "{\"zone\":1,\"volume\":30,\"mute\":false}");
+
+    server_shutdown(&loop);
+    zones_shutdown();
+    close(fd0);
+    close(fd1);
+    close(bin_fd);
+    loop_close(&loop);
+    unlink("zones.conf");
+}
+END_TEST
+
+/* With workers, connections are spread over several loops, each on a
+ * thread of its own, but commands from every loop reach the one mixer,
+ * and status reaches every client. */
+#define WORKER_CLIENTS 16
+
+START_TEST(server_workers)
+{
+    char buf[WS_MAX_PAYLOAD];
+    char cmd[32];
+    char expected[STATUS_BUFFER_SIZE];
+    loop_t loop;
+    long raw;
+    bool mute;
+    unsigned long writes;
+    unsigned long forwarded = 0;
+    int fds[WORKER_CLIENTS];
+    int i;
+    int j;
+
+    options.port = 0;
+    options.workers = 3;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert(mixer_open(&mixer, "fake", NULL, "Digital"));
+    cmdq_init(&command_queue, &loop, &mixer);
+    workers_start(&loop);
+    ck_assert_int_eq(nworkers, 2);
+    for (i = 0; i < WORKER_CLIENTS; i++) {
+	fds[i] = client_connect(server_port(&loop), &loop);
+    }
+
+    /* Each client in turn sets the volume, and every client sees each
+     * change. */
+    for (i = 0; i < WORKER_CLIENTS; i++) {
+	snprintf(cmd, sizeof(cmd), "volume %d", 10 + i);
+	snprintf(expected, sizeof(expected),
+		 "{\"volume\":%d,\"mute\":false}", 10 + i);
+	client_send(fds[i], cmd);
+	for (j = 0; j < WORKER_CLIENTS; j++) {
+	    ck_assert_str_eq(client_recv(fds[j], &loop, buf, sizeof(buf)),
+			     expected);
+	}
+    }
+    fake_mixer_get(&mixer, &raw, &mute, &writes);
+    ck_assert_int_eq(writes, WORKER_CLIENTS);
+    ck_assert_int_eq(command_queue.received, WORKER_CLIENTS);
+
+    /* Status queries are answered by whichever loop has the client. */
+    client_send(fds[WORKER_CLIENTS - 1], "status");
+    snprintf(expected, sizeof(expected),
+	     "{\"volume\":%d,\"mute\":false}", 10 + WORKER_CLIENTS - 1);
+    ck_assert_str_eq(client_recv(fds[WORKER_CLIENTS - 1], &loop,
+				 buf, sizeof(buf)), expected);
+
+    workers_stop();
+    for (i = 0; i < 2; i++) {
+	forwarded += workers[i].forwarded;
+    }
+    /* The kernel spreads the connections by hash, so with this many
+     * it is all but certain that some went to workers. */
+    ck_assert(forwarded > 0);
+    ck_assert_int_eq(nworkers, 0);
+    server_shutdown(&loop);
+    for (i = 0; i < WORKER_CLIENTS; i++) {
+	close(fds[i]);
+    }
+    loop_close(&loop);
+}
+END_TEST
+
+/* Run the server in a child process, and compare the round-trip
+ * latency of a query over a websocket with that over the local
+ * socket. */
+START_TEST(server_local_latency)
+{
+    int port;
+    int ws_fd;
+    int local_fd;
+    int i;
+    pid_t pid;
+    double median[2];
+    double p99[2];
+
+    options.socket_path = LOCAL_PATH;
+    pid = fork_server(&port);
+
+    ws_fd = client_connect(port, NULL);
+    local_fd = local_connect(LOCAL_PATH);
+    /* Alternate, so that both see the same conditions. */
+    for (i = 0; i < 2; i++) {
+	measure_latency(ws_fd, false, &median[0], &p99[0]);
+	measure_local_latency(local_fd, &median[1], &p99[1]);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(ws_fd);
+    close(local_fd);
+    unlink(LOCAL_PATH);
+    options.socket_path = NULL;
+
+    printf("Query round-trip usecs (median/p99): "
+	   "websocket %.1f/%.1f, local socket %.1f/%.1f\n",
+	   median[0], p99[0], median[1], p99[1]);
+    ck_assert_msg(median[1] < 1000, "median local latency exceeds 1ms");
+}
+END_TEST
+
+/* Move fd above the descriptors that socket activation uses. */
+static int
+high_fd(int fd)
+{
+    int high = fcntl(fd, F_DUPFD, LISTEN_FDS_START + 8);
+
+    ck_assert(high >= 0);
+    close(fd);
+    return high;
+}
+
+#define ACTIVATED_PATH "activated.sock"
+#define STREAM_PATH "stream.sock"
+
+/* Run the server in a child process, as socket activation would, with
+ * its listening sockets already open, and lazy_mixer set: clients are
+ * served on the sockets passed, and the mixer is opened only when the
+ * first command arrives. */
+START_TEST(server_socket_activation)
+{
+    struct sockaddr_in addr;
+    struct sockaddr_un un;
+    socklen_t len = sizeof(addr);
+    char buf[WS_MAX_PAYLOAD];
+    char pid_text[16];
+    loop_t loop;
+    int report[3];
+    int pipefd[2];
+    int tcp_fd;
+    int local_fd;
+    int stream_fd;
+    int idle_fd;
+    int ws_fd;
+    int fd;
+    char *p;
+    pid_t pid;
+
+    options.port = 0;
+    options.mixer = "fake";
+    options.lazy_mixer = true;
+    tcp_fd = high_fd(server_listen(0));
+    local_fd = high_fd(server_listen_local(ACTIVATED_PATH));
+    ck_assert(getsockname(tcp_fd, (struct sockaddr *) &addr, &len) == 0);
+    ck_assert(pipe(pipefd) == 0);
+    pipefd[0] = high_fd(pipefd[0]);
+    pipefd[1] = high_fd(pipefd[1]);
+
+    if ((pid = fork()) == 0) {
+	dup2(tcp_fd, LISTEN_FDS_START);
+	dup2(local_fd, LISTEN_FDS_START + 1);
+	snprintf(pid_text, sizeof(pid_text), "%d", (int) getpid());
+	setenv("LISTEN_PID", pid_text, 1);
+	setenv("LISTEN_FDS", "2", 1);
+	/* Neither of these can be bound, so must not be. */
+	options.port = 1;
+	options.socket_path = "/nonexistent/volumed.sock";
+	startup_us = now_us();
+	loop_init(&loop);
+	server_init(&loop);
+	zones_open();
+	zones_start(&loop);
+	report[0] = server_port(&loop);
+	report[1] = mixer.ops == NULL;
+	report[2] = getenv("LISTEN_FDS") == NULL;
+	if (write(pipefd[1], report, sizeof(report)) != sizeof(report)) {
+	    _exit(1);
+	}
+	loop_run(&loop);
+	_exit(0);
+    }
+    ck_assert(read(pipefd[0], report, sizeof(report)) == sizeof(report));
+    close(pipefd[0]);
+    close(pipefd[1]);
+    ck_assert_int_eq(report[0], ntohs(addr.sin_port));
+    ck_assert_msg(report[1], "mixer opened before the first command");
+    ck_assert(report[2]);
+
+    ws_fd = client_connect(report[0], NULL);
+    client_send(ws_fd, "status");
+    ck_assert_str_eq(client_recv(ws_fd, NULL, buf, sizeof(buf)),
+		     "{\"volume\":0,\"mute\":false}");
+    client_send(ws_fd, "stats");
+    client_recv(ws_fd, NULL, buf, sizeof(buf));
+    ck_assert((p = strstr(buf, "\"first_response_us\":")) != NULL);
+    ck_assert(strtoull(p + 20, NULL, 10) > 0);
+    fd = local_connect(ACTIVATED_PATH);
+    local_send(fd, "volume 30", 9);
+    ck_assert_str_eq(local_recv_text(fd, NULL, buf, sizeof(buf)),
+		     "{\"volume\":30,\"mute\":false}");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(ws_fd);
+    close(fd);
+
+    /* A unix domain socket that is not SOCK_SEQPACKET, and an internet
+     * socket that is not listening, are ignored. */
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, STREAM_PATH);
+    unlink(STREAM_PATH);
+    stream_fd = high_fd(socket(AF_UNIX, SOCK_STREAM, 0));
+    ck_assert(bind(stream_fd, (struct sockaddr *) &un, sizeof(un)) == 0);
+    ck_assert(listen(stream_fd, 1) == 0);
+    idle_fd = high_fd(socket(AF_INET, SOCK_STREAM, 0));
+    ck_assert(pipe(pipefd) == 0);
+    pipefd[0] = high_fd(pipefd[0]);
+    pipefd[1] = high_fd(pipefd[1]);
+    if ((pid = fork()) == 0) {
+	dup2(stream_fd, LISTEN_FDS_START);
+	dup2(idle_fd, LISTEN_FDS_START + 1);
+	snprintf(pid_text, sizeof(pid_text), "%d", (int) getpid());
+	setenv("LISTEN_PID", pid_text, 1);
+	setenv("LISTEN_FDS", "2", 1);
+	options.port = 0;
+	options.socket_path = NULL;
+	loop_init(&loop);
+	server_init(&loop);
+	report[0] = loop.local_listener.fd == -1;
+	report[1] = loop.listener.fd != LISTEN_FDS_START + 1;
+	report[2] = server_port(&loop) > 0;
+	if (write(pipefd[1], report, sizeof(report)) != sizeof(report)) {
+	    _exit(1);
+	}
+	_exit(0);
+    }
+    ck_assert(read(pipefd[0], report, sizeof(report)) == sizeof(report));
+    waitpid(pid, NULL, 0);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    ck_assert_msg(report[0], "SOCK_STREAM unix socket taken over");
+    ck_assert_msg(report[1], "socket that is not listening taken over");
+    ck_assert(report[2]);
+    close(stream_fd);
+    close(idle_fd);
+    unlink(STREAM_PATH);
+
+    /* Sockets meant for another process are left alone. */
+    setenv("LISTEN_PID", "1", 1);
+    setenv("LISTEN_FDS", "2", 1);
+    options.socket_path = NULL;
+    loop_init(&loop);
+    server_init(&loop);
+    ck_assert_int_ne(server_port(&loop), ntohs(addr.sin_port));
+    ck_assert_int_eq(loop.local_listener.fd, -1);
+    server_shutdown(&loop);
+    loop_close(&loop);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    close(tcp_fd);
+    close(local_fd);
+    unlink(ACTIVATED_PATH);
+}
+END_TEST
+
+/* With lazy_mixer set, a mixer that cannot be opened fails only the
+ * commands that need it, each of which tries again to open it. */
+START_TEST(server_lazy_mixer)
+{
+    static const bin_record_t cmd = {BIN_OP_VOLUME, 0, 1, 20};
+    char buf[WS_MAX_PAYLOAD];
+    bin_record_t rec;
+    loop_t loop;
+    int fd;
+    int bin_fd;
+
+    options.port = 0;
+    options.mixer = "nonexistent";
+    options.lazy_mixer = true;
+    zones_open();
+    loop_init(&loop);
+    server_init(&loop);
+    zones_start(&loop);
+    fd = client_connect(server_port(&loop), &loop);
+    bin_fd = client_connect_proto(server_port(&loop), &loop, BIN_PROTOCOL);
+
+    client_send(fd, "stats");
+    ck_assert(strstr(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "\"error\"") == NULL);
+    client_send(fd, "volume 30");
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"error\":\"mixer unavailable\"}");
+    client_send(fd, "status");
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"error\":\"mixer unavailable\"}");
+    client_send_records(bin_fd, &cmd, 1);
+    ck_assert_int_eq(client_recv_records(bin_fd, &loop, &rec, 1), 1);
+    ck_assert_int_eq(rec.op, BIN_OP_ERROR);
+    ck_assert_int_eq(rec.seq, 1);
+    ck_assert_int_eq(rec.value, BIN_ERR_MIXER);
+    ck_assert(mixer.ops == NULL);
+
+    /* Once the mixer can be opened, the next command opens it. */
+    options.mixer = "fake";
+    client_send(fd, "volume 30");
+    ck_assert_str_eq(client_recv(fd, &loop, buf, sizeof(buf)),
+		     "{\"volume\":30,\"mute\":false}");
+    ck_assert(mixer.ops != NULL);
+
+    server_shutdown(&loop);
+    zones_shutdown();
+    close(fd);
+    close(bin_fd);
+    loop_close(&loop);
+}
+END_TEST
+
+#define PIPELINE_STEPS 60
+
+static void
+save_reply(const char *msg, size_t len, void *arg)
+{
+    char *buf = (char *) arg;
+
+    len = MIN(len, STATUS_BUFFER_SIZE - 1);
+    memcpy(buf, msg, len);
+    buf[len] = '\0';
+}
+
+/* Send many commands, over each transport, without waiting for
+ * replies, and check that they all take effect. */
+static void
+pipeline_commands(client_t *cl)
+{
+    struct pollfd pfd = {cl->fd, POLLIN | POLLOUT, 0};
+    char last[STATUS_BUFFER_SIZE] = "";
+    int i;
+
+    ck_assert(client_queue(cl, "volume 0", 8));
+    for (i = 0; i < PIPELINE_STEPS; i++) {
+	while (!client_queue(cl, "up", 2)) {
+	    ck_assert(poll(&pfd, 1, 1000) > 0);
+	    ck_assert(client_flush(cl));
+	}
+    }
+    ck_assert(client_queue(cl, "status", 6));
+    while (client_pending(cl)) {
+	ck_assert(poll(&pfd, 1, 1000) > 0);
+	ck_assert(client_flush(cl));
+	ck_assert(client_read(cl, save_reply, last) >= 0);
+    }
+    pfd.events = POLLIN;
+    while (strcmp(last, "{\"volume\":60,\"mute\":false}") != 0) {
+	ck_assert_msg(poll(&pfd, 1, 1000) > 0, "last reply was %s", last);
+	ck_assert(client_read(cl, save_reply, last) >= 0);
+    }
+    ck_assert_int_eq(cl->sent, PIPELINE_STEPS + 2);
+    ck_assert(cl->received <= cl->sent);
+}
+
+START_TEST(client_pipeline)
+{
+    client_t cl;
+    int port;
+    pid_t pid;
+
+    options.socket_path = LOCAL_PATH;
+    pid = fork_server(&port);
+    ck_assert(client_open(&cl, "localhost", port, NULL));
+    pipeline_commands(&cl);
+    client_close(&cl);
+    ck_assert(client_open(&cl, NULL, 0, LOCAL_PATH));
+    pipeline_commands(&cl);
+    client_close(&cl);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(LOCAL_PATH);
+    options.socket_path = NULL;
+}
+END_TEST
+
+#define LOAD_CONNECTIONS 400
+
+/* Run the server in a child process, and show that command latency
+ * does not degrade as the number of idle connections grows: neither
+ * that of status queries, nor that of changes, whose acknowledgement
+ * is a broadcast to every connection.  The idle connections must still
+ * be sent the latest status. */
+START_TEST(server_load)
+{
+    char buf[WS_MAX_PAYLOAD];
+    int fds[LOAD_CONNECTIONS];
+    int port;
+    int i;
+    int n;
+    pid_t pid;
+    double median[3];
+    double p99[3];
+    double bcast_median[3];
+    double bcast_p99[3];
+
+    options.max_clients = LOAD_CONNECTIONS;
+    pid = fork_server(&port);
+
+    fds[0] = client_connect(port, NULL);
+    for (n = 1, i = 0; i < 3; i++) {
+	for (; n < (i * LOAD_CONNECTIONS / 2); n++) {
+	    fds[n] = client_connect(port, NULL);
+	}
+	measure_latency(fds[0], false, &median[i], &p99[i]);
+	measure_latency(fds[0], true, &bcast_median[i], &bcast_p99[i]);
+    }
+    client_send(fds[0], "volume 77");
+    ck_assert_str_eq(client_recv(fds[0], NULL, buf, sizeof(buf)),
+		     "{\"volume\":77,\"mute\":false}");
+    while (strcmp(client_recv(fds[n - 1], NULL, buf, sizeof(buf)),
+		  "{\"volume\":77,\"mute\":false}") != 0) {
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    for (i = 0; i < n; i++) {
+	close(fds[i]);
+    }
+
+    printf("Round-trip usecs (median/p99) for 1, %d and %d connections:\n"
+	   "    query:  %.0f/%.0f, %.0f/%.0f, %.0f/%.0f\n"
+	   "    change: %.0f/%.0f, %.0f/%.0f, %.0f/%.0f\n",
+	   LOAD_CONNECTIONS / 2, LOAD_CONNECTIONS,
+	   median[0], p99[0], median[1], p99[1], median[2], p99[2],
+	   bcast_median[0], bcast_p99[0], bcast_median[1], bcast_p99[1],
+	   bcast_median[2], bcast_p99[2]);
+    ck_assert_msg(median[2] < 1000, "median latency exceeds 1ms");
+    ck_assert_msg(median[2] < median[0] * 3 + 50,
+		  "latency grows with the number of connections");
+    ck_assert_msg(bcast_median[2] < 1000,
+		  "median change latency exceeds 1ms");
+    ck_assert_msg(bcast_median[2] < bcast_median[0] * 3 + 50,
+		  "change latency grows with the number of connections");
+}
+END_TEST
+
+static TCase *
+tcase_server(char *tests)
+{
+    TCase *tc_server = tcase_create("server");
+
+    tcase_set_timeout(tc_server, 30);
+    add_test(tc_server, server_loopback, tests);
+    add_test(tc_server, server_stats, tests);
+    add_test(tc_server, server_burst, tests);
+    add_test(tc_server, server_binary, tests);
+    add_test(tc_server, server_local, tests);
+    add_test(tc_server, server_ramp, tests);
+    add_test(tc_server, server_writer_thread, tests);
+    add_test(tc_server, server_shared_frames, tests);
+    add_test(tc_server, conn_status_replace, tests);
+    add_test(tc_server, conn_status_replace_zones, tests);
+    add_test(tc_server, conn_private_output, tests);
+    add_test(tc_server, server_external_change, tests);
+    add_test(tc_server, server_no_malloc, tests);
+    add_test(tc_server, server_conn_limit, tests);
+    add_test(tc_server, server_reload, tests);
+    add_test(tc_server, server_zones, tests);
+    add_test(tc_server, server_workers, tests);
+    add_test(tc_server, client_pipeline, tests);
+    add_test(tc_server, server_load, tests);
+    add_test(tc_server, server_local_latency, tests);
+    add_test(tc_server, server_socket_activation, tests);
+    add_test(tc_server, server_lazy_mixer, tests);
+
+    return tc_server;
+}
+
 static Suite *
 volumed_suite(char *tests)
 {
@@ -411,6 +3204,9 @@ volumed_suite(char *tests)
  
     suite_add_tcase (s, tcase_params(tests));
     suite_add_tcase (s, tcase_config(tests));
+    suite_add_tcase (s, tcase_protocol(tests));
+    suite_add_tcase (s, tcase_mixer(tests));
+    suite_add_tcase (s, tcase_server(tests));
     return s;
 }
 